@@ -305,6 +305,10 @@ HEADERS += src/addrman.h \
     src/json/json_spirit_writer.h \
     src/json/json_spirit_writer_template.h \
     src/kernel.h \
+    src/kvstore.h \
+    src/blockstore.h \
+    src/addressindex.h \
+    src/blockimport.h \
     src/key.h \
     src/keystore.h \
     src/main.h \
@@ -381,6 +385,10 @@ SOURCES += src/addrman.cpp \
     src/json/json_spirit_value.cpp \
     src/json/json_spirit_writer.cpp \
     src/kernel.cpp \
+    src/kvstore.cpp \
+    src/blockstore.cpp \
+    src/addressindex.cpp \
+    src/blockimport.cpp \
     src/key.cpp \
     src/keystore.cpp \
     src/main.cpp \
@@ -0,0 +1,295 @@
+// Copyright (c) 2013-2014 The Slimcoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addressindex.h"
+#include "db.h"
+#include "ui_interface.h"
+
+using namespace std;
+
+bool fAddressIndex = false;
+
+bool GetAddressIndexKey(const CScript& scriptPubKey, unsigned char& nAddressType, uint160& hashAddress)
+{
+    // the two standard templates are matched directly, without the solver
+    if (scriptPubKey.size() == 25 && scriptPubKey[0] == OP_DUP && scriptPubKey[1] == OP_HASH160 &&
+        scriptPubKey[2] == 20 && scriptPubKey[23] == OP_EQUALVERIFY && scriptPubKey[24] == OP_CHECKSIG)
+    {
+        nAddressType = ADDRESS_TYPE_PUBKEYHASH;
+        memcpy(hashAddress.begin(), &scriptPubKey[3], 20);
+        return true;
+    }
+    if (scriptPubKey.IsPayToScriptHash())
+    {
+        nAddressType = ADDRESS_TYPE_SCRIPTHASH;
+        memcpy(hashAddress.begin(), &scriptPubKey[2], 20);
+        return true;
+    }
+
+    CTxDestination dest;
+    if (!ExtractDestination(scriptPubKey, dest))
+        return false;
+    return GetAddressIndexKey(dest, nAddressType, hashAddress);
+}
+
+bool GetAddressIndexKey(const CTxDestination& dest, unsigned char& nAddressType, uint160& hashAddress)
+{
+    if (const CKeyID* pkeyID = boost::get<CKeyID>(&dest))
+    {
+        nAddressType = ADDRESS_TYPE_PUBKEYHASH;
+        hashAddress = *pkeyID;
+        return true;
+    }
+    if (const CScriptID* pscriptID = boost::get<CScriptID>(&dest))
+    {
+        nAddressType = ADDRESS_TYPE_SCRIPTHASH;
+        hashAddress = *pscriptID;
+        return true;
+    }
+    return false;
+}
+
+CTxDestination GetAddressIndexDestination(unsigned char nAddressType, const uint160& hashAddress)
+{
+    if (nAddressType == ADDRESS_TYPE_SCRIPTHASH)
+        return CScriptID(hashAddress);
+    return CKeyID(hashAddress);
+}
+
+typedef map<pair<unsigned char, uint160>, CAddressBalance> MapBalanceChanges;
+
+static bool WriteBalanceChanges(CTxDB& txdb, const MapBalanceChanges& mapChanges)
+{
+    for (MapBalanceChanges::const_iterator mi = mapChanges.begin(); mi != mapChanges.end(); ++mi)
+    {
+        CAddressBalance balance;
+        txdb.ReadAddressBalance(mi->first.first, mi->first.second, balance);
+        balance.nBalance += mi->second.nBalance;
+        balance.nReceived += mi->second.nReceived;
+        if (!txdb.WriteAddressBalance(mi->first.first, mi->first.second, balance))
+            return false;
+    }
+    return true;
+}
+
+bool AddressIndexConnectTx(CTxDB& txdb, const CTransaction& tx, const MapPrevTx& mapInputs, s32int nHeight, unsigned int nTx)
+{
+    const uint256 hashTx = tx.GetHash();
+    MapBalanceChanges mapChanges;
+    unsigned char nAddressType;
+    uint160 hashAddress;
+
+    if (!tx.IsCoinBase())
+    {
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+        {
+            const COutPoint& prevout = tx.vin[i].prevout;
+            MapPrevTx::const_iterator mi = mapInputs.find(prevout.hash);
+            if (mi == mapInputs.end() || prevout.n >= mi->second.second.vout.size())
+                return error("AddressIndexConnectTx() : %s input %u not fetched", hashTx.ToString().substr(0,10).c_str(), i);
+            const CTxOut& txout = mi->second.second.vout[prevout.n];
+            if (!GetAddressIndexKey(txout.scriptPubKey, nAddressType, hashAddress))
+                continue;
+
+            CAddressUnspentKey keyUnspent(nAddressType, hashAddress, prevout.hash, prevout.n);
+            CAddressUnspentValue unspent;
+            if (!txdb.ReadAddressUnspent(keyUnspent, unspent))
+                return error("AddressIndexConnectTx() : %s:%u not in the address index", prevout.hash.ToString().substr(0,10).c_str(), prevout.n);
+            if (!txdb.EraseAddressUnspent(keyUnspent))
+                return false;
+            if (!txdb.WriteAddressHistory(CAddressHistoryKey(nAddressType, hashAddress, nHeight, nTx, hashTx, i, true),
+                                          CAddressHistoryValue(-txout.nValue, unspent.nHeight)))
+                return false;
+            mapChanges[make_pair(nAddressType, hashAddress)].nBalance -= txout.nValue;
+        }
+    }
+
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        const CTxOut& txout = tx.vout[i];
+        if (!GetAddressIndexKey(txout.scriptPubKey, nAddressType, hashAddress))
+            continue;
+
+        if (!txdb.WriteAddressHistory(CAddressHistoryKey(nAddressType, hashAddress, nHeight, nTx, hashTx, i, false),
+                                      CAddressHistoryValue(txout.nValue, -1)))
+            return false;
+        if (!txdb.WriteAddressUnspent(CAddressUnspentKey(nAddressType, hashAddress, hashTx, i),
+                                      CAddressUnspentValue(txout.nValue, nHeight)))
+            return false;
+        CAddressBalance& change = mapChanges[make_pair(nAddressType, hashAddress)];
+        change.nBalance += txout.nValue;
+        change.nReceived += txout.nValue;
+    }
+
+    return WriteBalanceChanges(txdb, mapChanges);
+}
+
+bool AddressIndexDisconnectBlock(CTxDB& txdb, const CBlock& block, const CBlockIndex* pindex)
+{
+    MapBalanceChanges mapChanges;
+    unsigned char nAddressType;
+    uint160 hashAddress;
+
+    // Disconnect in reverse order, the outputs a transaction spends are still indexed
+    for (int nTx = block.vtx.size() - 1; nTx >= 0; nTx--)
+    {
+        const CTransaction& tx = block.vtx[nTx];
+        const uint256 hashTx = tx.GetHash();
+
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            const CTxOut& txout = tx.vout[i];
+            if (!GetAddressIndexKey(txout.scriptPubKey, nAddressType, hashAddress))
+                continue;
+
+            if (!txdb.EraseAddressHistory(CAddressHistoryKey(nAddressType, hashAddress, pindex->nHeight, nTx, hashTx, i, false)))
+                return false;
+            if (!txdb.EraseAddressUnspent(CAddressUnspentKey(nAddressType, hashAddress, hashTx, i)))
+                return false;
+            CAddressBalance& change = mapChanges[make_pair(nAddressType, hashAddress)];
+            change.nBalance -= txout.nValue;
+            change.nReceived -= txout.nValue;
+        }
+
+        if (tx.IsCoinBase())
+            continue;
+
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+        {
+            const COutPoint& prevout = tx.vin[i].prevout;
+            CTransaction txPrev;
+            if (!txdb.ReadDiskTx(prevout.hash, txPrev) || prevout.n >= txPrev.vout.size())
+                return error("AddressIndexDisconnectBlock() : %s not found", prevout.hash.ToString().substr(0,10).c_str());
+            const CTxOut& txout = txPrev.vout[prevout.n];
+            if (!GetAddressIndexKey(txout.scriptPubKey, nAddressType, hashAddress))
+                continue;
+
+            // the spend entry knows the height to put the output back at
+            CAddressHistoryKey key(nAddressType, hashAddress, pindex->nHeight, nTx, hashTx, i, true);
+            CAddressHistoryValue value;
+            if (!txdb.ReadAddressHistory(key, value))
+                return error("AddressIndexDisconnectBlock() : spend of %s:%u not in the address index", prevout.hash.ToString().substr(0,10).c_str(), prevout.n);
+            if (!txdb.EraseAddressHistory(key))
+                return false;
+            if (!txdb.WriteAddressUnspent(CAddressUnspentKey(nAddressType, hashAddress, prevout.hash, prevout.n),
+                                          CAddressUnspentValue(txout.nValue, value.nPrevHeight)))
+                return false;
+            mapChanges[make_pair(nAddressType, hashAddress)].nBalance += txout.nValue;
+        }
+    }
+
+    return WriteBalanceChanges(txdb, mapChanges);
+}
+
+// Index the blocks of the best chain above nBuildHeight, committing every few
+// hundred blocks together with the height reached, so an interrupted build resumes
+static bool BuildAddressIndex(CTxDB& txdb, s32int nBuildHeight)
+{
+    printf("BuildAddressIndex() : indexing heights %d to %d\n", nBuildHeight + 1, nBestHeight);
+    int64 nStart = GetTimeMillis();
+
+    CBlockIndex* pindex = pindexByHeight(nBuildHeight + 1);
+    if (!pindex)
+    {
+        if (!txdb.TxnBegin())
+            return error("BuildAddressIndex() : TxnBegin failed");
+        txdb.WriteAddressIndexState(true, nBuildHeight);
+        return txdb.TxnCommit();
+    }
+    while (pindex)
+    {
+        if (!txdb.TxnBegin())
+            return error("BuildAddressIndex() : TxnBegin failed");
+
+        s32int nHeight = pindex->nHeight;
+        for (int n = 0; pindex && n < 500; n++, pindex = pindex->pnext)
+        {
+            CBlock block;
+            if (!block.ReadFromDisk(pindex))
+            {
+                txdb.TxnAbort();
+                return error("BuildAddressIndex() : ReadFromDisk at height %d failed", pindex->nHeight);
+            }
+
+            for (unsigned int nTx = 0; nTx < block.vtx.size(); nTx++)
+            {
+                const CTransaction& tx = block.vtx[nTx];
+                MapPrevTx mapInputs;
+                if (!tx.IsCoinBase())
+                {
+                    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                    {
+                        if (mapInputs.count(txin.prevout.hash))
+                            continue;
+                        pair<CTxIndex, CTransaction>& input = mapInputs[txin.prevout.hash];
+                        if (!txdb.ReadDiskTx(txin.prevout.hash, input.second, input.first))
+                        {
+                            txdb.TxnAbort();
+                            return error("BuildAddressIndex() : input %s not found", txin.prevout.hash.ToString().substr(0,10).c_str());
+                        }
+                    }
+                }
+                if (!AddressIndexConnectTx(txdb, tx, mapInputs, pindex->nHeight, nTx))
+                {
+                    txdb.TxnAbort();
+                    return false;
+                }
+            }
+            nHeight = pindex->nHeight;
+        }
+
+        txdb.WriteAddressIndexState(pindex == NULL, nHeight);
+        if (!txdb.TxnCommit())
+            return error("BuildAddressIndex() : TxnCommit failed");
+
+        InitMessage(strprintf(_("Building address index... %d/%d"), nHeight, nBestHeight));
+        if (fRequestShutdown)
+        {
+            printf("BuildAddressIndex() : interrupted at height %d\n", nHeight);
+            return true;
+        }
+    }
+
+    printf("BuildAddressIndex() : done in %" PRI64d " ms\n", GetTimeMillis() - nStart);
+    return true;
+}
+
+bool InitAddressIndex()
+{
+    CTxDB txdb("r+");
+    bool fComplete = false;
+    s32int nBuildHeight = 0;
+    bool fExists = txdb.ReadAddressIndexState(fComplete, nBuildHeight);
+
+    if (!fAddressIndex)
+    {
+        // connected blocks no longer update it, turning it back on starts over
+        if (fExists)
+        {
+            printf("InitAddressIndex() : -addressindex is off, erasing the address index\n");
+            return txdb.EraseAddressIndex();
+        }
+        return true;
+    }
+
+    if (fExists && fComplete)
+        return true;
+    if (!pindexGenesisBlock)
+    {
+        // ConnectBlock() indexes the chain as it is downloaded
+        if (!txdb.TxnBegin())
+            return false;
+        txdb.WriteAddressIndexState(true, 0);
+        return txdb.TxnCommit();
+    }
+
+    if (!fExists)
+    {
+        // leftovers of a build that was erased half way
+        if (!txdb.EraseAddressIndex())
+            return error("InitAddressIndex() : EraseAddressIndex failed");
+        nBuildHeight = 0;
+    }
+    return BuildAddressIndex(txdb, nBuildHeight);
+}
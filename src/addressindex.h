@@ -0,0 +1,232 @@
+// Copyright (c) 2013-2014 The Slimcoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef SLIMCOIN_ADDRESSINDEX_H
+#define SLIMCOIN_ADDRESSINDEX_H
+
+#include "main.h"
+
+/** The -addressindex index lives in the txdb next to the tx index. For every
+ * address it keeps
+ *   ("addrtx", key)   history entries, one per output paid to and input spent from it
+ *   ("addrutxo", key) its unspent outputs
+ *   ("addrbal", key)  its balance and total received
+ * ConnectBlock() and DisconnectBlock() update it in the same batch as the tx index,
+ * and the RPC queries read it without touching the transactions.
+ */
+
+extern bool fAddressIndex;
+
+enum
+{
+    ADDRESS_TYPE_PUBKEYHASH = 1,
+    ADDRESS_TYPE_SCRIPTHASH = 2,
+};
+
+// Address that scriptPubKey pays to; pay-to-pubkey outputs count as their key hash
+bool GetAddressIndexKey(const CScript& scriptPubKey, unsigned char& nAddressType, uint160& hashAddress);
+bool GetAddressIndexKey(const CTxDestination& dest, unsigned char& nAddressType, uint160& hashAddress);
+CTxDestination GetAddressIndexDestination(unsigned char nAddressType, const uint160& hashAddress);
+
+/** History entry: output nIndex of, or input nIndex spending into, the nTx'th
+ * transaction of the block at nHeight. The numbers are written big endian, so the
+ * store keeps the entries of an address in height order and a query is one seek
+ * and a forward walk. */
+class CAddressHistoryKey
+{
+public:
+    unsigned char nAddressType;
+    uint160 hashAddress;
+    s32int nHeight;
+    unsigned int nTx;
+    uint256 hashTx;
+    unsigned int nIndex;
+    bool fSpending;
+
+    CAddressHistoryKey()
+    {
+        SetNull();
+    }
+
+    CAddressHistoryKey(unsigned char nAddressTypeIn, const uint160& hashAddressIn, s32int nHeightIn, unsigned int nTxIn,
+                       const uint256& hashTxIn, unsigned int nIndexIn, bool fSpendingIn)
+    {
+        nAddressType = nAddressTypeIn;
+        hashAddress = hashAddressIn;
+        nHeight = nHeightIn;
+        nTx = nTxIn;
+        hashTx = hashTxIn;
+        nIndex = nIndexIn;
+        fSpending = fSpendingIn;
+    }
+
+    void SetNull()
+    {
+        nAddressType = 0;
+        hashAddress = 0;
+        nHeight = 0;
+        nTx = 0;
+        hashTx = 0;
+        nIndex = 0;
+        fSpending = false;
+    }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 1 + 20 + 4 + 4 + 32 + 4 + 1;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, nAddressType, nType, nVersion);
+        hashAddress.Serialize(s, nType, nVersion);
+        WriteBigEndian32(s, nHeight);
+        WriteBigEndian32(s, nTx);
+        hashTx.Serialize(s, nType, nVersion);
+        WriteBigEndian32(s, nIndex);
+        ::Serialize(s, fSpending, nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, nAddressType, nType, nVersion);
+        hashAddress.Unserialize(s, nType, nVersion);
+        nHeight = ReadBigEndian32(s);
+        nTx = ReadBigEndian32(s);
+        hashTx.Unserialize(s, nType, nVersion);
+        nIndex = ReadBigEndian32(s);
+        ::Unserialize(s, fSpending, nType, nVersion);
+    }
+};
+
+/** Amount of a history entry, negative for spends. A spend also keeps the height
+ * of the output it spent, so DisconnectBlock() can put the output back. */
+class CAddressHistoryValue
+{
+public:
+    int64 nValue;
+    s32int nPrevHeight;
+
+    CAddressHistoryValue()
+    {
+        nValue = 0;
+        nPrevHeight = -1;
+    }
+
+    CAddressHistoryValue(int64 nValueIn, s32int nPrevHeightIn)
+    {
+        nValue = nValueIn;
+        nPrevHeight = nPrevHeightIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nValue);
+        READWRITE(nPrevHeight);
+    )
+};
+
+class CAddressUnspentKey
+{
+public:
+    unsigned char nAddressType;
+    uint160 hashAddress;
+    uint256 hashTx;
+    unsigned int nIndex;
+
+    CAddressUnspentKey()
+    {
+        nAddressType = 0;
+        hashAddress = 0;
+        hashTx = 0;
+        nIndex = 0;
+    }
+
+    CAddressUnspentKey(unsigned char nAddressTypeIn, const uint160& hashAddressIn, const uint256& hashTxIn, unsigned int nIndexIn)
+    {
+        nAddressType = nAddressTypeIn;
+        hashAddress = hashAddressIn;
+        hashTx = hashTxIn;
+        nIndex = nIndexIn;
+    }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 1 + 20 + 32 + 4;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, nAddressType, nType, nVersion);
+        hashAddress.Serialize(s, nType, nVersion);
+        hashTx.Serialize(s, nType, nVersion);
+        WriteBigEndian32(s, nIndex);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, nAddressType, nType, nVersion);
+        hashAddress.Unserialize(s, nType, nVersion);
+        hashTx.Unserialize(s, nType, nVersion);
+        nIndex = ReadBigEndian32(s);
+    }
+};
+
+class CAddressUnspentValue
+{
+public:
+    int64 nValue;
+    s32int nHeight;
+
+    CAddressUnspentValue()
+    {
+        nValue = 0;
+        nHeight = -1;
+    }
+
+    CAddressUnspentValue(int64 nValueIn, s32int nHeightIn)
+    {
+        nValue = nValueIn;
+        nHeight = nHeightIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nValue);
+        READWRITE(nHeight);
+    )
+};
+
+class CAddressBalance
+{
+public:
+    int64 nBalance;
+    int64 nReceived;
+
+    CAddressBalance()
+    {
+        nBalance = 0;
+        nReceived = 0;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nBalance);
+        READWRITE(nReceived);
+    )
+};
+
+// Index the outputs of tx, the nTx'th transaction of the block at nHeight, and the
+// inputs it spends out of mapInputs
+bool AddressIndexConnectTx(CTxDB& txdb, const CTransaction& tx, const MapPrevTx& mapInputs, s32int nHeight, unsigned int nTx);
+bool AddressIndexDisconnectBlock(CTxDB& txdb, const CBlock& block, const CBlockIndex* pindex);
+
+// Bring the index in line with -addressindex at startup: build it for the best
+// chain when it was just turned on, erase it when it was turned off
+bool InitAddressIndex();
+
+#endif // SLIMCOIN_ADDRESSINDEX_H
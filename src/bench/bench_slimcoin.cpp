@@ -0,0 +1,292 @@
+// Copyright (c) 2013-2014 The Slimcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Micro-benchmark for the dcrypt and sha256 hashing primitives.
+//
+// Every result is printed as one JSON object per line on stdout, so runs of
+// different releases can be diffed or fed into a regression script:
+//   ./bench_slimcoin -seconds=2 -threads=4 > bench.json
+//
+#include <boost/thread.hpp>
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+#include "main.h"
+#include "wallet.h"
+#include "dcrypt.h"
+
+using namespace std;
+
+CWallet* pwalletMain;
+
+void Shutdown(void* parg)
+{
+    exit(0);
+}
+
+void StartShutdown()
+{
+    exit(0);
+}
+
+//
+// Allocation counting
+// dcrypt is supposed to hash without touching the heap, the counters below
+// make any regression of that visible. malloc is only interposed with glibc.
+//
+static boost::thread_specific_ptr<uint64> nThreadAllocs;
+static bool fCountAllocs = false;
+
+static void CountAlloc()
+{
+    if (fCountAllocs && nThreadAllocs.get())
+        (*nThreadAllocs.get())++;
+}
+
+#ifdef __GLIBC__
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t nmemb, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+extern "C" void *malloc(size_t size)
+{
+    CountAlloc();
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t nmemb, size_t size)
+{
+    CountAlloc();
+    return __libc_calloc(nmemb, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    CountAlloc();
+    return __libc_realloc(ptr, size);
+}
+#else
+void* operator new(size_t size)
+{
+    CountAlloc();
+    void *p = std::malloc(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) throw()
+{
+    std::free(p);
+}
+#endif
+
+static double dBenchSeconds = 1.0;
+
+static int64 GetTimeMicros()
+{
+    return (boost::posix_time::microsec_clock::universal_time() -
+            boost::posix_time::ptime(boost::gregorian::date(1970,1,1))).total_microseconds();
+}
+
+static void FillPayload(vector<uint8_t>& vData, unsigned int nSeed)
+{
+    for (unsigned int i = 0; i < vData.size(); i++)
+        vData[i] = (uint8_t)((i * 131 + nSeed * 7919) >> 3);
+}
+
+//runs fn(n) with n = 0, 1, 2... for about dBenchSeconds and returns the number of calls
+template<typename Fn>
+static uint64 RunTimed(Fn fn, double& dElapsed)
+{
+    uint64 nCalls = 0;
+    int64 nStart = GetTimeMicros();
+    int64 nEnd = nStart + (int64)(dBenchSeconds * 1000000);
+    int64 nNow;
+
+    do
+    {
+        for (int i = 0; i < 16; i++)
+            fn(nCalls++);
+        nNow = GetTimeMicros();
+    } while (nNow < nEnd);
+
+    dElapsed = (nNow - nStart) / 1000000.0;
+    return nCalls;
+}
+
+static void PrintRate(const char *pszBench, size_t nSize, uint64 nHashes, double dElapsed,
+                      uint64 nAllocs, int nThreads)
+{
+    fprintf(stdout, "{\"bench\":\"%s\",\"size\":%u,\"threads\":%d,\"hashes\":%" PRI64u ",\"seconds\":%.3f,"
+            "\"hashespersec\":%.1f,\"nsperhash\":%.1f,\"allocsperhash\":%.3f}\n",
+            pszBench, (unsigned int)nSize, nThreads, nHashes, dElapsed, nHashes / dElapsed,
+            dElapsed * 1e9 / nHashes, (double)nAllocs / nHashes);
+    fflush(stdout);
+}
+
+//dcrypt throughput for one input size, with and without a reusable context
+static void BenchSize(size_t nSize)
+{
+    vector<uint8_t> vData(nSize);
+    FillPayload(vData, nSize);
+    uint8_t *pdata = nSize ? &vData[0] : NULL;
+
+    Dcrypt_Context ctx;
+    double dElapsed;
+    uint64 nHashes;
+
+    dcrypt(pdata, nSize, &ctx);  //warm up, openssl allocates on first use
+    nThreadAllocs.reset(new uint64(0));
+    fCountAllocs = true;
+
+    nHashes = RunTimed([&](uint64 n) {
+        if (nSize >= 4)
+            memcpy(pdata + nSize - 4, &n, 4);  //vary the tail like a nonce
+        dcrypt(pdata, nSize, &ctx);
+    }, dElapsed);
+    PrintRate("dcrypt_ctx", nSize, nHashes, dElapsed, *nThreadAllocs, 1);
+
+    *nThreadAllocs = 0;
+    nHashes = RunTimed([&](uint64 n) {
+        if (nSize >= 4)
+            memcpy(pdata + nSize - 4, &n, 4);
+        dcrypt(pdata, nSize);
+    }, dElapsed);
+    PrintRate("dcrypt", nSize, nHashes, dElapsed, *nThreadAllocs, 1);
+
+    fCountAllocs = false;
+}
+
+//batched hashing through the multi-lane sha256 backend, the way ScanDcryptHash does it
+static void BenchMulti()
+{
+    static const unsigned int nBatch = 64;
+    vector<uint8_t> vHeaders(nBatch * 80);
+    FillPayload(vHeaders, 80);
+
+    const uint8_t *pdata[nBatch];
+    size_t data_sz[nBatch];
+    uint256 hashes[nBatch];
+    for (unsigned int i = 0; i < nBatch; i++)
+    {
+        pdata[i] = &vHeaders[i * 80];
+        data_sz[i] = 80;
+    }
+
+    double dElapsed;
+    dcrypt_multi(pdata, data_sz, hashes, nBatch);  //warm up, openssl allocates on first use
+    nThreadAllocs.reset(new uint64(0));
+    fCountAllocs = true;
+
+    uint64 nBatches = RunTimed([&](uint64 n) {
+        for (unsigned int i = 0; i < nBatch; i++)
+            memcpy(&vHeaders[i * 80 + 76], &n, 4);
+        dcrypt_multi(pdata, data_sz, hashes, nBatch);
+    }, dElapsed);
+
+    fCountAllocs = false;
+    PrintRate("dcrypt_multi", 80, nBatches * nBatch, dElapsed, *nThreadAllocs, 1);
+}
+
+//distribution of the mix_hashed_nums iteration counts over consecutive nonces
+static void BenchMixRounds(unsigned int nSamples)
+{
+    vector<uint8_t> vHeader(80);
+    FillPayload(vHeader, 80);
+
+    Dcrypt_Context ctx;
+    vector<uint64> vRounds;
+    vRounds.reserve(nSamples);
+    for (unsigned int n = 0; n < nSamples; n++)
+    {
+        memcpy(&vHeader[76], &n, 4);
+        dcrypt(&vHeader[0], vHeader.size(), &ctx);
+        vRounds.push_back(ctx.nMixRounds);
+    }
+
+    sort(vRounds.begin(), vRounds.end());
+    double dMean = 0;
+    BOOST_FOREACH(uint64 nRounds, vRounds)
+        dMean += nRounds;
+    dMean /= nSamples;
+
+    fprintf(stdout, "{\"bench\":\"mix_rounds\",\"size\":80,\"samples\":%u,\"min\":%" PRI64u ",\"p50\":%" PRI64u
+            ",\"p90\":%" PRI64u ",\"p99\":%" PRI64u ",\"max\":%" PRI64u ",\"mean\":%.1f}\n",
+            nSamples, vRounds.front(), vRounds[nSamples / 2], vRounds[nSamples * 9 / 10],
+            vRounds[nSamples * 99 / 100], vRounds.back(), dMean);
+    fflush(stdout);
+}
+
+static void ThreadBenchHash(unsigned int nThread, uint64 *pnHashes, double *pdElapsed)
+{
+    vector<uint8_t> vHeader(80);
+    FillPayload(vHeader, 80 + nThread);
+
+    Dcrypt_Context ctx;
+    *pnHashes = RunTimed([&](uint64 n) {
+        memcpy(&vHeader[76], &n, 4);
+        dcrypt(&vHeader[0], vHeader.size(), &ctx);
+    }, *pdElapsed);
+}
+
+//aggregate 80 byte hash rate of nThreads independent hashing threads
+static void BenchScaling(int nThreads)
+{
+    vector<uint64> vHashes(nThreads);
+    vector<double> vElapsed(nThreads);
+
+    boost::thread_group threads;
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&ThreadBenchHash, i, &vHashes[i], &vElapsed[i]));
+    threads.join_all();
+
+    uint64 nHashes = 0;
+    double dElapsed = 0;
+    for (int i = 0; i < nThreads; i++)
+    {
+        nHashes += vHashes[i];
+        dElapsed = max(dElapsed, vElapsed[i]);
+    }
+
+    PrintRate("dcrypt_scaling", 80, nHashes, dElapsed, 0, nThreads);
+}
+
+int main(int argc, char* argv[])
+{
+    fPrintToDebugger = true; // don't want to write to debug.log file
+    ParseParameters(argc, argv);
+
+    if (mapArgs.count("-?") || mapArgs.count("--help"))
+    {
+        fprintf(stdout, "Usage: bench_slimcoin [-seconds=<n>] [-threads=<n>] [-mixsamples=<n>]\n");
+        return 0;
+    }
+
+    dBenchSeconds = max(0.1, atof(GetArg("-seconds", "1").c_str()));
+    int nThreads = GetArg("-threads", boost::thread::hardware_concurrency());
+    if (nThreads < 1)
+        nThreads = 1;
+    unsigned int nMixSamples = max((int64)100, GetArg("-mixsamples", 10000));
+
+    fprintf(stdout, "{\"bench\":\"info\",\"version\":\"%s\",\"sha256_lanes\":\"%s\",\"lanes_width\":%u,\"cores\":%d}\n",
+            FormatFullVersion().c_str(), sha256_lanes_backend_name(sha256_lanes_backend()),
+            sha256_lanes_width(), boost::thread::hardware_concurrency());
+
+    //80 bytes is a block header, the rest are arbitrary payloads
+    const size_t nSizes[] = { 0, 32, 80, 256, 1024, 4096 };
+    for (unsigned int i = 0; i < sizeof(nSizes) / sizeof(nSizes[0]); i++)
+        BenchSize(nSizes[i]);
+
+    BenchMulti();
+    BenchMixRounds(nMixSamples);
+
+    BenchScaling(1);
+    if (nThreads > 1)
+        BenchScaling(nThreads);
+
+    return 0;
+}
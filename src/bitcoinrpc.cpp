@@ -252,7 +252,7 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
     if (hashBlock != 0)
     {
         entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end() && (*mi).second)
         {
             CBlockIndex* pindex = (*mi).second;
@@ -781,12 +781,213 @@ Value getmininginfo(const Array& params, bool fHelp)
     obj.push_back(Pair("generate",      GetBoolArg("-gen")));
     obj.push_back(Pair("genproclimit",  (int)GetArg("-genproclimit", -1)));
     obj.push_back(Pair("hashespersec",  gethashespersec(params, false)));
+    {
+        vector<double> vRates;
+        GetMinerThreadHashesPerSec(vRates);
+        Array threadRates;
+        BOOST_FOREACH(double dRate, vRates)
+            threadRates.push_back((boost::int64_t)dRate);
+        obj.push_back(Pair("hashespersecperthread", threadRates));
+    }
     obj.push_back(Pair("networkghps",   getnetworkghps(params, false)));
     obj.push_back(Pair("pooledtx",      (uint64_t)mempool.size()));
     obj.push_back(Pair("testnet",       fTestNet));
+    if (fDebug)
+    {
+        obj.push_back(Pair("blockhashescomputed", (uint64_t)nBlockHashesComputed));
+        obj.push_back(Pair("blockhashescached",   (uint64_t)nBlockHashesCached));
+        obj.push_back(Pair("stakemodifiercachesize",   (uint64_t)GetStakeModifierCacheSize()));
+        obj.push_back(Pair("stakemodifiercachehits",   (uint64_t)nStakeModifierCacheHits));
+        obj.push_back(Pair("stakemodifiercachemisses", (uint64_t)nStakeModifierCacheMisses));
+        uint64 nEntries, nBytes;
+        GetBlockIndexMemoryUsage(nEntries, nBytes);
+        obj.push_back(Pair("blockindexentries",  (uint64_t)nEntries));
+        obj.push_back(Pair("blockindexbytes",    (uint64_t)nBytes));
+        obj.push_back(Pair("blockindexperentry", (uint64_t)(nEntries ? nBytes / nEntries : 0)));
+    }
     return obj;
 }
 
+Value gettxcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "gettxcacheinfo\n"
+            "Returns the size and hit rates of the transaction database cache (-txcache).");
+
+    CTxDBCacheStats stats;
+    GetTxDBCacheStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("maxsize",        (boost::int64_t)stats.nMaxSize));
+    obj.push_back(Pair("dirtyentries",   (uint64_t)stats.nDirtyCount));
+    obj.push_back(Pair("dirtysize",      (uint64_t)stats.nDirtySize));
+    obj.push_back(Pair("cleanentries",   (uint64_t)stats.nCleanCount));
+    obj.push_back(Pair("cleansize",      (uint64_t)stats.nCleanSize));
+    obj.push_back(Pair("transactions",   (uint64_t)stats.nTxCount));
+    obj.push_back(Pair("transactionsize",(uint64_t)stats.nTxSize));
+    obj.push_back(Pair("hits",           (uint64_t)stats.nHits));
+    obj.push_back(Pair("misses",         (uint64_t)stats.nMisses));
+    obj.push_back(Pair("hitrate",        stats.nHits + stats.nMisses ? (double)stats.nHits / (stats.nHits + stats.nMisses) : 0.0));
+    obj.push_back(Pair("txhits",         (uint64_t)stats.nTxHits));
+    obj.push_back(Pair("txmisses",       (uint64_t)stats.nTxMisses));
+    obj.push_back(Pair("txhitrate",      stats.nTxHits + stats.nTxMisses ? (double)stats.nTxHits / (stats.nTxHits + stats.nTxMisses) : 0.0));
+    obj.push_back(Pair("flushes",        (uint64_t)stats.nFlushes));
+    obj.push_back(Pair("lastflush",      (boost::int64_t)stats.nLastFlush));
+    return obj;
+}
+
+Value getblockcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getblockcacheinfo\n"
+            "Returns the size and hit rate of the cache of blocks served to peers (-blockcachesize).");
+
+    CBlockCacheStats stats;
+    GetBlockCacheStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("maxsize",        (boost::int64_t)stats.nMaxSize));
+    obj.push_back(Pair("blocks",         (uint64_t)stats.nCount));
+    obj.push_back(Pair("size",           (uint64_t)stats.nSize));
+    obj.push_back(Pair("hits",           (uint64_t)stats.nHits));
+    obj.push_back(Pair("misses",         (uint64_t)stats.nMisses));
+    obj.push_back(Pair("hitrate",        stats.nHits + stats.nMisses ? (double)stats.nHits / (stats.nHits + stats.nMisses) : 0.0));
+    return obj;
+}
+
+// address and its index key from the first parameter of the getaddress* calls
+static void GetAddressIndexParam(const Array& params, unsigned char& nAddressType, uint160& hashAddress)
+{
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled, restart with -addressindex");
+
+    CBitcoinAddress address(params[0].get_str());
+    if (!address.IsValid() || !GetAddressIndexKey(address.Get(), nAddressType, hashAddress))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Slimcoin address");
+}
+
+static void GetAddressIndexPage(const Array& params, unsigned int nFirst, int& nCount, int& nFrom)
+{
+    nCount = 100;
+    if (params.size() > nFirst)
+        nCount = params[nFirst].get_int();
+
+    nFrom = 0;
+    if (params.size() > nFirst + 1)
+        nFrom = params[nFirst + 1].get_int();
+
+    if (nCount < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative count");
+    if (nFrom < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative from");
+}
+
+Value getaddressbalance(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance <slimcoinaddress>\n"
+            "Returns the confirmed balance of <slimcoinaddress> and the total it received.\n"
+            "Requires -addressindex.");
+
+    unsigned char nAddressType;
+    uint160 hashAddress;
+    GetAddressIndexParam(params, nAddressType, hashAddress);
+
+    CTxDB txdb("r");
+    CAddressBalance balance;
+    txdb.ReadAddressBalance(nAddressType, hashAddress, balance);
+
+    Object obj;
+    obj.push_back(Pair("balance",  ValueFromAmount(balance.nBalance)));
+    obj.push_back(Pair("received", ValueFromAmount(balance.nReceived)));
+    return obj;
+}
+
+Value getaddressutxos(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "getaddressutxos <slimcoinaddress> [count=100] [from=0]\n"
+            "Returns up to [count] unspent outputs of <slimcoinaddress> in txid order,\n"
+            "skipping the first [from]. Requires -addressindex.");
+
+    unsigned char nAddressType;
+    uint160 hashAddress;
+    GetAddressIndexParam(params, nAddressType, hashAddress);
+    int nCount, nFrom;
+    GetAddressIndexPage(params, 1, nCount, nFrom);
+
+    CTxDB txdb("r");
+    vector<pair<CAddressUnspentKey, CAddressUnspentValue> > vEntries;
+    if (!txdb.ListAddressUnspent(nAddressType, hashAddress, nFrom, nCount, vEntries))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Error reading the address index");
+
+    Array ret;
+    BOOST_FOREACH(const PAIRTYPE(CAddressUnspentKey, CAddressUnspentValue)& item, vEntries)
+    {
+        Object entry;
+        entry.push_back(Pair("txid",          item.first.hashTx.GetHex()));
+        entry.push_back(Pair("vout",          (boost::int64_t)item.first.nIndex));
+        entry.push_back(Pair("amount",        ValueFromAmount(item.second.nValue)));
+        entry.push_back(Pair("height",        item.second.nHeight));
+        entry.push_back(Pair("confirmations", nBestHeight - item.second.nHeight + 1));
+        ret.push_back(entry);
+    }
+    return ret;
+}
+
+Value getaddresshistory(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 4)
+        throw runtime_error(
+            "getaddresshistory <slimcoinaddress> [count=100] [from=0] [startheight=0]\n"
+            "Returns up to [count] outputs paid to and inputs spent from <slimcoinaddress>\n"
+            "in block order, from block [startheight] on and skipping the first [from].\n"
+            "Requires -addressindex.");
+
+    unsigned char nAddressType;
+    uint160 hashAddress;
+    GetAddressIndexParam(params, nAddressType, hashAddress);
+    int nCount, nFrom;
+    GetAddressIndexPage(params, 1, nCount, nFrom);
+
+    int nStartHeight = 0;
+    if (params.size() > 3)
+        nStartHeight = params[3].get_int();
+    if (nStartHeight < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative startheight");
+
+    CTxDB txdb("r");
+    vector<pair<CAddressHistoryKey, CAddressHistoryValue> > vEntries;
+    if (!txdb.ListAddressHistory(nAddressType, hashAddress, nStartHeight, nFrom, nCount, vEntries))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Error reading the address index");
+
+    Array ret;
+    BOOST_FOREACH(const PAIRTYPE(CAddressHistoryKey, CAddressHistoryValue)& item, vEntries)
+    {
+        Object entry;
+        entry.push_back(Pair("txid",     item.first.hashTx.GetHex()));
+        entry.push_back(Pair("height",   item.first.nHeight));
+        entry.push_back(Pair("blockindex", (boost::int64_t)item.first.nTx));
+        if (item.first.fSpending)
+        {
+            entry.push_back(Pair("category", "spend"));
+            entry.push_back(Pair("vin",      (boost::int64_t)item.first.nIndex));
+        }
+        else
+        {
+            entry.push_back(Pair("category", "receive"));
+            entry.push_back(Pair("vout",     (boost::int64_t)item.first.nIndex));
+        }
+        entry.push_back(Pair("amount",   ValueFromAmount(item.second.nValue)));
+        ret.push_back(entry);
+    }
+    return ret;
+}
+
 Value getnewaddress(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -3015,6 +3216,8 @@ Value getblock(const Array& params, bool fHelp)
 
     CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
+    if (IsBlockPruned(pblockindex))
+        throw JSONRPCError(RPC_MISC_ERROR, "Block was pruned");
     block.ReadFromDisk(pblockindex, true, false);
 
     bool fTxInfo = params.size() > 1 ? params[1].get_bool() : false;
@@ -3256,6 +3459,8 @@ Value dumpbootstrap(const Array& params, bool fHelp)
     string strDest = params[0].get_str();
     int nEndBlock = nBestHeight;
     int nStartBlock = 0;
+    if (nPruneHeight > 0)
+        throw JSONRPCError(RPC_MISC_ERROR, "Blocks were pruned, can't dump the block chain");
 
     boost::filesystem::path pathDest(strDest);
     if (boost::filesystem::is_directory(pathDest))
@@ -3313,10 +3518,8 @@ Value linearizehashes(const Array& params, bool fHelp)
 
         for (int nHeight = nStartBlock; nHeight <= nEndBlock; nHeight++)
         {
-            CBlock block;
             CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
-            block.ReadFromDisk(pblockindex, true);
-            std::string blockhash = block.GetHash().ToString().c_str();
+            std::string blockhash = pblockindex->GetBlockHash().ToString();
             fileout << blockhash.append("\n");
         }
     } catch(const boost::filesystem::filesystem_error &e) {
@@ -3987,6 +4190,11 @@ static const CRPCCommand vRPCCommands[] =
     { "getnetworkghps",           &getnetworkghps,         true   },
     { "getinfo",                  &getinfo,                true   },
     { "getmininginfo",            &getmininginfo,          true   },
+    { "gettxcacheinfo",           &gettxcacheinfo,         true   },
+    { "getblockcacheinfo",        &getblockcacheinfo,      true   },
+    { "getaddressbalance",        &getaddressbalance,      true   },
+    { "getaddressutxos",          &getaddressutxos,        true   },
+    { "getaddresshistory",        &getaddresshistory,      true   },
     { "getnewaddress",            &getnewaddress,          true   },
     { "getaccountaddress",        &getaccountaddress,      true   },
     { "setaccount",               &setaccount,             true   },
@@ -4657,6 +4865,11 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "listreceivedbyaccount"  && n > 1) ConvertTo<bool>(params[1]);
     if (strMethod == "getbalance"             && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "getblockhash"           && n > 0) ConvertTo<boost::int64_t>(params[0]);
+    if (strMethod == "getaddressutxos"        && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "getaddressutxos"        && n > 2) ConvertTo<boost::int64_t>(params[2]);
+    if (strMethod == "getaddresshistory"      && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "getaddresshistory"      && n > 2) ConvertTo<boost::int64_t>(params[2]);
+    if (strMethod == "getaddresshistory"      && n > 3) ConvertTo<boost::int64_t>(params[3]);
     if (strMethod == "getblock"               && n > 1) ConvertTo<bool>(params[1]);
     if (strMethod == "getblock"               && n > 2) ConvertTo<bool>(params[2]);
     if (strMethod == "move"                   && n > 2) ConvertTo<double>(params[2]);
@@ -0,0 +1,362 @@
+// Copyright (c) 2013-2014 The Slimcoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockimport.h"
+#include "db.h"
+#include "main.h"
+#include "ui_interface.h"
+
+#include <deque>
+
+#include <boost/filesystem.hpp>
+
+using namespace std;
+using namespace boost;
+
+// Blocks read but not yet connected, bounds the memory the import takes
+static const unsigned int MAX_IMPORT_BLOCKS_IN_FLIGHT = 2000;
+
+// Numbers of the blk%04d.dat.reindex files in pathDir, ascending
+static vector<unsigned int> GetReindexFileNumbers(const filesystem::path& pathDir)
+{
+    vector<unsigned int> vFiles;
+    for (filesystem::directory_iterator it(pathDir); it != filesystem::directory_iterator(); ++it)
+    {
+        string strName = it->path().filename().string();
+        unsigned int nFile = 0;
+        if (sscanf(strName.c_str(), "blk%u.dat.reindex", &nFile) == 1 && nFile > 0 &&
+            strName == strprintf("blk%04u.dat.reindex", nFile))
+            vFiles.push_back(nFile);
+    }
+    sort(vFiles.begin(), vFiles.end());
+    return vFiles;
+}
+
+bool MoveBlockFilesAside(const filesystem::path& pathDir, unsigned int& nMovedRet)
+{
+    // blocks left over from an interrupted reindex stay ahead of the current files,
+    // so the new ones are numbered after the last of them
+    vector<unsigned int> vLeftover = GetReindexFileNumbers(pathDir);
+    unsigned int nReindexFile = vLeftover.empty() ? 1 : vLeftover.back() + 1;
+
+    nMovedRet = 0;
+    for (unsigned int nFile = 1; ; nFile++)
+    {
+        filesystem::path pathBlocks = pathDir / strprintf("blk%04u.dat", nFile);
+        if (!filesystem::exists(pathBlocks))
+            break;
+        filesystem::path pathReindex = pathDir / strprintf("blk%04u.dat.reindex", nReindexFile++);
+        if (filesystem::exists(pathReindex))
+            return error("MoveBlockFilesAside() : %s is in the way", pathReindex.string().c_str());
+        try {
+            filesystem::rename(pathBlocks, pathReindex);
+        } catch (filesystem::filesystem_error &e) {
+            return error("MoveBlockFilesAside() : moving %s aside failed", pathBlocks.string().c_str());
+        }
+        nMovedRet++;
+    }
+    return true;
+}
+
+bool PrepareReindex()
+{
+    {
+        CTxDB txdb("r");
+        int nPruned = 0;
+        if (txdb.ReadPruneHeight(nPruned) && nPruned > 0)
+            return error("PrepareReindex() : the block files were pruned up to height %d, they can't be reindexed", nPruned);
+    }
+
+    blockStore.CloseAll();
+    unsigned int nMoved = 0;
+    if (!MoveBlockFilesAside(GetDataDir(), nMoved))
+        return false;
+    printf("PrepareReindex() : %u block files moved aside, %u to import\n", nMoved, (unsigned int)GetReindexFiles().size());
+
+    filesystem::remove(GetDataDir() / "blkindex.snap");
+    CTxDB txdb("r+");
+    return txdb.EraseAll();
+}
+
+vector<filesystem::path> GetReindexFiles(const filesystem::path& pathDir)
+{
+    // the first files are deleted as they are imported
+    vector<filesystem::path> vFiles;
+    BOOST_FOREACH(unsigned int nFile, GetReindexFileNumbers(pathDir))
+        vFiles.push_back(pathDir / strprintf("blk%04u.dat.reindex", nFile));
+    return vFiles;
+}
+
+vector<filesystem::path> GetReindexFiles()
+{
+    return GetReindexFiles(GetDataDir());
+}
+
+/** State shared by the stages of one import */
+class CBlockImporter
+{
+public:
+    boost::mutex cs;
+    boost::condition_variable condRead;    // a block was read, or the reader is done
+    boost::condition_variable condChecked; // a block was checked
+    boost::condition_variable condSpace;   // a block was connected, the reader may go on
+
+    deque<pair<uint64, vector<char>*> > queueRead;
+    map<uint64, CBlock*> mapChecked;       // NULL for blocks that failed to deserialize or check
+    uint64 nRead;
+    uint64 nChecked;
+    uint64 nConnected;
+    bool fReadDone;
+    bool fStop;
+
+    // time each stage spent working, in microseconds, the check stage summed over its threads
+    int64 nReadMicros;
+    int64 nCheckMicros;
+    int64 nConnectMicros;
+    uint64 nBytesRead;
+
+    CBlockImporter()
+    {
+        nRead = nChecked = nConnected = 0;
+        fReadDone = fStop = false;
+        nReadMicros = nCheckMicros = nConnectMicros = 0;
+        nBytesRead = 0;
+    }
+
+    ~CBlockImporter()
+    {
+        for (deque<pair<uint64, vector<char>*> >::iterator it = queueRead.begin(); it != queueRead.end(); ++it)
+            delete it->second;
+        for (map<uint64, CBlock*>::iterator it = mapChecked.begin(); it != mapChecked.end(); ++it)
+            delete it->second;
+    }
+
+    void ThreadRead(FILE* file);
+    void ThreadCheck();
+};
+
+bool ReadNextBlock(FILE* file, const unsigned char pchMessageStart[4], vector<char>& vData)
+{
+    unsigned char pchWindow[4];
+    if (fread(pchWindow, 1, 4, file) != 4)
+        return false;
+    while (true)
+    {
+        if (memcmp(pchWindow, pchMessageStart, 4) == 0)
+        {
+            unsigned char pchSize[4];
+            if (fread(pchSize, 1, 4, file) != 4)
+                return false;
+            unsigned int nSize = pchSize[0] | (pchSize[1] << 8) | (pchSize[2] << 16) | ((unsigned int)pchSize[3] << 24);
+            if (nSize >= 80 && nSize <= MAX_BLOCK_SIZE)
+            {
+                vData.resize(nSize);
+                return fread(&vData[0], 1, nSize, file) == nSize;
+            }
+            // not a block after all, go on after the message start
+            if (fseek(file, -4, SEEK_CUR) != 0)
+                return false;
+        }
+
+        int c = fgetc(file);
+        if (c == EOF)
+            return false;
+        memmove(pchWindow, pchWindow + 1, 3);
+        pchWindow[3] = c;
+    }
+}
+
+void CBlockImporter::ThreadRead(FILE* file)
+{
+    unsigned char pchMessageStart[4];
+    GetMessageStart(pchMessageStart, true);
+
+    while (true)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            while (!fStop && nRead - nConnected >= MAX_IMPORT_BLOCKS_IN_FLIGHT)
+                condSpace.wait(lock);
+            if (fStop)
+                break;
+        }
+
+        int64 nStart = GetTimeMicros();
+        vector<char>* pvData = new vector<char>();
+        bool fRead = ReadNextBlock(file, pchMessageStart, *pvData);
+
+        boost::unique_lock<boost::mutex> lock(cs);
+        nReadMicros += GetTimeMicros() - nStart;
+        if (!fRead)
+        {
+            delete pvData;
+            break;
+        }
+        nBytesRead += pvData->size();
+        queueRead.push_back(make_pair(nRead++, pvData));
+        condRead.notify_one();
+    }
+
+    boost::unique_lock<boost::mutex> lock(cs);
+    fReadDone = true;
+    condRead.notify_all();
+    condChecked.notify_all();
+}
+
+void CBlockImporter::ThreadCheck()
+{
+    while (true)
+    {
+        pair<uint64, vector<char>*> item;
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            while (!fStop && !fReadDone && queueRead.empty())
+                condRead.wait(lock);
+            if (fStop || queueRead.empty())
+                return;
+            item = queueRead.front();
+            queueRead.pop_front();
+        }
+
+        int64 nStart = GetTimeMicros();
+        CBlock* pblock = new CBlock();
+        try {
+            const char* pbegin = &(*item.second)[0];
+            CMemoryReader reader(pbegin, pbegin + item.second->size(), SER_DISK, CLIENT_VERSION);
+            reader >> *pblock;
+        }
+        catch (std::exception &e) {
+            printf("CBlockImporter::ThreadCheck() : deserialize error in block %" PRI64u " of the file\n", item.first);
+            delete pblock;
+            pblock = NULL;
+        }
+        delete item.second;
+
+        // the dcrypt hash is computed here and cached in the block for the connect stage
+        if (pblock && !pblock->CheckBlock())
+        {
+            printf("CBlockImporter::ThreadCheck() : block %s failed CheckBlock()\n", pblock->GetHash().ToString().substr(0,20).c_str());
+            delete pblock;
+            pblock = NULL;
+        }
+        if (pblock)
+            pblock->fChecked = true;
+
+        boost::unique_lock<boost::mutex> lock(cs);
+        nCheckMicros += GetTimeMicros() - nStart;
+        nChecked++;
+        mapChecked[item.first] = pblock;
+        if (item.first == nConnected)
+            condChecked.notify_one();
+    }
+}
+
+static double BlocksPerSecond(uint64 nBlocks, int64 nMicros)
+{
+    return nMicros > 0 ? nBlocks * 1000000.0 / nMicros : 0.0;
+}
+
+static bool ImportBlockFile(const filesystem::path& pathFile, uint64& nImportedRet)
+{
+    FILE* file = fopen(pathFile.string().c_str(), "rb");
+    if (!file)
+        return error("ImportBlockFile() : can't open %s", pathFile.string().c_str());
+    printf("ImportBlockFile() : importing %s\n", pathFile.string().c_str());
+
+    int nThreads = boost::thread::hardware_concurrency();
+    if (nThreads < 1)
+        nThreads = 1;
+
+    CBlockImporter importer;
+    boost::thread_group threadGroup;
+    threadGroup.create_thread(boost::bind(&CBlockImporter::ThreadRead, &importer, file));
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&CBlockImporter::ThreadCheck, &importer));
+
+    int64 nStart = GetTimeMicros();
+    int64 nLastReport = GetTime();
+    uint64 nConnected = 0, nSkipped = 0, nInvalid = 0;
+    while (true)
+    {
+        CBlock* pblock = NULL;
+        {
+            boost::unique_lock<boost::mutex> lock(importer.cs);
+            while (!importer.mapChecked.count(importer.nConnected) && !(importer.fReadDone && importer.nConnected == importer.nRead) &&
+                   !fRequestShutdown)
+                importer.condChecked.timed_wait(lock, boost::posix_time::milliseconds(100));
+            if (fRequestShutdown || !importer.mapChecked.count(importer.nConnected))
+                break;
+            pblock = importer.mapChecked[importer.nConnected];
+            importer.mapChecked.erase(importer.nConnected++);
+            importer.condSpace.notify_one();
+        }
+
+        if (!pblock)
+            nInvalid++;
+        else
+        {
+            int64 nConnectStart = GetTimeMicros();
+            {
+                LOCK(cs_main);
+                uint256 hash = pblock->GetHash();
+                if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+                    nSkipped++;
+                else if (ProcessBlock(NULL, pblock))
+                    nConnected++;
+                else
+                    nInvalid++;
+            }
+            delete pblock;
+
+            boost::unique_lock<boost::mutex> lock(importer.cs);
+            importer.nConnectMicros += GetTimeMicros() - nConnectStart;
+        }
+
+        if (GetTime() - nLastReport >= 10)
+        {
+            nLastReport = GetTime();
+            boost::unique_lock<boost::mutex> lock(importer.cs);
+            printf("ImportBlockFile() : read %.1f blocks/s, check %.1f blocks/s on %d threads, connect %.1f blocks/s, best height %d\n",
+                BlocksPerSecond(importer.nRead, importer.nReadMicros), BlocksPerSecond(importer.nChecked, importer.nCheckMicros) * nThreads,
+                nThreads, BlocksPerSecond(importer.nConnected, importer.nConnectMicros), nBestHeight);
+            InitMessage(strprintf(_("Importing blocks... %d"), nBestHeight));
+        }
+    }
+
+    {
+        boost::unique_lock<boost::mutex> lock(importer.cs);
+        importer.fStop = true;
+        importer.condRead.notify_all();
+        importer.condSpace.notify_all();
+    }
+    threadGroup.join_all();
+    fclose(file);
+
+    int64 nMicros = GetTimeMicros() - nStart;
+    printf("ImportBlockFile() : %" PRI64u " blocks (%" PRI64u " MB) in %" PRI64d " ms, %.1f blocks/s: %" PRI64u " connected, %" PRI64u " known, %" PRI64u " invalid\n",
+        importer.nConnected, importer.nBytesRead / (1024 * 1024), nMicros / 1000, BlocksPerSecond(importer.nConnected, nMicros),
+        nConnected, nSkipped, nInvalid);
+    printf("ImportBlockFile() : stages: read %.1f blocks/s, check %.1f blocks/s on %d threads, connect %.1f blocks/s\n",
+        BlocksPerSecond(importer.nRead, importer.nReadMicros), BlocksPerSecond(importer.nChecked, importer.nCheckMicros) * nThreads,
+        nThreads, BlocksPerSecond(importer.nConnected, importer.nConnectMicros));
+
+    nImportedRet += nConnected;
+    return !fRequestShutdown;
+}
+
+bool ImportBlockFiles(const vector<filesystem::path>& vFiles, bool fDeleteFiles)
+{
+    uint64 nImported = 0;
+    BOOST_FOREACH(const filesystem::path& pathFile, vFiles)
+    {
+        InitMessage(strprintf(_("Importing blocks from %s..."), pathFile.filename().string().c_str()));
+        if (!ImportBlockFile(pathFile, nImported))
+            return false;
+        if (fDeleteFiles)
+            filesystem::remove(pathFile);
+    }
+    if (!vFiles.empty())
+        printf("ImportBlockFiles() : imported %" PRI64u " blocks from %u files\n", nImported, (unsigned int)vFiles.size());
+    return true;
+}
@@ -0,0 +1,43 @@
+// Copyright (c) 2013-2014 The Slimcoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef SLIMCOIN_BLOCKIMPORT_H
+#define SLIMCOIN_BLOCKIMPORT_H
+
+#include <cstdio>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+/** Bulk import of block files in the blk0001.dat format, for -loadblock and -reindex.
+ * The import is a pipeline:
+ *   a reader thread that finds the blocks by their message start and size,
+ *   a pool of threads that deserialize them and run the context free CheckBlock()
+ *     (dcrypt proof-of-work, merkle root, signatures),
+ *   and the calling thread, which hands them to ProcessBlock() in file order.
+ * The blocks per second of each stage are logged, the slowest one is the bottleneck.
+ */
+
+// Move the block files aside as blk%04d.dat.reindex and empty the transaction
+// database, before the block index is loaded. The blocks are imported back from
+// GetReindexFiles().
+bool PrepareReindex();
+
+// Block files moved aside by PrepareReindex() and not imported yet, in file order.
+// A reindex that was interrupted continues with the files it has left.
+std::vector<boost::filesystem::path> GetReindexFiles();
+std::vector<boost::filesystem::path> GetReindexFiles(const boost::filesystem::path& pathDir);
+
+// Rename the blk%04d.dat files of pathDir to blk%04d.dat.reindex, numbered after the
+// files an interrupted reindex left. Fails rather than replace one of them.
+bool MoveBlockFilesAside(const boost::filesystem::path& pathDir, unsigned int& nMovedRet);
+
+// The next block in the file: scan for the message start, then read the size and the block.
+// Garbage between blocks and blocks with a bad size are skipped.
+bool ReadNextBlock(FILE* file, const unsigned char pchMessageStart[4], std::vector<char>& vData);
+
+// Import the blocks of vFiles. With fDeleteFiles every file is deleted once its blocks
+// are imported. False on errors and when shutdown was requested.
+bool ImportBlockFiles(const std::vector<boost::filesystem::path>& vFiles, bool fDeleteFiles);
+
+#endif // SLIMCOIN_BLOCKIMPORT_H
@@ -0,0 +1,85 @@
+// Copyright (c) 2013-2014 The Slimcoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockstore.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+CBlockStore blockStore;
+
+CMappedBlockFile::~CMappedBlockFile()
+{
+#ifndef WIN32
+    if (pdata)
+        munmap((void*)pdata, nSize);
+#endif
+}
+
+CBlockStore::CBlockStore()
+{
+    // 2GB block files would use up a 32-bit address space
+    fEnabled = (sizeof(void*) >= 8);
+#ifdef WIN32
+    fEnabled = false;
+#endif
+}
+
+boost::shared_ptr<CMappedBlockFile> CBlockStore::GetFile(unsigned int nFile, uint64 nEnd)
+{
+    LOCK(cs);
+    if (!fEnabled || nFile == (unsigned int)-1)
+        return boost::shared_ptr<CMappedBlockFile>();
+
+    map<unsigned int, boost::shared_ptr<CMappedBlockFile> >::iterator mi = mapFiles.find(nFile);
+    if (mi != mapFiles.end() && mi->second->nSize >= nEnd)
+        return mi->second;
+
+#ifndef WIN32
+    string strPath = (GetDataDir() / strprintf("blk%04d.dat", nFile)).string();
+    int fd = open(strPath.c_str(), O_RDONLY);
+    if (fd == -1)
+        return boost::shared_ptr<CMappedBlockFile>();
+
+    // map exactly the current size, pages past the end of the file can't be read
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64)st.st_size < nEnd)
+    {
+        close(fd);
+        return boost::shared_ptr<CMappedBlockFile>();
+    }
+    void* pdata = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (pdata == MAP_FAILED)
+    {
+        printf("CBlockStore::GetFile() : mmap of %s failed, errno %d\n", strPath.c_str(), errno);
+        return boost::shared_ptr<CMappedBlockFile>();
+    }
+    madvise(pdata, st.st_size, MADV_RANDOM);
+
+    boost::shared_ptr<CMappedBlockFile> pfile(new CMappedBlockFile((const char*)pdata, st.st_size));
+    mapFiles[nFile] = pfile;
+    return pfile;
+#else
+    return boost::shared_ptr<CMappedBlockFile>();
+#endif
+}
+
+void CBlockStore::CloseFile(unsigned int nFile)
+{
+    LOCK(cs);
+    mapFiles.erase(nFile);
+}
+
+void CBlockStore::CloseAll()
+{
+    LOCK(cs);
+    mapFiles.clear();
+}
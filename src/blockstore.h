@@ -0,0 +1,81 @@
+// Copyright (c) 2013-2014 The Slimcoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef SLIMCOIN_BLOCKSTORE_H
+#define SLIMCOIN_BLOCKSTORE_H
+
+#include "serialize.h"
+#include "util.h"
+
+#include <map>
+
+#include <boost/shared_ptr.hpp>
+
+/** Read-only memory map of one blk%04d.dat file, unmapped when the last user lets go */
+class CMappedBlockFile
+{
+public:
+    const char* pdata;
+    uint64 nSize;
+
+    CMappedBlockFile(const char* pdataIn, uint64 nSizeIn) : pdata(pdataIn), nSize(nSizeIn) { }
+    ~CMappedBlockFile();
+
+private:
+    CMappedBlockFile(const CMappedBlockFile&);
+    void operator=(const CMappedBlockFile&);
+};
+
+/** Reads blocks and transactions out of memory maps of the block files instead of
+ * opening the file for every read. Block files only grow by appends; a read past the
+ * end of a mapping maps the file again at its new size. Readers hold a reference to
+ * the mapping they use, so the old one stays valid until they are done with it.
+ * Files that can't be mapped, and builds without mmap, fall back to the stdio path.
+ */
+class CBlockStore
+{
+private:
+    CCriticalSection cs;
+    std::map<unsigned int, boost::shared_ptr<CMappedBlockFile> > mapFiles;
+    bool fEnabled;
+
+public:
+    CBlockStore();
+
+    // Mapping of block file nFile that covers at least the first nEnd bytes, NULL if
+    // the file is shorter or can't be mapped
+    boost::shared_ptr<CMappedBlockFile> GetFile(unsigned int nFile, uint64 nEnd);
+
+    // Forget the mapping of a file that is rewritten or deleted
+    void CloseFile(unsigned int nFile);
+    void CloseAll();
+
+    // Unserialize obj at nPos of block file nFile straight from the mapping. False if
+    // the file can't be mapped or obj can't be read there, the caller then reads it
+    // from the file to report the error.
+    template<typename T>
+    bool Read(unsigned int nFile, unsigned int nPos, T& obj, int nType, int nVersion)
+    {
+        uint64 nEnd = (uint64)nPos + 1;
+        for (int nTry = 0; nTry < 2; nTry++)
+        {
+            boost::shared_ptr<CMappedBlockFile> pfile = GetFile(nFile, nEnd);
+            if (!pfile)
+                return false;
+            try {
+                CMemoryReader reader(pfile->pdata + nPos, pfile->pdata + pfile->nSize, nType, nVersion);
+                reader >> obj;
+                return true;
+            }
+            catch (std::exception &e) {
+                // ran off the end of the mapping, the file may have grown since
+                nEnd = pfile->nSize + 1;
+            }
+        }
+        return false;
+    }
+};
+
+extern CBlockStore blockStore;
+
+#endif // SLIMCOIN_BLOCKSTORE_H
@@ -8,6 +8,7 @@
 #include <map>
 #include "net.h"
 #include "util.h"
+#include "main.h"
 
 #define CHECKPOINT_MAX_SPAN (60 * 60 * 4) // max 4 hours before latest block
 
@@ -30,7 +31,7 @@ namespace Checkpoints
   int GetTotalBlocksEstimate();
 
   // Returns last CBlockIndex* in mapBlockIndex that is a checkpoint
-  CBlockIndex* GetLastCheckpoint(const std::map<uint256, CBlockIndex*>& mapBlockIndex);
+  CBlockIndex* GetLastCheckpoint(const BlockMap& mapBlockIndex);
 
   extern uint256 hashSyncCheckpoint;
   extern CSyncCheckpoint checkpointMessage;
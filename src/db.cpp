@@ -16,6 +16,10 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
 #ifndef WIN32
 #include "sys/stat.h"
 #endif
@@ -296,8 +300,13 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
 }
 
 
+static void FlushTxDB(bool fShutdown);
+
 void DBFlush(bool fShutdown)
 {
+    // The transaction database goes first, with -txdb=bdb it holds blkindex.dat open
+    FlushTxDB(fShutdown);
+
     // Flush log data to the actual data file
     //  on all files that are not in use
     printf("DBFlush(%s)%s\n", fShutdown ? "true" : "false", fDbEnvInit ? "" : " db not started");
@@ -348,186 +357,1298 @@ void DBFlush(bool fShutdown)
 // CTxDB
 //
 
-bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
-{
-    assert(!fClient);
-    txindex.SetNull();
-    return Read(make_pair(string("tx"), hash), txindex);
-}
-
-bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
-{
-    assert(!fClient);
-    return Write(make_pair(string("tx"), hash), txindex);
-}
-
-bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight)
+/** Berkeley database backend of CTxDB, the blkindex.dat of earlier versions.
+ * It has no snapshots, reads always see the latest data.
+ */
+class CBDBKeyValueStore : public CKeyValueStore, private CDB
 {
-    assert(!fClient);
+private:
+    class CBDBKeyValueIterator : public CKeyValueIterator
+    {
+    private:
+        Dbc* pcursor;
+        bool fValid;
+        std::string strKey;
+        std::string strValue;
 
-    // Add to tx index
-    uint256 hash = tx.GetHash();
-    CTxIndex txindex(pos, tx.vout.size());
-    return Write(make_pair(string("tx"), hash), txindex);
-}
+        void Get(std::string strKeyIn, unsigned int fFlags)
+        {
+            fValid = false;
+            if (!pcursor)
+                return;
+            Dbt datKey;
+            if (fFlags == DB_SET_RANGE)
+            {
+                datKey.set_data((void*)strKeyIn.data());
+                datKey.set_size(strKeyIn.size());
+            }
+            Dbt datValue;
+            datKey.set_flags(DB_DBT_MALLOC);
+            datValue.set_flags(DB_DBT_MALLOC);
+            int ret = pcursor->get(&datKey, &datValue, fFlags);
+            if (ret == 0 && datKey.get_data() && datValue.get_data())
+            {
+                strKey.assign((char*)datKey.get_data(), datKey.get_size());
+                strValue.assign((char*)datValue.get_data(), datValue.get_size());
+                fValid = true;
+            }
+            if (ret == 0)
+            {
+                free(datKey.get_data());
+                free(datValue.get_data());
+            }
+        }
 
-bool CTxDB::EraseTxIndex(const CTransaction& tx)
-{
-    assert(!fClient);
-    uint256 hash = tx.GetHash();
+    public:
+        CBDBKeyValueIterator(Db* pdb)
+        {
+            pcursor = NULL;
+            fValid = false;
+            if (pdb && pdb->cursor(NULL, &pcursor, 0) != 0)
+                pcursor = NULL;
+        }
 
-    return Erase(make_pair(string("tx"), hash));
-}
+        ~CBDBKeyValueIterator()
+        {
+            if (pcursor)
+                pcursor->close();
+        }
 
-bool CTxDB::ContainsTx(uint256 hash)
-{
-    assert(!fClient);
-    return Exists(make_pair(string("tx"), hash));
-}
+        void Seek(const std::string& strKeyIn) { Get(strKeyIn, DB_SET_RANGE); }
+        bool Valid() const { return fValid; }
+        void Next() { Get(std::string(), DB_NEXT); }
+        const std::string& GetKey() const { return strKey; }
+        bool GetValue(std::string& strValueOut) { strValueOut = strValue; return fValid; }
+    };
 
-bool CTxDB::ReadOwnerTxes(uint160 hash160, int nMinHeight, vector<CTransaction>& vtx)
-{
-    assert(!fClient);
-    vtx.clear();
+public:
+    CBDBKeyValueStore() : CDB("blkindex.dat", "cr+") { }
 
-    // Get cursor
-    Dbc* pcursor = GetCursor();
-    if (!pcursor)
-        return false;
+    std::string GetName() const { return "bdb"; }
 
-    unsigned int fFlags = DB_SET_RANGE;
-    while (true)
+    bool Read(const std::string& strKey, std::string& strValue, const CKeyValueSnapshot* psnapshot=NULL)
     {
-        // Read next record
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        if (fFlags == DB_SET_RANGE)
-            ssKey << string("owner") << hash160 << CDiskTxPos(0, 0, 0);
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
-        fFlags = DB_NEXT;
-        if (ret == DB_NOTFOUND)
-            break;
-        else if (ret != 0)
-        {
-            pcursor->close();
+        if (!pdb)
             return false;
-        }
-
-        // Unserialize
-        string strType;
-        uint160 hashItem;
-        CDiskTxPos pos;
-        int nItemHeight;
+        Dbt datKey((void*)strKey.data(), strKey.size());
+        Dbt datValue;
+        datValue.set_flags(DB_DBT_MALLOC);
+        int ret = pdb->get(NULL, &datKey, &datValue, 0);
+        if (datValue.get_data() == NULL)
+            return false;
+        strValue.assign((char*)datValue.get_data(), datValue.get_size());
+        free(datValue.get_data());
+        return (ret == 0);
+    }
 
-        try {
-            ssKey >> strType >> hashItem >> pos;
-            ssValue >> nItemHeight;
-        }
-        catch (std::exception &e) {
-            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
-        }
+    bool Exists(const std::string& strKey, const CKeyValueSnapshot* psnapshot=NULL)
+    {
+        if (!pdb)
+            return false;
+        Dbt datKey((void*)strKey.data(), strKey.size());
+        return (pdb->exists(NULL, &datKey, 0) == 0);
+    }
 
-        // Read transaction
-        if (strType != "owner" || hashItem != hash160)
-            break;
-        if (nItemHeight >= nMinHeight)
+    bool WriteBatch(const CKeyValueBatch& batch, bool fSync=false)
+    {
+        if (!pdb)
+            return false;
+        DbTxn* ptxn = NULL;
+        int ret = dbenv.txn_begin(NULL, &ptxn, DB_TXN_WRITE_NOSYNC);
+        if (!ptxn || ret != 0)
+            return false;
+        for (map<string, pair<bool, string> >::const_iterator mi = batch.mapWrites.begin(); mi != batch.mapWrites.end(); ++mi)
         {
-            vtx.resize(vtx.size()+1);
-            if (!vtx.back().ReadFromDisk(pos))
+            Dbt datKey((void*)mi->first.data(), mi->first.size());
+            if (mi->second.first)
+                ret = pdb->del(ptxn, &datKey, 0);
+            else
             {
-                pcursor->close();
+                Dbt datValue((void*)mi->second.second.data(), mi->second.second.size());
+                ret = pdb->put(ptxn, &datKey, &datValue, 0);
+            }
+            if (ret != 0 && !(mi->second.first && ret == DB_NOTFOUND))
+            {
+                ptxn->abort();
                 return false;
             }
         }
+        if (ptxn->commit(0) != 0)
+            return false;
+        if (fSync)
+            dbenv.log_flush(NULL);
+
+        // Flush database activity from memory pool to disk log, as CDB::Close() did
+        dbenv.txn_checkpoint(GetArg("-dblogsize", 100)*1024, IsInitialBlockDownload() ? 5 : 2, 0);
+        return true;
     }
 
-    pcursor->close();
-    return true;
-}
+    const CKeyValueSnapshot* GetSnapshot()
+    {
+        return new CKeyValueSnapshot(0);
+    }
 
-bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex)
+    void ReleaseSnapshot(const CKeyValueSnapshot* psnapshot)
+    {
+        delete psnapshot;
+    }
+
+    CKeyValueIterator* NewIterator(const CKeyValueSnapshot* psnapshot=NULL)
+    {
+        return new CBDBKeyValueIterator(pdb);
+    }
+
+    bool Flush()
+    {
+        if (!pdb)
+            return false;
+        dbenv.txn_checkpoint(0, 0, 0);
+        return true;
+    }
+};
+
+static CCriticalSection cs_txdbStore;
+static CKeyValueStore* ptxdbStore = NULL;
+static int nTxDBUseCount = 0;
+
+string GetTxDBBackend()
 {
-    assert(!fClient);
-    tx.SetNull();
-    if (!ReadTxIndex(hash, txindex))
-        return false;
-    return (tx.ReadFromDisk(txindex.pos));
+    string strBackend = GetArg("-txdb", "");
+    if (strBackend.empty())
+    {
+        // keep using the blkindex.dat of an existing data directory until it is migrated
+        bool fLog = filesystem::exists(GetDataDir() / "txdb" / "txdb.log");
+        strBackend = (fLog || !filesystem::exists(GetDataDir() / "blkindex.dat")) ? "log" : "bdb";
+    }
+    return strBackend;
 }
 
-bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx)
+static CKeyValueStore* OpenTxDBStore(const string& strBackend)
 {
-    CTxIndex txindex;
-    return ReadDiskTx(hash, tx, txindex);
+    if (strBackend == "bdb")
+        return new CBDBKeyValueStore();
+    if (strBackend == "log")
+    {
+        CLogKeyValueStore* pstore = new CLogKeyValueStore();
+        if (pstore->Open(GetDataDir() / "txdb"))
+            return pstore;
+        delete pstore;
+        return NULL;
+    }
+    throw runtime_error(strprintf("CTxDB() : unknown -txdb backend %s", strBackend.c_str()));
 }
 
-bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex)
+//
+// Write-back cache in front of the store (-txcache). Committed batches collect in
+// batchTxDBDirty, which goes to the store in one atomic WriteBatch when it is
+// over half the cache size, when it is older than TXDB_CACHE_FLUSH_INTERVAL or
+// at shutdown. The store therefore always holds the state as of some earlier
+// commit. Reads see the dirty writes first, then the values recently read or
+// flushed. The transactions the txindex entries point to are cached as well,
+// so connecting a block does not read the block files for recent outputs.
+//
+static const int64 TXDB_CACHE_FLUSH_INTERVAL = 10 * 60;
+// dirty writes an iterator copies at a time
+static const unsigned int TXDB_ITERATOR_DIRTY_CHUNK = 1000;
+
+static CCriticalSection cs_txdbCache;
+static int64 nTxDBCacheSize = 0;
+static int64 nTxDBLastFlush = 0;
+static CKeyValueBatch batchTxDBDirty;
+// key -> (fFound, value), keys not in the store are remembered too
+static map<string, pair<bool, string> > mapTxDBClean;
+static deque<string> dequeTxDBClean;
+static uint64 nTxDBCleanSize = 0;
+// tx hash -> (position in the block files, transaction)
+static map<uint256, pair<CDiskTxPos, CTransaction> > mapTxDBTx;
+static deque<uint256> dequeTxDBTx;
+static uint64 nTxDBTxSize = 0;
+static uint64 nTxDBCacheHits = 0;
+static uint64 nTxDBCacheMisses = 0;
+static uint64 nTxDBTxHits = 0;
+static uint64 nTxDBTxMisses = 0;
+static uint64 nTxDBCacheFlushes = 0;
+// counts the batches written to the store, a read that saw the same count
+// before and after got the current value
+static uint64 nTxDBStoreWrites = 0;
+
+static void SetTxDBClean(const string& strKey, bool fFound, const string& strValue)
 {
-    return ReadDiskTx(outpoint.hash, tx, txindex);
+    pair<map<string, pair<bool, string> >::iterator, bool> ret = mapTxDBClean.insert(make_pair(strKey, make_pair(fFound, strValue)));
+    if (ret.second)
+    {
+        dequeTxDBClean.push_back(strKey);
+        nTxDBCleanSize += 2 * strKey.size() + strValue.size() + 64;
+    }
+    else
+    {
+        nTxDBCleanSize += strValue.size() - ret.first->second.second.size();
+        ret.first->second = make_pair(fFound, strValue);
+    }
+
+    // oldest first
+    while (nTxDBCleanSize > (uint64)nTxDBCacheSize / 4 && !dequeTxDBClean.empty())
+    {
+        map<string, pair<bool, string> >::iterator mi = mapTxDBClean.find(dequeTxDBClean.front());
+        nTxDBCleanSize -= 2 * mi->first.size() + mi->second.second.size() + 64;
+        mapTxDBClean.erase(mi);
+        dequeTxDBClean.pop_front();
+    }
 }
 
-bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
+static bool FlushTxDBCache(CKeyValueStore* pstore)
 {
-    CTxIndex txindex;
-    return ReadDiskTx(outpoint.hash, tx, txindex);
+    nTxDBLastFlush = GetTime();
+    if (batchTxDBDirty.IsEmpty())
+        return true;
+
+    int64 nStart = GetTimeMillis();
+    nTxDBStoreWrites++;
+    if (!pstore->WriteBatch(batchTxDBDirty))
+        return error("FlushTxDBCache() : writing %u entries failed", batchTxDBDirty.GetCount());
+    nTxDBCacheFlushes++;
+    printf("FlushTxDBCache() : %u writes, %" PRI64u " bytes, %" PRI64d " ms\n",
+        batchTxDBDirty.GetCount(), batchTxDBDirty.nDataSize, GetTimeMillis() - nStart);
+
+    // what was just written is the most likely to be read next
+    for (map<string, pair<bool, string> >::iterator mi = batchTxDBDirty.mapWrites.begin(); mi != batchTxDBDirty.mapWrites.end(); ++mi)
+        SetTxDBClean(mi->first, !mi->second.first, mi->second.second);
+    batchTxDBDirty.Clear();
+    return true;
 }
 
-bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
+static bool CommitTxDBBatch(CKeyValueStore* pstore, CKeyValueBatch& batch)
 {
-    return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
+    if (nTxDBCacheSize <= 0)
+        return pstore->WriteBatch(batch);
+
+    LOCK(cs_txdbCache);
+    if (batchTxDBDirty.nDataSize + batch.nDataSize <= (uint64)nTxDBCacheSize / 2 && GetTime() - nTxDBLastFlush <= TXDB_CACHE_FLUSH_INTERVAL)
+    {
+        batchTxDBDirty.Append(batch);
+        return true;
+    }
+
+    // the caller aborts when this fails, so a failed flush must not leave the
+    // batch in the cache; the copy costs about what the flush writes
+    CKeyValueBatch batchPrev = batchTxDBDirty;
+    batchTxDBDirty.Append(batch);
+    if (FlushTxDBCache(pstore))
+        return true;
+    std::swap(batchTxDBDirty, batchPrev);
+    return false;
 }
 
-bool CTxDB::EraseBlockIndex(uint256 hash)
+/** Iterator over the store with the dirty writes of the cache laid over it. The
+ * dirty writes are copied a chunk at a time together with a store snapshot, so
+ * the walk needs no flush and does not hold cs_txdbCache. Each chunk is consistent
+ * in itself; a chunk taken after a flush sees the flushed writes in the store.
+ */
+class CTxDBCacheIterator : public CKeyValueIterator
 {
-    return Erase(make_pair(string("blockindex"), hash));
-}
+private:
+    CKeyValueStore* pstore;
+    const CKeyValueSnapshot* psnapshot;
+    CKeyValueIterator* pbase;
+    vector<pair<string, pair<bool, string> > > vDirty;
+    unsigned int nDirtyPos;
+    bool fDirtyAll;     // vDirty runs to the last dirty write
+    bool fValid;
+    bool fFromDirty;
+
+    void Release()
+    {
+        delete pbase;
+        pbase = NULL;
+        if (psnapshot)
+            pstore->ReleaseSnapshot(psnapshot);
+        psnapshot = NULL;
+    }
 
-bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
+    // Take a new snapshot and chunk of dirty writes starting at strKey
+    void Load(const string& strKey, bool fInclusive)
+    {
+        LOCK(cs_txdbCache);
+        Release();
+        psnapshot = pstore->GetSnapshot();
+        pbase = pstore->NewIterator(psnapshot);
+        pbase->Seek(strKey);
+        if (!fInclusive && pbase->Valid() && pbase->GetKey() == strKey)
+            pbase->Next();
+
+        vDirty.clear();
+        nDirtyPos = 0;
+        map<string, pair<bool, string> >::const_iterator mi = fInclusive ? batchTxDBDirty.mapWrites.lower_bound(strKey) : batchTxDBDirty.mapWrites.upper_bound(strKey);
+        for (; mi != batchTxDBDirty.mapWrites.end() && vDirty.size() < TXDB_ITERATOR_DIRTY_CHUNK; ++mi)
+            vDirty.push_back(*mi);
+        fDirtyAll = (mi == batchTxDBDirty.mapWrites.end());
+    }
+
+    // Move to the first visible key at or after the current positions
+    void SetPosition()
+    {
+        while (true)
+        {
+            bool fDirty = (nDirtyPos < vDirty.size());
+            if (!fDirty && !fDirtyAll)
+            {
+                // past the chunk, the store keys after it need the next one
+                Load(vDirty.back().first, false);
+                continue;
+            }
+            if (fDirty && (!pbase->Valid() || vDirty[nDirtyPos].first <= pbase->GetKey()))
+            {
+                if (pbase->Valid() && vDirty[nDirtyPos].first == pbase->GetKey())
+                    pbase->Next();
+                if (vDirty[nDirtyPos].second.first)
+                {
+                    nDirtyPos++;
+                    continue;
+                }
+                fValid = fFromDirty = true;
+                return;
+            }
+            fFromDirty = false;
+            fValid = pbase->Valid();
+            return;
+        }
+    }
+
+public:
+    CTxDBCacheIterator(CKeyValueStore* pstoreIn)
+    {
+        pstore = pstoreIn;
+        psnapshot = NULL;
+        pbase = NULL;
+        nDirtyPos = 0;
+        fDirtyAll = true;
+        fValid = fFromDirty = false;
+    }
+
+    ~CTxDBCacheIterator()
+    {
+        Release();
+    }
+
+    void Seek(const string& strKey)
+    {
+        Load(strKey, true);
+        SetPosition();
+    }
+
+    bool Valid() const
+    {
+        return fValid;
+    }
+
+    void Next()
+    {
+        if (!fValid)
+            return;
+        if (fFromDirty)
+            nDirtyPos++;
+        else
+            pbase->Next();
+        SetPosition();
+    }
+
+    const string& GetKey() const
+    {
+        return fFromDirty ? vDirty[nDirtyPos].first : pbase->GetKey();
+    }
+
+    bool GetValue(string& strValue)
+    {
+        if (!fValid)
+            return false;
+        if (!fFromDirty)
+            return pbase->GetValue(strValue);
+        strValue = vDirty[nDirtyPos].second.second;
+        return true;
+    }
+};
+
+void GetTxDBCacheStats(CTxDBCacheStats& stats)
 {
-    return Read(string("hashBestChain"), hashBestChain);
+    LOCK(cs_txdbCache);
+    stats.nMaxSize = nTxDBCacheSize;
+    stats.nDirtyCount = batchTxDBDirty.GetCount();
+    stats.nDirtySize = batchTxDBDirty.nDataSize;
+    stats.nCleanCount = mapTxDBClean.size();
+    stats.nCleanSize = nTxDBCleanSize;
+    stats.nTxCount = mapTxDBTx.size();
+    stats.nTxSize = nTxDBTxSize;
+    stats.nHits = nTxDBCacheHits;
+    stats.nMisses = nTxDBCacheMisses;
+    stats.nTxHits = nTxDBTxHits;
+    stats.nTxMisses = nTxDBTxMisses;
+    stats.nFlushes = nTxDBCacheFlushes;
+    stats.nLastFlush = nTxDBLastFlush;
 }
 
-bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
+static void FlushTxDB(bool fShutdown)
 {
-    return Write(string("hashBestChain"), hashBestChain);
+    LOCK(cs_txdbStore);
+    if (!ptxdbStore)
+        return;
+    printf("FlushTxDB(%s) %s refcount=%d\n", fShutdown ? "true" : "false", ptxdbStore->GetName().c_str(), nTxDBUseCount);
+    {
+        LOCK(cs_txdbCache);
+        FlushTxDBCache(ptxdbStore);
+    }
+    ptxdbStore->Flush();
+    if (fShutdown && nTxDBUseCount == 0)
+    {
+        delete ptxdbStore;
+        ptxdbStore = NULL;
+    }
 }
 
-bool CTxDB::ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust)
+CTxDB::CTxDB(const char* pszMode) : pstore(NULL)
 {
-    return Read(string("bnBestInvalidTrust"), bnBestInvalidTrust);
+    fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
+
+    LOCK(cs_txdbStore);
+    if (!ptxdbStore)
+    {
+        if (fShutdown)
+            return;
+        string strBackend = GetTxDBBackend();
+        printf("Opening the transaction database, backend %s\n", strBackend.c_str());
+        ptxdbStore = OpenTxDBStore(strBackend);
+        if (!ptxdbStore)
+            throw runtime_error(strprintf("CTxDB() : can't open the %s transaction database", strBackend.c_str()));
+        {
+            LOCK(cs_txdbCache);
+            nTxDBCacheSize = GetArg("-txcache", 100) << 20;
+            nTxDBLastFlush = GetTime();
+        }
+
+        string strVersionKey = SerializeKey(string("version"));
+        if (!ptxdbStore->Exists(strVersionKey))
+        {
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            ssValue << CLIENT_VERSION;
+            CKeyValueBatch batch;
+            batch.Write(strVersionKey, string(ssValue.begin(), ssValue.end()));
+            ptxdbStore->WriteBatch(batch);
+        }
+    }
+    pstore = ptxdbStore;
+    nTxDBUseCount++;
 }
 
-bool CTxDB::WriteBestInvalidTrust(CBigNum bnBestInvalidTrust)
+void CTxDB::Close()
 {
-    return Write(string("bnBestInvalidTrust"), bnBestInvalidTrust);
+    if (!pstore)
+        return;
+    vTxn.clear();
+    pstore = NULL;
+
+    LOCK(cs_txdbStore);
+    nTxDBUseCount--;
 }
 
-bool CTxDB::ReadSyncCheckpoint(uint256& hashCheckpoint)
+bool CTxDB::ReadRaw(const string& strKey, string& strValue)
 {
-    return Read(string("hashSyncCheckpoint"), hashCheckpoint);
+    if (!pstore)
+        return false;
+
+    // the innermost transaction has the latest writes
+    for (vector<CKeyValueBatch>::reverse_iterator it = vTxn.rbegin(); it != vTxn.rend(); ++it)
+    {
+        int nRead = it->Read(strKey, strValue);
+        if (nRead >= 0)
+            return nRead == 1;
+    }
+    if (nTxDBCacheSize <= 0)
+        return pstore->Read(strKey, strValue);
+
+    bool fMissed = false;
+    while (true)
+    {
+        uint64 nStoreWrites;
+        {
+            LOCK(cs_txdbCache);
+            int nRead = batchTxDBDirty.Read(strKey, strValue);
+            if (nRead >= 0)
+            {
+                nTxDBCacheHits++;
+                return nRead == 1;
+            }
+            map<string, pair<bool, string> >::iterator mi = mapTxDBClean.find(strKey);
+            if (mi != mapTxDBClean.end())
+            {
+                nTxDBCacheHits++;
+                if (mi->second.first)
+                    strValue = mi->second.second;
+                return mi->second.first;
+            }
+            if (!fMissed)
+                nTxDBCacheMisses++;
+            fMissed = true;
+            nStoreWrites = nTxDBStoreWrites;
+        }
+
+        // the store is read without the lock, so other readers and commits
+        // don't wait on the disk
+        string strRead;
+        bool fFound = pstore->Read(strKey, strRead);
+
+        LOCK(cs_txdbCache);
+        // a commit that came in meanwhile is newer than the store
+        int nRead = batchTxDBDirty.Read(strKey, strValue);
+        if (nRead >= 0)
+            return nRead == 1;
+        // a flush meanwhile may have changed the key after it was read, look again
+        if (nStoreWrites != nTxDBStoreWrites)
+            continue;
+        SetTxDBClean(strKey, fFound, fFound ? strRead : string());
+        if (fFound)
+            strValue.swap(strRead);
+        return fFound;
+    }
 }
 
-bool CTxDB::WriteSyncCheckpoint(uint256 hashCheckpoint)
+bool CTxDB::WriteRaw(const string& strKey, string& strValue)
 {
-    return Write(string("hashSyncCheckpoint"), hashCheckpoint);
+    if (!pstore)
+        return false;
+    if (!vTxn.empty())
+    {
+        vTxn.back().WriteSwap(strKey, strValue);
+        return true;
+    }
+    CKeyValueBatch batch;
+    batch.WriteSwap(strKey, strValue);
+    return CommitTxDBBatch(pstore, batch);
 }
 
-bool CTxDB::ReadCheckpointPubKey(string& strPubKey)
+bool CTxDB::EraseRaw(const string& strKey)
 {
-    return Read(string("strCheckpointPubKey"), strPubKey);
+    if (!pstore)
+        return false;
+    if (!vTxn.empty())
+    {
+        vTxn.back().Erase(strKey);
+        return true;
+    }
+    CKeyValueBatch batch;
+    batch.Erase(strKey);
+    return CommitTxDBBatch(pstore, batch);
 }
 
-bool CTxDB::WriteCheckpointPubKey(const string& strPubKey)
+bool CTxDB::ExistsRaw(const string& strKey)
 {
-    return Write(string("strCheckpointPubKey"), strPubKey);
+    string strValue;
+    if (!vTxn.empty() || nTxDBCacheSize > 0)
+        return ReadRaw(strKey, strValue);
+    return pstore && pstore->Exists(strKey);
 }
 
-CBlockIndex static * InsertBlockIndex(uint256 hash)
+bool CTxDB::Sync()
 {
-    if (hash == 0)
-        return NULL;
+    if (!pstore)
+        return false;
+    {
+        LOCK(cs_txdbCache);
+        if (!FlushTxDBCache(pstore))
+            return false;
+    }
+    return pstore->Flush();
+}
+
+CKeyValueIterator* CTxDB::NewIterator()
+{
+    if (!pstore)
+        return NULL;
+
+    if (nTxDBCacheSize <= 0)
+        return pstore->NewIterator();
+    return new CTxDBCacheIterator(pstore);
+}
+
+bool CTxDB::ReadCachedTx(const uint256& hash, const CDiskTxPos& pos, CTransaction& tx)
+{
+    if (nTxDBCacheSize > 0)
+    {
+        LOCK(cs_txdbCache);
+        map<uint256, pair<CDiskTxPos, CTransaction> >::iterator mi = mapTxDBTx.find(hash);
+        if (mi != mapTxDBTx.end() && mi->second.first == pos)
+        {
+            nTxDBTxHits++;
+            tx = mi->second.second;
+            return true;
+        }
+        nTxDBTxMisses++;
+    }
+    if (!tx.ReadFromDisk(pos))
+        return false;
+    CacheTx(hash, pos, tx);
+    return true;
+}
+
+void CTxDB::CacheTx(const uint256& hash, const CDiskTxPos& pos, const CTransaction& tx)
+{
+    if (nTxDBCacheSize <= 0)
+        return;
+
+    LOCK(cs_txdbCache);
+    pair<map<uint256, pair<CDiskTxPos, CTransaction> >::iterator, bool> ret = mapTxDBTx.insert(make_pair(hash, make_pair(pos, tx)));
+    if (!ret.second)
+    {
+        // the same transaction in another block after a reorganize
+        ret.first->second.first = pos;
+        return;
+    }
+    dequeTxDBTx.push_back(hash);
+    nTxDBTxSize += ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION) + 200;
+
+    while (nTxDBTxSize > (uint64)nTxDBCacheSize / 4 && !dequeTxDBTx.empty())
+    {
+        map<uint256, pair<CDiskTxPos, CTransaction> >::iterator mi = mapTxDBTx.find(dequeTxDBTx.front());
+        nTxDBTxSize -= ::GetSerializeSize(mi->second.second, SER_NETWORK, PROTOCOL_VERSION) + 200;
+        mapTxDBTx.erase(mi);
+        dequeTxDBTx.pop_front();
+    }
+}
+
+bool CTxDB::TxnBegin()
+{
+    if (!pstore)
+        return false;
+    vTxn.push_back(CKeyValueBatch());
+    return true;
+}
+
+bool CTxDB::TxnCommit()
+{
+    if (!pstore)
+        return false;
+    if (vTxn.empty())
+        return false;
+
+    // a nested transaction becomes part of the one around it
+    bool fSuccess = true;
+    if (vTxn.size() > 1)
+        vTxn[vTxn.size() - 2].Append(vTxn.back());
+    else
+    {
+        // everything a block or a reorganize wrote goes to the store in one sorted batch
+        CKeyValueBatch& batch = vTxn.back();
+        unsigned int nCount = batch.GetCount();
+        uint64 nDataSize = batch.nDataSize;
+        int64 nStart = GetTimeMicros();
+        fSuccess = CommitTxDBBatch(pstore, batch);
+        if (fDebug && GetBoolArg("-printtxdb"))
+            printf("CTxDB::TxnCommit() : %u writes, %" PRI64u " bytes, %" PRI64d " us\n",
+                nCount, nDataSize, GetTimeMicros() - nStart);
+    }
+    vTxn.pop_back();
+    return fSuccess;
+}
+
+bool CTxDB::TxnAbort()
+{
+    if (!pstore)
+        return false;
+    if (vTxn.empty())
+        return false;
+    vTxn.pop_back();
+    return true;
+}
+
+bool MigrateTxDB(const string& strToIn)
+{
+    string strTo = strToIn.empty() ? "log" : strToIn;
+    if (strTo != "log" && strTo != "bdb")
+        return error("MigrateTxDB() : unknown backend %s", strTo.c_str());
+    string strFrom = (strTo == "log") ? "bdb" : "log";
+
+    {
+        LOCK(cs_txdbStore);
+        if (ptxdbStore)
+            return error("MigrateTxDB() : the transaction database is already open");
+    }
+    if (!filesystem::exists(strFrom == "log" ? GetDataDir() / "txdb" / "txdb.log" : GetDataDir() / "blkindex.dat"))
+        return error("MigrateTxDB() : there is no %s transaction database to migrate", strFrom.c_str());
+
+    printf("MigrateTxDB() : copying the %s transaction database to %s\n", strFrom.c_str(), strTo.c_str());
+    CKeyValueStore* pstoreFrom = OpenTxDBStore(strFrom);
+    CKeyValueStore* pstoreTo = OpenTxDBStore(strTo);
+    if (!pstoreFrom || !pstoreTo)
+    {
+        delete pstoreFrom;
+        delete pstoreTo;
+        return error("MigrateTxDB() : opening the databases failed");
+    }
+
+    bool fSuccess = true;
+    CDataStream ssVersionKey(SER_DISK, CLIENT_VERSION);
+    ssVersionKey << string("version");
+    string strVersionKey(ssVersionKey.begin(), ssVersionKey.end());
+    {
+        // the target may only hold the version a new database starts with
+        CKeyValueIterator* pcursor = pstoreTo->NewIterator();
+        for (pcursor->Seek(string()); pcursor->Valid(); pcursor->Next())
+            if (pcursor->GetKey() != strVersionKey)
+                fSuccess = error("MigrateTxDB() : the %s transaction database is not empty", strTo.c_str());
+        delete pcursor;
+    }
+
+    uint64 nKeys = 0;
+    CKeyValueBatch batch;
+    CKeyValueIterator* pcursor = pstoreFrom->NewIterator();
+    for (pcursor->Seek(string()); fSuccess && pcursor->Valid() && !fRequestShutdown; pcursor->Next())
+    {
+        string strValue;
+        if (!pcursor->GetValue(strValue))
+        {
+            fSuccess = error("MigrateTxDB() : reading the %s transaction database failed", strFrom.c_str());
+            break;
+        }
+        batch.WriteSwap(pcursor->GetKey(), strValue);
+        if (++nKeys % 100000 == 0)
+            printf("MigrateTxDB() : %" PRI64u " keys\n", nKeys);
+        if (batch.nDataSize > 16 * 1024 * 1024)
+        {
+            fSuccess = pstoreTo->WriteBatch(batch);
+            batch.Clear();
+        }
+    }
+    delete pcursor;
+    if (fRequestShutdown)
+        fSuccess = false;
+    fSuccess = fSuccess && pstoreTo->WriteBatch(batch, true) && pstoreTo->Flush();
+
+    delete pstoreFrom;
+    delete pstoreTo;
+    if (!fSuccess)
+        return error("MigrateTxDB() : migration to %s failed after %" PRI64u " keys", strTo.c_str(), nKeys);
+
+    // a log store left behind would be picked again by default
+    if (strFrom == "log")
+    {
+        filesystem::path pathOld = GetDataDir() / "txdb.migrated";
+        filesystem::remove_all(pathOld);
+        filesystem::rename(GetDataDir() / "txdb", pathOld);
+    }
+    mapArgs["-txdb"] = strTo;
+    printf("MigrateTxDB() : copied %" PRI64u " keys, %s is no longer used\n", nKeys,
+        strFrom == "log" ? "txdb.migrated" : "blkindex.dat");
+    return true;
+}
+
+bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
+{
+    assert(!fClient);
+    txindex.SetNull();
+    return Read(make_pair(string("tx"), hash), txindex);
+}
+
+bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
+{
+    assert(!fClient);
+    return Write(make_pair(string("tx"), hash), txindex);
+}
+
+bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight)
+{
+    assert(!fClient);
+
+    // Add to tx index
+    uint256 hash = tx.GetHash();
+    CTxIndex txindex(pos, tx.vout.size());
+    return Write(make_pair(string("tx"), hash), txindex);
+}
+
+bool CTxDB::EraseTxIndex(const CTransaction& tx)
+{
+    assert(!fClient);
+    uint256 hash = tx.GetHash();
+
+    return Erase(make_pair(string("tx"), hash));
+}
+
+bool CTxDB::ContainsTx(uint256 hash)
+{
+    assert(!fClient);
+    return Exists(make_pair(string("tx"), hash));
+}
+
+bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex)
+{
+    assert(!fClient);
+    tx.SetNull();
+    if (!ReadTxIndex(hash, txindex))
+        return false;
+    return (tx.ReadFromDisk(txindex.pos));
+}
+
+bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx)
+{
+    CTxIndex txindex;
+    return ReadDiskTx(hash, tx, txindex);
+}
+
+bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex)
+{
+    return ReadDiskTx(outpoint.hash, tx, txindex);
+}
+
+bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
+{
+    CTxIndex txindex;
+    return ReadDiskTx(outpoint.hash, tx, txindex);
+}
+
+bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
+{
+    return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
+}
+
+bool CTxDB::EraseBlockIndex(uint256 hash)
+{
+    return Erase(make_pair(string("blockindex"), hash));
+}
+
+bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
+{
+    return Read(string("hashBestChain"), hashBestChain);
+}
+
+bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
+{
+    return Write(string("hashBestChain"), hashBestChain);
+}
+
+bool CTxDB::ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust)
+{
+    return Read(string("bnBestInvalidTrust"), bnBestInvalidTrust);
+}
+
+bool CTxDB::WriteBestInvalidTrust(CBigNum bnBestInvalidTrust)
+{
+    return Write(string("bnBestInvalidTrust"), bnBestInvalidTrust);
+}
+
+bool CTxDB::ReadSyncCheckpoint(uint256& hashCheckpoint)
+{
+    return Read(string("hashSyncCheckpoint"), hashCheckpoint);
+}
+
+bool CTxDB::WriteSyncCheckpoint(uint256 hashCheckpoint)
+{
+    return Write(string("hashSyncCheckpoint"), hashCheckpoint);
+}
+
+bool CTxDB::ReadCheckpointPubKey(string& strPubKey)
+{
+    return Read(string("strCheckpointPubKey"), strPubKey);
+}
+
+bool CTxDB::WriteCheckpointPubKey(const string& strPubKey)
+{
+    return Write(string("strCheckpointPubKey"), strPubKey);
+}
+
+bool CTxDB::ReadIndexSnapshotNonce(uint64& nNonce)
+{
+    return Read(string("indexSnapshotNonce"), nNonce);
+}
+
+bool CTxDB::WriteIndexSnapshotNonce(uint64 nNonce)
+{
+    return Write(string("indexSnapshotNonce"), nNonce);
+}
+
+bool CTxDB::EraseIndexSnapshotNonce()
+{
+    return Erase(string("indexSnapshotNonce"));
+}
+
+bool CTxDB::EraseAll()
+{
+    const string strVersionKey = SerializeKey(string("version"));
+    uint64 nErased = 0;
+    while (true)
+    {
+        // collect a bounded number of keys, then erase them with the iterator closed
+        vector<string> vKeys;
+        CKeyValueIterator* pcursor = NewIterator();
+        if (!pcursor)
+            return false;
+        for (pcursor->Seek(string()); pcursor->Valid() && vKeys.size() < 10000; pcursor->Next())
+            if (pcursor->GetKey() != strVersionKey)
+                vKeys.push_back(pcursor->GetKey());
+        delete pcursor;
+        if (vKeys.empty())
+            break;
+
+        if (!TxnBegin())
+            return false;
+        BOOST_FOREACH(const string& strKey, vKeys)
+            EraseRaw(strKey);
+        if (!TxnCommit())
+            return false;
+        nErased += vKeys.size();
+    }
+    printf("CTxDB::EraseAll() : erased %" PRI64u " keys\n", nErased);
+    return true;
+}
+
+bool CTxDB::ReadPruneHeight(int& nPruneHeight)
+{
+    return Read(string("pruneHeight"), nPruneHeight);
+}
+
+bool CTxDB::WritePruneHeight(int nPruneHeight)
+{
+    return Write(string("pruneHeight"), nPruneHeight);
+}
+
+bool CTxDB::ReadBurnTxLocation(const uint256& hashBlock, s32int nTx, CBurnTxLocation& location)
+{
+    return Read(make_pair(string("burntx"), make_pair(hashBlock, nTx)), location);
+}
+
+bool CTxDB::WriteBurnTxLocation(const uint256& hashBlock, s32int nTx, const CBurnTxLocation& location)
+{
+    return Write(make_pair(string("burntx"), make_pair(hashBlock, nTx)), location);
+}
+
+bool CTxDB::EraseBurnTxLocation(const uint256& hashBlock, s32int nTx)
+{
+    return Erase(make_pair(string("burntx"), make_pair(hashBlock, nTx)));
+}
+
+bool CTxDB::ReadBurnTxIndexState(bool& fComplete, int& nBuildHeight)
+{
+    pair<bool, int> state;
+    if (!Read(string("burnTxIndex"), state))
+        return false;
+    fComplete = state.first;
+    nBuildHeight = state.second;
+    return true;
+}
+
+bool CTxDB::WriteBurnTxIndexState(bool fComplete, int nBuildHeight)
+{
+    return Write(string("burnTxIndex"), make_pair(fComplete, nBuildHeight));
+}
+
+bool CTxDB::ReadAddressIndexState(bool& fComplete, s32int& nBuildHeight)
+{
+    pair<bool, s32int> state;
+    if (!Read(string("addressIndex"), state))
+        return false;
+    fComplete = state.first;
+    nBuildHeight = state.second;
+    return true;
+}
+
+bool CTxDB::WriteAddressIndexState(bool fComplete, s32int nBuildHeight)
+{
+    return Write(string("addressIndex"), make_pair(fComplete, nBuildHeight));
+}
+
+bool CTxDB::WriteAddressHistory(const CAddressHistoryKey& key, const CAddressHistoryValue& value)
+{
+    return Write(make_pair(string("addrtx"), key), value);
+}
+
+bool CTxDB::ReadAddressHistory(const CAddressHistoryKey& key, CAddressHistoryValue& value)
+{
+    return Read(make_pair(string("addrtx"), key), value);
+}
+
+bool CTxDB::EraseAddressHistory(const CAddressHistoryKey& key)
+{
+    return Erase(make_pair(string("addrtx"), key));
+}
+
+bool CTxDB::WriteAddressUnspent(const CAddressUnspentKey& key, const CAddressUnspentValue& value)
+{
+    return Write(make_pair(string("addrutxo"), key), value);
+}
+
+bool CTxDB::ReadAddressUnspent(const CAddressUnspentKey& key, CAddressUnspentValue& value)
+{
+    return Read(make_pair(string("addrutxo"), key), value);
+}
+
+bool CTxDB::EraseAddressUnspent(const CAddressUnspentKey& key)
+{
+    return Erase(make_pair(string("addrutxo"), key));
+}
+
+bool CTxDB::ReadAddressBalance(unsigned char nAddressType, const uint160& hashAddress, CAddressBalance& balance)
+{
+    return Read(make_pair(string("addrbal"), make_pair(nAddressType, hashAddress)), balance);
+}
+
+bool CTxDB::WriteAddressBalance(unsigned char nAddressType, const uint160& hashAddress, const CAddressBalance& balance)
+{
+    return Write(make_pair(string("addrbal"), make_pair(nAddressType, hashAddress)), balance);
+}
+
+bool CTxDB::ListAddressHistory(unsigned char nAddressType, const uint160& hashAddress, s32int nStartHeight, unsigned int nSkip, unsigned int nCount,
+                               vector<pair<CAddressHistoryKey, CAddressHistoryValue> >& vEntries)
+{
+    vEntries.clear();
+    CKeyValueIterator* pcursor = NewIterator();
+    if (!pcursor)
+        return false;
+
+    // the first key of the address at nStartHeight
+    CAddressHistoryKey keyStart(nAddressType, hashAddress, nStartHeight, 0, 0, 0, false);
+    for (pcursor->Seek(SerializeKey(make_pair(string("addrtx"), keyStart))); pcursor->Valid() && vEntries.size() < nCount; pcursor->Next())
+    {
+        const string& strKey = pcursor->GetKey();
+        string strType;
+        CAddressHistoryKey key;
+        CAddressHistoryValue value;
+        try {
+            CDataStream ssKey(strKey.data(), strKey.data() + strKey.size(), SER_DISK, CLIENT_VERSION);
+            ssKey >> strType;
+            if (strType != "addrtx")
+                break;
+            ssKey >> key;
+            if (key.nAddressType != nAddressType || key.hashAddress != hashAddress)
+                break;
+            if (nSkip > 0)
+            {
+                nSkip--;
+                continue;
+            }
+
+            string strValue;
+            if (!pcursor->GetValue(strValue))
+            {
+                delete pcursor;
+                return false;
+            }
+            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> value;
+        }
+        catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+        vEntries.push_back(make_pair(key, value));
+    }
+
+    delete pcursor;
+    return true;
+}
+
+bool CTxDB::ListAddressUnspent(unsigned char nAddressType, const uint160& hashAddress, unsigned int nSkip, unsigned int nCount,
+                               vector<pair<CAddressUnspentKey, CAddressUnspentValue> >& vEntries)
+{
+    vEntries.clear();
+    CKeyValueIterator* pcursor = NewIterator();
+    if (!pcursor)
+        return false;
+
+    CAddressUnspentKey keyStart(nAddressType, hashAddress, 0, 0);
+    for (pcursor->Seek(SerializeKey(make_pair(string("addrutxo"), keyStart))); pcursor->Valid() && vEntries.size() < nCount; pcursor->Next())
+    {
+        const string& strKey = pcursor->GetKey();
+        string strType;
+        CAddressUnspentKey key;
+        CAddressUnspentValue value;
+        try {
+            CDataStream ssKey(strKey.data(), strKey.data() + strKey.size(), SER_DISK, CLIENT_VERSION);
+            ssKey >> strType;
+            if (strType != "addrutxo")
+                break;
+            ssKey >> key;
+            if (key.nAddressType != nAddressType || key.hashAddress != hashAddress)
+                break;
+            if (nSkip > 0)
+            {
+                nSkip--;
+                continue;
+            }
+
+            string strValue;
+            if (!pcursor->GetValue(strValue))
+            {
+                delete pcursor;
+                return false;
+            }
+            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> value;
+        }
+        catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+        vEntries.push_back(make_pair(key, value));
+    }
+
+    delete pcursor;
+    return true;
+}
+
+bool CTxDB::EraseAddressIndex()
+{
+    const char* pszPrefix[] = { "addrtx", "addrutxo", "addrbal" };
+    for (unsigned int i = 0; i < sizeof(pszPrefix) / sizeof(pszPrefix[0]); i++)
+    {
+        const string strPrefix = SerializeKey(string(pszPrefix[i]));
+        while (true)
+        {
+            // collect a bounded number of keys, then erase them with the iterator closed
+            vector<string> vKeys;
+            CKeyValueIterator* pcursor = NewIterator();
+            if (!pcursor)
+                return false;
+            for (pcursor->Seek(strPrefix); pcursor->Valid() && vKeys.size() < 10000; pcursor->Next())
+            {
+                if (pcursor->GetKey().compare(0, strPrefix.size(), strPrefix) != 0)
+                    break;
+                vKeys.push_back(pcursor->GetKey());
+            }
+            delete pcursor;
+            if (vKeys.empty())
+                break;
+
+            if (!TxnBegin())
+                return false;
+            BOOST_FOREACH(const string& strKey, vKeys)
+                EraseRaw(strKey);
+            if (!TxnCommit())
+                return false;
+        }
+    }
+
+    if (!TxnBegin())
+        return false;
+    Erase(string("addressIndex"));
+    return TxnCommit();
+}
+
+bool CTxDB::ReadTxMessageIndexState(bool& fComplete, int& nBuildHeight)
+{
+    pair<bool, int> state;
+    if (!Read(string("msgIndex"), state))
+        return false;
+    fComplete = state.first;
+    nBuildHeight = state.second;
+    return true;
+}
+
+bool CTxDB::WriteTxMessageIndexState(bool fComplete, int nBuildHeight)
+{
+    return Write(string("msgIndex"), make_pair(fComplete, nBuildHeight));
+}
+
+bool CTxDB::WriteTxMessage(const CTxMessageKey& key, const CTxMessageEntry& entry)
+{
+    return Write(make_pair(string("msg"), key), entry);
+}
+
+bool CTxDB::EraseTxMessage(const CTxMessageKey& key)
+{
+    return Erase(make_pair(string("msg"), key));
+}
+
+bool CTxDB::WriteTxMessageFace(const uint256& hashFace, const CTxMessageKey& key)
+{
+    return Write(make_pair(string("msgface"), make_pair(hashFace, key)), true);
+}
+
+bool CTxDB::EraseTxMessageFace(const uint256& hashFace, const CTxMessageKey& key)
+{
+    return Erase(make_pair(string("msgface"), make_pair(hashFace, key)));
+}
+
+bool CTxDB::ListTxMessages(int nMinHeight, unsigned int nCount, vector<pair<CTxMessageKey, CTxMessageEntry> >& vEntries)
+{
+    vEntries.clear();
+    CKeyValueIterator* pcursor = NewIterator();
+    if (!pcursor)
+        return false;
+
+    for (pcursor->Seek(SerializeKey(string("msg"))); pcursor->Valid() && vEntries.size() < nCount; pcursor->Next())
+    {
+        const string& strKey = pcursor->GetKey();
+        string strType;
+        CTxMessageKey key;
+        CTxMessageEntry entry;
+        try {
+            CDataStream ssKey(strKey.data(), strKey.data() + strKey.size(), SER_DISK, CLIENT_VERSION);
+            ssKey >> strType;
+            if (strType != "msg")
+                break;
+            ssKey >> key;
+            if (key.nHeight <= nMinHeight)
+                break;
+
+            string strValue;
+            if (!pcursor->GetValue(strValue))
+            {
+                delete pcursor;
+                return false;
+            }
+            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> entry;
+        }
+        catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+        vEntries.push_back(make_pair(key, entry));
+    }
+
+    delete pcursor;
+    return true;
+}
+
+bool CTxDB::ListTxMessagesByFace(const uint256& hashFace, int nMinHeight, vector<CTxMessageKey>& vKeys)
+{
+    vKeys.clear();
+    CKeyValueIterator* pcursor = NewIterator();
+    if (!pcursor)
+        return false;
+
+    for (pcursor->Seek(SerializeKey(make_pair(string("msgface"), hashFace))); pcursor->Valid(); pcursor->Next())
+    {
+        const string& strKey = pcursor->GetKey();
+        string strType;
+        uint256 hashKey;
+        CTxMessageKey key;
+        try {
+            CDataStream ssKey(strKey.data(), strKey.data() + strKey.size(), SER_DISK, CLIENT_VERSION);
+            ssKey >> strType;
+            if (strType != "msgface")
+                break;
+            ssKey >> hashKey;
+            if (hashKey != hashFace)
+                break;
+            ssKey >> key;
+        }
+        catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+        if (key.nHeight <= nMinHeight)
+            break;
+        vKeys.push_back(key);
+    }
+
+    delete pcursor;
+    return true;
+}
+
+CBlockIndex static * InsertBlockIndex(uint256 hash)
+{
+    if (hash == 0)
+        return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
@@ -541,28 +1662,358 @@ CBlockIndex static * InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
-bool CTxDB::LoadBlockIndex()
+//
+// Block index snapshot, blkindex.snap: a header and one fixed size record per
+// block index, pprev and pnext as record numbers. Written at clean shutdown,
+// together with a random nonce in the txdb. Loading it erases the nonce, so
+// after a crash the snapshot is stale and the block index is read from the txdb.
+//
+static const unsigned int BLOCK_INDEX_SNAPSHOT_MAGIC = 0x49424c53;
+static const unsigned int BLOCK_INDEX_SNAPSHOT_VERSION = 1;
+
+struct CBlockIndexSnapshotHeader
+{
+    unsigned int nMagic;
+    unsigned int nVersion;
+    unsigned int nRecordSize;
+    unsigned int nCount;
+    uint64 nNonce;
+    uint256 hashBestChain;
+    uint256 hashRecords;
+};
+
+struct CBlockIndexSnapshotRecord
+{
+    uint256 hashBlock;
+    uint256 bnChainTrust;
+    uint256 hashProofOfStake;
+    uint256 hashPrevoutStake;
+    uint256 hashMerkleRoot;
+    uint256 burnHash;
+    int64 nMint;
+    int64 nMoneySupply;
+    int64 nEffectiveBurnCoins;
+    uint64 nStakeModifier;
+    int nPrev;
+    int nNext;
+    unsigned int nFile;
+    unsigned int nBlockPos;
+    int nHeight;
+    unsigned int nFlags;
+    unsigned int nStakeModifierChecksum;
+    unsigned int nPrevoutStake;
+    unsigned int nStakeTime;
+    int nVersion;
+    unsigned int nTime;
+    unsigned int nBits;
+    unsigned int nNonce;
+    unsigned int nBurnBits;
+    int burnBlkHeight;
+    int burnCTx;
+    int burnCTxOut;
+    unsigned int fProofOfBurn;
+};
+
+static boost::filesystem::path GetBlockIndexSnapshotPath()
+{
+    return GetDataDir() / "blkindex.snap";
+}
+
+bool WriteBlockIndexSnapshot()
+{
+    LOCK(cs_main);
+    if (!pindexBest || mapBlockIndex.empty())
+        return false;
+    int64 nStart = GetTimeMillis();
+
+    // record numbers in height order, the loader allocates the block indexes in
+    // record order so a chain walk moves through the arena front to back
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+
+    map<const CBlockIndex*, int> mapRecord;
+    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+        mapRecord.insert(make_pair(item.second, (int)mapRecord.size()));
+
+    vector<CBlockIndexSnapshotRecord> vRecord(mapRecord.size());
+    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    {
+        const CBlockIndex* pindex = item.second;
+        // value initialized by the vector, padding included
+        CBlockIndexSnapshotRecord& record = vRecord[mapRecord[pindex]];
+
+        // chain trust is 256 bits in practice, a CBigNum can hold more
+        CBigNum bnChainTrust = pindex->bnChainTrust;
+        record.bnChainTrust = bnChainTrust.getuint256();
+        if (CBigNum(record.bnChainTrust) != pindex->bnChainTrust)
+            return error("WriteBlockIndexSnapshot() : chain trust at height %d does not fit", pindex->nHeight);
+
+        record.hashBlock = pindex->GetBlockHash();
+        record.hashProofOfStake = pindex->hashProofOfStake;
+        record.hashPrevoutStake = pindex->prevoutStake.hash;
+        record.hashMerkleRoot = pindex->hashMerkleRoot;
+        record.burnHash = pindex->burnHash;
+        record.nMint = pindex->nMint;
+        record.nMoneySupply = pindex->nMoneySupply;
+        record.nEffectiveBurnCoins = pindex->nEffectiveBurnCoins;
+        record.nStakeModifier = pindex->nStakeModifier;
+        record.nPrev = pindex->pprev ? mapRecord[pindex->pprev] : -1;
+        record.nNext = pindex->pnext ? mapRecord[pindex->pnext] : -1;
+        record.nFile = pindex->nFile;
+        record.nBlockPos = pindex->nBlockPos;
+        record.nHeight = pindex->nHeight;
+        record.nFlags = pindex->nFlags;
+        record.nStakeModifierChecksum = pindex->nStakeModifierChecksum;
+        record.nPrevoutStake = pindex->prevoutStake.n;
+        record.nStakeTime = pindex->nStakeTime;
+        record.nVersion = pindex->nVersion;
+        record.nTime = pindex->nTime;
+        record.nBits = pindex->nBits;
+        record.nNonce = pindex->nNonce;
+        record.nBurnBits = pindex->nBurnBits;
+        record.burnBlkHeight = pindex->burnBlkHeight;
+        record.burnCTx = pindex->burnCTx;
+        record.burnCTxOut = pindex->burnCTxOut;
+        record.fProofOfBurn = pindex->fProofOfBurn;
+    }
+
+    CBlockIndexSnapshotHeader header = CBlockIndexSnapshotHeader();
+    header.nMagic = BLOCK_INDEX_SNAPSHOT_MAGIC;
+    header.nVersion = BLOCK_INDEX_SNAPSHOT_VERSION;
+    header.nRecordSize = sizeof(CBlockIndexSnapshotRecord);
+    header.nCount = vRecord.size();
+    header.nNonce = GetRand(std::numeric_limits<uint64>::max());
+    header.hashBestChain = hashBestChain;
+    const char* pbegin = (const char*)&vRecord[0];
+    header.hashRecords = Hash(pbegin, pbegin + vRecord.size() * sizeof(CBlockIndexSnapshotRecord));
+
+    // the nonce goes to the txdb only once the file is complete
+    boost::filesystem::path pathSnapshot = GetBlockIndexSnapshotPath();
+    boost::filesystem::path pathTmp = pathSnapshot.string() + ".tmp";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("WriteBlockIndexSnapshot() : can't create %s", pathTmp.string().c_str());
+    bool fWritten = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                    fwrite(&vRecord[0], sizeof(CBlockIndexSnapshotRecord), vRecord.size(), file) == vRecord.size() &&
+                    fflush(file) == 0;
+#ifdef WIN32
+    fWritten = fWritten && _commit(_fileno(file)) == 0;
+#else
+    fWritten = fWritten && fsync(fileno(file)) == 0;
+#endif
+    fclose(file);
+    if (!fWritten || !RenameOver(pathTmp, pathSnapshot))
+    {
+        boost::filesystem::remove(pathTmp);
+        return error("WriteBlockIndexSnapshot() : writing %s failed", pathSnapshot.string().c_str());
+    }
+
+    CTxDB txdb;
+    if (!txdb.WriteIndexSnapshotNonce(header.nNonce))
+        return error("WriteBlockIndexSnapshot() : WriteIndexSnapshotNonce failed");
+    printf("WriteBlockIndexSnapshot() : %u block indexes, %" PRI64d " ms\n", header.nCount, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CTxDB::LoadBlockIndexSnapshot()
+{
+    // a snapshot is only good for the txdb state it was written with
+    uint64 nNonce;
+    if (!ReadIndexSnapshotNonce(nNonce))
+        return false;
+    uint256 hashBestChainDB;
+    if (!ReadHashBestChain(hashBestChainDB))
+        return false;
+
+    boost::filesystem::path pathSnapshot = GetBlockIndexSnapshotPath();
+    FILE* file = fopen(pathSnapshot.string().c_str(), "rb");
+    if (!file)
+        return false;
+    CBlockIndexSnapshotHeader header;
+    bool fHeader = fread(&header, sizeof(header), 1, file) == 1;
+    uint64 nFileSize = boost::filesystem::file_size(pathSnapshot);
+    if (!fHeader || header.nMagic != BLOCK_INDEX_SNAPSHOT_MAGIC || header.nVersion != BLOCK_INDEX_SNAPSHOT_VERSION ||
+        header.nRecordSize != sizeof(CBlockIndexSnapshotRecord) ||
+        nFileSize != sizeof(header) + (uint64)header.nCount * sizeof(CBlockIndexSnapshotRecord) ||
+        header.nNonce != nNonce || header.hashBestChain != hashBestChainDB || header.nCount == 0)
+    {
+        fclose(file);
+        printf("LoadBlockIndexSnapshot() : %s is stale\n", pathSnapshot.string().c_str());
+        return false;
+    }
+
+#ifndef WIN32
+    void* pmap = mmap(NULL, nFileSize, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    fclose(file);
+    if (pmap == MAP_FAILED)
+        return false;
+    madvise(pmap, nFileSize, MADV_SEQUENTIAL);
+    const char* pdata = (const char*)pmap;
+#else
+    vector<char> vData(nFileSize);
+    bool fRead = fseek(file, 0, SEEK_SET) == 0 && fread(&vData[0], 1, nFileSize, file) == nFileSize;
+    fclose(file);
+    if (!fRead)
+        return false;
+    const char* pdata = &vData[0];
+#endif
+    const char* precords = pdata + sizeof(header);
+
+    bool fSuccess = (Hash(precords, pdata + nFileSize) == header.hashRecords);
+    if (!fSuccess)
+        printf("LoadBlockIndexSnapshot() : %s checksum mismatch\n", pathSnapshot.string().c_str());
+
+    vector<CBlockIndex*> vpindex;
+    if (fSuccess)
+    {
+        vpindex.reserve(header.nCount);
+        mapBlockIndex.reserve(header.nCount);
+        CBlockIndexSnapshotRecord record;
+        for (unsigned int i = 0; i < header.nCount; i++)
+        {
+            memcpy(&record, precords + (uint64)i * sizeof(record), sizeof(record));
+            CBlockIndex* pindexNew = InsertBlockIndex(record.hashBlock);
+            if (!pindexNew || (int)mapBlockIndex.size() != (int)i + 1)
+            {
+                fSuccess = false;
+                break;
+            }
+            vpindex.push_back(pindexNew);
+        }
+    }
+
+    if (fSuccess)
+    {
+        CBlockIndexSnapshotRecord record;
+        for (unsigned int i = 0; i < header.nCount; i++)
+        {
+            memcpy(&record, precords + (uint64)i * sizeof(record), sizeof(record));
+            if (record.nPrev >= (int)header.nCount || record.nNext >= (int)header.nCount)
+            {
+                fSuccess = false;
+                break;
+            }
+            CBlockIndex* pindexNew = vpindex[i];
+            pindexNew->pprev          = record.nPrev < 0 ? NULL : vpindex[record.nPrev];
+            pindexNew->pnext          = record.nNext < 0 ? NULL : vpindex[record.nNext];
+            pindexNew->nFile          = record.nFile;
+            pindexNew->nBlockPos      = record.nBlockPos;
+            pindexNew->bnChainTrust   = CBigNum(record.bnChainTrust);
+            pindexNew->nHeight        = record.nHeight;
+            pindexNew->nMint          = record.nMint;
+            pindexNew->nMoneySupply   = record.nMoneySupply;
+            pindexNew->nFlags         = record.nFlags;
+            pindexNew->nStakeModifier = record.nStakeModifier;
+            pindexNew->nStakeModifierChecksum = record.nStakeModifierChecksum;
+            pindexNew->prevoutStake   = COutPoint(record.hashPrevoutStake, record.nPrevoutStake);
+            pindexNew->nStakeTime     = record.nStakeTime;
+            pindexNew->hashProofOfStake = record.hashProofOfStake;
+            pindexNew->nVersion       = record.nVersion;
+            pindexNew->hashMerkleRoot = record.hashMerkleRoot;
+            pindexNew->nTime          = record.nTime;
+            pindexNew->nBits          = record.nBits;
+            pindexNew->nNonce         = record.nNonce;
+            pindexNew->fProofOfBurn   = record.fProofOfBurn;
+            pindexNew->burnHash       = record.burnHash;
+            pindexNew->burnBlkHeight  = record.burnBlkHeight;
+            pindexNew->burnCTx        = record.burnCTx;
+            pindexNew->burnCTxOut     = record.burnCTxOut;
+            pindexNew->nEffectiveBurnCoins = record.nEffectiveBurnCoins;
+            pindexNew->nBurnBits      = record.nBurnBits;
+        }
+    }
+
+    // the checksum only catches damage to the file, the links must also make up
+    // a tree with the best chain through it, or the txdb is loaded instead
+    int nNextLinks = 0;
+    if (fSuccess)
+    {
+        BOOST_FOREACH(CBlockIndex* pindex, vpindex)
+        {
+            if (pindex->pnext)
+                nNextLinks++;
+            if ((pindex->pprev ? pindex->pprev->nHeight != pindex->nHeight - 1 : pindex->nHeight != 0) ||
+                (pindex->pnext && pindex->pnext->pprev != pindex))
+            {
+                printf("LoadBlockIndexSnapshot() : %s has a bad link at height %d\n", pathSnapshot.string().c_str(), pindex->nHeight);
+                fSuccess = false;
+                break;
+            }
+        }
+    }
+    if (fSuccess)
+    {
+        // pnext runs from the genesis block to the best block and nowhere else
+        BlockMap::iterator mi = mapBlockIndex.find(hashBestChainDB);
+        CBlockIndex* pindex = mi == mapBlockIndex.end() ? NULL : mi->second;
+        if (!pindex || pindex->pnext || pindex->nHeight != nNextLinks)
+            fSuccess = false;
+        for (; fSuccess && pindex->pprev; pindex = pindex->pprev)
+            if (pindex->pprev->pnext != pindex)
+                fSuccess = false;
+        if (!fSuccess)
+            printf("LoadBlockIndexSnapshot() : %s has a bad best chain\n", pathSnapshot.string().c_str());
+    }
+
+#ifndef WIN32
+    munmap(pmap, nFileSize);
+#endif
+
+    if (!fSuccess)
+    {
+        // start over with the txdb
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+            delete item.second;
+        mapBlockIndex.clear();
+        return false;
+    }
+
+    BOOST_FOREACH(CBlockIndex* pindex, vpindex)
+    {
+        if (!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
+            return error("CTxDB::LoadBlockIndexSnapshot() : Failed stake modifier checkpoint height=%d, modifier=0x%016llx", pindex->nHeight, pindex->nStakeModifier);
+
+        // Watch for genesis block
+        if (pindexGenesisBlock == NULL && *pindex->phashBlock == hashGenesisBlock)
+            pindexGenesisBlock = pindex;
+
+        // ppcoin: build setStakeSeen
+        if (pindex->IsProofOfStake())
+            setStakeSeen.insert(make_pair(pindex->prevoutStake, pindex->nStakeTime));
+        else if(pindex->IsProofOfBurn()) //build the setBurnSeen
+            setBurnSeen.insert(pindex->GetProofOfBurn());
+    }
+
+    // the next start reads the txdb unless this one shuts down cleanly
+    if (!EraseIndexSnapshotNonce())
+        return error("LoadBlockIndexSnapshot() : EraseIndexSnapshotNonce failed");
+
+    printf("LoadBlockIndexSnapshot() : %u block indexes from %s\n", header.nCount, pathSnapshot.string().c_str());
+    return true;
+}
+
+bool CTxDB::ReadBlockIndex()
 {
     // Get database cursor
-    Dbc* pcursor = GetCursor();
+    CKeyValueIterator* pcursor = NewIterator();
     if (!pcursor)
         return false;
 
     // Load mapBlockIndex
-    unsigned int fFlags = DB_SET_RANGE;
-  for(;;)
+    for (pcursor->Seek(SerializeKey(make_pair(string("blockindex"), uint256(0)))); pcursor->Valid(); pcursor->Next())
     {
         // Read next record
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        if (fFlags == DB_SET_RANGE)
-            ssKey << make_pair(string("blockindex"), uint256(0));
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
-        fFlags = DB_NEXT;
-        if (ret == DB_NOTFOUND)
-            break;
-        else if (ret != 0)
+        string strValue;
+        if (!pcursor->GetValue(strValue))
+        {
+            delete pcursor;
             return false;
+        }
+        CDataStream ssKey(pcursor->GetKey().data(), pcursor->GetKey().data() + pcursor->GetKey().size(), SER_DISK, CLIENT_VERSION);
+        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
 
         // Unserialize
 
@@ -610,7 +2061,10 @@ bool CTxDB::LoadBlockIndex()
                 pindexGenesisBlock = pindexNew;
 
             if (!pindexNew->CheckIndex())
+            {
+                delete pcursor;
                 return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+            }
 
             // ppcoin: build setStakeSeen
             if (pindexNew->IsProofOfStake())
@@ -624,10 +2078,11 @@ bool CTxDB::LoadBlockIndex()
         }
         }    // try
         catch (std::exception &e) {
+            delete pcursor;
             return error("%s() : deserialize error : %s", __PRETTY_FUNCTION__, e.what());
         }
     }
-    pcursor->close();
+    delete pcursor;
 
     if (fRequestShutdown)
         return true;
@@ -651,6 +2106,22 @@ bool CTxDB::LoadBlockIndex()
             return error("CTxDB::LoadBlockIndex() : Failed stake modifier checkpoint height=%d, modifier=0x%016llx", pindex->nHeight, pindex->nStakeModifier);
     }
 
+    return true;
+}
+
+bool CTxDB::LoadBlockIndex()
+{
+    if (!LoadBlockIndexSnapshot() && !ReadBlockIndex())
+        return false;
+
+    uint64 nEntries, nBytes;
+    GetBlockIndexMemoryUsage(nEntries, nBytes);
+    printf("LoadBlockIndex() : %" PRI64u " block indexes in %" PRI64u " KB, %" PRI64u " bytes each\n",
+           nEntries, nBytes / 1024, nEntries ? nBytes / nEntries : 0);
+
+    if (fRequestShutdown)
+        return true;
+
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
     {
@@ -661,6 +2132,7 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+    SetBestChainIndex(pindexBest);
     nBestHeight = pindexBest->nHeight;
     bnBestChainTrust = pindexBest->bnChainTrust;
     printf("LoadBlockIndex(): hashBestChain=%s  height=%d  trust=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainTrust.ToString().c_str());
@@ -673,6 +2145,9 @@ bool CTxDB::LoadBlockIndex()
     // Load bnBestInvalidTrust, OK if it doesn't exist
     ReadBestInvalidTrust(bnBestInvalidTrust);
 
+    // Load how far -prune got, OK if it doesn't exist
+    ReadPruneHeight(nPruneHeight);
+
     // Verify blocks in the best chain
     int nCheckLevel = GetArg("-checklevel", 1);
     int nCheckDepth = GetArg( "-checkblocks", 2500);
@@ -683,47 +2158,19 @@ bool CTxDB::LoadBlockIndex()
 
     {
         //after all of the indexes are loaded, now check the proof-of-burn blocks
+        vector<const CBlockIndex*> vpindexBurn;
         for(const CBlockIndex *pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
         {
-
             //check it if the fUseFastIndex is false or
             // if this index is a proof-of-burn as was found within the last 24 hours, check it
             if(!fUseFastIndex || (pindex->IsProofOfBurn() && pindex->nTime > GetAdjustedTime() - 24 * 60 * 60))
-            {
-
-                uint256 burnHashRet;
-
-                /*
-                 * Check if the burn hash meets the burn target requirement
-                 */
-
-                //Get the actual burn hash, with the multiplier applied
-                // nHeight - 1 since GetBurnHash wants the index of the previous block
-                GetBurnHash(pindex->pprev->GetBlockHash(), pindex->burnBlkHeight, pindex->burnCTx, 
-                                        pindex->burnCTxOut, burnHashRet, false);
-
-                if(!CheckProofOfBurnHash(burnHashRet, pindex->nBurnBits))
-                    return error("%s : deserialize error on PoB index %d", __PRETTY_FUNCTION__, pindex->nHeight);
-
-                /*
-                 * If Slimcoin is past the intermediate hash update, check that too
-                 */
-
-                //apply the checking of burn hashes if the height is past the burn intermediate hash change in the client
-                const bool fUseIntermediate = use_burn_hash_intermediate(pindex->nTime);
-
-                if(fUseIntermediate)
-                {
-                    //Get the intermediate burn hash without the multiplier applied
-                    // nHeight - 1 since GetBurnHash wants the index of the previous block
-                    GetBurnHash(pindex->pprev->GetBlockHash(), pindex->burnBlkHeight, pindex->burnCTx, 
-                                            pindex->burnCTxOut, burnHashRet, true);
-
-                    if(pindex->burnHash != burnHashRet)
-                        return error("%s : deserialize error on PoB index %d", __PRETTY_FUNCTION__, pindex->nHeight);
-                }
-            }
+                vpindexBurn.push_back(pindex);
         }
+
+        //the checks are independent, so they run on all cores
+        const CBlockIndex *pindexFail = NULL;
+        if(!CheckProofOfBurnHashes(vpindexBurn, &pindexFail))
+            return error("%s : deserialize error on PoB index %d", __PRETTY_FUNCTION__, pindexFail->nHeight);
     }
 
     InitMessage("Verifying blocks...");
@@ -732,7 +2179,7 @@ bool CTxDB::LoadBlockIndex()
     map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
     for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
     {
-        if (fRequestShutdown || pindex->nHeight < nBestHeight - nCheckDepth)
+        if (fRequestShutdown || pindex->nHeight < nBestHeight - nCheckDepth || IsBlockPruned(pindex))
             break;
         CBlock block;
         if (!block.ReadFromDisk(pindex))
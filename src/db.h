@@ -8,6 +8,9 @@
 #define BITCOIN_DB_H
 
 #include "main.h"
+#include "addressindex.h"
+#include "kvstore.h"
+#include "smalldata.h"
 
 #include <map>
 #include <string>
@@ -61,7 +64,7 @@ protected:
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
+        ssKey.reserve(::GetSerializeSize(key, SER_DISK, CLIENT_VERSION));
         ssKey << key;
         Dbt datKey(&ssKey[0], ssKey.size());
 
@@ -272,21 +275,119 @@ public:
 
 
 
-/** Access to the transaction database (blkindex.dat) */
-class CTxDB : public CDB
+/** Access to the transaction database. The data is in a CKeyValueStore, the log
+ * structured store in txdb/ or, with -txdb=bdb, the Berkeley database blkindex.dat.
+ * Writes between TxnBegin() and TxnCommit() are collected in a batch that reads
+ * see, and that goes to the store in one atomic write on commit.
+ */
+class CTxDB
 {
+protected:
+    CKeyValueStore* pstore;
+    bool fReadOnly;
+    std::vector<CKeyValueBatch> vTxn;
+
 public:
-    CTxDB(const char* pszMode="r+") : CDB("blkindex.dat", pszMode) { }
+    CTxDB(const char* pszMode="r+");
+    ~CTxDB() { Close(); }
+    void Close();
 private:
     CTxDB(const CTxDB&);
     void operator=(const CTxDB&);
+
+protected:
+    template<typename K>
+    static std::string SerializeKey(const K& key)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(1000);
+        ssKey << key;
+        return std::string(ssKey.begin(), ssKey.end());
+    }
+
+    bool ReadRaw(const std::string& strKey, std::string& strValue);
+    bool WriteRaw(const std::string& strKey, std::string& strValue);  // takes over strValue
+    bool EraseRaw(const std::string& strKey);
+    bool ExistsRaw(const std::string& strKey);
+
+    template<typename K, typename T>
+    bool Read(const K& key, T& value)
+    {
+        std::string strValue;
+        if (!ReadRaw(SerializeKey(key), strValue))
+            return false;
+
+        // Unserialize value
+        try {
+            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> value;
+        }
+        catch (std::exception &e) {
+            return false;
+        }
+        return true;
+    }
+
+    template<typename K, typename T>
+    bool Write(const K& key, const T& value)
+    {
+        if (fReadOnly)
+            assert(!"Write called on database in read-only mode");
+
+        // sized to the value, a block commits thousands of these
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue.reserve(::GetSerializeSize(value, SER_DISK, CLIENT_VERSION));
+        ssValue << value;
+        std::string strValue(ssValue.begin(), ssValue.end());
+        return WriteRaw(SerializeKey(key), strValue);
+    }
+
+    template<typename K>
+    bool Erase(const K& key)
+    {
+        if (fReadOnly)
+            assert(!"Erase called on database in read-only mode");
+        return EraseRaw(SerializeKey(key));
+    }
+
+    template<typename K>
+    bool Exists(const K& key)
+    {
+        return ExistsRaw(SerializeKey(key));
+    }
+
+    // Iterators walk the store and the write-back cache, not the writes of an
+    // open transaction.
+    CKeyValueIterator* NewIterator();
+
 public:
+    bool TxnBegin();
+    bool TxnCommit();
+    bool TxnAbort();
+
+    // Write the committed transactions out of the write-back cache and make them durable
+    bool Sync();
+
+    bool ReadVersion(int& nVersion)
+    {
+        nVersion = 0;
+        return Read(std::string("version"), nVersion);
+    }
+
+    bool WriteVersion(int nVersion)
+    {
+        return Write(std::string("version"), nVersion);
+    }
+
+    // Read the transaction at pos, from the -txcache transaction cache when it has it
+    bool ReadCachedTx(const uint256& hash, const CDiskTxPos& pos, CTransaction& tx);
+    void CacheTx(const uint256& hash, const CDiskTxPos& pos, const CTransaction& tx);
+
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
     bool AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight);
     bool EraseTxIndex(const CTransaction& tx);
     bool ContainsTx(uint256 hash);
-    bool ReadOwnerTxes(uint160 hash160, int nHeight, std::vector<CTransaction>& vtx);
     bool ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(uint256 hash, CTransaction& tx);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
@@ -301,9 +402,85 @@ public:
     bool WriteSyncCheckpoint(uint256 hashCheckpoint);
     bool ReadCheckpointPubKey(std::string& strPubKey);
     bool WriteCheckpointPubKey(const std::string& strPubKey);
+    bool ReadIndexSnapshotNonce(uint64& nNonce);
+    bool WriteIndexSnapshotNonce(uint64 nNonce);
+    bool EraseIndexSnapshotNonce();
+    // Erase every key but the version, outside of a transaction (-reindex)
+    bool EraseAll();
+    // -prune state, the best chain is pruned up to nPruneHeight
+    bool ReadPruneHeight(int& nPruneHeight);
+    bool WritePruneHeight(int nPruneHeight);
+    bool ReadBurnTxLocation(const uint256& hashBlock, s32int nTx, CBurnTxLocation& location);
+    bool WriteBurnTxLocation(const uint256& hashBlock, s32int nTx, const CBurnTxLocation& location);
+    bool EraseBurnTxLocation(const uint256& hashBlock, s32int nTx);
+    bool ReadBurnTxIndexState(bool& fComplete, int& nBuildHeight);
+    bool WriteBurnTxIndexState(bool fComplete, int nBuildHeight);
+
+    // -addressindex entries, see addressindex.h
+    bool ReadAddressIndexState(bool& fComplete, s32int& nBuildHeight);
+    bool WriteAddressIndexState(bool fComplete, s32int nBuildHeight);
+    bool WriteAddressHistory(const CAddressHistoryKey& key, const CAddressHistoryValue& value);
+    bool ReadAddressHistory(const CAddressHistoryKey& key, CAddressHistoryValue& value);
+    bool EraseAddressHistory(const CAddressHistoryKey& key);
+    bool WriteAddressUnspent(const CAddressUnspentKey& key, const CAddressUnspentValue& value);
+    bool ReadAddressUnspent(const CAddressUnspentKey& key, CAddressUnspentValue& value);
+    bool EraseAddressUnspent(const CAddressUnspentKey& key);
+    bool ReadAddressBalance(unsigned char nAddressType, const uint160& hashAddress, CAddressBalance& balance);
+    bool WriteAddressBalance(unsigned char nAddressType, const uint160& hashAddress, const CAddressBalance& balance);
+    // Pages of the entries of one address; history from nStartHeight up, unspent
+    // outputs in txid order. Only reads the index.
+    bool ListAddressHistory(unsigned char nAddressType, const uint160& hashAddress, s32int nStartHeight, unsigned int nSkip, unsigned int nCount,
+                            std::vector<std::pair<CAddressHistoryKey, CAddressHistoryValue> >& vEntries);
+    bool ListAddressUnspent(unsigned char nAddressType, const uint160& hashAddress, unsigned int nSkip, unsigned int nCount,
+                            std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vEntries);
+    // Erase all address index keys, outside of a transaction
+    bool EraseAddressIndex();
+
+    // small data message index, see smalldata.h
+    bool ReadTxMessageIndexState(bool& fComplete, int& nBuildHeight);
+    bool WriteTxMessageIndexState(bool fComplete, int nBuildHeight);
+    bool WriteTxMessage(const CTxMessageKey& key, const CTxMessageEntry& entry);
+    bool EraseTxMessage(const CTxMessageKey& key);
+    bool WriteTxMessageFace(const uint256& hashFace, const CTxMessageKey& key);
+    bool EraseTxMessageFace(const uint256& hashFace, const CTxMessageKey& key);
+    // Messages of the blocks above nMinHeight, newest block first
+    bool ListTxMessages(int nMinHeight, unsigned int nCount, std::vector<std::pair<CTxMessageKey, CTxMessageEntry> >& vEntries);
+    // Transactions above nMinHeight with the message "face <hashFace>", newest block first
+    bool ListTxMessagesByFace(const uint256& hashFace, int nMinHeight, std::vector<CTxMessageKey>& vKeys);
     bool LoadBlockIndex();
+private:
+    bool LoadBlockIndexSnapshot();
+    bool ReadBlockIndex();
 };
 
+/** Size and hit counts of the CTxDB write-back cache */
+struct CTxDBCacheStats
+{
+    int64 nMaxSize;
+    uint64 nDirtyCount;
+    uint64 nDirtySize;
+    uint64 nCleanCount;
+    uint64 nCleanSize;
+    uint64 nTxCount;
+    uint64 nTxSize;
+    uint64 nHits;
+    uint64 nMisses;
+    uint64 nTxHits;
+    uint64 nTxMisses;
+    uint64 nFlushes;
+    int64 nLastFlush;
+};
+
+void GetTxDBCacheStats(CTxDBCacheStats& stats);
+
+// Write blkindex.snap, which the next LoadBlockIndex() reads instead of the txdb
+bool WriteBlockIndexSnapshot();
+
+// Backend of the transaction database chosen by -txdb, "log" or "bdb"
+std::string GetTxDBBackend();
+// Copy the transaction database into backend strTo, which is used from then on
+bool MigrateTxDB(const std::string& strTo);
+
 
 
 
@@ -2,34 +2,14 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
-#include <stdlib.h>        //malloc, free, realloc
-#include <math.h>          //pow
-
 #include "uint256.h"
 #include "main.h"
 #include "dcrypt.h"
 
-//the base size for malloc/realloc will be 1KB
-#define REALLOC_BASE_SZ   (1024)
-
-typedef struct
-{
-  uint8_t *array;
-  unsigned long long actual_array_sz;
-  uint32_t times_realloced;
-
-} Extend_Array;
-
-inline void Extend_Array_init(Extend_Array *ExtArray)
-{
-  //initial values
-  ExtArray->array = 0;
-  ExtArray->actual_array_sz = 0;
-  ExtArray->times_realloced = 0;
-  return;
-}
+static const uint8_t hex_digits[16] = {'0', '1', '2', '3', '4', '5', '6', '7',
+                                       '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
 
-uint32_t hex_char_to_int(uint8_t c)
+inline uint32_t hex_char_to_int(uint8_t c)
 {
   if(c >= '0' && c <= '9')
     return c - '0';
@@ -43,61 +23,33 @@ uint32_t hex_char_to_int(uint8_t c)
   return -1;
 }
 
-inline void join_to_array(uint8_t *array, uint8_t join)
+//sha256 the data and write the lowercase hex of the digest straight into string,
+// the hex form is what dcrypt hashes next, so there is no separate string conversion
+inline void sha256_to_hex(const uint8_t *data, size_t data_sz, uint8_t *string, uint8_t *hash_digest)
 {
-  *(array + SHA256_LEN) = join;
-  return;
-}
-
-void extend_array(Extend_Array *extend_array, unsigned long long used_array_sz, 
-                  uint8_t *extend, uint32_t extend_sz, uint8_t hashed_end)
-{
-  if(!extend_array)
-    return;
+  SHA256_CTX sha256;
+  SHA256_Init(&sha256);
+  SHA256_Update(&sha256, data, data_sz);
+  SHA256_Final(hash_digest, &sha256);
 
-  //make a few references
-  unsigned long long *actual_array_sz = &extend_array->actual_array_sz;
-  uint32_t *times_realloced = &extend_array->times_realloced;
-
-  //if there is not enough room
-  if((*actual_array_sz - used_array_sz) < (extend_sz + hashed_end))
+  for(uint32_t i = 0; i < DCRYPT_DIGEST_LENGTH; i++)
   {
-    //if extend_array->array has already been malloc'd
-    if(*times_realloced)
-    {
-      //reallocate on an exponential curve, modern computers have plenty ram
-      *actual_array_sz += pow(2, (*times_realloced)++) * REALLOC_BASE_SZ;
-      extend_array->array = (uint8_t*)realloc(extend_array->array, *actual_array_sz);
-    }else{
-      //allocate the base size
-      *actual_array_sz += REALLOC_BASE_SZ;
-      (*times_realloced)++;
-
-      extend_array->array = (uint8_t*)malloc(*actual_array_sz); //if we have not allocated anything, malloc
-    }
+    *(string + (i * 2)) = hex_digits[*(hash_digest + i) >> 4];
+    *(string + (i * 2) + 1) = hex_digits[*(hash_digest + i) & 0x0F];
   }
 
-  //copy the data to be extended
-  memcpy(extend_array->array + used_array_sz, extend, extend_sz);
-
-  if(hashed_end)   
-    *(extend_array->array + used_array_sz + extend_sz) = 0; //add the final \000 of the whole string array
-
   return;
 }
 
-uint64 mix_hashed_nums(uint8_t *hashed_nums, const uint8_t *unhashedData, size_t unhashed_sz,
-                       uint8_t **mixed_hash, uint8_t *hash_digest)
+//mixes the hashed data and feeds every mixed hash into ctx->mix_ctx, returns the number of rounds
+uint64 mix_hashed_nums(Dcrypt_Context *ctx)
 {
   uint32_t i, index = 0;
   const uint32_t hashed_nums_len = SHA256_LEN;
 
   uint64 count;
-  uint8_t tmp_val, tmp_array[SHA256_LEN + 2];
-
-  //initialize the class for the extend hash
-  Extend_Array new_hash;
-  Extend_Array_init(&new_hash);
+  uint8_t tmp_val;
+  uint8_t *hashed_nums = ctx->hashed_nums, *tmp_array = ctx->tmp_array;
 
   //set the first hash length in the temp array to all 0xff
   memset(tmp_array, 0xff, SHA256_LEN);
@@ -109,21 +61,21 @@ uint64 mix_hashed_nums(uint8_t *hashed_nums, const uint8_t *unhashedData, size_t
     //+1 to keeps a 0 value of *(hashed_nums + index) moving on
     i = hex_char_to_int(*(hashed_nums + index)) + 1;
     index += i;
-    
+
     //if we hit the end of the hash, rehash it
     if(index >= hashed_nums_len)
     {
       index = index % hashed_nums_len;
-      sha256_to_str(hashed_nums, hashed_nums_len, hashed_nums, hash_digest); //rescramble
+      sha256_to_hex(hashed_nums, hashed_nums_len, hashed_nums, ctx->digest); //rescramble
     }
-    
+
     tmp_val = *(hashed_nums + index);
 
-    join_to_array(tmp_array, tmp_val); //plop tmp_val at the end of tmp_array
-    sha256_to_str(tmp_array, SHA256_LEN + 1, tmp_array, hash_digest);
+    *(tmp_array + SHA256_LEN) = tmp_val; //plop tmp_val at the end of tmp_array
+    sha256_to_hex(tmp_array, SHA256_LEN + 1, tmp_array, ctx->digest);
 
-    //extend the expanded hash to the array
-    extend_array(&new_hash, count * SHA256_LEN, tmp_array, SHA256_LEN, false);
+    //the mixed hashes are only ever hashed as a whole, so stream them in
+    SHA256_Update(&ctx->mix_ctx, tmp_array, SHA256_LEN);
 
     //check if the last value of hashed_nums is the same as the last value in tmp_array
     if(index == hashed_nums_len - 1)
@@ -137,18 +89,18 @@ uint64 mix_hashed_nums(uint8_t *hashed_nums, const uint8_t *unhashedData, size_t
 
   }
 
-  //extend the unhashed data to the end and add the \000 to the end
-  extend_array(&new_hash, count * SHA256_LEN, (u8int*)unhashedData, unhashed_sz, true);
-
-  //assign the address of new_hash's array to mixed_hash
-  *mixed_hash = new_hash.array;
+  return count;
+}
 
-  return count * SHA256_LEN + unhashed_sz;
+uint256 dcrypt(const uint8_t *data, size_t data_sz)
+{
+  Dcrypt_Context ctx;
+  return dcrypt(data, data_sz, &ctx);
 }
 
-uint256 dcrypt(const uint8_t *data, size_t data_sz, uint8_t *hash_digest)
+uint256 dcrypt(const uint8_t *data, size_t data_sz, Dcrypt_Context *ctx)
 {
-  //dcrypt is really intense, don't use it for testnet hashes, 
+  //dcrypt is really intense, don't use it for testnet hashes,
   // it is too slow and takes more time to test, just use the traditional double sha256
   if(fTestNet)
   {
@@ -159,30 +111,230 @@ uint256 dcrypt(const uint8_t *data, size_t data_sz, uint8_t *hash_digest)
 
     return hash2;
   }
-  
-  uint8_t hashed_nums[SHA256_LEN + 1], *mix_hash;
+
   uint256 hash;
 
-  bool allocDigest = false;
-  if(!hash_digest)
+  sha256_to_hex(data, data_sz, ctx->hashed_nums, ctx->digest);
+  *(ctx->hashed_nums + SHA256_LEN) = 0;
+
+  //mix the hashes up, magority of the time takes here
+  SHA256_Init(&ctx->mix_ctx);
+  ctx->nMixRounds = mix_hashed_nums(ctx);
+
+  //apply the final hash to the mixed hashes followed by the unhashed data
+  SHA256_Update(&ctx->mix_ctx, data, data_sz);
+  SHA256_Final((uint8_t*)&hash, &ctx->mix_ctx);
+
+  //sucess
+  return hash;
+}
+
+//one in-flight hash of dcrypt_multi
+typedef struct
+{
+  uint32_t nJob;                            //which of the inputs this lane is hashing
+  uint32_t index;                           //position in hashed_nums, as in mix_hashed_nums
+  uint8_t tmp_val;                          //the char of hashed_nums joined this round
+  uint64 mix_blocks;                        //64 byte blocks fed into the final hash so far
+  u32int hashed_nums[DCRYPT_HEX_LENGTH / 4]; //the hex string as big endian message words
+
+} Dcrypt_Lane;
+
+//the two hex chars of every byte as a big endian 16 bit value
+static u32int hex_pairs[256];
+
+static bool init_hex_pairs()
+{
+  for(uint32_t i = 0; i < 256; i++)
+    hex_pairs[i] = (hex_digits[i >> 4] << 8) | hex_digits[i & 0x0F];
+
+  return true;
+}
+
+static bool fHexPairsInit = init_hex_pairs();
+
+//char number index of a hex string stored as big endian message words
+inline uint8_t hex_word_char(const u32int *words, uint32_t index)
+{
+  return words[index / 4] >> (24 - (index % 4) * 8);
+}
+
+//the lowercase hex string of a digest word is the next two message words
+inline void digest_word_to_hex(u32int digest, u32int *words)
+{
+  words[0] = (hex_pairs[digest >> 24] << 16) | hex_pairs[(digest >> 16) & 0xFF];
+  words[1] = (hex_pairs[(digest >> 8) & 0xFF] << 16) | hex_pairs[digest & 0xFF];
+}
+
+//sha256 of the 64 hex chars of each lane, followed by the join char when given (64 or 65 bytes).
+// The hex of the result replaces the message words; every message is exactly two blocks long
+static void sha256_lanes_to_hex(u32int words[16][SHA256_MAX_LANES], const uint8_t *join, uint32_t nLanes)
+{
+  u32int state[8][SHA256_MAX_LANES], pad[16][SHA256_MAX_LANES];
+  uint32_t i, lane;
+
+  for(i = 0; i < 8; i++)
+    for(lane = 0; lane < nLanes; lane++)
+      state[i][lane] = sha256_init_state[i];
+
+  sha256_transform_lanes(state, words, nLanes);
+
+  //the padding block
+  for(i = 1; i < 15; i++)
+    for(lane = 0; lane < nLanes; lane++)
+      pad[i][lane] = 0;
+
+  for(lane = 0; lane < nLanes; lane++)
   {
-    hash_digest = (uint8_t*)malloc(DCRYPT_DIGEST_LENGTH);
-    allocDigest = true;
+    if(join)
+    {
+      pad[0][lane] = ((u32int)join[lane] << 24) | 0x00800000;
+      pad[15][lane] = (SHA256_LEN + 1) * 8;
+    }else{
+      pad[0][lane] = 0x80000000;
+      pad[15][lane] = SHA256_LEN * 8;
+    }
   }
 
-  sha256_to_str(data, data_sz, hashed_nums, hash_digest);
+  sha256_transform_lanes(state, pad, nLanes);
 
-  //mix the hashes up, magority of the time takes here
-  uint64 mix_hash_len = mix_hashed_nums(hashed_nums, data, data_sz, &mix_hash, hash_digest);
+  for(i = 0; i < 8; i++)
+    for(lane = 0; lane < nLanes; lane++)
+    {
+      words[i * 2][lane] = (hex_pairs[state[i][lane] >> 24] << 16) | hex_pairs[(state[i][lane] >> 16) & 0xFF];
+      words[i * 2 + 1][lane] = (hex_pairs[(state[i][lane] >> 8) & 0xFF] << 16) | hex_pairs[state[i][lane] & 0xFF];
+    }
 
-  //apply the final hash to the output
-  sha256((const uint8_t*)mix_hash, mix_hash_len, &hash);
+  return;
+}
 
-  free(mix_hash);
+void dcrypt_multi(const uint8_t * const *data, const size_t *data_sz, uint256 *hashes, uint32_t nCount)
+{
+  //testnet hashes are a plain double sha256, nothing to run in lockstep.
+  // Without a vector unit, one hash at a time through openssl is faster than scalar lanes
+  if(fTestNet || sha256_lanes_backend() == SHA256_BACKEND_SCALAR)
+  {
+    Dcrypt_Context ctx;
+    for(uint32_t n = 0; n < nCount; n++)
+      hashes[n] = dcrypt(data[n], data_sz[n], &ctx);
 
-  if(allocDigest)
-    free(hash_digest);
+    return;
+  }
 
-  //sucess
-  return hash;
+  //the strings of mix_hashed_nums are kept as sha256 message words, lane-interleaved
+  // where every lane hashes them each round
+  Dcrypt_Lane lanes[SHA256_MAX_LANES];
+  u32int mix_state[8][SHA256_MAX_LANES], tmp_array[16][SHA256_MAX_LANES], rescramble[16][SHA256_MAX_LANES];
+  uint32_t rescramble_lanes[SHA256_MAX_LANES];
+  uint8_t joins[SHA256_MAX_LANES], digest[DCRYPT_DIGEST_LENGTH];
+  SHA256_CTX sha256;
+  uint32_t nActive = 0, nNext = 0, lane, i;
+
+  //lanes [0, nActive) are always busy, finished lanes are refilled or swapped out.
+  // All SHA256_MAX_LANES are kept busy even on narrower backends, so the rescrambles,
+  // which only a few lanes need each round, still come in useful batches
+  while(nActive || nNext < nCount)
+  {
+    //start new hashes in the free lanes
+    for(; nActive < SHA256_MAX_LANES && nNext < nCount; nActive++, nNext++)
+    {
+      Dcrypt_Lane *pLane = &lanes[nActive];
+      pLane->nJob = nNext;
+      pLane->index = 0;
+      pLane->mix_blocks = 0;
+
+      //not the one-shot SHA256(), openssl 3 allocates an EVP context for every call of it
+      SHA256_Init(&sha256);
+      SHA256_Update(&sha256, data[nNext], data_sz[nNext]);
+      SHA256_Final(digest, &sha256);
+      for(i = 0; i < 8; i++)
+        digest_word_to_hex(((u32int)digest[i * 4] << 24) | ((u32int)digest[i * 4 + 1] << 16) |
+                           ((u32int)digest[i * 4 + 2] << 8) | digest[i * 4 + 3], &pLane->hashed_nums[i * 2]);
+
+      //the first tmp_array is all 0xff
+      for(i = 0; i < 16; i++)
+        tmp_array[i][nActive] = 0xffffffff;
+      for(i = 0; i < 8; i++)
+        mix_state[i][nActive] = sha256_init_state[i];
+    }
+
+    //step the index of every lane, collecting the ones that have to rescramble hashed_nums
+    uint32_t nRescramble = 0;
+    for(lane = 0; lane < nActive; lane++)
+    {
+      Dcrypt_Lane *pLane = &lanes[lane];
+
+      //+1 to keeps a 0 value of *(hashed_nums + index) moving on
+      pLane->index += hex_char_to_int(hex_word_char(pLane->hashed_nums, pLane->index)) + 1;
+
+      if(pLane->index >= SHA256_LEN)
+      {
+        pLane->index = pLane->index % SHA256_LEN;
+
+        for(i = 0; i < 16; i++)
+          rescramble[i][nRescramble] = pLane->hashed_nums[i];
+        rescramble_lanes[nRescramble++] = lane;
+      }
+    }
+
+    if(nRescramble)
+    {
+      sha256_lanes_to_hex(rescramble, NULL, nRescramble);
+
+      for(uint32_t n = 0; n < nRescramble; n++)
+        for(i = 0; i < 16; i++)
+          lanes[rescramble_lanes[n]].hashed_nums[i] = rescramble[i][n];
+    }
+
+    //hash tmp_array with the joined char of every lane
+    for(lane = 0; lane < nActive; lane++)
+    {
+      lanes[lane].tmp_val = hex_word_char(lanes[lane].hashed_nums, lanes[lane].index);
+      joins[lane] = lanes[lane].tmp_val;
+    }
+
+    sha256_lanes_to_hex(tmp_array, joins, nActive);
+
+    //the new mixed hashes are exactly one block of each lane's final hash
+    sha256_transform_lanes(mix_state, tmp_array, nActive);
+    for(lane = 0; lane < nActive; lane++)
+      lanes[lane].mix_blocks++;
+
+    //finish the lanes that are done mixing
+    for(lane = 0; lane < nActive;)
+    {
+      Dcrypt_Lane *pLane = &lanes[lane];
+
+      if(pLane->index != SHA256_LEN - 1 || pLane->tmp_val != (uint8_t)tmp_array[15][lane])
+      {
+        lane++;
+        continue;
+      }
+
+      //continue the final hash from the lane's state with the unhashed data
+      SHA256_Init(&sha256);
+      for(i = 0; i < 8; i++)
+        sha256.h[i] = mix_state[i][lane];
+
+      sha256.Nl = (u32int)(pLane->mix_blocks * SHA256_LEN * 8);
+      sha256.Nh = (u32int)((pLane->mix_blocks * SHA256_LEN * 8) >> 32);
+
+      SHA256_Update(&sha256, data[pLane->nJob], data_sz[pLane->nJob]);
+      SHA256_Final((uint8_t*)&hashes[pLane->nJob], &sha256);
+
+      //move the last busy lane into this one
+      nActive--;
+      if(lane != nActive)
+      {
+        *pLane = lanes[nActive];
+
+        for(i = 0; i < 8; i++)
+          mix_state[i][lane] = mix_state[i][nActive];
+        for(i = 0; i < 16; i++)
+          tmp_array[i][lane] = tmp_array[i][nActive];
+      }
+    }
+  }
+
+  return;
 }
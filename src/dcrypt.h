@@ -7,9 +7,32 @@
 
 #include "sha256.h"
 
-#define DCRYPT_DIGEST_LENGTH SHA256_DIGEST_LENGTH 
+#define DCRYPT_DIGEST_LENGTH SHA256_DIGEST_LENGTH
+#define DCRYPT_HEX_LENGTH    (DCRYPT_DIGEST_LENGTH * 2) //same as SHA256_LEN, which may not be defined yet here
+
+//caller-owned scratch space for dcrypt
+// every intermediate value of a hash lives in here, so hashing never touches the heap.
+// The mixed hashes are streamed into mix_ctx as they are produced instead of being
+// collected into a growing array, which makes the size fixed for any input.
+// A context can be reused for any number of hashes, but only by one thread at a time.
+typedef struct
+{
+  SHA256_CTX mix_ctx;                         //running sha256 of the mixed hashes + the data
+  uint8_t hashed_nums[DCRYPT_HEX_LENGTH + 1]; //hex string of the data hash, rescrambled as we go
+  uint8_t tmp_array[DCRYPT_HEX_LENGTH + 2];   //hex string of the last mixed hash + the joined char
+  uint8_t digest[DCRYPT_DIGEST_LENGTH];       //binary output of the intermediate sha256s
+  uint64 nMixRounds;                          //mixing rounds done by the last hash
+
+} Dcrypt_Context;
 
 //the dcrypt hashing algorithm for a single piece of data
-uint256 dcrypt(const uint8_t *data, size_t data_sz, uint8_t *hash_digest = 0);
+uint256 dcrypt(const uint8_t *data, size_t data_sz);
+
+//same as above, but uses the given scratch context, for callers that hash in a loop
+uint256 dcrypt(const uint8_t *data, size_t data_sz, Dcrypt_Context *ctx);
+
+//hashes nCount independent pieces of data, running as many of them in lockstep as the
+// multi-lane sha256 backend allows. Each result is identical to dcrypt() of that data
+void dcrypt_multi(const uint8_t * const *data, const size_t *data_sz, uint256 *hashes, uint32_t nCount);
 
 #endif
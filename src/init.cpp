@@ -13,6 +13,7 @@
 #include "util.h"
 #include "ui_interface.h"
 #include "checkpoints.h"
+#include "blockimport.h"
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/filesystem/convenience.hpp>
@@ -79,6 +80,8 @@ void Shutdown(void* parg)
         nTransactionsUpdated++;
         DBFlush(false);
         StopNode();
+        if(GetBoolArg("-indexsnapshot", true))
+            WriteBlockIndexSnapshot();
         DBFlush(true);
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
@@ -270,6 +273,7 @@ bool AppInit2(int argc, char *argv[])
     printf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     printf("Slimcoin version %s (%s)\n", FormatFullVersion().c_str(), CLIENT_DATE.c_str());
     printf("Default data directory %s\n", GetDefaultDataDir().string().c_str());
+    printf("Using %s sha256 lanes for dcrypt\n", sha256_lanes_backend_name(sha256_lanes_backend()));
 
     if(GetBoolArg("-loadblockindextest"))
     {
@@ -290,6 +294,36 @@ bool AppInit2(int argc, char *argv[])
         return false;
     }
 
+    if(mapArgs.count("-prune"))
+    {
+        int64 nPruneMB = GetArg("-prune", 0);
+        if(nPruneMB < 0)
+        {
+            ThreadSafeMessageBox(_("Invalid amount for -prune=<MB>"), _("Slimcoin"), wxOK | wxMODAL);
+            return false;
+        }
+        if(nPruneMB > 0 && !CanPruneBlockFiles())
+        {
+            ThreadSafeMessageBox(_("-prune is not supported on this platform"), _("Slimcoin"), wxOK | wxMODAL);
+            return false;
+        }
+        if(nPruneMB > 0 && GetBoolArg("-rescan"))
+        {
+            ThreadSafeMessageBox(_("-rescan can't be used with -prune"), _("Slimcoin"), wxOK | wxMODAL);
+            return false;
+        }
+        nPruneTarget = (uint64)nPruneMB * 1024 * 1024;
+
+        // peers can't download old blocks from us
+        if(nPruneTarget)
+        {
+            nLocalServices &= ~NODE_NETWORK;
+            addrLocalHost.nServices = nLocalServices;
+        }
+    }
+
+    nBlockCacheMaxSize = std::max(GetArg("-blockcachesize", 32), (int64)0) << 20;
+
     std::ostringstream strErrors;
     //
     // Load data files
@@ -305,12 +339,38 @@ bool AppInit2(int argc, char *argv[])
         strErrors << _("Error loading addr.dat") << "\n";
     printf(" addresses   %15d ms\n", GetTimeMillis() - nStart);
 
+    if(mapArgs.count("-migratetxdb"))
+    {
+        InitMessage(_("Migrating transaction database..."));
+        printf("Migrating transaction database...\n");
+        nStart = GetTimeMillis();
+        if(!MigrateTxDB(GetArg("-migratetxdb", "")))
+        {
+            ThreadSafeMessageBox(_("Error migrating the transaction database, see debug.log"), _("Slimcoin"), wxOK | wxICON_ERROR | wxMODAL);
+            return false;
+        }
+        printf(" migrated    %15" PRI64d " ms\n", GetTimeMillis() - nStart);
+    }
+
+    if(GetBoolArg("-reindex"))
+    {
+        InitMessage(_("Preparing to reindex..."));
+        printf("Preparing to reindex...\n");
+        nStart = GetTimeMillis();
+        if(!PrepareReindex())
+        {
+            ThreadSafeMessageBox(_("Error preparing the reindex, see debug.log"), _("Slimcoin"), wxOK | wxICON_ERROR | wxMODAL);
+            return false;
+        }
+        printf(" reindex     %15" PRI64d " ms\n", GetTimeMillis() - nStart);
+    }
+
     InitMessage(_("Loading block index..."));
-    printf("Loading block index...\n");
+    printf("Loading block index (%s)...\n", GetTxDBBackend().c_str());
     nStart = GetTimeMillis();
 
     if(!LoadBlockIndex())
-        strErrors << _("Error loading blkindex.dat") << "\n";
+        strErrors << _("Error loading the transaction database") << "\n";
 
     // as LoadBlockIndex can take several minutes, it's possible the user
     // requested to kill bitcoin-qt during the last operation. If so, exit.
@@ -322,6 +382,72 @@ bool AppInit2(int argc, char *argv[])
     }
     printf(" block index %15d ms\n", GetTimeMillis() - nStart);
 
+    fAddressIndex = GetBoolArg("-addressindex");
+    InitMessage(_("Checking address index..."));
+    nStart = GetTimeMillis();
+    if(!InitAddressIndex())
+    {
+        ThreadSafeMessageBox(_("Error building the address index, see debug.log"), _("Slimcoin"), wxOK | wxICON_ERROR | wxMODAL);
+        return false;
+    }
+    if(fRequestShutdown)
+    {
+        printf("Shutdown requested. Exiting.\n");
+        return false;
+    }
+    printf(" addr index  %15" PRI64d " ms\n", GetTimeMillis() - nStart);
+
+    InitMessage(_("Checking message index..."));
+    nStart = GetTimeMillis();
+    if(!InitTxMessageIndex())
+    {
+        ThreadSafeMessageBox(_("Error building the message index, see debug.log"), _("Slimcoin"), wxOK | wxICON_ERROR | wxMODAL);
+        return false;
+    }
+    if(fRequestShutdown)
+    {
+        printf("Shutdown requested. Exiting.\n");
+        return false;
+    }
+    printf(" msg index   %15" PRI64d " ms\n", GetTimeMillis() - nStart);
+
+    InitMessage(_("Checking burn transaction index..."));
+    nStart = GetTimeMillis();
+    if(!InitBurnTxIndex())
+    {
+        ThreadSafeMessageBox(_("Error building the burn transaction index, see debug.log"), _("Slimcoin"), wxOK | wxICON_ERROR | wxMODAL);
+        return false;
+    }
+    if(fRequestShutdown)
+    {
+        printf("Shutdown requested. Exiting.\n");
+        return false;
+    }
+    printf(" burn index  %15" PRI64d " ms\n", GetTimeMillis() - nStart);
+
+    // Blocks of an unfinished -reindex first, then the -loadblock files
+    std::vector<boost::filesystem::path> vReindexFiles = GetReindexFiles();
+    std::vector<boost::filesystem::path> vImportFiles;
+    if(mapArgs.count("-loadblock"))
+    {
+        BOOST_FOREACH(std::string strFile, mapMultiArgs["-loadblock"])
+            vImportFiles.push_back(strFile);
+    }
+    if(!vReindexFiles.empty() || !vImportFiles.empty())
+    {
+        InitMessage(_("Importing blocks..."));
+        nStart = GetTimeMillis();
+        bool fImported = ImportBlockFiles(vReindexFiles, true) && ImportBlockFiles(vImportFiles, false);
+        if(fRequestShutdown)
+        {
+            printf("Shutdown requested. Exiting.\n");
+            return false;
+        }
+        if(!fImported)
+            strErrors << _("Error importing blocks, see debug.log") << "\n";
+        printf(" import      %15" PRI64d " ms\n", GetTimeMillis() - nStart);
+    }
+
     InitMessage(_("Loading wallet..."));
     printf("Loading wallet...\n");
     nStart = GetTimeMillis();
@@ -391,6 +517,11 @@ bool AppInit2(int argc, char *argv[])
 
     if(pindexBest != pindexRescan && pindexBest && pindexRescan && pindexBest->nHeight > pindexRescan->nHeight)
     {
+        if(nPruneHeight > 0 && pindexRescan->nHeight <= nPruneHeight)
+        {
+            ThreadSafeMessageBox(strprintf(_("The wallet needs a rescan from block %d, but the blocks up to %d were pruned"), pindexRescan->nHeight, nPruneHeight), _("Slimcoin"), wxOK | wxICON_ERROR | wxMODAL);
+            return false;
+        }
         InitMessage(_("Rescanning..."));
         printf("Rescanning last %i blocks (from block %i)...\n",
                      pindexBest->nHeight - pindexRescan->nHeight, pindexRescan->nHeight);
@@ -442,7 +573,7 @@ bool AppInit2(int argc, char *argv[])
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for(map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for(BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if(strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -596,7 +727,16 @@ std::string HelpMessage()
             "  -splash          \t\t  " + _("Show splash screen on startup (default: 1)") + "\n" +
             "  -datadir=<dir>   \t\t  " + _("Specify data directory") + "\n" +
             "  -dbcache=<n>     \t\t  " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+            "  -indexsnapshot   \t\t  " + _("Write the block index to blkindex.snap at shutdown for a faster start (default: 1)") + "\n" +
+            "  -txcache=<n>     \t\t  " + _("Set transaction database write-back cache size in megabytes (default: 100)") + "\n" +
+            "  -blockcachesize=<n>\t  " + _("Keep up to <n> megabytes of recent blocks ready to send to peers (default: 32)") + "\n" +
+            "  -reindex         \t\t  " + _("Rebuild the block index and the transaction database from the blk*.dat files") + "\n" +
+            "  -loadblock=<file>\t\t  " + _("Import blocks from an external blk*.dat file at startup") + "\n" +
+            "  -prune=<n>       \t\t  " + _("Delete old blocks to keep the block files under <n> MB, still keeping the unspent and recent transactions (default: 0 = off)") + "\n" +
+            "  -addressindex    \t\t  " + _("Maintain an index of the transactions and unspent outputs of every address, for the getaddress* RPCs (default: 0)") + "\n" +
             "  -dblogsize=<n>   \t\t  " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
+            "  -txdb=<backend>  \t\t  " + _("Transaction database backend, log or bdb (default: log, bdb for an existing blkindex.dat)") + "\n" +
+            "  -migratetxdb=<backend> \t  " + _("Copy the transaction database to backend log or bdb at startup and use it") + "\n" +
             "  -timeout=<n>     \t  "   + _("Specify connection timeout (in milliseconds)") + "\n" +
             "  -proxy=<ip:port> \t  "   + _("Connect through socks4 proxy") + "\n" +
             "  -dns             \t  "   + _("Allow DNS lookups for addnode and connect") + "\n" +
@@ -614,6 +754,9 @@ std::string HelpMessage()
             "  -maxreceivebuffer=<n>\t " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 10000)") + "\n" +
             "  -maxsendbuffer=<n>\t    "   + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 10000)") + "\n" +
             "  -maxorphanblocks=<n>\t  "  + _("Maximum number of orphan blocks to store in the memory (default: 750)") + "\n" +
+#ifdef __linux__
+            "  -epoll           \t  "   + _("Watch the peer sockets with epoll instead of select (default: 1)") + "\n" +
+#endif
 #ifdef USE_UPNP
 #if USE_UPNP
             "  -upnp            \t  "   + _("Use Universal Plug and Play to map the listening port (default: 1)") + "\n" +
@@ -7,6 +7,7 @@
 #include "kernel.h"
 #include "db.h"
 #include "init.h"
+#include "sha256.h"
 
 #include <math.h>       /* pow */
 
@@ -343,13 +344,143 @@ static bool GetKernelStakeModifierV03(uint256 hashBlockFrom, uint64& nStakeModif
     return true;
 }
 
+// Cache of kernel stake modifiers, so kernel checks skip the walk through the
+// block index. v0.3 modifiers only depend on the block the staked coin is from and
+// are keyed by hashBlockFrom, entries are dropped in insertion order once the cache
+// is full. v0.5 modifiers depend on the best block and the kernel timestamp, they
+// are kept apart keyed by nTimeTx and dropped as a whole when the best block changes.
+struct CStakeModifierCacheEntry
+{
+    uint64 nStakeModifier;
+    int nStakeModifierHeight;
+    int64 nStakeModifierTime;
+};
+
+static const unsigned int MAX_STAKE_MODIFIER_CACHE = 100000;
+static const unsigned int MAX_STAKE_MODIFIER_CACHE_V05 = 10000;
+static CCriticalSection cs_stakeModifierCache;
+static map<uint256, CStakeModifierCacheEntry> mapStakeModifierCache;
+static deque<uint256> dequeStakeModifierCache;
+static map<unsigned int, CStakeModifierCacheEntry> mapStakeModifierCacheV05;
+static uint256 hashStakeModifierCacheV05Best = 0;
+std::atomic<uint64> nStakeModifierCacheHits(0);
+std::atomic<uint64> nStakeModifierCacheMisses(0);
+
+void StakeModifierCacheReorganize(int nForkHeight)
+{
+    LOCK(cs_stakeModifierCache);
+    // v0.3 modifiers walked pnext up to the modifier block
+    map<uint256, CStakeModifierCacheEntry>::iterator mi = mapStakeModifierCache.begin();
+    while (mi != mapStakeModifierCache.end())
+    {
+        if (mi->second.nStakeModifierHeight > nForkHeight)
+            mapStakeModifierCache.erase(mi++);
+        else
+            ++mi;
+    }
+
+    // drop the keys of erased entries from the insertion order, the rest keep their place
+    deque<uint256> dequeNew;
+    for (deque<uint256>::const_iterator it = dequeStakeModifierCache.begin(); it != dequeStakeModifierCache.end(); ++it)
+        if (mapStakeModifierCache.count(*it))
+            dequeNew.push_back(*it);
+    dequeStakeModifierCache.swap(dequeNew);
+
+    mapStakeModifierCacheV05.clear();
+    hashStakeModifierCacheV05Best = 0;
+}
+
+void StakeModifierCacheSetBest(const uint256& hashBest)
+{
+    LOCK(cs_stakeModifierCache);
+    // v0.5 modifiers of an earlier best block are never looked up again
+    if (hashStakeModifierCacheV05Best != hashBest)
+    {
+        mapStakeModifierCacheV05.clear();
+        hashStakeModifierCacheV05Best = hashBest;
+    }
+}
+
+unsigned int GetStakeModifierCacheSize()
+{
+    LOCK(cs_stakeModifierCache);
+    return mapStakeModifierCache.size() + mapStakeModifierCacheV05.size();
+}
+
 // Get the stake modifier specified by the protocol to hash for a stake kernel
 static bool GetKernelStakeModifier(uint256 hashBlockFrom, unsigned int nTimeTx, uint64& nStakeModifier, int& nStakeModifierHeight, int64& nStakeModifierTime, bool fPrintProofOfStake)
 {
-    if (IsProtocolV05(nTimeTx))
-        return GetKernelStakeModifierV05(nTimeTx, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, fPrintProofOfStake);
+    bool fV05 = IsProtocolV05(nTimeTx);
+    uint256 hashBest = hashBestChain;
+    {
+        LOCK(cs_stakeModifierCache);
+        const CStakeModifierCacheEntry* pentry = NULL;
+        if (fV05)
+        {
+            if (hashBest == hashStakeModifierCacheV05Best)
+            {
+                map<unsigned int, CStakeModifierCacheEntry>::const_iterator mi = mapStakeModifierCacheV05.find(nTimeTx);
+                if (mi != mapStakeModifierCacheV05.end())
+                    pentry = &mi->second;
+            }
+        }
+        else
+        {
+            map<uint256, CStakeModifierCacheEntry>::const_iterator mi = mapStakeModifierCache.find(hashBlockFrom);
+            if (mi != mapStakeModifierCache.end())
+                pentry = &mi->second;
+        }
+        if (pentry)
+        {
+            nStakeModifierCacheHits++;
+            nStakeModifier = pentry->nStakeModifier;
+            nStakeModifierHeight = pentry->nStakeModifierHeight;
+            nStakeModifierTime = pentry->nStakeModifierTime;
+            return true;
+        }
+    }
+    nStakeModifierCacheMisses++;
+
+    bool fFound;
+    if (fV05)
+        fFound = GetKernelStakeModifierV05(nTimeTx, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, fPrintProofOfStake);
     else
-        return GetKernelStakeModifierV03(hashBlockFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, fPrintProofOfStake);
+        fFound = GetKernelStakeModifierV03(hashBlockFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, fPrintProofOfStake);
+
+    // a modifier that is not there yet may be found once the chain is longer
+    if (fFound)
+    {
+        LOCK(cs_stakeModifierCache);
+        CStakeModifierCacheEntry entry;
+        entry.nStakeModifier = nStakeModifier;
+        entry.nStakeModifierHeight = nStakeModifierHeight;
+        entry.nStakeModifierTime = nStakeModifierTime;
+        if (fV05)
+        {
+            // the best block moved on while this was looked up
+            if (hashBest != hashStakeModifierCacheV05Best)
+            {
+                if (hashBest != hashBestChain)
+                    return fFound;
+                mapStakeModifierCacheV05.clear();
+                hashStakeModifierCacheV05Best = hashBest;
+            }
+            if (mapStakeModifierCacheV05.size() < MAX_STAKE_MODIFIER_CACHE_V05)
+                mapStakeModifierCacheV05.insert(make_pair(nTimeTx, entry));
+            return fFound;
+        }
+
+        // another thread may have cached it meanwhile, the key is queued once
+        if (!mapStakeModifierCache.insert(make_pair(hashBlockFrom, entry)).second)
+            return fFound;
+        dequeStakeModifierCache.push_back(hashBlockFrom);
+        while (dequeStakeModifierCache.size() > MAX_STAKE_MODIFIER_CACHE)
+        {
+            mapStakeModifierCache.erase(dequeStakeModifierCache.front());
+            dequeStakeModifierCache.pop_front();
+        }
+    }
+    return fFound;
 }
 
 // ppcoin kernel protocol
@@ -448,6 +579,355 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     return true;
 }
 
+// Stake kernels are 28 bytes, one sha256 block with the padding, and the second
+// round hashes the 32 byte digest, so both rounds are a single compression
+static void SetKernelWords(u32int words[16][SHA256_MAX_LANES], unsigned int nLane, const CStakeKernel& kernel)
+{
+    words[0][nLane] = ByteReverse((u32int)kernel.nStakeModifier);
+    words[1][nLane] = ByteReverse((u32int)(kernel.nStakeModifier >> 32));
+    words[2][nLane] = ByteReverse(kernel.nTimeBlockFrom);
+    words[3][nLane] = ByteReverse(kernel.nTxPrevOffset);
+    words[4][nLane] = ByteReverse(kernel.nTimeTxPrev);
+    words[5][nLane] = ByteReverse(kernel.nPrevout);
+    words[6][nLane] = ByteReverse(kernel.nTimeTx);
+    words[7][nLane] = 0x80000000;
+    for (int i = 8; i < 15; i++)
+        words[i][nLane] = 0;
+    words[15][nLane] = 28 * 8;
+}
+
+void HashStakeKernels(const CStakeKernel* pkernels, uint256* phashes, unsigned int nCount)
+{
+    if (sha256_lanes_backend() == SHA256_BACKEND_SCALAR)
+    {
+        for (unsigned int n = 0; n < nCount; n++)
+        {
+            CDataStream ss(SER_GETHASH, 0);
+            ss << pkernels[n].nStakeModifier << pkernels[n].nTimeBlockFrom << pkernels[n].nTxPrevOffset
+               << pkernels[n].nTimeTxPrev << pkernels[n].nPrevout << pkernels[n].nTimeTx;
+            phashes[n] = Hash(ss.begin(), ss.end());
+        }
+        return;
+    }
+
+    u32int state[8][SHA256_MAX_LANES], words[16][SHA256_MAX_LANES];
+    for (unsigned int nFirst = 0; nFirst < nCount; nFirst += SHA256_MAX_LANES)
+    {
+        unsigned int nLanes = min(nCount - nFirst, (unsigned int)SHA256_MAX_LANES);
+
+        for (unsigned int nLane = 0; nLane < nLanes; nLane++)
+        {
+            SetKernelWords(words, nLane, pkernels[nFirst + nLane]);
+            for (int i = 0; i < 8; i++)
+                state[i][nLane] = sha256_init_state[i];
+        }
+        sha256_transform_lanes(state, words, nLanes);
+
+        for (unsigned int nLane = 0; nLane < nLanes; nLane++)
+        {
+            for (int i = 0; i < 8; i++)
+            {
+                words[i][nLane] = state[i][nLane];
+                state[i][nLane] = sha256_init_state[i];
+            }
+            words[8][nLane] = 0x80000000;
+            for (int i = 9; i < 15; i++)
+                words[i][nLane] = 0;
+            words[15][nLane] = 32 * 8;
+        }
+        sha256_transform_lanes(state, words, nLanes);
+
+        for (unsigned int nLane = 0; nLane < nLanes; nLane++)
+        {
+            unsigned char* p = phashes[nFirst + nLane].begin();
+            for (int i = 0; i < 8; i++)
+            {
+                p[4 * i]     = state[i][nLane] >> 24;
+                p[4 * i + 1] = state[i][nLane] >> 16;
+                p[4 * i + 2] = state[i][nLane] >> 8;
+                p[4 * i + 3] = state[i][nLane];
+            }
+        }
+    }
+}
+
+// uint256 as little endian 32 bit limbs
+static void GetLimbs(const uint256& n, u32int limbs[8])
+{
+    for (int i = 0; i < 4; i++)
+    {
+        limbs[2 * i] = (u32int)n.Get64(i);
+        limbs[2 * i + 1] = (u32int)(n.Get64(i) >> 32);
+    }
+}
+
+bool CheckStakeKernelTarget(const uint256& hashProofOfStake, const uint256& targetPerCoinDay, int64 nValueIn, int64 nTimeWeight)
+{
+    // coin day weight, |nValueIn * nTimeWeight| / COIN / (24 * 60 * 60) in 4 limbs;
+    // CBigNum division truncates towards zero, so a negative weight is 0 or below
+    bool fNegative = (nValueIn < 0) != (nTimeWeight < 0);
+    uint64 nValue = nValueIn < 0 ? -(uint64)nValueIn : nValueIn;
+    uint64 nWeight = nTimeWeight < 0 ? -(uint64)nTimeWeight : nTimeWeight;
+
+    u32int weight[4] = {0, 0, 0, 0};
+    for (int i = 0; i < 2; i++)
+    {
+        uint64 nCarry = 0;
+        for (int j = 0; j < 2; j++)
+        {
+            nCarry += (uint64)weight[i + j] + (nValue >> (32 * i) & 0xffffffff) * (nWeight >> (32 * j) & 0xffffffff);
+            weight[i + j] = (u32int)nCarry;
+            nCarry >>= 32;
+        }
+        weight[i + 2] = (u32int)nCarry;
+    }
+
+    const u32int divisors[2] = {(u32int)COIN, 24 * 60 * 60};
+    for (int d = 0; d < 2; d++)
+    {
+        uint64 nRem = 0;
+        for (int i = 3; i >= 0; i--)
+        {
+            nRem = (nRem << 32) | weight[i];
+            weight[i] = (u32int)(nRem / divisors[d]);
+            nRem %= divisors[d];
+        }
+    }
+
+    if (fNegative && (weight[0] | weight[1] | weight[2] | weight[3]))
+        return hashProofOfStake == 0 && targetPerCoinDay == 0;
+
+    // target * weight, anything above 256 bits beats every hash
+    u32int target[8], hash[8], product[12];
+    GetLimbs(targetPerCoinDay, target);
+    GetLimbs(hashProofOfStake, hash);
+    memset(product, 0, sizeof(product));
+    for (int i = 0; i < 8; i++)
+    {
+        uint64 nCarry = 0;
+        for (int j = 0; j < 4; j++)
+        {
+            nCarry += (uint64)product[i + j] + (uint64)target[i] * weight[j];
+            product[i + j] = (u32int)nCarry;
+            nCarry >>= 32;
+        }
+        product[i + 4] = (u32int)nCarry;
+    }
+
+    if (product[8] | product[9] | product[10] | product[11])
+        return true;
+    for (int i = 7; i >= 0; i--)
+        if (hash[i] != product[i])
+            return hash[i] < product[i];
+    return true;
+}
+
+const CStakeKernelSearch::CStakeKernelCoin* CStakeKernelSearch::GetCoin(CTxDB& txdb, const CWalletTx& wtx, unsigned int nOut)
+{
+    COutPoint prevout(wtx.GetHash(), nOut);
+    map<COutPoint, CStakeKernelCoin>::iterator mi = mapCoins.find(prevout);
+    if (mi != mapCoins.end())
+    {
+        // the block of the coin must still be in the main chain
+        const CBlockIndex* pindexFrom = mi->second.pindexFrom;
+        if (pindexByHeight(pindexFrom->nHeight) == pindexFrom)
+            return &mi->second;
+        mapCoins.erase(mi);
+    }
+
+    CTxIndex txindex;
+    if (!txdb.ReadTxIndex(prevout.hash, txindex))
+        return NULL;
+
+    // Read block header
+    CBlock block;
+    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+        return NULL;
+    BlockMap::iterator miIndex = mapBlockIndex.find(block.GetHash());
+    if (miIndex == mapBlockIndex.end() || !miIndex->second->IsInMainChain())
+        return NULL;
+
+    CStakeKernelCoin& coin = mapCoins[prevout];
+    coin.pindexFrom = miIndex->second;
+    coin.nFile = txindex.pos.nFile;
+    coin.nBlockPos = txindex.pos.nBlockPos;
+    coin.nTimeBlockFrom = block.GetBlockTime();
+    coin.nTxPrevOffset = txindex.pos.nTxPos - txindex.pos.nBlockPos;
+    coin.nTimeTxPrev = wtx.nTime;
+    coin.nValue = wtx.vout[nOut].nValue;
+    return &coin;
+}
+
+// Repeat a kernel found in a batch with CheckStakeKernelHash() itself, so the
+// winner is checked by the same code that validates the block
+bool CStakeKernelSearch::VerifyKernel(unsigned int nBits, const CStakeKernelCoin& coin, const CWalletTx& wtx, unsigned int nOut, unsigned int nTimeTx)
+{
+    CBlock block;
+    if (!block.ReadFromDisk(coin.nFile, coin.nBlockPos, false))
+        return false;
+    uint256 hashProofOfStake = 0;
+    if (!CheckStakeKernelHash(nBits, block, coin.nTxPrevOffset, wtx, COutPoint(wtx.GetHash(), nOut), nTimeTx, hashProofOfStake))
+        return error("CStakeKernelSearch : kernel of %s:%u at %u failed CheckStakeKernelHash()", wtx.GetHash().ToString().substr(0,10).c_str(), nOut, nTimeTx);
+    return true;
+}
+
+bool CStakeKernelSearch::Search(unsigned int nBits, unsigned int nTimeTx, unsigned int nSearchSteps, unsigned int nMaxStakeSearchAge,
+                                const vector<pair<const CWalletTx*, unsigned int> >& vCoins, unsigned int nCoinStart,
+                                unsigned int& nCoinRet, unsigned int& nStepRet, unsigned int& nTimeBlockFromRet)
+{
+    // forget spent coins once the cache is well beyond the current selection
+    if (mapCoins.size() > 2 * vCoins.size() + 1000)
+    {
+        map<COutPoint, CStakeKernelCoin> mapKeep;
+        for (unsigned int i = 0; i < vCoins.size(); i++)
+        {
+            COutPoint prevout(vCoins[i].first->GetHash(), vCoins[i].second);
+            if (mapCoins.count(prevout))
+                mapKeep[prevout] = mapCoins[prevout];
+        }
+        mapCoins.swap(mapKeep);
+    }
+
+    if (nSearchSteps == 0 || nCoinStart >= vCoins.size())
+        return false;
+
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+    uint256 targetPerCoinDay = bnTargetPerCoinDay.getuint256();
+
+    // v0.5 modifiers depend on the timestamp only, v0.2 kernels hash nBits and
+    // are left to CheckStakeKernelHash()
+    vector<uint64> vStakeModifierV05(nSearchSteps, 0);
+    vector<char> vStepState(nSearchSteps, 0);
+    enum { STEP_V02 = 1, STEP_V03, STEP_V05, STEP_NONE };
+    for (unsigned int n = 0; n < nSearchSteps; n++)
+    {
+        unsigned int nTime = nTimeTx - n;
+        int nStakeModifierHeight;
+        int64 nStakeModifierTime;
+        if (!IsProtocolV03(nTime))
+            vStepState[n] = STEP_V02;
+        else if (!IsProtocolV05(nTime))
+            vStepState[n] = STEP_V03;
+        else if (GetKernelStakeModifier(0, nTime, vStakeModifierV05[n], nStakeModifierHeight, nStakeModifierTime, false))
+            vStepState[n] = STEP_V05;
+        else
+            vStepState[n] = STEP_NONE;
+    }
+
+    unsigned int nBatchSize = max(4u * SHA256_MAX_LANES, nSearchSteps);
+    vector<CStakeKernel> vKernels;
+    vector<pair<unsigned int, unsigned int> > vBatch;  // (coin, step) of each kernel
+    vector<int64> vTimeWeight;
+    vector<const CStakeKernelCoin*> vBatchCoins;
+    vector<uint256> vHashes(nBatchSize);
+    vKernels.reserve(nBatchSize);
+
+    CTxDB txdb("r");
+    for (unsigned int nCoin = nCoinStart; nCoin <= vCoins.size() && !fShutdown; nCoin++)
+    {
+        // hash the batch when it is full, or before a v0.2 check or the end so the
+        // first kernel found is still the first in search order
+        bool fLast = nCoin == vCoins.size();
+        const CStakeKernelCoin* pcoin = NULL;
+        if (!fLast)
+        {
+            pcoin = GetCoin(txdb, *vCoins[nCoin].first, vCoins[nCoin].second);
+            if (pcoin && pcoin->nTimeBlockFrom + nStakeMinAge > nTimeTx - nMaxStakeSearchAge)
+                pcoin = NULL; // only count coins meeting min age requirement
+        }
+        bool fLegacy = pcoin && vStepState[nSearchSteps - 1] == STEP_V02;
+
+        if (!vKernels.empty() && (fLast || fLegacy || vKernels.size() + nSearchSteps > nBatchSize))
+        {
+            HashStakeKernels(&vKernels[0], &vHashes[0], vKernels.size());
+            for (unsigned int i = 0; i < vKernels.size(); i++)
+            {
+                if (!CheckStakeKernelTarget(vHashes[i], targetPerCoinDay, vBatchCoins[i]->nValue, vTimeWeight[i]))
+                    continue;
+                const pair<const CWalletTx*, unsigned int>& coin = vCoins[vBatch[i].first];
+                if (VerifyKernel(nBits, *vBatchCoins[i], *coin.first, coin.second, vKernels[i].nTimeTx))
+                {
+                    nCoinRet = vBatch[i].first;
+                    nStepRet = vBatch[i].second;
+                    nTimeBlockFromRet = vBatchCoins[i]->nTimeBlockFrom;
+                    return true;
+                }
+            }
+            vKernels.clear();
+            vBatch.clear();
+            vTimeWeight.clear();
+            vBatchCoins.clear();
+        }
+
+        if (!pcoin)
+            continue;
+
+        const CWalletTx& wtx = *vCoins[nCoin].first;
+        unsigned int nOut = vCoins[nCoin].second;
+        if (fLegacy)
+        {
+            CBlock block;
+            if (!block.ReadFromDisk(pcoin->nFile, pcoin->nBlockPos, false))
+                continue;
+            for (unsigned int n = 0; n < nSearchSteps; n++)
+            {
+                uint256 hashProofOfStake = 0;
+                if (CheckStakeKernelHash(nBits, block, pcoin->nTxPrevOffset, wtx, COutPoint(wtx.GetHash(), nOut), nTimeTx - n, hashProofOfStake))
+                {
+                    nCoinRet = nCoin;
+                    nStepRet = n;
+                    nTimeBlockFromRet = pcoin->nTimeBlockFrom;
+                    return true;
+                }
+            }
+            continue;
+        }
+
+        // the v0.3 modifier is the same for every timestamp of the coin
+        uint64 nStakeModifierV03 = 0;
+        int nStateV03 = 0;
+        for (unsigned int n = 0; n < nSearchSteps; n++)
+        {
+            unsigned int nTime = nTimeTx - n;
+            if (nTime < pcoin->nTimeTxPrev || pcoin->nTimeBlockFrom + nStakeMinAge > nTime)
+                continue;
+
+            uint64 nStakeModifier;
+            if (vStepState[n] == STEP_V05)
+                nStakeModifier = vStakeModifierV05[n];
+            else if (vStepState[n] == STEP_V03)
+            {
+                if (!nStateV03)
+                {
+                    int nStakeModifierHeight;
+                    int64 nStakeModifierTime;
+                    bool fStakeModifier = GetKernelStakeModifier(pcoin->pindexFrom->GetBlockHash(), nTime, nStakeModifierV03, nStakeModifierHeight, nStakeModifierTime, false);
+                    nStateV03 = fStakeModifier ? STEP_V03 : STEP_NONE;
+                }
+                if (nStateV03 != STEP_V03)
+                    continue;
+                nStakeModifier = nStakeModifierV03;
+            }
+            else
+                continue;
+
+            CStakeKernel kernel;
+            kernel.nStakeModifier = nStakeModifier;
+            kernel.nTimeBlockFrom = pcoin->nTimeBlockFrom;
+            kernel.nTxPrevOffset = pcoin->nTxPrevOffset;
+            kernel.nTimeTxPrev = pcoin->nTimeTxPrev;
+            kernel.nPrevout = nOut;
+            kernel.nTimeTx = nTime;
+            vKernels.push_back(kernel);
+            vBatch.push_back(make_pair(nCoin, n));
+            vTimeWeight.push_back(min((int64)nTime - pcoin->nTimeTxPrev, (int64)STAKE_MAX_AGE) - nStakeMinAge);
+            vBatchCoins.push_back(pcoin);
+        }
+    }
+    return false;
+}
+
 // Check kernel hash target and coinstake signature
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake)
 {
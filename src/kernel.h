@@ -34,10 +34,68 @@ bool IsProtocolV05(unsigned int nTimeTx);
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexCurrent, uint64& nStakeModifier, bool& fGeneratedStakeModifier);
 
+// Stake modifier cache of GetKernelStakeModifier()
+extern std::atomic<uint64> nStakeModifierCacheHits;
+extern std::atomic<uint64> nStakeModifierCacheMisses;
+unsigned int GetStakeModifierCacheSize();
+// Drop the cached modifiers that depend on blocks above the fork of a reorganize
+void StakeModifierCacheReorganize(int nForkHeight);
+// Drop the cached v0.5 modifiers of best blocks other than hashBest
+void StakeModifierCacheSetBest(const uint256& hashBest);
+
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, bool fPrintProofOfStake=false);
 
+// The fields of a v0.3 stake kernel, hashed in the order of CheckStakeKernelHash()
+struct CStakeKernel
+{
+    uint64 nStakeModifier;
+    unsigned int nTimeBlockFrom;
+    unsigned int nTxPrevOffset;
+    unsigned int nTimeTxPrev;
+    unsigned int nPrevout;
+    unsigned int nTimeTx;
+};
+
+// Double sha256 of a batch of kernels, using the multi-lane sha256 when the cpu has one
+void HashStakeKernels(const CStakeKernel* pkernels, uint256* phashes, unsigned int nCount);
+
+// Integer version of the CheckStakeKernelHash() target test:
+// hashProofOfStake <= targetPerCoinDay * (nValueIn * nTimeWeight / COIN / (24 * 60 * 60))
+bool CheckStakeKernelTarget(const uint256& hashProofOfStake, const uint256& targetPerCoinDay, int64 nValueIn, int64 nTimeWeight);
+
+// Kernel search for CreateCoinStake(). Keeps the kernel inputs of each coin between
+// rounds so a round is only hashing, and checks all (coin, timestamp) pairs in batches.
+class CStakeKernelSearch
+{
+private:
+    struct CStakeKernelCoin
+    {
+        const CBlockIndex* pindexFrom;
+        unsigned int nFile;
+        unsigned int nBlockPos;
+        unsigned int nTimeBlockFrom;
+        unsigned int nTxPrevOffset;
+        unsigned int nTimeTxPrev;
+        int64 nValue;
+    };
+
+    std::map<COutPoint, CStakeKernelCoin> mapCoins;
+
+    const CStakeKernelCoin* GetCoin(CTxDB& txdb, const CWalletTx& wtx, unsigned int nOut);
+    bool VerifyKernel(unsigned int nBits, const CStakeKernelCoin& coin, const CWalletTx& wtx, unsigned int nOut, unsigned int nTimeTx);
+
+public:
+    // Finds the first coin of vCoins, starting at nCoinStart, that has a kernel at one of
+    // nTimeTx, nTimeTx - 1, ... nTimeTx - nSearchSteps + 1, in the same order
+    // CreateCoinStake() used to try them. Coins younger than nStakeMinAge at
+    // nTimeTx - nMaxStakeSearchAge are skipped.
+    bool Search(unsigned int nBits, unsigned int nTimeTx, unsigned int nSearchSteps, unsigned int nMaxStakeSearchAge,
+                const std::vector<std::pair<const CWalletTx*, unsigned int> >& vCoins, unsigned int nCoinStart,
+                unsigned int& nCoinRet, unsigned int& nStepRet, unsigned int& nTimeBlockFromRet);
+};
+
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake);
@@ -0,0 +1,526 @@
+// Copyright (c) 2013-2014 The Slimcoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "kvstore.h"
+#include "serialize.h"
+
+#include <boost/crc.hpp>
+
+#ifdef WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// Log record: magic, payload size and crc32 of the payload, then the payload:
+// sequence number, number of writes, and per write the erase flag, the key and
+// unless erased the value
+static const unsigned int LOG_RECORD_MAGIC = 0x4b56534c;
+static const unsigned int LOG_RECORD_HEADER_SIZE = 12;
+
+// Rewrite the log once it is this many times the live data. Each compaction copies
+// the live data, so that costs at most half a byte per byte written, but the store
+// is locked while it runs.
+static const unsigned int LOG_COMPACT_RATIO = 3;
+
+static const uint64 SEQUENCE_LATEST = std::numeric_limits<uint64>::max();
+
+static bool SyncFile(FILE* file)
+{
+    if (fflush(file) != 0)
+        return false;
+#ifdef WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+struct CCloseFile
+{
+    void operator()(FILE* file) const
+    {
+        if (file)
+            fclose(file);
+    }
+};
+
+static boost::shared_ptr<FILE> OpenFile(const boost::filesystem::path& path, const char* pszMode)
+{
+    FILE* file = fopen(path.string().c_str(), pszMode);
+    if (!file)
+        return boost::shared_ptr<FILE>();
+    return boost::shared_ptr<FILE>(file, CCloseFile());
+}
+
+static bool ReadAt(FILE* file, uint64 nPos, char* pch, unsigned int nSize)
+{
+#ifdef WIN32
+    // callers hold the store lock on windows, there is no positioned read
+    if (fseeko64(file, nPos, SEEK_SET) != 0)
+        return false;
+    return fread(pch, 1, nSize, file) == nSize;
+#else
+    while (nSize > 0)
+    {
+        ssize_t nRead = pread(fileno(file), pch, nSize, nPos);
+        if (nRead <= 0)
+            return false;
+        pch += nRead;
+        nPos += nRead;
+        nSize -= nRead;
+    }
+    return true;
+#endif
+}
+
+
+class CLogKeyValueIterator : public CKeyValueIterator
+{
+private:
+    CLogKeyValueStore* pstore;
+    const CKeyValueSnapshot* psnapshot;
+    bool fOwnSnapshot;
+    bool fValid;
+    std::string strKey;
+    CLogKeyValueStore::CLogEntry entry;
+    boost::shared_ptr<FILE> file;
+
+    // First visible key at or after mi, the store lock is held
+    void SetVisible(std::map<std::string, std::vector<CLogKeyValueStore::CLogEntry> >::const_iterator mi)
+    {
+        for (; mi != pstore->mapIndex.end(); ++mi)
+        {
+            const CLogKeyValueStore::CLogEntry* pentry = pstore->FindEntry(mi->first, psnapshot->nSequence);
+            if (pentry)
+            {
+                strKey = mi->first;
+                entry = *pentry;
+                file = pstore->file;
+                fValid = true;
+                return;
+            }
+        }
+        fValid = false;
+    }
+
+public:
+    CLogKeyValueIterator(CLogKeyValueStore* pstoreIn, const CKeyValueSnapshot* psnapshotIn)
+    {
+        pstore = pstoreIn;
+        fOwnSnapshot = (psnapshotIn == NULL);
+        psnapshot = fOwnSnapshot ? pstore->GetSnapshot() : psnapshotIn;
+        fValid = false;
+    }
+
+    ~CLogKeyValueIterator()
+    {
+        if (fOwnSnapshot)
+            pstore->ReleaseSnapshot(psnapshot);
+    }
+
+    // The position is kept as a key rather than a map iterator, so writes that
+    // prune the index never leave the iterator dangling
+    void Seek(const std::string& strKeyIn)
+    {
+        LOCK(pstore->cs);
+        SetVisible(pstore->mapIndex.lower_bound(strKeyIn));
+    }
+
+    bool Valid() const
+    {
+        return fValid;
+    }
+
+    void Next()
+    {
+        LOCK(pstore->cs);
+        SetVisible(pstore->mapIndex.upper_bound(strKey));
+    }
+
+    const std::string& GetKey() const
+    {
+        return strKey;
+    }
+
+    bool GetValue(std::string& strValue)
+    {
+        return fValid && pstore->ReadValue(file, entry, strValue);
+    }
+};
+
+
+CLogKeyValueStore::CLogKeyValueStore(uint64 nCompactMinSizeIn)
+{
+    nCompactMinSize = nCompactMinSizeIn;
+    nFileSize = 0;
+    nLiveSize = 0;
+    nSequence = 0;
+}
+
+CLogKeyValueStore::~CLogKeyValueStore()
+{
+    if (file)
+        SyncFile(file.get());
+}
+
+bool CLogKeyValueStore::Open(const boost::filesystem::path& path)
+{
+    LOCK(cs);
+    boost::filesystem::create_directories(path);
+    pathLog = path / "txdb.log";
+
+    file = OpenFile(pathLog, "a+b");
+    if (!file)
+        return error("CLogKeyValueStore::Open() : cannot open %s", pathLog.string().c_str());
+
+    mapIndex.clear();
+    nFileSize = nLiveSize = nSequence = 0;
+    uint64 nValidSize = 0;
+    Replay(nValidSize);
+
+    uint64 nSize = boost::filesystem::file_size(pathLog);
+    if (nValidSize < nSize)
+    {
+        // torn write of the last batch before a crash
+        printf("CLogKeyValueStore::Open() : dropping %" PRI64u " bytes after the last complete batch of %s\n", nSize - nValidSize, pathLog.string().c_str());
+        file.reset();
+        boost::filesystem::resize_file(pathLog, nValidSize);
+        file = OpenFile(pathLog, "a+b");
+        if (!file)
+            return error("CLogKeyValueStore::Open() : cannot reopen %s", pathLog.string().c_str());
+    }
+    nFileSize = nValidSize;
+
+    if (NeedsCompact() && !Compact())
+        return error("CLogKeyValueStore::Open() : compacting %s failed", pathLog.string().c_str());
+
+    printf("CLogKeyValueStore::Open() : %s, %u keys, %" PRI64u " bytes of log, %" PRI64u " live\n",
+        pathLog.string().c_str(), (unsigned int)mapIndex.size(), nFileSize, nLiveSize);
+    return true;
+}
+
+// Rebuild the index from the log, stopping at the first incomplete or damaged record
+bool CLogKeyValueStore::Replay(uint64& nValidSize)
+{
+    nValidSize = 0;
+    if (fseek(file.get(), 0, SEEK_SET) != 0)
+        return false;
+
+    std::vector<char> vchPayload;
+    for (;;)
+    {
+        char pchHeader[LOG_RECORD_HEADER_SIZE];
+        if (fread(pchHeader, 1, sizeof(pchHeader), file.get()) != sizeof(pchHeader))
+            break;
+        unsigned int nMagic, nPayloadSize, nChecksum;
+        CDataStream ssHeader(pchHeader, pchHeader + sizeof(pchHeader), SER_DISK, CLIENT_VERSION);
+        ssHeader >> nMagic >> nPayloadSize >> nChecksum;
+        if (nMagic != LOG_RECORD_MAGIC)
+            break;
+
+        vchPayload.resize(nPayloadSize);
+        if (nPayloadSize && fread(&vchPayload[0], 1, nPayloadSize, file.get()) != nPayloadSize)
+            break;
+        boost::crc_32_type crc;
+        crc.process_bytes(nPayloadSize ? &vchPayload[0] : NULL, nPayloadSize);
+        if (crc.checksum() != nChecksum)
+            break;
+
+        uint64 nPosPayload = nValidSize + LOG_RECORD_HEADER_SIZE;
+        try {
+            CDataStream ssPayload(&vchPayload[0], &vchPayload[0] + nPayloadSize, SER_DISK, CLIENT_VERSION);
+            uint64 nRecordSequence;
+            ssPayload >> nRecordSequence;
+            uint64 nWrites = ReadCompactSize(ssPayload);
+            for (uint64 i = 0; i < nWrites; i++)
+            {
+                unsigned char fErase;
+                std::string strKey;
+                ssPayload >> fErase >> strKey;
+
+                CLogEntry entry;
+                entry.nSequence = nRecordSequence;
+                entry.fErased = fErase;
+                entry.nSize = 0;
+                entry.nPos = 0;
+                if (!fErase)
+                {
+                    entry.nSize = ReadCompactSize(ssPayload);
+                    entry.nPos = nPosPayload + (nPayloadSize - ssPayload.size());
+                    if (entry.nSize > ssPayload.size())
+                        throw std::runtime_error("value past the end of the record");
+                    ssPayload.ignore(entry.nSize);
+                }
+                AddEntry(strKey, entry);
+            }
+            nSequence = nRecordSequence;
+        }
+        catch (std::exception &e) {
+            break;
+        }
+        nValidSize = nPosPayload + nPayloadSize;
+    }
+    return true;
+}
+
+bool CLogKeyValueStore::NeedsCompact() const
+{
+    return nFileSize >= nCompactMinSize && nFileSize >= LOG_COMPACT_RATIO * nLiveSize;
+}
+
+// Write the live values to a new log and replace the old one with it. The index is
+// only pointed at the new log once it is complete, a failure leaves the store as it
+// was. Older versions of the keys are dropped, so there must be no open snapshots.
+bool CLogKeyValueStore::Compact()
+{
+    printf("CLogKeyValueStore::Compact() : rewriting %s, %" PRI64u " of %" PRI64u " bytes are live\n",
+        pathLog.string().c_str(), nLiveSize, nFileSize);
+    int64 nStart = GetTimeMillis();
+
+    boost::filesystem::path pathCompact = pathLog.string() + ".compact";
+    boost::shared_ptr<FILE> fileCompact = OpenFile(pathCompact, "w+b");
+    if (!fileCompact)
+        return false;
+
+    // the new value positions, in the order of mapIndex
+    uint64 nCompactSize = 0;
+    uint64 nCompactSequence = nSequence;
+    std::vector<uint64> vNewPos;
+    vNewPos.reserve(mapIndex.size());
+
+    bool fSuccess = true;
+    CKeyValueBatch batch;
+    std::vector<uint64> vValuePos;
+    for (std::map<std::string, std::vector<CLogEntry> >::iterator mi = mapIndex.begin(); fSuccess && mi != mapIndex.end(); ++mi)
+    {
+        const CLogEntry& entry = mi->second.back();
+        std::string strValue(entry.nSize, '\0');
+        if (entry.nSize && !ReadAt(file.get(), entry.nPos, &strValue[0], entry.nSize))
+            fSuccess = false;
+        batch.WriteSwap(mi->first, strValue);
+
+        if (batch.nDataSize > 4 * 1024 * 1024)
+        {
+            fSuccess = fSuccess && WriteRecord(fileCompact.get(), pathCompact, nCompactSize, ++nCompactSequence, batch, vValuePos);
+            vNewPos.insert(vNewPos.end(), vValuePos.begin(), vValuePos.end());
+            batch.Clear();
+        }
+    }
+    if (fSuccess && !batch.IsEmpty())
+    {
+        fSuccess = WriteRecord(fileCompact.get(), pathCompact, nCompactSize, ++nCompactSequence, batch, vValuePos);
+        vNewPos.insert(vNewPos.end(), vValuePos.begin(), vValuePos.end());
+    }
+    fSuccess = fSuccess && SyncFile(fileCompact.get());
+    fileCompact.reset();
+    if (!fSuccess)
+    {
+        boost::filesystem::remove(pathCompact);
+        return false;
+    }
+
+    // readers still holding the old log keep it open, windows reads take cs so
+    // there are none there and the rename can replace it
+    file.reset();
+    if (!RenameOver(pathCompact, pathLog))
+    {
+        boost::filesystem::remove(pathCompact);
+        file = OpenFile(pathLog, "a+b");
+        return false;
+    }
+    file = OpenFile(pathLog, "a+b");
+    if (!file)
+        return error("CLogKeyValueStore::Compact() : cannot reopen %s", pathLog.string().c_str());
+
+    unsigned int nKey = 0;
+    for (std::map<std::string, std::vector<CLogEntry> >::iterator mi = mapIndex.begin(); mi != mapIndex.end(); ++mi)
+        mi->second.back().nPos = vNewPos[nKey++];
+    nFileSize = nCompactSize;
+    nSequence = nCompactSequence;
+
+    printf("CLogKeyValueStore::Compact() : %" PRI64u " bytes in %" PRI64d " ms\n", nFileSize, GetTimeMillis() - nStart);
+    return true;
+}
+
+// Append a record of batch to fileTo, which is nSizeTo bytes, and return where its values are
+bool CLogKeyValueStore::WriteRecord(FILE* fileTo, const boost::filesystem::path& pathTo, uint64& nSizeTo, uint64 nRecordSequence,
+                                    const CKeyValueBatch& batch, std::vector<uint64>& vValuePos)
+{
+    CDataStream ssPayload(SER_DISK, CLIENT_VERSION);
+    ssPayload.reserve(batch.nDataSize + 16 * batch.GetCount() + 16);
+    std::vector<unsigned int> vValueOffset;
+    vValueOffset.reserve(batch.GetCount());
+    ssPayload << nRecordSequence;
+    WriteCompactSize(ssPayload, batch.mapWrites.size());
+    for (std::map<std::string, std::pair<bool, std::string> >::const_iterator mi = batch.mapWrites.begin(); mi != batch.mapWrites.end(); ++mi)
+    {
+        ssPayload << (unsigned char)mi->second.first << mi->first;
+        if (!mi->second.first)
+        {
+            WriteCompactSize(ssPayload, mi->second.second.size());
+            vValueOffset.push_back(ssPayload.size());
+            ssPayload.write(mi->second.second.data(), mi->second.second.size());
+        }
+    }
+
+    boost::crc_32_type crc;
+    crc.process_bytes(&ssPayload[0], ssPayload.size());
+    CDataStream ssHeader(SER_DISK, CLIENT_VERSION);
+    ssHeader << LOG_RECORD_MAGIC << (unsigned int)ssPayload.size() << (unsigned int)crc.checksum();
+
+    if (fwrite(&ssHeader[0], 1, ssHeader.size(), fileTo) != ssHeader.size() ||
+        fwrite(&ssPayload[0], 1, ssPayload.size(), fileTo) != ssPayload.size() ||
+        fflush(fileTo) != 0)
+    {
+        // cut the partial record off, or replay would stop at it and lose what follows
+        boost::filesystem::resize_file(pathTo, nSizeTo);
+        return error("CLogKeyValueStore : writing to %s failed", pathTo.string().c_str());
+    }
+
+    vValuePos.clear();
+    for (unsigned int i = 0; i < vValueOffset.size(); i++)
+        vValuePos.push_back(nSizeTo + ssHeader.size() + vValueOffset[i]);
+    nSizeTo += ssHeader.size() + ssPayload.size();
+    return true;
+}
+
+bool CLogKeyValueStore::AppendRecord(const CKeyValueBatch& batch, std::vector<uint64>& vValuePos)
+{
+    if (!WriteRecord(file.get(), pathLog, nFileSize, nSequence + 1, batch, vValuePos))
+        return false;
+
+    unsigned int nValue = 0;
+    nSequence++;
+    for (std::map<std::string, std::pair<bool, std::string> >::const_iterator mi = batch.mapWrites.begin(); mi != batch.mapWrites.end(); ++mi)
+    {
+        CLogEntry entry;
+        entry.nSequence = nSequence;
+        entry.fErased = mi->second.first;
+        entry.nPos = entry.fErased ? 0 : vValuePos[nValue++];
+        entry.nSize = entry.fErased ? 0 : mi->second.second.size();
+        AddEntry(mi->first, entry);
+    }
+    return true;
+}
+
+void CLogKeyValueStore::AddEntry(const std::string& strKey, const CLogEntry& entry)
+{
+    std::vector<CLogEntry>& vEntries = mapIndex[strKey];
+    if (!vEntries.empty() && !vEntries.back().fErased)
+        nLiveSize -= strKey.size() + vEntries.back().nSize;
+    if (!entry.fErased)
+        nLiveSize += strKey.size() + entry.nSize;
+    vEntries.push_back(entry);
+
+    // keep an older version only while a snapshot sees it
+    if (setSnapshots.empty())
+        vEntries.erase(vEntries.begin(), vEntries.end() - 1);
+    else if (vEntries.size() > 1)
+    {
+        std::vector<CLogEntry> vKeep;
+        for (unsigned int i = 0; i + 1 < vEntries.size(); i++)
+        {
+            std::multiset<uint64>::const_iterator it = setSnapshots.lower_bound(vEntries[i].nSequence);
+            if (it != setSnapshots.end() && *it < vEntries[i + 1].nSequence)
+                vKeep.push_back(vEntries[i]);
+        }
+        vKeep.push_back(vEntries.back());
+        vEntries.swap(vKeep);
+    }
+
+    if (vEntries.size() == 1 && vEntries[0].fErased)
+        mapIndex.erase(strKey);
+}
+
+const CLogKeyValueStore::CLogEntry* CLogKeyValueStore::FindEntry(const std::string& strKey, uint64 nSnapshot) const
+{
+    std::map<std::string, std::vector<CLogEntry> >::const_iterator mi = mapIndex.find(strKey);
+    if (mi == mapIndex.end())
+        return NULL;
+    for (std::vector<CLogEntry>::const_reverse_iterator it = mi->second.rbegin(); it != mi->second.rend(); ++it)
+        if (it->nSequence <= nSnapshot)
+            return it->fErased ? NULL : &*it;
+    return NULL;
+}
+
+bool CLogKeyValueStore::ReadValue(const boost::shared_ptr<FILE>& fileFrom, const CLogEntry& entry, std::string& strValue)
+{
+    strValue.resize(entry.nSize);
+    if (entry.nSize == 0)
+        return true;
+#ifdef WIN32
+    LOCK(cs);
+#endif
+    return fileFrom && ReadAt(fileFrom.get(), entry.nPos, &strValue[0], entry.nSize);
+}
+
+bool CLogKeyValueStore::Read(const std::string& strKey, std::string& strValue, const CKeyValueSnapshot* psnapshot)
+{
+    CLogEntry entry;
+    boost::shared_ptr<FILE> fileFrom;
+    {
+        LOCK(cs);
+        const CLogEntry* pentry = FindEntry(strKey, psnapshot ? psnapshot->nSequence : SEQUENCE_LATEST);
+        if (!pentry)
+            return false;
+        entry = *pentry;
+        fileFrom = file;
+    }
+    return ReadValue(fileFrom, entry, strValue);
+}
+
+bool CLogKeyValueStore::Exists(const std::string& strKey, const CKeyValueSnapshot* psnapshot)
+{
+    LOCK(cs);
+    return FindEntry(strKey, psnapshot ? psnapshot->nSequence : SEQUENCE_LATEST) != NULL;
+}
+
+bool CLogKeyValueStore::WriteBatch(const CKeyValueBatch& batch, bool fSync)
+{
+    LOCK(cs);
+    if (!file)
+        return false;
+    std::vector<uint64> vValuePos;
+    if (!batch.IsEmpty() && !AppendRecord(batch, vValuePos))
+        return false;
+    if (fSync && !SyncFile(file.get()))
+        return false;
+
+    // a snapshot still sees older versions, the next write tries again
+    if (setSnapshots.empty() && NeedsCompact() && !Compact())
+        printf("CLogKeyValueStore::WriteBatch() : compacting %s failed, going on with the old log\n", pathLog.string().c_str());
+    return true;
+}
+
+const CKeyValueSnapshot* CLogKeyValueStore::GetSnapshot()
+{
+    LOCK(cs);
+    setSnapshots.insert(nSequence);
+    return new CKeyValueSnapshot(nSequence);
+}
+
+void CLogKeyValueStore::ReleaseSnapshot(const CKeyValueSnapshot* psnapshot)
+{
+    {
+        LOCK(cs);
+        std::multiset<uint64>::iterator it = setSnapshots.find(psnapshot->nSequence);
+        if (it != setSnapshots.end())
+            setSnapshots.erase(it);
+    }
+    delete psnapshot;
+}
+
+CKeyValueIterator* CLogKeyValueStore::NewIterator(const CKeyValueSnapshot* psnapshot)
+{
+    return new CLogKeyValueIterator(this, psnapshot);
+}
+
+bool CLogKeyValueStore::Flush()
+{
+    LOCK(cs);
+    return file && SyncFile(file.get());
+}
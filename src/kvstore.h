@@ -0,0 +1,222 @@
+// Copyright (c) 2013-2014 The Slimcoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef SLIMCOIN_KVSTORE_H
+#define SLIMCOIN_KVSTORE_H
+
+#include "util.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/shared_ptr.hpp>
+
+/** Writes that a key value store applies all at once or not at all. The writes
+ * are kept sorted by key, so a store applies them in one ordered pass.
+ */
+class CKeyValueBatch
+{
+public:
+    // key -> (fErase, value), a later write of a key replaces the earlier one
+    std::map<std::string, std::pair<bool, std::string> > mapWrites;
+    // bytes of the keys and values in mapWrites
+    uint64 nDataSize;
+
+    CKeyValueBatch() : nDataSize(0) { }
+
+    void Write(const std::string& strKey, const std::string& strValue)
+    {
+        std::pair<bool, std::string>& write = Insert(strKey);
+        write.first = false;
+        write.second = strValue;
+        nDataSize += strValue.size();
+    }
+
+    // Write that takes over the contents of strValue instead of copying it
+    void WriteSwap(const std::string& strKey, std::string& strValue)
+    {
+        std::pair<bool, std::string>& write = Insert(strKey);
+        write.first = false;
+        write.second.swap(strValue);
+        nDataSize += write.second.size();
+    }
+
+    void Erase(const std::string& strKey)
+    {
+        Insert(strKey).first = true;
+    }
+
+    // 1 if the batch writes the key, 0 if it erases it, -1 if it does not touch it
+    int Read(const std::string& strKey, std::string& strValue) const
+    {
+        std::map<std::string, std::pair<bool, std::string> >::const_iterator mi = mapWrites.find(strKey);
+        if (mi == mapWrites.end())
+            return -1;
+        if (mi->second.first)
+            return 0;
+        strValue = mi->second.second;
+        return 1;
+    }
+
+    // Apply the writes of a later batch on top of this one, leaving it empty
+    void Append(CKeyValueBatch& batch)
+    {
+        if (IsEmpty())
+        {
+            mapWrites.swap(batch.mapWrites);
+            std::swap(nDataSize, batch.nDataSize);
+            return;
+        }
+        for (std::map<std::string, std::pair<bool, std::string> >::iterator mi = batch.mapWrites.begin(); mi != batch.mapWrites.end(); ++mi)
+        {
+            std::pair<bool, std::string>& write = Insert(mi->first);
+            write.first = mi->second.first;
+            write.second.swap(mi->second.second);
+            nDataSize += write.second.size();
+        }
+        batch.Clear();
+    }
+
+    unsigned int GetCount() const { return mapWrites.size(); }
+    bool IsEmpty() const { return mapWrites.empty(); }
+    void Clear() { mapWrites.clear(); nDataSize = 0; }
+
+private:
+    // the entry of strKey with its old value cleared
+    std::pair<bool, std::string>& Insert(const std::string& strKey)
+    {
+        std::map<std::string, std::pair<bool, std::string> >::iterator mi = mapWrites.lower_bound(strKey);
+        if (mi != mapWrites.end() && mi->first == strKey)
+        {
+            nDataSize -= mi->second.second.size();
+            mi->second.second.clear();
+            return mi->second;
+        }
+        nDataSize += strKey.size();
+        return mapWrites.insert(mi, std::make_pair(strKey, std::make_pair(false, std::string())))->second;
+    }
+};
+
+/** Consistent read-only view of a store as of the time it was taken */
+class CKeyValueSnapshot
+{
+public:
+    uint64 nSequence;
+
+    CKeyValueSnapshot(uint64 nSequenceIn) : nSequence(nSequenceIn) { }
+};
+
+/** Ordered walk over the keys of a store */
+class CKeyValueIterator
+{
+public:
+    virtual ~CKeyValueIterator() { }
+
+    // Position at the first key not less than strKey
+    virtual void Seek(const std::string& strKey) = 0;
+    virtual bool Valid() const = 0;
+    virtual void Next() = 0;
+    virtual const std::string& GetKey() const = 0;
+    virtual bool GetValue(std::string& strValue) = 0;
+};
+
+/** Storage under CTxDB. Keys and values are serialized byte strings. */
+class CKeyValueStore
+{
+public:
+    virtual ~CKeyValueStore() { }
+
+    virtual std::string GetName() const = 0;
+
+    // Reads see the latest data, or the data as of psnapshot
+    virtual bool Read(const std::string& strKey, std::string& strValue, const CKeyValueSnapshot* psnapshot=NULL) = 0;
+    virtual bool Exists(const std::string& strKey, const CKeyValueSnapshot* psnapshot=NULL) = 0;
+
+    // Atomic write. With fSync the batch is on disk when this returns, otherwise
+    // it survives a crash of the process but maybe not of the machine.
+    virtual bool WriteBatch(const CKeyValueBatch& batch, bool fSync=false) = 0;
+
+    virtual const CKeyValueSnapshot* GetSnapshot() = 0;
+    virtual void ReleaseSnapshot(const CKeyValueSnapshot* psnapshot) = 0;
+
+    // The iterator is owned by the caller. Without a snapshot it takes its own, so
+    // it walks a consistent view even while others write.
+    virtual CKeyValueIterator* NewIterator(const CKeyValueSnapshot* psnapshot=NULL) = 0;
+
+    // Make all written batches durable
+    virtual bool Flush() = 0;
+};
+
+
+/** Log structured store. Every batch is appended to a single log file as one
+ * checksummed record, and an in-memory ordered index maps each key to where its
+ * value is in the log. Writes are sequential appends, reads are one positioned
+ * read. Replaying the log at startup rebuilds the index and drops a torn last
+ * record. Once most of the log is old values, the write that pushes it over
+ * is followed by rewriting the log with only the live ones.
+ *
+ * The index holds every live key in memory, the key plus about 64 bytes of map
+ * node and entry each. For the transaction database that is in the order of the
+ * number of transactions with unspent outputs.
+ */
+class CLogKeyValueStore : public CKeyValueStore
+{
+private:
+    // one version of a key; versions older than the latest are kept while a
+    // snapshot can still see them
+    struct CLogEntry
+    {
+        uint64 nSequence;
+        uint64 nPos;
+        unsigned int nSize;
+        bool fErased;
+    };
+
+    CCriticalSection cs;
+    boost::filesystem::path pathLog;
+    // the log; readers take a reference under cs and read without it, so a
+    // compaction that replaces the file never closes it under them
+    boost::shared_ptr<FILE> file;
+    uint64 nCompactMinSize;
+    uint64 nFileSize;
+    uint64 nLiveSize;
+    uint64 nSequence;
+    std::map<std::string, std::vector<CLogEntry> > mapIndex;
+    std::multiset<uint64> setSnapshots;
+
+    bool Replay(uint64& nValidSize);
+    bool NeedsCompact() const;
+    bool Compact();
+    bool WriteRecord(FILE* fileTo, const boost::filesystem::path& pathTo, uint64& nSizeTo, uint64 nRecordSequence,
+                     const CKeyValueBatch& batch, std::vector<uint64>& vValuePos);
+    bool AppendRecord(const CKeyValueBatch& batch, std::vector<uint64>& vValuePos);
+    void AddEntry(const std::string& strKey, const CLogEntry& entry);
+    const CLogEntry* FindEntry(const std::string& strKey, uint64 nSnapshot) const;
+    bool ReadValue(const boost::shared_ptr<FILE>& fileFrom, const CLogEntry& entry, std::string& strValue);
+
+    friend class CLogKeyValueIterator;
+
+public:
+    // the log is not compacted below this size
+    static const uint64 COMPACT_MIN_SIZE = 64 * 1024 * 1024;
+
+    CLogKeyValueStore(uint64 nCompactMinSizeIn=COMPACT_MIN_SIZE);
+    ~CLogKeyValueStore();
+
+    // Opens or creates the log in directory path
+    bool Open(const boost::filesystem::path& path);
+
+    std::string GetName() const { return "log"; }
+    bool Read(const std::string& strKey, std::string& strValue, const CKeyValueSnapshot* psnapshot=NULL);
+    bool Exists(const std::string& strKey, const CKeyValueSnapshot* psnapshot=NULL);
+    bool WriteBatch(const CKeyValueBatch& batch, bool fSync=false);
+    const CKeyValueSnapshot* GetSnapshot();
+    void ReleaseSnapshot(const CKeyValueSnapshot* psnapshot);
+    CKeyValueIterator* NewIterator(const CKeyValueSnapshot* psnapshot=NULL);
+    bool Flush();
+};
+
+#endif // SLIMCOIN_KVSTORE_H
@@ -17,6 +17,12 @@
 #include <math.h>       /* pow */
 #include <cstdlib>      /* std::rand() */
 
+#ifndef WIN32
+#include <fcntl.h>      /* fallocate() */
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "dcrypt.h"
 
 using namespace std;
@@ -34,7 +40,8 @@ CCriticalSection cs_main;
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
+CBlockIndexArena blockIndexArena(sizeof(CBlockIndex));
 uint256 hashGenesisBlock = hashGenesisBlockOfficial;
 static CBigNum bnProofOfWorkLimit(~uint256(0) >> 20); //5 preceding 0s, 20/4 since every hex = 4 bits
 static CBigNum bnProofOfBurnLimit(~uint256(0) >> 16); //4 preceding 0s, 16/4 since every hex = 4 bits
@@ -103,6 +110,13 @@ const string strMessageMagic = "SLIMCoin Signed Message:\n";
 double dHashesPerSec;
 int64 nHPSTimerStart;
 
+// dcrypt hashes of block headers done by CBlock::GetHash, and the ones its cache avoided
+std::atomic<uint64> nBlockHashesComputed(0);
+std::atomic<uint64> nBlockHashesCached(0);
+// guards the hash cache of every CBlock, a block like the miner template is hashed
+// from several threads at once; only the memcmp and copy run under it, not dcrypt
+CCriticalSection cs_blockHashCache;
+
 // Settings
 int64 nTransactionFee = MIN_TX_FEE;
 int64 nReserveBalance;
@@ -350,7 +364,7 @@ bool CTransaction::ReadFromDisk(CTxDB& txdb, const uint256& hash, CTxIndex& txin
     SetNull();
     if (!txdb.ReadTxIndex(hash, txindexRet))
          return false;
-    if (!ReadFromDisk(txindexRet.pos))
+    if (!txdb.ReadCachedTx(hash, txindexRet.pos, *this))
          return false;
     return true;
 }
@@ -562,7 +576,10 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
             CTxIndex txindex;
             if (!CTxDB("r").ReadTxIndex(GetHash(), txindex))
                 return 0;
-            if (!blockTmp.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos))
+            if (!blockTmp.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+                return 0;
+            BlockMap::iterator mi = mapBlockIndex.find(blockTmp.GetHash());
+            if (mi == mapBlockIndex.end() || !blockTmp.ReadFromDisk(mi->second))
                 return 0;
             pblock = &blockTmp;
         }
@@ -587,7 +604,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -867,7 +884,7 @@ int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -966,7 +983,7 @@ int CTxIndex::GetDepthInMainChain() const
     if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
         return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -987,6 +1004,8 @@ bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions, boo
         *this = pindex->GetBlockHeader();
         return true;
     }
+    if (IsBlockPruned(pindex))
+        return error("CBlock::ReadFromDisk() : block %d was pruned", pindex->nHeight);
     if (!ReadFromDisk(pindex->nFile, pindex->nBlockPos, fReadTransactions, fCheckValidity))
         return false;
     if (fCheckValidity && GetHash() != pindex->GetBlockHash())
@@ -1342,7 +1361,7 @@ bool CBlock::CheckProofOfBurn() const
 
     //Get prev block index, this may fail durining initial block download,
     // if the previous block has not been received yet
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end() || !mi->second)
         return error("CheckProofOfBurn() : INFO: prev block not found");
 
@@ -1353,15 +1372,24 @@ bool CBlock::CheckProofOfBurn() const
     if (!pindexByHeight(pindexPrev->nHeight))
         return DoS(1, error("CheckProofOfBurn() : INFO: prev block not in main chain"));
 
+    if (burnBlkHeight < 0 || burnCTx < 0 || burnCTxOut < 0)
+        return DoS(100, error("CheckProofOfBurn() : burn indexes %d:%d:%d are invalid", burnBlkHeight, burnCTx, burnCTxOut));
+
     CBlockIndex *pBurnIndex = pindexByHeight(burnBlkHeight);
     if (!pBurnIndex)
         return DoS(1, error("CheckProofOfBurn() : INFO: burn block not found"));
 
     //failure to read a burn block may occur durring the initial block download
-    CBlock burnBlock;
-    //Read the block
-    if (!burnBlock.ReadFromDisk(pBurnIndex))
+    uint256 hashBurnTxBlock;
+    CTransaction burnTx;
+    CTxOut burnTxOut;
+    bool fMalformed = false;
+    if (!GetBurnTxByIndex(burnBlkHeight, burnCTx, burnCTxOut, hashBurnTxBlock, burnTx, burnTxOut, &fMalformed))
+    {
+        if (fMalformed)
+            return DoS(100, error("CheckProofOfBurn() : %d:%d:%d is not a burn output", burnBlkHeight, burnCTx, burnCTxOut));
         return DoS(1, error("CheckProofOfBurn() : INFO: prev block cannot be read"));
+    }
 
     //the previous block must be a PoW block
     if (!pindexPrev->IsProofOfWork())
@@ -1439,22 +1467,12 @@ void CBlock::UpdateTime(const CBlockIndex* pindexPrev)
     nTime = max(GetBlockTime(), GetAdjustedTime());
 }
 
-static CBlockIndex* pblockindexFBBHLast;
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    if (nHeight == 0)
+        return pindexGenesisBlock;
+
+    return pindexByHeight(nHeight);
 }
 
 
@@ -1553,7 +1571,7 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
         else
         {
             // Get prev tx from disk
-            if (!txPrev.ReadFromDisk(txindex.pos))
+            if (!txdb.ReadCachedTx(prevout.hash, txindex.pos, txPrev))
                 return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
         }
     }
@@ -1782,8 +1800,22 @@ bool CTransaction::ClientConnectInputs()
 
 
 
+static bool HasBurnOutput(const CTransaction &tx);
+
 bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
+    // needs the tx index of the inputs before DisconnectInputs() touches it
+    if (fAddressIndex && !AddressIndexDisconnectBlock(txdb, *this, pindex))
+        return error("DisconnectBlock() : AddressIndexDisconnectBlock failed");
+    if (!TxMessageIndexDisconnectBlock(txdb, *this, pindex))
+        return error("DisconnectBlock() : TxMessageIndexDisconnectBlock failed");
+
+    // slimcoin: the burn transactions of the block are no longer in the best chain
+    const uint256 hashBlock = pindex->GetBlockHash();
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        if (HasBurnOutput(vtx[i]) && !txdb.EraseBurnTxLocation(hashBlock, i))
+            return error("DisconnectBlock() : EraseBurnTxLocation failed");
+
     // Disconnect in reverse order
     for (int i = vtx.size()-1; i >= 0; i--)
         if (!vtx[i].DisconnectInputs(txdb))
@@ -1809,7 +1841,7 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
     // Check it again in case a previous version let a bad block in
-    if (!CheckBlock())
+    if (!fChecked && !CheckBlock())
         return false;
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
@@ -1848,6 +1880,8 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     int64 nValueIn = 0;
     int64 nValueOut = 0;
     unsigned int nSigOps = 0;
+    const uint256 hashBlock = pindex->GetBlockHash();
+    s32int nTx = 0;
     BOOST_FOREACH(CTransaction& tx, vtx)
     {
         nSigOps += tx.GetLegacySigOpCount();
@@ -1857,6 +1891,16 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
         CDiskTxPos posThisTx(pindex->nFile, pindex->nBlockPos, nTxPos);
         nTxPos += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
 
+        // slimcoin: remember where burn transactions are for the proof-of-burn checks
+        if (HasBurnOutput(tx))
+        {
+            CBurnTxLocation location;
+            location.hashTx = tx.GetHash();
+            location.pos = posThisTx;
+            if (!txdb.WriteBurnTxLocation(hashBlock, nTx, location))
+                return error("ConnectBlock() : WriteBurnTxLocation failed");
+        }
+
         MapPrevTx mapInputs;
         if (tx.IsCoinBase())
             nValueOut += tx.GetValueOut();
@@ -1887,9 +1931,20 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
                 return false;
         }
 
-        mapQueuedChanges[tx.GetHash()] = CTxIndex(posThisTx, tx.vout.size());
+        if (fAddressIndex && !AddressIndexConnectTx(txdb, tx, mapInputs, pindex->nHeight, nTx))
+            return error("ConnectBlock() : AddressIndexConnectTx failed");
+        nTx++;
+
+        uint256 hashTx = tx.GetHash();
+        mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
+
+        // the next blocks are likely to spend it
+        txdb.CacheTx(hashTx, posThisTx, tx);
     }
 
+    if (!TxMessageIndexConnectBlock(txdb, *this, pindex))
+        return error("ConnectBlock() : TxMessageIndexConnectBlock failed");
+
     // ppcoin: track money supply and mint amount info
     pindex->nMint = nValueOut - nValueIn + nFees;
     pindex->nMoneySupply = (pindex->pprev? pindex->pprev->nMoneySupply : 0) + nValueOut - nValueIn;
@@ -1983,8 +2038,7 @@ bool Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
             return error("Reorganize() : ReadFromDisk for connect failed");
         if (!block.ConnectBlock(txdb, pindex))
         {
-            // Invalid block
-            txdb.TxnAbort();
+            // Invalid block, SetBestChain() drops the batch
             return error("Reorganize() : ConnectBlock %s failed", pindex->GetBlockHash().ToString().substr(0,20).c_str());
         }
 
@@ -1996,7 +2050,9 @@ bool Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     if (!txdb.WriteHashBestChain(pindexNew->GetBlockHash()))
         return error("Reorganize() : WriteHashBestChain failed");
 
-    // Make sure it's successfully written to disk before changing memory structure
+    // Make sure it's successfully written to disk before changing memory structure.
+    // All the disconnects and connects above are one batch, the store gets the
+    // whole reorganize or none of it.
     if (!txdb.TxnCommit())
         return error("Reorganize() : TxnCommit failed");
 
@@ -2010,6 +2066,9 @@ bool Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         if (pindex->pprev)
             pindex->pprev->pnext = pindex;
 
+    // Cached stake modifiers above the fork were found through the old branch
+    StakeModifierCacheReorganize(pfork->nHeight);
+
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect)
         tx.AcceptToMemoryPool(txdb, false);
@@ -2125,6 +2184,8 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
+    SetBestChainIndex(pindexNew);
+    StakeModifierCacheSetBest(hashBestChain);
     nBestHeight = pindexBest->nHeight;
     bnBestChainTrust = pindexNew->bnChainTrust;
     nTimeBestReceived = GetTime();
@@ -2233,7 +2294,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         return error("AddToBlockIndex() : new CBlockIndex failed");
 
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
@@ -2266,7 +2327,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         return error("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=0x%016llx, modifierChecksum 0x%09x", pindexNew->nHeight, nStakeModifier, pindexNew->nStakeModifierChecksum);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(pindexNew->GetProofOfStake());
     else if (pindexNew->IsProofOfBurn())
@@ -2413,7 +2474,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
 
@@ -2575,6 +2636,8 @@ CBigNum CBlockIndex::GetBlockTrust() const
         return (IsProofOfStake() ? (CBigNum(1) << 256) / (bnTarget + 1) : 1);
     }
 }
+static void AddToBlockCache(const uint256& hash, const CSendBufferRef& pmsg);
+
 bool ProcessBlock(CNode* pfrom, CBlock *pblock)
 {
     // Check for duplicate
@@ -2603,7 +2666,7 @@ bool ProcessBlock(CNode* pfrom, CBlock *pblock)
                                  hash.ToString().c_str());
 
     // Preliminary checks
-    if (!pblock->CheckBlock())
+    if (!pblock->fChecked && !pblock->CheckBlock())
         return error("ProcessBlock() : CheckBlock FAILED");
 
     // slimcoin: verify hash target and signature of coinstake tx
@@ -2732,6 +2795,10 @@ bool ProcessBlock(CNode* pfrom, CBlock *pblock)
     if (!pblock->AcceptBlock())
         return error("ProcessBlock() : AcceptBlock FAILED");
 
+    // the peers it is announced to will ask for it
+    if (nBlockCacheMaxSize > 0 && !IsInitialBlockDownload())
+        AddToBlockCache(hash, SerializeMessage("block", *pblock, PROTOCOL_VERSION));
+
     // Recursively process any orphan blocks that depended on this one
     vector<uint256> vWorkQueue;
     vWorkQueue.push_back(hash);
@@ -2823,7 +2890,7 @@ bool CBlock::CheckBurnEffectiveCoins(int64 *calcEffCoinsRet) const
 
     CBlockIndex *pindexPrev;
 
-    std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi != mapBlockIndex.end())
         pindexPrev = mapBlockIndex[hashPrevBlock];
     else
@@ -2931,6 +2998,394 @@ FILE* AppendBlockFile(unsigned int& nFileRet)
     }
 }
 
+//
+// Cache of "block" messages for getdata (-blockcachesize). Most peers ask for a new
+// block within seconds of each other, they are all served the same buffer. A block
+// that isn't cached is read from the block file as it is, the disk and the network
+// serialization of a block being the same, and goes out without being unserialized
+// and serialized again. Blocks accepted while in sync are cached right away. The
+// least recently served block goes first.
+//
+
+int64 nBlockCacheMaxSize = 0;
+
+static CCriticalSection cs_blockCache;
+typedef list<pair<uint256, CSendBufferRef> > BlockCacheList;
+static BlockCacheList listBlockCache; // most recently served first
+static map<uint256, BlockCacheList::iterator> mapBlockCache;
+static uint64 nBlockCacheSize = 0;
+static uint64 nBlockCacheHits = 0;
+static uint64 nBlockCacheMisses = 0;
+
+static void AddToBlockCache(const uint256& hash, const CSendBufferRef& pmsg)
+{
+    LOCK(cs_blockCache);
+    if ((int64)pmsg->size() > nBlockCacheMaxSize || mapBlockCache.count(hash))
+        return;
+    listBlockCache.push_front(make_pair(hash, pmsg));
+    mapBlockCache[hash] = listBlockCache.begin();
+    nBlockCacheSize += pmsg->size();
+
+    while (nBlockCacheSize > (uint64)nBlockCacheMaxSize)
+    {
+        nBlockCacheSize -= listBlockCache.back().second->size();
+        mapBlockCache.erase(listBlockCache.back().first);
+        listBlockCache.pop_back();
+    }
+}
+
+static bool ReadBlockFileBytes(unsigned int nFile, unsigned int nPos, char* pch, unsigned int nSize)
+{
+    boost::shared_ptr<CMappedBlockFile> pfile = blockStore.GetFile(nFile, (uint64)nPos + nSize);
+    if (pfile)
+    {
+        memcpy(pch, pfile->pdata + nPos, nSize);
+        return true;
+    }
+
+    FILE* file = OpenBlockFile(nFile, nPos, "rb");
+    if (!file)
+        return false;
+    bool fRet = (fread(pch, 1, nSize, file) == nSize);
+    fclose(file);
+    return fRet;
+}
+
+// The "block" message of pindex, with the block copied out of the block file
+static CSendBufferRef ReadBlockMessage(const CBlockIndex* pindex)
+{
+    if (IsBlockPruned(pindex) || pindex->nBlockPos < 8)
+        return CSendBufferRef();
+
+    // the block file has the message start and the size in front of every block
+    char pchPrefix[8];
+    if (!ReadBlockFileBytes(pindex->nFile, pindex->nBlockPos - 8, pchPrefix, sizeof(pchPrefix)))
+    {
+        error("ReadBlockMessage() : reading block %s failed", pindex->GetBlockHash().ToString().substr(0,20).c_str());
+        return CSendBufferRef();
+    }
+    unsigned char pchMessageStart[4];
+    GetMessageStart(pchMessageStart, true);
+    unsigned int nSize;
+    memcpy(&nSize, pchPrefix + 4, sizeof(nSize));
+    if (memcmp(pchPrefix, pchMessageStart, sizeof(pchMessageStart)) != 0 || nSize > MAX_BLOCK_SIZE)
+    {
+        error("ReadBlockMessage() : no block %s at %u:%u", pindex->GetBlockHash().ToString().substr(0,20).c_str(), pindex->nFile, pindex->nBlockPos);
+        return CSendBufferRef();
+    }
+
+    boost::shared_ptr<CSerializeData> pdata(new CSerializeData(CMessageHeader::HEADER_SIZE + nSize));
+    char* pchBlock = &(*pdata)[CMessageHeader::HEADER_SIZE];
+    if (!ReadBlockFileBytes(pindex->nFile, pindex->nBlockPos, pchBlock, nSize))
+    {
+        error("ReadBlockMessage() : reading block %s failed", pindex->GetBlockHash().ToString().substr(0,20).c_str());
+        return CSendBufferRef();
+    }
+
+    CMessageHeader hdr("block", nSize);
+    uint256 hash = Hash(pchBlock, pchBlock + nSize);
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+    ssHeader << hdr;
+    memcpy(&(*pdata)[0], &ssHeader[0], CMessageHeader::HEADER_SIZE);
+    return pdata;
+}
+
+CSendBufferRef GetBlockMessage(const CBlockIndex* pindex)
+{
+    uint256 hash = pindex->GetBlockHash();
+    if (nBlockCacheMaxSize > 0)
+    {
+        LOCK(cs_blockCache);
+        map<uint256, BlockCacheList::iterator>::iterator mi = mapBlockCache.find(hash);
+        if (mi != mapBlockCache.end())
+        {
+            nBlockCacheHits++;
+            listBlockCache.splice(listBlockCache.begin(), listBlockCache, mi->second);
+            return mi->second->second;
+        }
+        nBlockCacheMisses++;
+    }
+
+    CSendBufferRef pmsg = ReadBlockMessage(pindex);
+    if (pmsg && nBlockCacheMaxSize > 0)
+        AddToBlockCache(hash, pmsg);
+    return pmsg;
+}
+
+void GetBlockCacheStats(CBlockCacheStats& stats)
+{
+    LOCK(cs_blockCache);
+    stats.nMaxSize = nBlockCacheMaxSize;
+    stats.nCount = listBlockCache.size();
+    stats.nSize = nBlockCacheSize;
+    stats.nHits = nBlockCacheHits;
+    stats.nMisses = nBlockCacheMisses;
+}
+
+//
+// -prune
+// Blocks deeper than PRUNE_MIN_BLOCKS_TO_KEEP are deleted from the block files, oldest
+// first, while the files take up more than -prune MB. The tx index and the stake kernel
+// keep positions in the block files, so the files are not rewritten: the deleted ranges
+// are punched out of them, the filesystem frees the space and they read back as zeros.
+// Transactions that still have unspent outputs, that were spent in the last
+// PRUNE_MIN_BLOCKS_TO_KEEP blocks, or that burn coins stay, with the header of their block.
+//
+
+uint64 nPruneTarget = 0;
+int nPruneHeight = 0;
+
+static unsigned int GetFirstTxPos(unsigned int nBlockPos, unsigned int nTx);
+
+bool IsBlockPruned(const CBlockIndex* pindex)
+{
+    // the best chain is pruned in height order, the genesis block is never pruned
+    return pindex->nHeight > 0 && pindex->nHeight <= nPruneHeight && pindex->IsInMainChain();
+}
+
+bool CanPruneBlockFiles()
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Disk space the block files take up, holes excluded
+static uint64 GetBlockFilesSize()
+{
+    uint64 nSize = 0;
+#ifndef WIN32
+    for (unsigned int nFile = 1; ; nFile++)
+    {
+        struct stat st;
+        if (stat((GetDataDir() / strprintf("blk%04d.dat", nFile)).string().c_str(), &st) != 0)
+            break;
+        nSize += (uint64)st.st_blocks * 512;
+    }
+#endif
+    return nSize;
+}
+
+static bool PunchBlockFile(unsigned int nFile, unsigned int nPos, unsigned int nSize)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+    int fd = open((GetDataDir() / strprintf("blk%04d.dat", nFile)).string().c_str(), O_WRONLY);
+    if (fd == -1)
+        return error("PunchBlockFile() : open of blk%04d.dat failed, errno %d", nFile, errno);
+    int ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, nPos, nSize);
+    close(fd);
+    if (ret != 0)
+        return error("PunchBlockFile() : fallocate on blk%04d.dat failed, errno %d", nFile, errno);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void AddPruneRange(map<unsigned int, PruneRanges>& mapRanges, unsigned int nFile, unsigned int nBegin, unsigned int nEnd)
+{
+    PruneRanges& vRanges = mapRanges[nFile];
+    if (!vRanges.empty() && vRanges.back().second == nBegin)
+        vRanges.back().second = nEnd;
+    else
+        vRanges.push_back(make_pair(nBegin, nEnd));
+}
+
+bool KeepPrunedTx(const CTransaction& tx, const CTxIndex* ptxindex, const CDiskTxPos& posTx,
+                  const set<pair<unsigned int, unsigned int> >& setRecentBlocks)
+{
+    if (HasBurnOutput(tx))
+        return true;
+
+    if (!ptxindex || ptxindex->pos != posTx)
+        return true;  // a duplicate of a transaction elsewhere, leave it alone
+
+    for (unsigned int i = 0; i < ptxindex->vSpent.size() && i < tx.vout.size(); i++)
+    {
+        const CDiskTxPos& posSpent = ptxindex->vSpent[i];
+        if (posSpent.IsNull())
+        {
+            // empty coinstake markers and data outputs are never spent
+            const CScript& scriptPubKey = tx.vout[i].scriptPubKey;
+            if (!scriptPubKey.empty() && scriptPubKey[0] != OP_RETURN)
+                return true;
+        }
+        else if (setRecentBlocks.count(make_pair(posSpent.nFile, posSpent.nBlockPos)))
+            return true;  // a reorganization may still need it back
+    }
+    return false;
+}
+
+// Ranges of blocks below nPruneHeight that are not punched out yet. Every punch has
+// to wait for a txdb sync, so they are collected over several rounds.
+static map<unsigned int, PruneRanges> mapPrunePending;
+static uint64 nPrunePendingSize = 0;
+static const uint64 PRUNE_PUNCH_MIN_SIZE = 32 * 1024 * 1024;
+
+static bool PunchPrunePending(CTxDB& txdb)
+{
+    if (mapPrunePending.empty())
+        return true;
+
+    // the prune height may still sit in the write-back cache, it has to be on
+    // disk before the blocks below it are gone
+    if (!txdb.Sync())
+        return error("PunchPrunePending() : Sync failed");
+
+    map<unsigned int, PruneRanges> mapRanges;
+    mapRanges.swap(mapPrunePending);
+    nPrunePendingSize = 0;
+    for (map<unsigned int, PruneRanges>::const_iterator mi = mapRanges.begin(); mi != mapRanges.end(); ++mi)
+        BOOST_FOREACH(const PAIRTYPE(unsigned int, unsigned int)& range, mi->second)
+            if (!PunchBlockFile(mi->first, range.first, range.second - range.first))
+                return false;
+    return true;
+}
+
+// Prune up to nMaxBlocks blocks, false when there is nothing left to prune
+static bool PruneBlockFiles(int nMaxBlocks)
+{
+    LOCK(cs_main);
+    CTxDB txdb("r+");
+    int nPruneLimit = nBestHeight - PRUNE_MIN_BLOCKS_TO_KEEP;
+    // the pending ranges are as good as freed
+    uint64 nSize = GetBlockFilesSize();
+    nSize -= min(nSize, nPrunePendingSize);
+    if (nPruneHeight >= nPruneLimit || nSize <= nPruneTarget)
+    {
+        PunchPrunePending(txdb);
+        return false;
+    }
+
+    set<pair<unsigned int, unsigned int> > setRecentBlocks;
+    for (CBlockIndex* pindex = pindexBest; pindex && pindex->nHeight > nPruneLimit; pindex = pindex->pprev)
+        setRecentBlocks.insert(make_pair(pindex->nFile, pindex->nBlockPos));
+
+    map<unsigned int, PruneRanges> mapRanges;
+    vector<pair<pair<uint256, s32int>, CBurnTxLocation> > vBurnLocations;
+    int nHeight = nPruneHeight;
+    for (CBlockIndex* pindex = pindexByHeight(nPruneHeight + 1); pindex && pindex->nHeight <= nPruneLimit && nMaxBlocks > 0;
+         pindex = pindex->pnext, nMaxBlocks--)
+    {
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+            return error("PruneBlockFiles() : ReadFromDisk at height %d failed", pindex->nHeight);
+
+        const uint256 hashBlock = pindex->GetBlockHash();
+        PruneRanges vBlockRanges;
+        bool fKeepHeader = false;
+        unsigned int nTxPos = GetFirstTxPos(pindex->nBlockPos, block.vtx.size());
+        for (unsigned int i = 0; i < block.vtx.size(); i++)
+        {
+            const CTransaction& tx = block.vtx[i];
+            CDiskTxPos posTx(pindex->nFile, pindex->nBlockPos, nTxPos);
+            unsigned int nTxSize = ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+            CTxIndex txindex;
+            bool fTxIndex = txdb.ReadTxIndex(tx.GetHash(), txindex);
+            if (KeepPrunedTx(tx, fTxIndex ? &txindex : NULL, posTx, setRecentBlocks))
+            {
+                fKeepHeader = true;
+                if (HasBurnOutput(tx))
+                {
+                    CBurnTxLocation location;
+                    location.hashTx = tx.GetHash();
+                    location.pos = posTx;
+                    vBurnLocations.push_back(make_pair(make_pair(hashBlock, (s32int)i), location));
+                }
+            }
+            else if (!vBlockRanges.empty() && vBlockRanges.back().second == nTxPos)
+                vBlockRanges.back().second = nTxPos + nTxSize;
+            else
+                vBlockRanges.push_back(make_pair(nTxPos, nTxPos + nTxSize));
+            nTxPos += nTxSize;
+        }
+
+        if (!fKeepHeader)
+        {
+            // the whole block goes, with the message start and size in front of it
+            vBlockRanges.clear();
+            vBlockRanges.push_back(make_pair(pindex->nBlockPos - 8, pindex->nBlockPos + ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION)));
+        }
+        BOOST_FOREACH(const PAIRTYPE(unsigned int, unsigned int)& range, vBlockRanges)
+            AddPruneRange(mapRanges, pindex->nFile, range.first, range.second);
+        nHeight = pindex->nHeight;
+    }
+    if (nHeight == nPruneHeight)
+    {
+        PunchPrunePending(txdb);
+        return false;
+    }
+
+    // Record the new prune height before anything is deleted, a crash in between
+    // only leaves some space unfreed. The ranges are punched once enough of them
+    // are pending, after a sync, so IBD doesn't sync the txdb every round.
+    if (!txdb.TxnBegin())
+        return error("PruneBlockFiles() : TxnBegin failed");
+    for (unsigned int i = 0; i < vBurnLocations.size(); i++)
+        txdb.WriteBurnTxLocation(vBurnLocations[i].first.first, vBurnLocations[i].first.second, vBurnLocations[i].second);
+    txdb.WritePruneHeight(nHeight);
+    if (!txdb.TxnCommit())
+        return error("PruneBlockFiles() : TxnCommit failed");
+    nPruneHeight = nHeight;
+
+    for (map<unsigned int, PruneRanges>::const_iterator mi = mapRanges.begin(); mi != mapRanges.end(); ++mi)
+        BOOST_FOREACH(const PAIRTYPE(unsigned int, unsigned int)& range, mi->second)
+        {
+            AddPruneRange(mapPrunePending, mi->first, range.first, range.second);
+            nPrunePendingSize += range.second - range.first;
+        }
+    if (nPrunePendingSize >= PRUNE_PUNCH_MIN_SIZE && !PunchPrunePending(txdb))
+        return false;
+
+    printf("PruneBlockFiles() : pruned up to height %d, block files were %" PRI64u " MB\n", nHeight, nSize / (1024 * 1024));
+    return true;
+}
+
+static void ThreadPruneBlockFiles2(void* parg)
+{
+    printf("ThreadPruneBlockFiles started\n");
+    while (!fShutdown)
+    {
+        // a couple hundred blocks at a time, so cs_main isn't held for long
+        while (!fShutdown && PruneBlockFiles(200))
+            ;
+        if (fShutdown)
+        {
+            // pending ranges would never be punched after a restart
+            LOCK(cs_main);
+            CTxDB txdb("r+");
+            PunchPrunePending(txdb);
+            break;
+        }
+        vnThreadsRunning[THREAD_PRUNE]--;
+        for (int i = 0; i < 60 && !fShutdown; i++)
+            Sleep(1000);
+        vnThreadsRunning[THREAD_PRUNE]++;
+    }
+}
+
+void ThreadPruneBlockFiles(void* parg)
+{
+    IMPLEMENT_RANDOMIZE_STACK(ThreadPruneBlockFiles(parg));
+    try
+    {
+        vnThreadsRunning[THREAD_PRUNE]++;
+        ThreadPruneBlockFiles2(parg);
+        vnThreadsRunning[THREAD_PRUNE]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_PRUNE]--;
+        PrintException(&e, "ThreadPruneBlockFiles()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_PRUNE]--;
+        PrintException(NULL, "ThreadPruneBlockFiles()");
+    }
+    printf("ThreadPruneBlockFiles exiting\n");
+}
+
 bool LoadBlockIndex(bool fAllowNew)
 {
     if (fTestNet)
@@ -3155,7 +3610,7 @@ void PrintBlockTree()
 {
     // precompute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -3561,7 +4016,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "verack")
     {
-        pfrom->vRecv.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+        pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
     }
 
 
@@ -3700,15 +4155,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (inv.type == MSG_BLOCK)
             {
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
                     //useful to print the nHeight
                     printf("\tnHeight: %d\t", mi->second->nHeight);
 
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second, true, false);
-                    pfrom->PushMessage("block", block);
+                    CSendBufferRef pmsg = GetBlockMessage((*mi).second);
+                    if (pmsg)
+                        pfrom->PushSerializedMessage(pmsg);
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -3799,7 +4254,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -4041,11 +4496,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
 bool ProcessMessages(CNode* pfrom)
 {
-    CDataStream& vRecv = pfrom->vRecv;
-    if (vRecv.empty())
-        return true;
     //if (fDebug)
-    //    printf("ProcessMessages(%u bytes)\n", vRecv.size());
+    //    printf("ProcessMessages(%u messages)\n", pfrom->vRecvMsg.size());
 
     //
     // Message format
@@ -4055,6 +4507,8 @@ bool ProcessMessages(CNode* pfrom)
     //  (4) checksum
     //  (x) data
     //
+    // The socket thread frames the messages into vRecvMsg, see CNode::ReceiveMsgBytes()
+    //
 
     unsigned char pchMessageStart[4];
     GetMessageStart(pchMessageStart);
@@ -4067,64 +4521,30 @@ bool ProcessMessages(CNode* pfrom)
         nTimeLastPrintMessageStart = GetAdjustedTime();
     }
 
-    for (;;)
+    while (!pfrom->fDisconnect && !pfrom->vRecvMsg.empty())
     {
-        // Scan for message start
-        CDataStream::iterator pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
-        int nHeaderSize = vRecv.GetSerializeSize(CMessageHeader());
-        if (vRecv.end() - pstart < nHeaderSize)
-        {
-            if ((int)vRecv.size() > nHeaderSize)
-            {
-                printf("\n\nPROCESSMESSAGE MESSAGESTART NOT FOUND\n\n");
-                vRecv.erase(vRecv.begin(), vRecv.end() - nHeaderSize);
-            }
+        // the message at the front stays in place while it is processed
+        CNetMessage& msg = pfrom->vRecvMsg.front();
+        if (!msg.Complete())
             break;
-        }
-        if (pstart - vRecv.begin() > 0)
-            printf("\n\nPROCESSMESSAGE SKIPPED %d BYTES\n\n", pstart - vRecv.begin());
-        vRecv.erase(vRecv.begin(), pstart);
 
-        // Read header
-        vector<char> vHeaderSave(vRecv.begin(), vRecv.begin() + nHeaderSize);
-        CMessageHeader hdr;
-        vRecv >> hdr;
-        if (!hdr.IsValid())
-        {
-            printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand().c_str());
-            continue;
-        }
+        CMessageHeader& hdr = msg.hdr;
         string strCommand = hdr.GetCommand();
-
-        // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
-        if (nMessageSize > MAX_SIZE)
-        {
-            printf("ProcessMessages(%s, %u bytes) : nMessageSize > MAX_SIZE\n", strCommand.c_str(), nMessageSize);
-            continue;
-        }
-        if (nMessageSize > vRecv.size())
-        {
-            // Rewind and wait for rest of message
-            vRecv.insert(vRecv.begin(), vHeaderSave.begin(), vHeaderSave.end());
-            break;
-        }
+        CDataStream& vMsg = msg.vRecv;
 
         // Checksum
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
+        uint256 hash = Hash(vMsg.begin(), vMsg.end());
         unsigned int nChecksum = 0;
         memcpy(&nChecksum, &hash, sizeof(nChecksum));
         if (nChecksum != hdr.nChecksum)
         {
             printf("ProcessMessages(%s, %u bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
                 strCommand.c_str(), nMessageSize, nChecksum, hdr.nChecksum);
+            pfrom->vRecvMsg.pop_front();
             continue;
         }
 
-        // Copy message to its own buffer
-        CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
-        vRecv.ignore(nMessageSize);
-
         // Process message
         bool fRet = false;
         try
@@ -4161,9 +4581,10 @@ bool ProcessMessages(CNode* pfrom)
 
         if (!fRet)
             printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
+
+        pfrom->vRecvMsg.pop_front();
     }
 
-    vRecv.Compact();
     return true;
 }
 
@@ -4178,7 +4599,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 
         // Keep-alive ping. We send a nonce of zero because we don't use it anywhere
         // right now.
-        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSend.empty()) {
+        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSendMsg.empty()) {
             uint64 nonce = 0;
             if (pto->nVersion > BIP0031_VERSION)
                 pto->PushMessage("ping", nonce);
@@ -4386,28 +4807,57 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
 // It operates on big endian data.  Caller does the byte reversing.
 // nNonce is usually preserved between calls, but periodically or if nNonce is 0xffff0000 or above,
 // the block is rebuilt and nNonce starts over at zero.
+// Nonces are hashed in batches through dcrypt_multi, which runs them in lockstep on the vector unit.
 //
+static const u32int nScanBatchSize = 64;
+
 static u32int ScanDcryptHash(CBlock *pblock, u32int *nHashesDone, uint256 *phash)
 {
     u32int *nNonce = &(pblock->nNonce);
     u32int orig_nNonce = *nNonce;
-    uint8_t digest[DCRYPT_DIGEST_LENGTH];
+
+    //one copy of the header per nonce of the batch
+    const size_t nHeaderSize = HASH_PBLOCK_SIZE(pblock);
+    const size_t nNonceOffset = UBEGIN(pblock->nNonce) - UBEGIN(pblock->nVersion);
+    vector<unsigned char> vHeaders(nScanBatchSize * nHeaderSize);
+    const uint8_t *pHeaders[nScanBatchSize];
+    size_t nHeaderSizes[nScanBatchSize];
+    uint256 hashes[nScanBatchSize];
+
+    for (u32int i = 0; i < nScanBatchSize; i++)
+    {
+        memcpy(&vHeaders[i * nHeaderSize], UBEGIN(pblock->nVersion), nHeaderSize);
+        pHeaders[i] = &vHeaders[i * nHeaderSize];
+        nHeaderSizes[i] = nHeaderSize;
+    }
 
     for (; !fShutdown;)
     {
-        //hash the block
-        (*nNonce)++;
+        //hash the next batch, stopping at the 0x10000 boundary like the nonce by nonce scan did
+        u32int nBatch = min(nScanBatchSize, 0x10000 - (*nNonce & 0xffff));
+        for (u32int i = 0; i < nBatch; i++)
+        {
+            u32int nBatchNonce = *nNonce + 1 + i;
+            memcpy(&vHeaders[i * nHeaderSize + nNonceOffset], &nBatchNonce, sizeof(nBatchNonce));
+        }
 
-        *phash = dcrypt(UBEGIN(pblock->nVersion), HASH_PBLOCK_SIZE(pblock), digest);
+        dcrypt_multi(pHeaders, nHeaderSizes, hashes, nBatch);
 
         // Return the nonce if the top 8 bits of the hash are all 0s,
         // caller will check if it satisfies the target
-        if (!uint256_get_top<u8int>(*phash))
-        {
-            //increment the hash counter accordingly
-            *nHashesDone += (*nNonce - orig_nNonce);
-            return *nNonce;
-        }
+        for (u32int i = 0; i < nBatch; i++)
+            if (!uint256_get_top<u8int>(hashes[i]))
+            {
+                *nNonce += 1 + i;
+                *phash = hashes[i];
+                pblock->SetCachedHash(hashes[i]);
+
+                //increment the hash counter accordingly
+                *nHashesDone += (*nNonce - orig_nNonce);
+                return *nNonce;
+            }
+
+        *nNonce += nBatch;
 
         // If nothing found after trying for a while, return -1
         if (!(*nNonce & 0xffff))
@@ -4420,54 +4870,172 @@ static u32int ScanDcryptHash(CBlock *pblock, u32int *nHashesDone, uint256 *phash
     return (u32int) -1;
 }
 
-CBlockIndex *pindexByHeight(s32int nHeight)
+uint64 GetBlockHasherSalt()
 {
-    if (nHeight < 0)
-        return NULL;
+    //salted per process so peers can't pick hashes that all land in one bucket
+    static const uint64 nSalt = GetRand(std::numeric_limits<uint64>::max());
+    return nSalt;
+}
 
-    //Get the block index by burnBlkHeight
-    CBlockIndex *pindex = NULL;
-    const CBlockIndex *pTestBlkIndex;
+//block indexes are allocated from slabs of ENTRIES_PER_SLAB entries, so entries
+// loaded together sit next to each other instead of all over the heap. Freed entries
+// go on a free list threaded through the entries themselves, slabs are never released.
+CBlockIndexArena::CBlockIndexArena(unsigned int nEntrySizeIn)
+{
+    //keep every entry aligned for any member type and big enough for the free list link
+    const unsigned int nAlign = 16;
+    nEntrySize = (std::max(nEntrySizeIn, (unsigned int)sizeof(void*)) + nAlign - 1) / nAlign * nAlign;
+    nSlabUsed = ENTRIES_PER_SLAB;
+    pFree = NULL;
+    nCount = 0;
+}
 
-    //if pindexBest is not set yet, scan through the entire map
-    if (!pindexBest)
+CBlockIndexArena::~CBlockIndexArena()
+{
+    BOOST_FOREACH(char* pslab, vSlab)
+        delete[] pslab;
+}
+
+void* CBlockIndexArena::Allocate()
+{
+    LOCK(cs);
+    nCount++;
+    if (pFree)
     {
-        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
-        {
-            pTestBlkIndex = item.second;
-            if (pTestBlkIndex->nHeight == nHeight)
-            {
-                pindex = (CBlockIndex*)pTestBlkIndex;
-                break;
-            }
-        }
-    }else{
-        for (pTestBlkIndex = pindexBest; pTestBlkIndex && pTestBlkIndex->pprev; pTestBlkIndex = pTestBlkIndex->pprev)
-            if (pTestBlkIndex->nHeight == nHeight)
-            {
-                pindex = (CBlockIndex*)pTestBlkIndex;
-                break;
-            }
+        void* p = pFree;
+        pFree = *(void**)p;
+        return p;
     }
+    if (nSlabUsed == ENTRIES_PER_SLAB)
+    {
+        vSlab.push_back(new char[nEntrySize * ENTRIES_PER_SLAB]);
+        nSlabUsed = 0;
+    }
+    return vSlab.back() + nEntrySize * nSlabUsed++;
+}
 
-    return pindex;
+void CBlockIndexArena::Free(void* p)
+{
+    LOCK(cs);
+    nCount--;
+    *(void**)p = pFree;
+    pFree = p;
 }
 
-//given a valid block height, transaction depth, out transaction dept, this will set values for those
-bool GetAllTxClassesByIndex(s32int blkHeight, s32int txDepth, s32int txOutDepth, 
-                                                        CBlock &blockRet, CTransaction &txRet, CTxOut &txOutRet)
+uint64 CBlockIndexArena::GetCount()
 {
-    if (blkHeight < 0 || txDepth < 0 || txOutDepth < 0)
-        return false;
+    LOCK(cs);
+    return nCount;
+}
 
-    //Get the block index by burnBlkHeight
-    const CBlockIndex *pindex = pindexByHeight(blkHeight);
+uint64 CBlockIndexArena::GetSize()
+{
+    LOCK(cs);
+    return (uint64)vSlab.size() * nEntrySize * ENTRIES_PER_SLAB;
+}
 
-    if (!pindex || !pindex->pprev)
-        return false;
+void GetBlockIndexMemoryUsage(uint64& nEntries, uint64& nBytes)
+{
+    LOCK(cs_main);
+    nEntries = mapBlockIndex.size();
+    //the slabs, the bucket array and one node (value plus next pointer and cached hash) per entry
+    nBytes = blockIndexArena.GetSize() +
+             (uint64)mapBlockIndex.bucket_count() * sizeof(void*) +
+             nEntries * (sizeof(BlockMap::value_type) + 2 * sizeof(void*));
+}
 
-    CBlock block;
-    //Read the block
+//the chain ending at pindexBest, indexed by height, and the number of PoW blocks
+// at or below each height of it. SetBestChainIndex() is called wherever pindexBest is set.
+// Both follow pindexBest, not the pnext links, so blocks connected before pindexBest
+// moves (Reorganize) see the same chain as when pindexByHeight() walked back from it.
+// The writer holds cs_main, but the burn miner, the wallet and the RPC read them without
+// it, so they have their own lock; a resize may move them.
+static CCriticalSection cs_vBestChain;
+static std::vector<CBlockIndex*> vBestChain;
+static std::vector<s32int> vBestChainPoWCount;
+
+void SetBestChainIndex(CBlockIndex *pindexNew)
+{
+    LOCK(cs_vBestChain);
+    if (!pindexNew)
+    {
+        vBestChain.clear();
+        vBestChainPoWCount.clear();
+        return;
+    }
+
+    //find the fork with the indexed chain, only the blocks after it change
+    vector<CBlockIndex*> vConnect;
+    CBlockIndex *pindex = pindexNew;
+    for (; pindex; pindex = pindex->pprev)
+    {
+        if (pindex->nHeight < vBestChain.size() && vBestChain[pindex->nHeight] == pindex)
+            break;
+        vConnect.push_back(pindex);
+    }
+
+    const s32int nForkHeight = pindex ? pindex->nHeight : -1;
+    vBestChain.resize(nForkHeight + 1);
+    vBestChainPoWCount.resize(nForkHeight + 1);
+
+    BOOST_REVERSE_FOREACH(CBlockIndex *pindexConnect, vConnect)
+    {
+        const s32int nPoWCount = vBestChainPoWCount.empty() ? 0 : vBestChainPoWCount.back();
+        vBestChain.push_back(pindexConnect);
+        vBestChainPoWCount.push_back(nPoWCount + (pindexConnect->IsProofOfWork() ? 1 : 0));
+    }
+}
+
+CBlockIndex *pindexByHeight(s32int nHeight)
+{
+    if (nHeight < 0)
+        return NULL;
+
+    //if pindexBest is not set yet, scan through the entire map
+    if (!pindexBest)
+    {
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+            if (item.second->nHeight == nHeight)
+                return item.second;
+
+        return NULL;
+    }
+
+    //the genesis block is never returned, as when this walked back from pindexBest
+    LOCK(cs_vBestChain);
+    if (nHeight == 0 || nHeight >= vBestChain.size())
+        return NULL;
+
+    return vBestChain[nHeight];
+}
+
+s32int GetPoWBlockCount(s32int nHeight)
+{
+    LOCK(cs_vBestChain);
+    if (nHeight < 0 || vBestChainPoWCount.empty())
+        return 0;
+
+    if (nHeight >= vBestChainPoWCount.size())
+        nHeight = vBestChainPoWCount.size() - 1;
+
+    return vBestChainPoWCount[nHeight];
+}
+
+//given a valid block height, transaction depth, out transaction dept, this will set values for those
+bool GetAllTxClassesByIndex(s32int blkHeight, s32int txDepth, s32int txOutDepth, 
+                                                        CBlock &blockRet, CTransaction &txRet, CTxOut &txOutRet)
+{
+    if (blkHeight < 0 || txDepth < 0 || txOutDepth < 0)
+        return false;
+
+    //Get the block index by burnBlkHeight
+    const CBlockIndex *pindex = pindexByHeight(blkHeight);
+
+    if (!pindex || !pindex->pprev)
+        return false;
+
+    CBlock block;
+    //Read the block
     if (!block.ReadFromDisk(pindex))
         return false;
 
@@ -4488,6 +5056,151 @@ bool GetAllTxClassesByIndex(s32int blkHeight, s32int txDepth, s32int txOutDepth,
     return true;
 }
 
+//
+// Burn transaction locations
+// Proof-of-burn checks only need the one burn transaction out of the burn block. Where the
+// transactions that pay to the burn address are in the block files is written to the txdb
+// when their block is connected and erased when it is disconnected, so later checks seek
+// straight to the transaction. InitBurnTxIndex() writes them for the blocks an earlier
+// version connected
+//
+static CScript MakeBurnScript()
+{
+    CBurnAddress burnAddress;
+    CScript script;
+    script.SetDestination(burnAddress.Get());
+    return script;
+}
+
+static bool HasBurnOutput(const CTransaction &tx)
+{
+    static const CScript scriptBurn = MakeBurnScript();
+
+    BOOST_FOREACH(const CTxOut &txout, tx.vout)
+        if (txout.scriptPubKey == scriptBurn)
+            return true;
+
+    return false;
+}
+
+//the disk position of the first transaction of a block at nBlockPos, as ConnectBlock() computes it
+static unsigned int GetFirstTxPos(unsigned int nBlockPos, unsigned int nTx)
+{
+    return nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(nTx);
+}
+
+//like GetAllTxClassesByIndex(), but only reads the burn transaction, not the whole block
+bool GetBurnTxByIndex(s32int blkHeight, s32int txDepth, s32int txOutDepth,
+                      uint256 &hashBlockRet, CTransaction &txRet, CTxOut &txOutRet, bool *pfMalformed)
+{
+    if (pfMalformed)
+        *pfMalformed = false;
+
+    if (blkHeight < 0 || txDepth < 0 || txOutDepth < 0)
+    {
+        if (pfMalformed)
+            *pfMalformed = true;
+        return false;
+    }
+
+    const CBlockIndex *pindex = pindexByHeight(blkHeight);
+    if (!pindex || !pindex->pprev)
+        return false;
+
+    const uint256 hashBlock = pindex->GetBlockHash();
+
+    //every burn transaction of the main chain has an entry, no entry means txDepth
+    // is not one, or not in the block at all
+    CBurnTxLocation location;
+    if (!CTxDB("r").ReadBurnTxLocation(hashBlock, txDepth, location))
+    {
+        if (pfMalformed)
+            *pfMalformed = true;
+        return false;
+    }
+
+    CTransaction tx;
+    if (!tx.ReadFromDisk(location.pos) || tx.GetHash() != location.hashTx)
+        return error("GetBurnTxByIndex() : burn transaction %d:%d cannot be read", blkHeight, txDepth);
+
+    if (txOutDepth >= tx.vout.size())
+    {
+        if (pfMalformed)
+            *pfMalformed = true;
+        return false;
+    }
+
+    hashBlockRet = hashBlock;
+    txOutRet = tx.vout[txOutDepth];
+    txRet = tx;
+
+    //sucess!
+    return true;
+}
+
+//writes the burn transaction entries of the main chain blocks that were connected
+// before ConnectBlock() wrote them, the blocks connected from here on have them
+bool InitBurnTxIndex()
+{
+    CTxDB txdb("r+");
+    bool fComplete = false;
+    int nBuildHeight = 0;
+    if (txdb.ReadBurnTxIndexState(fComplete, nBuildHeight) && fComplete)
+        return true;
+
+    CBlockIndex* pindex = pindexByHeight(nBuildHeight + 1);
+    if (pindex)
+        printf("InitBurnTxIndex() : indexing heights %d to %d\n", pindex->nHeight, nBestHeight);
+    int64 nStart = GetTimeMillis();
+    do
+    {
+        if (!txdb.TxnBegin())
+            return error("InitBurnTxIndex() : TxnBegin failed");
+
+        for (int n = 0; pindex && n < 1000; n++, pindex = pindex->pnext)
+        {
+            //pruning kept the burn transactions of its blocks and wrote their entries
+            nBuildHeight = pindex->nHeight;
+            if (IsBlockPruned(pindex))
+                continue;
+
+            CBlock block;
+            if (!block.ReadFromDisk(pindex))
+            {
+                txdb.TxnAbort();
+                return error("InitBurnTxIndex() : ReadFromDisk at height %d failed", pindex->nHeight);
+            }
+
+            const uint256 hashBlock = pindex->GetBlockHash();
+            unsigned int nTxPos = GetFirstTxPos(pindex->nBlockPos, block.vtx.size());
+            for (u32int i = 0; i < block.vtx.size(); i++)
+            {
+                if (HasBurnOutput(block.vtx[i]))
+                {
+                    CBurnTxLocation location;
+                    location.hashTx = block.vtx[i].GetHash();
+                    location.pos = CDiskTxPos(pindex->nFile, pindex->nBlockPos, nTxPos);
+                    txdb.WriteBurnTxLocation(hashBlock, i, location);
+                }
+                nTxPos += ::GetSerializeSize(block.vtx[i], SER_DISK, CLIENT_VERSION);
+            }
+        }
+
+        txdb.WriteBurnTxIndexState(pindex == NULL, nBuildHeight);
+        if (!txdb.TxnCommit())
+            return error("InitBurnTxIndex() : TxnCommit failed");
+
+        if (pindex)
+            InitMessage(strprintf(_("Indexing burn transactions... %d/%d"), nBuildHeight, nBestHeight));
+        if (fRequestShutdown)
+            return true;
+    }
+    while (pindex);
+
+    printf("InitBurnTxIndex() : done in %" PRI64d " ms\n", GetTimeMillis() - nStart);
+    return true;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////
@@ -4503,21 +5216,25 @@ s32int nPoWBlocksBetween(s32int startHeight, s32int endHeight)
     if (startHeight >= endHeight || startHeight < 0 || endHeight < 0)
         return 0;
 
-    s32int between = 0;
+    //the end block has to be in the chain
     CBlockIndex *pindex = pindexByHeight(endHeight);
-    
-    //Go backwards and count the number of proof of work indexes
-    for (; pindex && pindex->pprev && pindex->pprev->nHeight > startHeight; pindex = pindex->pprev)
+    if (!pindex)
+        return 0;
+
+    //while loading the block index there is no best chain to count in yet
+    if (!pindexBest)
     {
-        if (pindex->IsProofOfWork())
-            between++;
-    }
+        s32int between = 0;
+        for (; pindex->pprev && pindex->pprev->nHeight > startHeight; pindex = pindex->pprev)
+            if (pindex->IsProofOfWork())
+                between++;
 
-    //exited the for loop early, bad thing
-    if (!pindex || !pindex->pprev)
-        return 0;
+        return pindex->pprev ? between : 0;
+    }
 
-    return between;
+    //the blocks at startHeight + 2 through endHeight, the same that walking back
+    // from endHeight while pprev is above startHeight would count
+    return GetPoWBlockCount(endHeight) - GetPoWBlockCount(startHeight + 1);
 }
 
 //Calculates the has with the given input data
@@ -4609,15 +5326,13 @@ bool GetBurnHash(uint256 hashPrevBlock, s32int burnBlkHeight, s32int burnCTx,
         return error("GetBurnHash(): Input indexes are invalid %d:%d:%d\n", 
                                  burnBlkHeight, burnCTx, burnCTxOut);
 
-    CBlock block;
+    uint256 txHashBlock;
     CTransaction burnTx;
     CTxOut burnTxOut;
 
-    if (!GetAllTxClassesByIndex(burnBlkHeight, burnCTx, burnCTxOut, block, burnTx, burnTxOut))
+    if (!GetBurnTxByIndex(burnBlkHeight, burnCTx, burnCTxOut, txHashBlock, burnTx, burnTxOut))
         return error("GetBurnHash(): Unable to read burn transaction %d:%d:%d\n", burnBlkHeight, burnCTx, burnCTxOut);
 
-    const uint256 txHashBlock = block.GetHash();
-
     //check if burnTxOut's address is a burn address
     // with a bunch of sanity checks
     CBurnAddress burnAddress;
@@ -4646,6 +5361,79 @@ bool GetBurnHash(uint256 hashPrevBlock, s32int burnBlkHeight, s32int burnCTx,
                                             burnBlkHeight , burnTxOut.nValue, smallestHashRet, fRetIntermediate);
 }
 
+//checks the burn hash of a proof-of-burn block index against its nBurnBits and recorded burnHash
+static bool CheckProofOfBurnIndex(const CBlockIndex *pindex)
+{
+    uint256 burnHashRet;
+
+    //Get the actual burn hash, with the multiplier applied
+    // nHeight - 1 since GetBurnHash wants the index of the previous block
+    GetBurnHash(pindex->pprev->GetBlockHash(), pindex->burnBlkHeight, pindex->burnCTx, 
+                pindex->burnCTxOut, burnHashRet, false);
+
+    if (!CheckProofOfBurnHash(burnHashRet, pindex->nBurnBits))
+        return false;
+
+    //If Slimcoin is past the intermediate hash update, check that too
+    if (use_burn_hash_intermediate(pindex->nTime))
+    {
+        //Get the intermediate burn hash without the multiplier applied
+        GetBurnHash(pindex->pprev->GetBlockHash(), pindex->burnBlkHeight, pindex->burnCTx, 
+                    pindex->burnCTxOut, burnHashRet, true);
+
+        if (pindex->burnHash != burnHashRet)
+            return false;
+    }
+
+    return true;
+}
+
+static void ThreadCheckProofOfBurnHashes(const std::vector<const CBlockIndex*> *pvpindex, std::atomic<size_t> *pnNext,
+                                         std::atomic<size_t> *pnFailed)
+{
+    //every thread takes the next unchecked index, until all are done or one failed
+    for (size_t i = (*pnNext)++; i < pvpindex->size() && *pnFailed == pvpindex->size(); i = (*pnNext)++)
+    {
+        if (!CheckProofOfBurnIndex((*pvpindex)[i]))
+        {
+            //keep the lowest failed position, so the result does not depend on the thread timing
+            size_t nFailed = *pnFailed;
+            while (i < nFailed && !pnFailed->compare_exchange_weak(nFailed, i))
+                ;
+        }
+    }
+}
+
+//the burn transactions are found through the burn tx locations, so this is bound by the
+// hashing and the reads of single transactions, which run on all cores.
+// The block indexes must be in the best chain, as pindexByHeight() finds the burn blocks there
+bool CheckProofOfBurnHashes(const std::vector<const CBlockIndex*> &vpindex, const CBlockIndex **ppindexFailRet)
+{
+    std::atomic<size_t> nNext(0), nFailed(vpindex.size());
+
+    int nThreads = boost::thread::hardware_concurrency();
+    if (nThreads > (int)vpindex.size() / 16)
+        nThreads = vpindex.size() / 16;
+
+    if (nThreads <= 1)
+        ThreadCheckProofOfBurnHashes(&vpindex, &nNext, &nFailed);
+    else
+    {
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&ThreadCheckProofOfBurnHashes, &vpindex, &nNext, &nFailed));
+        threadGroup.join_all();
+    }
+
+    if (nFailed == vpindex.size())
+        return true;
+
+    if (ppindexFailRet)
+        *ppindexFailRet = vpindex[nFailed];
+
+    return false;
+}
+
 //Scans all of the hashes of this transaction and returns the smallest one
 bool ScanBurnHashes(const CWalletTx &burnWTx, uint256 &smallestHashRet)
 {
@@ -4705,40 +5493,237 @@ bool ScanBurnHashes(const CWalletTx &burnWTx, uint256 &smallestHashRet)
                                             pindex->nHeight, burnTxOut.nValue, smallestHashRet, false);
 }
 
+//
+// Burn candidate engine
+// HashAllBurntTx() is run for every new best block and burn wallets can hold thousands
+// of burn outputs. Everything about a burn output that does not depend on the best block
+// is worked out once, when it first shows up, and kept in a flat array:
+//   - the sha256 state after burnBlockHash ++ burnTxHash, the [Hash] of ScanBurnHashes()
+//     only adds hashPrevBlock on top of that
+//   - the burnt value and the count of PoW blocks up to the burn, so nPoWBlocksBetween()
+//     becomes a subtraction
+// A new best block then costs one hash and one multiply per burn output.
+//
+struct CBurnCandidate
+{
+    uint256 hashTx;             //the wallet transaction holding the burn
+    SHA256_CTX ctxPrefix;       //sha256 of burnBlockHash ++ burnTxHash, without the final block
+    int64 nValue;               //the amount of coins burned
+    s32int nPoWCount;           //GetPoWBlockCount(burnBlkHeight + 1)
+};
+
+class CBurnCandidates
+{
+private:
+    std::vector<CBurnCandidate> vCandidates;
+    std::set<uint256> setKnown;             //wallet transactions that are in vCandidates
+
+    //nPoWBlocksBetween(start, end) counts the PoW blocks in [start + 2, end], which is the
+    // count at end minus the count at start + 1
+    const CBlockIndex *pindexTip;
+    s32int nTipPoWCount;
+
+    //the result for pindexTip
+    bool fResultValid;
+    uint256 smallestHash;
+    uint256 smallestTx;
+
+    //moves the tip to pindexNew, the best block, returns false if the candidates have to be rebuilt
+    bool AdvanceTip(const CBlockIndex *pindexNew)
+    {
+        //a reorganize took pindexTip, and maybe burn blocks, out of the main chain
+        if (!pindexTip || pindexByHeight(pindexTip->nHeight) != pindexTip)
+            return false;
+
+        pindexTip = pindexNew;
+        nTipPoWCount = GetPoWBlockCount(pindexTip->nHeight);
+        return true;
+    }
+
+    //adds the burn transactions of the wallet that are not candidates yet
+    void AddNewCandidates()
+    {
+        bool fAdded = false;
+
+        {
+            LOCK(pwalletMain->cs_wallet);
+
+            BOOST_FOREACH(const uint256 &hash, pwalletMain->setBurnHashes)
+            {
+                if (setKnown.count(hash))
+                    continue;
+
+                map<uint256, CWalletTx>::const_iterator mi = pwalletMain->mapWallet.find(hash);
+                if (mi == pwalletMain->mapWallet.end())
+                    continue;
+
+                const CWalletTx &wtx = mi->second;
+
+                //not in a block of the main chain yet, try again with the next best block
+                CBlockIndex *pindex = NULL;
+                if (!wtx.hashBlock || wtx.GetDepthInMainChain(pindex) <= 0 || !pindex)
+                    continue;
+
+                //the burn block + 1 needs to be in the chain to have a PoW count
+                if (pindex->nHeight + 1 > pindexTip->nHeight)
+                    continue;
+
+                CTxOut burnTxOut = wtx.GetBurnOutTx();
+                if (burnTxOut.IsNull() || !burnTxOut.nValue)
+                    continue;
+
+                CBurnCandidate candidate;
+                candidate.hashTx = hash;
+                candidate.nValue = burnTxOut.nValue;
+                candidate.nPoWCount = GetPoWBlockCount(pindex->nHeight + 1);
+
+                const uint256 burnTxHash = wtx.GetHash();
+                SHA256_Init(&candidate.ctxPrefix);
+                SHA256_Update(&candidate.ctxPrefix, BEGIN(wtx.hashBlock), sizeof(wtx.hashBlock));
+                SHA256_Update(&candidate.ctxPrefix, BEGIN(burnTxHash), sizeof(burnTxHash));
+
+                vCandidates.push_back(candidate);
+                setKnown.insert(hash);
+                fAdded = true;
+            }
+        }
+
+        if (fAdded)
+            fResultValid = false;
+    }
+
+    void HashCandidates()
+    {
+        smallestHash = ~uint256(0);
+        smallestTx = 0;
+
+        const uint256 hashPrevBlock = pindexTip->GetBlockHash();
+        const CBigNum bnMax(~uint256(0));
+
+        BOOST_FOREACH(const CBurnCandidate &candidate, vCandidates)
+        {
+            const s32int between = nTipPoWCount - candidate.nPoWCount;
+            if (between < BURN_MIN_CONFIRMS)
+                continue;
+
+            //the same as Hash(burnBlockHash ++ burnTxHash ++ hashPrevBlock) in HashBurnData()
+            uint256 hash1, hash2;
+            SHA256_CTX ctx = candidate.ctxPrefix;
+            SHA256_Update(&ctx, BEGIN(hashPrevBlock), sizeof(hashPrevBlock));
+            SHA256_Final((unsigned char*)&hash1, &ctx);
+            SHA256_Init(&ctx);
+            SHA256_Update(&ctx, BEGIN(hash1), sizeof(hash1));
+            SHA256_Final((unsigned char*)&hash2, &ctx);
+
+            CBigNum bnTest = CBigNum(hash2) * calculate_burn_multiplier(candidate.nValue, between);
+            if (bnTest > bnMax)
+                continue;
+
+            uint256 hash = bnTest.getuint256();
+            if (pindexTip->nTime >= BURN_ROUND_DOWN)
+                hash = becomeCompact(hash);
+
+            if (!hash)
+                continue;
+
+            if (hash < smallestHash)
+            {
+                smallestHash = hash;
+                smallestTx = candidate.hashTx;
+            }
+        }
+
+        fResultValid = true;
+    }
+
+public:
+    CBurnCandidates()
+    {
+        Clear();
+    }
+
+    void Clear()
+    {
+        vCandidates.clear();
+        setKnown.clear();
+        pindexTip = NULL;
+        nTipPoWCount = 0;
+        fResultValid = false;
+    }
+
+    //finds the smallest burn hash at pindexNew, returns false if there is none
+    bool Update(const CBlockIndex *pindexNew, uint256 &smallestHashRet, uint256 &smallestTxRet)
+    {
+        //the wallet dropped burn transactions, i.e. after a rescan, also when it added others
+        // at the same time, so every candidate is looked up
+        bool fDropped = false;
+        {
+            LOCK(pwalletMain->cs_wallet);
+            BOOST_FOREACH(const uint256 &hash, setKnown)
+            {
+                if (!pwalletMain->setBurnHashes.count(hash))
+                {
+                    fDropped = true;
+                    break;
+                }
+            }
+        }
+        if (fDropped)
+            Clear();
+
+        if (pindexNew != pindexTip)
+        {
+            if (!AdvanceTip(pindexNew))
+            {
+                Clear();
+                pindexTip = pindexNew;
+                nTipPoWCount = GetPoWBlockCount(pindexTip->nHeight);
+            }
+
+            fResultValid = false;
+        }
+
+        AddNewCandidates();
+
+        if (!fResultValid)
+            HashCandidates();
+
+        smallestHashRet = smallestHash;
+        smallestTxRet = smallestTx;
+        return smallestTx != 0;
+    }
+};
+
+//taken after cs_main and pwalletMain->cs_wallet
+static CCriticalSection cs_burnCandidates;
+static CBurnCandidates burnCandidates;
+
 //returns the (if found) the best hash with the transaction that produced it
 void HashAllBurntTx(uint256 &smallestHashRet, CWalletTx &smallestWTxRet)
 {
     //give the smallest hash the absolute largest value it can hold
     smallestHashRet = ~uint256(0);
 
+    //the locks in the order the RPC calls hold them, cs_burnCandidates is taken last
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
     //if the best index is not a proof-of-work index, do not bother hashing as it will throw errors
     if (!pindexBest->IsProofOfWork())
         return;
 
-    //go through all of the burnt hashes in the setBurnHashes
-    for (set<uint256>::iterator it = pwalletMain->setBurnHashes.begin(); 
-            it != pwalletMain->setBurnHashes.end(); ++it)
+    uint256 smallestHash, smallestTx;
     {
-        if (!pwalletMain->mapWallet.count(*it))
-            continue;
-
-        CWalletTx tmpWTx = pwalletMain->mapWallet[*it];
-        if (!tmpWTx.IsBurnTxMature()) //transaction has to have at least some confirmations
-            continue;
-
-        uint256 tmpHash;
-        if (!ScanBurnHashes(tmpWTx, tmpHash))
-            continue;
+        LOCK(cs_burnCandidates);
+        if (!burnCandidates.Update(pindexBest, smallestHash, smallestTx))
+            return;
+    }
 
-        if (tmpHash < smallestHashRet)
-        {
-            smallestHashRet = tmpHash;
-            smallestWTxRet = const_cast<const CWalletTx&>(tmpWTx);
-        }
+    map<uint256, CWalletTx>::const_iterator mi = pwalletMain->mapWallet.find(smallestTx);
+    if (mi == pwalletMain->mapWallet.end())
+        return;
 
-    }
-    
-    return;
+    smallestHashRet = smallestHash;
+    smallestWTxRet = mi->second;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -4815,13 +5800,13 @@ CBlock *CreateNewBlock(CWallet* pwallet, bool fProofOfStake, const CWalletTx *bu
     //handle the public key of burn block differently
     if (pblock->IsProofOfBurn())
     {
-        CBlock burnBlock;
+        uint256 hashBurnBlock;
         CTransaction burnTx;
         CTxOut burnTxOut;
 
-        //given the burn coords in pblock, set the class objects burnBlock, burnTx, burnTxOut
-        if (!GetAllTxClassesByIndex(pblock->burnBlkHeight, pblock->burnCTx, pblock->burnCTxOut, 
-                                                             burnBlock, burnTx, burnTxOut))
+        //given the burn coords in pblock, set the class objects burnTx, burnTxOut
+        if (!GetBurnTxByIndex(pblock->burnBlkHeight, pblock->burnCTx, pblock->burnCTxOut, 
+                              hashBurnBlock, burnTx, burnTxOut))
             return NULL;
 
         CScript sendersPubKey;
@@ -5191,185 +6176,322 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
 }
 
 void static ThreadSlimcoinMiner(void* parg);
+void static ThreadSlimcoinMinerTemplate(void* parg);
 
 static bool fGenerateSlimcoins = false;
 static bool fLimitProcessors = false;
 static int nLimitProcessors = -1;
 
-void SlimCoinMiner(CWallet *pwallet, bool fProofOfStake)
+//
+// Proof-of-work mining is split between one template thread and N hashing threads.
+// The template thread builds a single block whenever pindexBest or the mempool changes,
+// the hashing threads take disjoint ranges of its nonce space from nMinerWork.
+// A template is never changed once published; it owns the reserve key of its coinbase,
+// so a hashing thread that still holds it can keep the key when it finds a block.
+//
+struct CMinerTemplate
+{
+    CBlock block;
+    CBlockIndex* pindexPrev;
+    unsigned int nId;
+    boost::shared_ptr<CReserveKey> preservekey;
+};
+
+static CCriticalSection cs_minerTemplate;
+static boost::shared_ptr<const CMinerTemplate> pminerTemplate;  // guarded by cs_minerTemplate
+static unsigned int nMinerTemplateId = 0;                        // guarded by cs_minerTemplate
+static CMinerWorkCounter nMinerWork;
+static std::atomic<bool> fMinerTemplateStale(false);
+
+// Make ptemplate the one the hashing threads work on, NULL stops them
+static void PublishMinerTemplate(const boost::shared_ptr<CMinerTemplate>& ptemplate)
+{
+    LOCK(cs_minerTemplate);
+    nMinerTemplateId++;
+    if (ptemplate)
+        ptemplate->nId = nMinerTemplateId;
+    pminerTemplate = ptemplate;
+    nMinerWork.Reset(nMinerTemplateId);
+}
+
+// per thread hash rates, for the hashmeter and getmininginfo
+static CCriticalSection cs_minerStats;
+static std::map<int, double> mapMinerThreadHashesPerSec;
+static int nMinerThreadNext = 0;
+
+void GetMinerThreadHashesPerSec(std::vector<double>& vRates)
+{
+    LOCK(cs_minerStats);
+    vRates.clear();
+    BOOST_FOREACH(const PAIRTYPE(int, double)& item, mapMinerThreadHashesPerSec)
+        vRates.push_back(item.second);
+}
+
+static void UpdateMinerHashesPerSec(int nThread, double dThreadHashesPerSec)
+{
+    LOCK(cs_minerStats);
+    mapMinerThreadHashesPerSec[nThread] = dThreadHashesPerSec;
+
+    dHashesPerSec = 0;
+    BOOST_FOREACH(const PAIRTYPE(int, double)& item, mapMinerThreadHashesPerSec)
+        dHashesPerSec += item.second;
+    nHPSTimerStart = GetTimeMillis();
+}
+
+static void SlimCoinMinerTemplate(CWallet *pwallet)
 {
-    printf("CPUMiner started for proof-of-%s\n", fProofOfStake ? "stake" : "work");
+    printf("SlimCoinMiner template builder started\n");
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
 
-    // Each thread has its own key and counter
-    CReserveKey reservekey(pwallet);
     unsigned int nExtraNonce = 0;
+    unsigned int nTransactionsUpdatedLast = 0;
+    CBlockIndex* pindexPrev = NULL;
+    int64 nStart = 0;
+    int64 nLogTime = 0;
 
-    while (fGenerateSlimcoins || fProofOfStake)
+    while (fGenerateSlimcoins && !fShutdown)
     {
-        if (fShutdown)
-            return;
-
-        while (vNodes.empty() || IsInitialBlockDownload())
+        if (vNodes.empty() || IsInitialBlockDownload() || pwallet->IsLocked())
         {
             Sleep(1000);
-            if (fShutdown)
-                return;
-            if ((!fGenerateSlimcoins) && !fProofOfStake)
-                return;
+            continue;
         }
 
-        while (pwallet->IsLocked())
+        //the hashing threads flag the template stale when they used up its nonces,
+        // or its coinbase timestamp fell too far behind
+        bool fRebuild = (pindexPrev != pindexBest) || fMinerTemplateStale ||
+                        (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60);
+
+        if (fRebuild)
         {
-            strMintWarning = strMintMessage;
-            Sleep(1000);
-        }
-        strMintWarning = "";
+            nTransactionsUpdatedLast = nTransactionsUpdated;
+            pindexPrev = pindexBest;
+            nStart = GetTime();
+            fMinerTemplateStale = false;
+
+            //built without cs_minerTemplate, the hashing threads go on with the old one meanwhile
+            boost::shared_ptr<CMinerTemplate> ptemplate(new CMinerTemplate());
+            ptemplate->preservekey.reset(new CReserveKey(pwallet));
+            boost::scoped_ptr<CBlock> pblock(CreateNewBlock(pwallet, false, NULL, ptemplate->preservekey.get()));
+            if (!pblock)
+            {
+                PublishMinerTemplate(boost::shared_ptr<CMinerTemplate>());
+                Sleep(1000);
+                continue;
+            }
 
-        //
-        // Create new block
-        //
-        unsigned int nTransactionsUpdatedLast = nTransactionsUpdated;
-        CBlockIndex* pindexPrev = pindexBest;
-        /* FIXME: boost::movelib::unique_ptr<CBlock> pblock(CreateNewBlock(pwallet, fProofOfStake)); */
-        unique_ptr<CBlock> pblock(CreateNewBlock(pwallet, fProofOfStake));
-        if (!pblock.get())
-            return;
+            IncrementExtraNonce(pblock.get(), pindexPrev, nExtraNonce);
+            ptemplate->block = *pblock;
+            ptemplate->pindexPrev = pindexPrev;
+            PublishMinerTemplate(ptemplate);
 
-        IncrementExtraNonce(pblock.get(), pindexPrev, nExtraNonce);
+            printf("SlimCoinMiner template %u with %d %s in block\n", ptemplate->nId, pblock->vtx.size(),
+                   pblock->vtx.size() != 1 ? "transactions" : "transaction");
+        }
 
-        if (fProofOfStake)
+        //update with hashing speed information 30 secs
+        if (GetTime() - nLogTime > 30 && GetTimeMillis() - nHPSTimerStart < 8000)
         {
-            // ppcoin: if proof-of-stake block found then process block
-            if (pblock->IsProofOfStake())
-            {
-                if (!pblock->SignBlock(*pwalletMain))
-                {
-                    strMintWarning = strMintMessage;
-                    continue;
-                }
+            nLogTime = GetTime();
 
-                strMintWarning = "";
-                printf("CPUMiner : proof-of-stake block found %s\n", pblock->GetHash().ToString().c_str()); 
-                SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                CheckWork(pblock.get(), *pwalletMain, reservekey);
-                SetThreadPriority(THREAD_PRIORITY_LOWEST);
-            }
+            vector<double> vRates;
+            GetMinerThreadHashesPerSec(vRates);
 
-            Sleep(500);
-            continue;
+            string strRates;
+            BOOST_FOREACH(double dRate, vRates)
+                strRates += strprintf(" %.0f", dRate);
+
+            printf("%s ", DateTimeStrFormat(GetTime()).c_str());
+            printf("hashmeter %3d CPUs %6.0f hash/s (per thread:%s)\n", vnThreadsRunning[THREAD_MINER],
+                   dHashesPerSec, strRates.c_str());
         }
 
-        printf("Running SlimCoinMiner with %d %s in block\n", pblock->vtx.size(), pblock->vtx.size() != 1 ? "transactions" : "transaction");
+        Sleep(250);
+    }
 
+    PublishMinerTemplate(boost::shared_ptr<CMinerTemplate>());
+}
 
-        //
-        // Prebuild hash buffers
-        //
-        char pmidstatebuf[32+16]; char* pmidstate = alignup<16>(pmidstatebuf);
-        char pdatabuf[128+16];    char* pdata     = alignup<16>(pdatabuf);
-        char phash1buf[64+16];    char* phash1    = alignup<16>(phash1buf);
+static void SlimCoinPoWMiner(CWallet *pwallet)
+{
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
 
-        FormatHashBuffers(pblock.get(), pmidstate, pdata, phash1);
+    int nThread;
+    {
+        LOCK(cs_minerStats);
+        nThread = nMinerThreadNext++;
+    }
 
-        unsigned int& nBlockTime = *(unsigned int*)(pdata + 64 + 4);
-        unsigned int& nBlockNonce = *(unsigned int*)(pdata + 64 + 12);
+    printf("CPUMiner thread %d started for proof-of-work\n", nThread);
 
+    int64 nRateStart = GetTimeMillis();
+    uint64 nRateHashes = 0;
 
-        //
-        // Search
-        //
-        int64 nStart = GetTime();
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
-        uint256 test_hash;
+    while (fGenerateSlimcoins && !fShutdown)
+    {
+        if (fLimitProcessors && vnThreadsRunning[THREAD_MINER] > nLimitProcessors)
+            break;
+
+        while (pwallet->IsLocked() && !fShutdown)
+        {
+            strMintWarning = strMintMessage;
+            Sleep(1000);
+        }
+        strMintWarning = "";
+
+        //take a private copy of the current template
+        boost::shared_ptr<const CMinerTemplate> ptemplate;
+        {
+            LOCK(cs_minerTemplate);
+            ptemplate = pminerTemplate;
+        }
+
+        if (!ptemplate)
+        {
+            Sleep(100);
+            continue;
+        }
+
+        CBlock block(ptemplate->block);
+        CBlockIndex* pindexPrev = ptemplate->pindexPrev;
+        uint256 hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
 
         for (;;)
         {
-            unsigned int nHashesDone = 0;
-            unsigned int nNonceFound;
+            unsigned int nNonce = 0;
+            int nTake = nMinerWork.Take(ptemplate->nId, nNonce);
+            if (nTake == CMinerWorkCounter::WORK_STALE)
+                break;
 
-            nNonceFound = ScanDcryptHash(pblock.get(), &nHashesDone, &test_hash);
+            if (nTake == CMinerWorkCounter::WORK_EXHAUSTED)
+            {
+                //every nonce of this template is taken, wait for one with the next extranonce
+                fMinerTemplateStale = true;
+                Sleep(100);
+                break;
+            }
+
+            // Update nTime for each range
+            block.nTime = max(pindexPrev->GetMedianTimePast()+1, block.GetMaxTransactionTime());
+            block.nTime = max(block.GetBlockTime(), pindexPrev->GetBlockTime() - nMaxClockDrift);
+            block.UpdateTime(pindexPrev);
 
-            // Check if something found
-            if (nNonceFound != (unsigned int) -1)
+            if (block.GetBlockTime() >= (int64)block.vtx[0].nTime + nMaxClockDrift)
             {
-                if (test_hash <= hashTarget)
-                {
-                    // Found a solution!
+                fMinerTemplateStale = true;  // need to update coinbase timestamp
+                Sleep(100);
+                break;
+            }
 
-                    assert(test_hash == pblock->GetHash());
-                    if (!pblock->SignBlock(*pwalletMain))
-                    {
-                        strMintWarning = strMintMessage;
-                        break;
-                    }
+            //ScanDcryptHash starts after nNonce and stops at the next 0x10000 boundary
+            block.nNonce = nNonce;
 
-                    strMintWarning = "";
-                    SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                    CheckWork(pblock.get(), *pwalletMain, reservekey);
-                    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+            unsigned int nHashesDone = 0;
+            uint256 test_hash;
+            unsigned int nNonceFound = ScanDcryptHash(&block, &nHashesDone, &test_hash);
+
+            if (nNonceFound != (unsigned int) -1 && test_hash <= hashTarget)
+            {
+                // Found a solution!
+                assert(test_hash == block.GetHash());
+                if (!block.SignBlock(*pwalletMain))
+                {
+                    strMintWarning = strMintMessage;
                     break;
                 }
+
+                strMintWarning = "";
+                SetThreadPriority(THREAD_PRIORITY_NORMAL);
+                CheckWork(&block, *pwalletMain, *ptemplate->preservekey);
+                SetThreadPriority(THREAD_PRIORITY_LOWEST);
+                break;
             }
 
             // Meter hashes/sec
-            static int64 nHashCounter;
-            if (nHPSTimerStart == 0)
-            {
-                nHPSTimerStart = GetTimeMillis();
-                nHashCounter = 0;
-            }
-            else
-                nHashCounter += nHashesDone;
-            if (GetTimeMillis() - nHPSTimerStart > 4000)
+            nRateHashes += nHashesDone;
+            if (GetTimeMillis() - nRateStart > 4000)
             {
-                static CCriticalSection cs;
-                {
-                    LOCK(cs);
-                    if (GetTimeMillis() - nHPSTimerStart > 4000)
-                    {
-                        //times 1000 to get to seconds
-                        dHashesPerSec = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStart);
-                        nHPSTimerStart = GetTimeMillis();
-                        nHashCounter = 0;
-                        static int64 nLogTime;
-                        //update with hashing speed information 30 secs
-                        if (GetTime() - nLogTime > 30)
-                        {
-                            nLogTime = GetTime();
-                            printf("%s ", DateTimeStrFormat(GetTime()).c_str());
-                            printf("hashmeter %3d CPUs %6.0f hash/s\n", vnThreadsRunning[THREAD_MINER], dHashesPerSec);
-                            printf("\tPoW Target: %s\n", hashTarget.ToString().c_str());
-                        }
-                    }
-                }
+                //times 1000 to get to seconds
+                UpdateMinerHashesPerSec(nThread, 1000.0 * nRateHashes / (GetTimeMillis() - nRateStart));
+                nRateStart = GetTimeMillis();
+                nRateHashes = 0;
             }
 
-            // Check for stop or if block needs to be rebuilt
-            if (fShutdown)
-                return;
-            if (!fGenerateSlimcoins)
-                return;
-            if (fLimitProcessors && vnThreadsRunning[THREAD_MINER] > nLimitProcessors)
-                return;
-            if (vNodes.empty())
+            // Check for stop
+            if (fShutdown || !fGenerateSlimcoins)
                 break;
-            if (nBlockNonce >= 0xffff0000)
-                break;
-            if (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60)
-                break;
-            if (pindexPrev != pindexBest)
+            if (fLimitProcessors && vnThreadsRunning[THREAD_MINER] > nLimitProcessors)
                 break;
+        }
+    }
+
+    {
+        LOCK(cs_minerStats);
+        mapMinerThreadHashesPerSec.erase(nThread);
+    }
+}
+
+void SlimCoinMiner(CWallet *pwallet, bool fProofOfStake)
+{
+    if (!fProofOfStake)
+    {
+        SlimCoinPoWMiner(pwallet);
+        return;
+    }
 
-            // Update nTime every few seconds
-            pblock->nTime = max(pindexPrev->GetMedianTimePast()+1, pblock->GetMaxTransactionTime());
-            pblock->nTime = max(pblock->GetBlockTime(), pindexPrev->GetBlockTime() - nMaxClockDrift);
-            pblock->UpdateTime(pindexPrev);
-            nBlockTime = ByteReverse(pblock->nTime);
+    printf("CPUMiner started for proof-of-stake\n");
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
 
-            if (pblock->GetBlockTime() >= (int64)pblock->vtx[0].nTime + nMaxClockDrift)
-                break;  // need to update coinbase timestamp
+    CReserveKey reservekey(pwallet);
+    unsigned int nExtraNonce = 0;
+
+    while (true)
+    {
+        if (fShutdown)
+            return;
+
+        while (vNodes.empty() || IsInitialBlockDownload())
+        {
+            Sleep(1000);
+            if (fShutdown)
+                return;
+        }
+
+        while (pwallet->IsLocked())
+        {
+            strMintWarning = strMintMessage;
+            Sleep(1000);
         }
+        strMintWarning = "";
+
+        //
+        // Create new block
+        //
+        CBlockIndex* pindexPrev = pindexBest;
+        /* FIXME: boost::movelib::unique_ptr<CBlock> pblock(CreateNewBlock(pwallet, fProofOfStake)); */
+        unique_ptr<CBlock> pblock(CreateNewBlock(pwallet, fProofOfStake));
+        if (!pblock.get())
+            return;
+
+        IncrementExtraNonce(pblock.get(), pindexPrev, nExtraNonce);
+
+        // ppcoin: if proof-of-stake block found then process block
+        if (pblock->IsProofOfStake())
+        {
+            if (!pblock->SignBlock(*pwalletMain))
+            {
+                strMintWarning = strMintMessage;
+                continue;
+            }
+
+            strMintWarning = "";
+            printf("CPUMiner : proof-of-stake block found %s\n", pblock->GetHash().ToString().c_str()); 
+            SetThreadPriority(THREAD_PRIORITY_NORMAL);
+            CheckWork(pblock.get(), *pwalletMain, reservekey);
+            SetThreadPriority(THREAD_PRIORITY_LOWEST);
+        }
+
+        Sleep(500);
     }
 }
 
@@ -5507,6 +6629,26 @@ void static ThreadSlimcoinMiner(void* parg)
     printf("ThreadSlimcoinMiner exiting, %d threads remaining\n", vnThreadsRunning[THREAD_MINER]);
 }
 
+void static ThreadSlimcoinMinerTemplate(void* parg)
+{
+    CWallet* pwallet = (CWallet*)parg;
+    try
+    {
+        vnThreadsRunning[THREAD_MINER_TEMPLATE]++;
+        SlimCoinMinerTemplate(pwallet);
+        vnThreadsRunning[THREAD_MINER_TEMPLATE]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_MINER_TEMPLATE]--;
+        PrintException(&e, "ThreadSlimcoinMinerTemplate()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_MINER_TEMPLATE]--;
+        PrintException(NULL, "ThreadSlimcoinMinerTemplate()");
+    }
+
+    printf("ThreadSlimcoinMinerTemplate exiting\n");
+}
+
 void GenerateSlimcoins(bool fGenerate, CWallet* pwallet)
 {
     fGenerateSlimcoins = fGenerate;
@@ -5529,6 +6671,11 @@ void GenerateSlimcoins(bool fGenerate, CWallet* pwallet)
         if (fLimitProcessors && nProcessors > nLimitProcessors)
             nProcessors = nLimitProcessors;
 
+        //one template builder feeds all of the hashing threads
+        if (vnThreadsRunning[THREAD_MINER_TEMPLATE] < 1)
+            if (!CreateThread(ThreadSlimcoinMinerTemplate, pwallet))
+                printf("Error: CreateThread(ThreadSlimcoinMinerTemplate) failed\n");
+
         int nAddThreads = nProcessors - vnThreadsRunning[THREAD_MINER];
         printf("Starting %d SlimCoinMiner threads\n", nAddThreads);
 
@@ -11,6 +11,7 @@
 #include "net.h"
 #include "script.h"
 #include "base58.h"
+#include "blockstore.h"
 #include <math.h>       /* pow */
 
 #ifdef WIN32
@@ -18,6 +19,9 @@
 #endif
 
 #include <list>
+#include <atomic>
+
+#include <boost/unordered_map.hpp>
 
 //the size of the block to hash, from the nVersion to the nNonce
 #define HASH_PBLOCK_SIZE(pblock)  UEND(pblock->nNonce) - UBEGIN(pblock->nVersion)
@@ -32,6 +36,7 @@ class COutPoint;
 class CWalletTx;
 class CTransaction;
 class CTxOut;
+class CDiskTxPos;
 
 
 class CAddress;
@@ -53,6 +58,9 @@ static const int64 MIN_TXOUT_AMOUNT = MIN_TX_FEE;
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 750;
 inline bool MoneyRange(int64 nValue) { return (nValue >= 0 && nValue <= MAX_MONEY); }
 static const int COINBASE_MATURITY_SLM = 500;
+// -prune never deletes the blocks this deep from the best block, reorganizations and
+// rescans of recent blocks still find them
+static const int PRUNE_MIN_BLOCKS_TO_KEEP = 2880;
 // Threshold for nLockTime: below this value it is interpreted as block number, otherwise as UNIX timestamp.
 static const int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 static const int STAKE_TARGET_SPACING = 90; // 90 second block spacing 
@@ -78,8 +86,56 @@ extern CScript COINBASE_FLAGS;
 
 
 
+uint64 GetBlockHasherSalt();
+
+/** Hash of a block hash for BlockMap. Block hashes are uniform already, so their low
+ * 64 bits do; the per-process salt keeps peers from predicting the buckets. */
+struct BlockHasher
+{
+    size_t operator()(const uint256& hash) const
+    {
+        uint64 n = (hash.Get64(0) ^ GetBlockHasherSalt()) * 0x9e3779b97f4a7c15ULL;
+        return (size_t)(n ^ (n >> 32));
+    }
+};
+
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+
+/** Slab allocator behind CBlockIndex::operator new. Entries are handed out in order
+ * from slabs of ENTRIES_PER_SLAB, so block indexes allocated one after the other,
+ * as a chain is loaded or connected, are next to each other in memory and a pprev
+ * walk stays in few pages. Freed entries are reused first.
+ */
+class CBlockIndexArena
+{
+private:
+    CCriticalSection cs;
+    std::vector<char*> vSlab;
+    unsigned int nEntrySize;
+    unsigned int nSlabUsed;
+    void* pFree;
+    uint64 nCount;
+
+public:
+    static const unsigned int ENTRIES_PER_SLAB = 4096;
+
+    CBlockIndexArena(unsigned int nEntrySizeIn);
+    ~CBlockIndexArena();
+    void* Allocate();
+    void Free(void* p);
+
+    uint64 GetCount();
+    // bytes of all slabs
+    uint64 GetSize();
+};
+
+extern CBlockIndexArena blockIndexArena;
+
+// Approximate memory of mapBlockIndex and its entries
+void GetBlockIndexMemoryUsage(uint64& nEntries, uint64& nBytes);
+
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern std::set<std::pair<uint256, uint256> > setBurnSeen;
 extern uint256 hashGenesisBlock;
@@ -98,6 +154,9 @@ extern int64 nLastCoinStakeSearchInterval;
 extern const std::string strMessageMagic;
 extern double dHashesPerSec;
 extern int64 nHPSTimerStart;
+extern std::atomic<uint64> nBlockHashesComputed;
+extern std::atomic<uint64> nBlockHashesCached;
+extern CCriticalSection cs_blockHashCache;
 extern int64 nTimeBestReceived;
 extern CCriticalSection cs_setpwalletRegistered;
 extern std::set<CWallet*> setpwalletRegistered;
@@ -106,6 +165,59 @@ extern std::map<uint256, CBlock*> mapOrphanBlocks;
 // Settings
 extern int64 nTransactionFee;
 extern int64 nReserveBalance;
+extern uint64 nPruneTarget;
+extern int nPruneHeight;
+extern int64 nBlockCacheMaxSize;
+
+/** Size and hit counts of the getdata block cache */
+struct CBlockCacheStats
+{
+    int64 nMaxSize;
+    uint64 nCount;
+    uint64 nSize;
+    uint64 nHits;
+    uint64 nMisses;
+};
+
+/** Hands out disjoint nonce ranges of the current proof-of-work template to the
+ * hashing threads without a lock. The high 32 bits of the counter are the template
+ * id, so a range taken for an old template is recognized and thrown away.
+ */
+class CMinerWorkCounter
+{
+private:
+    std::atomic<uint64> nWork;  // template id << 32 | next nonce range
+
+public:
+    static const unsigned int RANGE_BITS = 16;  // ScanDcryptHash returns every 0x10000 nonces
+    static const uint64 RANGES_PER_TEMPLATE = (uint64)1 << (32 - RANGE_BITS);
+
+    enum
+    {
+        WORK_RANGE,     // nNonceRet starts a range of the template
+        WORK_STALE,     // the counter moved on to another template
+        WORK_EXHAUSTED, // every range of the template was taken
+    };
+
+    CMinerWorkCounter() : nWork(0) { }
+
+    void Reset(unsigned int nTemplateId)
+    {
+        nWork = (uint64)nTemplateId << 32;
+    }
+
+    int Take(unsigned int nTemplateId, unsigned int& nNonceRet)
+    {
+        uint64 nTaken = nWork++;
+        if ((nTaken >> 32) != nTemplateId)
+            return WORK_STALE;
+        uint64 nRange = nTaken & 0xffffffff;
+        if (nRange >= RANGES_PER_TEMPLATE)
+            return WORK_EXHAUSTED;
+        nNonceRet = (unsigned int)(nRange << RANGE_BITS);
+        return WORK_RANGE;
+    }
+};
 
 //////////////////////////////////////////////////////////////////////////////
 /*                              Proof Of Burn                               */
@@ -167,6 +279,12 @@ bool GetBurnHash(uint256 hashPrevBlock, s32int burnBlkHeight, s32int burnCTx,
                                  s32int burnCTxOut, uint256 &smallestHashRet, bool fRetIntermediate);
 bool GetAllTxClassesByIndex(s32int blkHeight, s32int txDepth, s32int txOutDepth, 
                                                         CBlock &blockRet, CTransaction &txRet, CTxOut &txOutRet);
+//pfMalformed is set when the indexes do not point to a burn output of the main chain
+bool GetBurnTxByIndex(s32int blkHeight, s32int txDepth, s32int txOutDepth,
+                      uint256 &hashBlockRet, CTransaction &txRet, CTxOut &txOutRet, bool *pfMalformed=NULL);
+bool InitBurnTxIndex();
+//checks the burn hashes of many proof-of-burn block indexes at once, on a pool of threads
+bool CheckProofOfBurnHashes(const std::vector<const CBlockIndex*> &vpindex, const CBlockIndex **ppindexFailRet=NULL);
 
 //Scans all of the hashes of this transaction and returns the smallest one
 bool ScanBurnHashes(const CWalletTx &burnWTx, uint256 &smallestHashRet);
@@ -240,12 +358,27 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 bool CheckDiskSpace(uint64 nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(unsigned int& nFileRet);
+bool IsBlockPruned(const CBlockIndex* pindex);
+// The "block" message for pindex, from the -blockcachesize cache or the block file.
+// NULL if the block was pruned or can't be read.
+CSendBufferRef GetBlockMessage(const CBlockIndex* pindex);
+void GetBlockCacheStats(CBlockCacheStats& stats);
+bool CanPruneBlockFiles();
+void ThreadPruneBlockFiles(void* parg);
+// Byte ranges [first, second) of one block file
+typedef std::vector<std::pair<unsigned int, unsigned int> > PruneRanges;
+void AddPruneRange(std::map<unsigned int, PruneRanges>& mapRanges, unsigned int nFile, unsigned int nBegin, unsigned int nEnd);
+// Whether tx, at posTx of a block about to be pruned, has to stay in the block files.
+// ptxindex is its tx index entry, NULL when there is none.
+bool KeepPrunedTx(const CTransaction& tx, const CTxIndex* ptxindex, const CDiskTxPos& posTx,
+                  const std::set<std::pair<unsigned int, unsigned int> >& setRecentBlocks);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 void GenerateSlimcoins(bool fGenerate, CWallet* pwallet);
+void GetMinerThreadHashesPerSec(std::vector<double>& vRates);
 CBlock *CreateNewBlock(CWallet* pwallet, bool fProofOfStake=false, const CWalletTx *burnWalletTx=NULL, CReserveKey *resKey=NULL);
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash1);
@@ -263,6 +396,9 @@ uint256 WantedByOrphan(const CBlock* pblockOrphan);
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
 void SlimCoinMiner(CWallet *pwallet, bool fProofOfStake);
 CBlockIndex *pindexByHeight(s32int nHeight);
+void SetBestChainIndex(CBlockIndex *pindexNew);
+//the number of proof of work blocks at or below nHeight in the best chain
+s32int GetPoWBlockCount(s32int nHeight);
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
 
 //Returns the number of proof of work blocks between (not including) the
@@ -327,6 +463,27 @@ public:
 };
 
 
+/** Where the transaction that pays to the burn address, the nTx'th of its block, is in
+ * the block files. Proof-of-burn checks seek straight to it instead of reading the block. */
+class CBurnTxLocation
+{
+public:
+    uint256 hashTx;
+    CDiskTxPos pos;
+
+    CBurnTxLocation()
+    {
+        hashTx = 0;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashTx);
+        READWRITE(pos);
+    )
+};
+
+
 
 /** An inpoint - a combination of a transaction and an index n into its vin */
 class CInPoint
@@ -845,6 +1002,11 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
+        // Straight from the memory mapped block file when the caller doesn't want the file.
+        // -prune zeroes the transactions it deletes, they read back as a null transaction
+        if (!pfileRet && blockStore.Read(pos.nFile, pos.nTxPos, *this, SER_DISK, CLIENT_VERSION))
+            return IsNull() ? error("CTransaction::ReadFromDisk() : transaction pruned") : true;
+
         CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
@@ -859,6 +1021,8 @@ public:
         catch (std::exception &e) {
             return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
         }
+        if (IsNull())
+            return error("CTransaction::ReadFromDisk() : transaction pruned");
 
         // Return file pointer
         if (pfileRet)
@@ -1117,6 +1281,16 @@ public:
     // memory only
     mutable std::vector<uint256> vMerkleTree;
 
+    // memory only: the dcrypt hash of the header and the header it was computed from,
+    // const calls fill it in, so it is only touched under cs_blockHashCache
+    mutable bool fHashCached;
+    mutable uint256 hashCached;
+    mutable unsigned char vchHeaderCached[sizeof(int) + 2 * sizeof(uint256) + 3 * sizeof(unsigned int)];
+
+    // memory only: CheckBlock() already passed, the -loadblock workers set it so
+    // ProcessBlock() and ConnectBlock() don't check the block again
+    bool fChecked;
+
     // Denial-of-service detection:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
@@ -1179,6 +1353,8 @@ public:
         vtx.clear();
         vchBlockSig.clear();
         vMerkleTree.clear();
+        fHashCached = false;
+        fChecked = false;
         nDoS = 0;
     }
 
@@ -1187,9 +1363,32 @@ public:
         return (nBits == 0);
     }
 
+    // The header fields are changed in place (nNonce, nTime, hashMerkleRoot...), so the
+    // cached hash is only used while the header still matches the one it was computed from
     uint256 GetHash() const
     {
-        return DcryptHash(BEGIN(nVersion), END(nNonce));
+        {
+            LOCK(cs_blockHashCache);
+            if (fHashCached && memcmp(BEGIN(nVersion), vchHeaderCached, sizeof(vchHeaderCached)) == 0)
+            {
+                nBlockHashesCached++;
+                return hashCached;
+            }
+        }
+
+        uint256 hash = DcryptHash(BEGIN(nVersion), END(nNonce));
+        SetCachedHash(hash);
+        nBlockHashesComputed++;
+        return hash;
+    }
+
+    // for callers that just dcrypt hashed this exact header themselves, like the miner
+    void SetCachedHash(const uint256& hash) const
+    {
+        LOCK(cs_blockHashCache);
+        memcpy(vchHeaderCached, BEGIN(nVersion), sizeof(vchHeaderCached));
+        hashCached = hash;
+        fHashCached = true;
     }
 
     // PoB
@@ -1208,10 +1407,10 @@ public:
     //check this block's coinbase public key signature with that of the given transaction index
     bool BurnCheckPubKeys(s32int blkHeight, s32int txDepth, s32int txOutDepth) const
     {
-        CBlock indexBlock;
+        uint256 hashIndexBlock;
         CTransaction indexTx;
         CTxOut indexTxOut;
-        if(!GetAllTxClassesByIndex(blkHeight, txDepth, txOutDepth, indexBlock, indexTx, indexTxOut))
+        if(!GetBurnTxByIndex(blkHeight, txDepth, txOutDepth, hashIndexBlock, indexTx, indexTxOut))
             return false;
 
         CScript indexTxScript;
@@ -1378,19 +1577,24 @@ public:
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
+        // Read block from the memory mapped block file
+        int nType = SER_DISK | (fReadTransactions ? 0 : SER_BLOCKHEADERONLY);
+        if (!blockStore.Read(nFile, nBlockPos, *this, nType, CLIENT_VERSION))
+        {
+            SetNull();
 
-        // Read block
-        try {
-            filein >> *this;
-        }
-        catch (std::exception &e) {
-            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+            // Open history file to read
+            CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), nType, CLIENT_VERSION);
+            if (!filein)
+                return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+
+            // Read block
+            try {
+                filein >> *this;
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+            }
         }
 
         // Check the header
@@ -1465,6 +1669,22 @@ private:
 class CBlockIndex
 {
 public:
+    // Block indexes come from blockIndexArena; derived classes use the heap
+    static void* operator new(size_t nSize)
+    {
+        if (nSize != sizeof(CBlockIndex))
+            return ::operator new(nSize);
+        return blockIndexArena.Allocate();
+    }
+
+    static void operator delete(void* p, size_t nSize)
+    {
+        if (nSize != sizeof(CBlockIndex))
+            ::operator delete(p);
+        else
+            blockIndexArena.Free(p);
+    }
+
     const uint256* phashBlock;
     CBlockIndex* pprev;
     CBlockIndex* pnext;
@@ -1759,6 +1979,9 @@ class CDiskBlockIndex : public CBlockIndex
 private:
     uint256 blockHash;
 
+    // memory only: blockHash was computed from this header, not just read from disk
+    bool fBlockHashChecked;
+
 public:
     uint256 hashPrev;
     uint256 hashNext;
@@ -1768,13 +1991,17 @@ public:
         hashPrev = 0;
         hashNext = 0;
         blockHash = 0;
-
+        fBlockHashChecked = false;
     }
 
     explicit CDiskBlockIndex(CBlockIndex* pindex) : CBlockIndex(*pindex)
     {
         hashPrev = (pprev ? pprev->GetBlockHash() : 0);
         hashNext = (pnext ? pnext->GetBlockHash() : 0);
+
+        // the index is keyed by the hash of its header, write it out so it need not be recomputed on load
+        blockHash = (phashBlock ? *phashBlock : 0);
+        fBlockHashChecked = (phashBlock != NULL);
     }
 
     IMPLEMENT_SERIALIZE
@@ -1826,6 +2053,9 @@ public:
 
     uint256 GetBlockHash() const
     {
+        if(fBlockHashChecked)
+            return blockHash;
+
         if(fUseFastIndex && (nTime < GetAdjustedTime() - 24 * 60 * 60) && blockHash != 0)
             return blockHash;
 
@@ -1839,6 +2069,7 @@ public:
 
         //assign the cached value to be written a value
         const_cast<CDiskBlockIndex*>(this)->blockHash = block.GetHash();
+        const_cast<CDiskBlockIndex*>(this)->fBlockHashChecked = true;
         return blockHash;
     }
 
@@ -1888,7 +2119,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1939,7 +2170,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1958,7 +2189,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1974,7 +2205,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
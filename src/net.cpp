@@ -17,6 +17,16 @@
 #include <string.h>
 #endif
 
+#ifndef WIN32
+#include <sys/uio.h>
+#endif
+
+#ifdef __linux__
+#define USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 #undef USE_UPNP
 #ifdef USE_UPNP
 #include <miniupnpc/miniwget.h>
@@ -68,6 +78,17 @@ map<CInv, int64> mapAlreadyAskedFor;
 set<CNetAddr> setservAddNodeAddresses;
 CCriticalSection cs_setservAddNodeAddresses;
 
+// nodes with work for ThreadMessageHandler2, see WakeMessageHandler()
+static deque<CNode*> vNodesToProcess;
+static boost::mutex mutexMessageHandler;
+static boost::condition_variable condMessageHandler;
+
+#ifdef USE_EPOLL
+// nodes other threads queued data for, see WakeSocketHandler()
+static set<CNode*> setNodesToWake;
+static CCriticalSection cs_setNodesToWake;
+#endif
+
 static CSemaphore *semOutbound = NULL;
 
 unsigned short GetListenPort()
@@ -369,6 +390,7 @@ CNode* ConnectNode(CAddress addrConnect, int64 nTimeout)
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        WakeSocketHandler(pnode);
 
         pnode->nTimeConnected = GetTime();
         return pnode;
@@ -389,7 +411,7 @@ void CNode::CloseSocketDisconnect()
         printf("disconnecting node %s\n", addr.ToString().c_str());
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
-        vRecv.clear();
+        // vRecvMsg stays, ProcessMessages() may be in the middle of one of them
     }
 }
 
@@ -397,6 +419,77 @@ void CNode::Cleanup()
 {
 }
 
+bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes, bool& fCompleteRet)
+{
+    while (nBytes > 0)
+    {
+        // start a new message
+        if (vRecvMsg.empty() || vRecvMsg.back().Complete())
+            vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
+
+        CNetMessage& msg = vRecvMsg.back();
+        int nUsed;
+        if (!msg.fInData)
+            nUsed = msg.ReadHeader(pch, nBytes);
+        else
+            nUsed = msg.ReadData(pch, nBytes);
+        if (nUsed < 0)
+            return false;
+
+        pch += nUsed;
+        nBytes -= nUsed;
+        if (msg.Complete())
+            fCompleteRet = true;
+    }
+    return true;
+}
+
+int CNetMessage::ReadHeader(const char* pch, unsigned int nBytes)
+{
+    // copy what there is of the header
+    unsigned int nRemaining = CMessageHeader::HEADER_SIZE - nHdrPos;
+    unsigned int nCopy = std::min(nRemaining, nBytes);
+    memcpy(&hdrbuf[nHdrPos], pch, nCopy);
+    nHdrPos += nCopy;
+
+    if (nHdrPos < CMessageHeader::HEADER_SIZE)
+        return nCopy;
+
+    try {
+        hdrbuf >> hdr;
+    }
+    catch (std::exception& e) {
+        return -1;
+    }
+    if (!hdr.IsValid())
+    {
+        printf("CNetMessage::ReadHeader() : errors in header %s\n", hdr.GetCommand().c_str());
+        return -1;
+    }
+
+    fInData = true;
+    return nCopy;
+}
+
+int CNetMessage::ReadData(const char* pch, unsigned int nBytes)
+{
+    unsigned int nSpace;
+    char* pchDest = GetDataBuffer(nSpace);
+    unsigned int nCopy = std::min(nSpace, nBytes);
+    memcpy(pchDest, pch, nCopy);
+    nDataPos += nCopy;
+    return nCopy;
+}
+
+char* CNetMessage::GetDataBuffer(unsigned int& nSpaceRet)
+{
+    // grow by at most 256 KB ahead of the data, not to what the header claims
+    if (vRecv.size() == nDataPos)
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + 256 * 1024));
+    nSpaceRet = vRecv.size() - nDataPos;
+    return &vRecv[nDataPos];
+}
+
 
 void CNode::PushVersion()
 {
@@ -507,83 +600,625 @@ void ThreadSocketHandler(void* parg)
     printf("ThreadSocketHandler exiting\n");
 }
 
-void ThreadSocketHandler2(void* parg)
+// Move nodes that are done to vNodesDisconnected and delete the ones no thread holds anymore
+static void DisconnectNodes(list<CNode*>& vNodesDisconnected, set<CNode*>* psetReady)
+{
+    LOCK(cs_vNodes);
+    // Disconnect unused nodes
+    vector<CNode*> vNodesCopy = vNodes;
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        if (pnode->fDisconnect ||
+            (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->vSendMsg.empty()))
+        {
+            // remove from vNodes
+            vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+
+            if (pnode->fHasGrant)
+                semOutbound->post();
+            pnode->fHasGrant = false;
+
+            // close socket and cleanup
+            pnode->CloseSocketDisconnect();
+            pnode->Cleanup();
+
+            // hold in disconnected pool until all refs are released
+            pnode->nReleaseTime = max(pnode->nReleaseTime, GetTime() + 15 * 60);
+            if (pnode->fNetworkNode || pnode->fInbound)
+                pnode->Release();
+            vNodesDisconnected.push_back(pnode);
+        }
+    }
+
+    // Delete disconnected nodes
+    list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+    BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+    {
+        // wait until threads are done using it
+        if (pnode->GetRefCount() <= 0)
+        {
+            bool fDelete = false;
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend)
+                {
+                    TRY_LOCK(pnode->cs_vRecv, lockRecv);
+                    if (lockRecv)
+                    {
+                        TRY_LOCK(pnode->cs_mapRequests, lockReq);
+                        if (lockReq)
+                        {
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
+                        }
+                    }
+                }
+            }
+            if (fDelete)
+            {
+                vNodesDisconnected.remove(pnode);
+                if (psetReady)
+                    psetReady->erase(pnode);
+                {
+                    boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+                    if (pnode->fMessageHandlerQueued)
+                        vNodesToProcess.erase(remove(vNodesToProcess.begin(), vNodesToProcess.end(), pnode), vNodesToProcess.end());
+                }
+#ifdef USE_EPOLL
+                {
+                    LOCK(cs_setNodesToWake);
+                    setNodesToWake.erase(pnode);
+                }
+#endif
+                delete pnode;
+            }
+        }
+    }
+}
+
+// Accept one connection on the listen socket. False when there was none to accept.
+static bool AcceptConnection(CNode** ppnodeRet)
+{
+    *ppnodeRet = NULL;
+    struct sockaddr_in sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            printf("socket error accept failed: %d\n", nErr);
+        return false;
+    }
+    addr = CAddress(sockaddr);
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
+    {
+        {
+            LOCK(cs_setservAddNodeAddresses);
+            if (!setservAddNodeAddresses.count(addr))
+                closesocket(hSocket);
+        }
+    }
+    else if (CNode::IsBanned(addr))
+    {
+        printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
+        closesocket(hSocket);
+    }
+    else
+    {
+        printf("accepted connection %s\n", addr.ToString().c_str());
+        CNode* pnode = new CNode(hSocket, addr, true);
+        pnode->AddRef();
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+        *ppnodeRet = pnode;
+    }
+    return true;
+}
+
+// Read from the socket into vRecvMsg, at most nMaxReads times. False when the socket
+// may have more to read. fMessageRet is set when a message was completed.
+// The caller holds cs_vRecv.
+static bool SocketRecv(CNode* pnode, int nMaxReads, bool& fMessageRet)
+{
+    for (int i = 0; i < nMaxReads; i++)
+    {
+        if (pnode->hSocket == INVALID_SOCKET)
+            return true;
+
+        unsigned int nRecvSize = pnode->GetRecvSize();
+        if (nRecvSize > ReceiveBufferSize()) {
+            if (!pnode->fDisconnect)
+                printf("socket recv flood control disconnect (%u bytes)\n", nRecvSize);
+            pnode->CloseSocketDisconnect();
+            return true;
+        }
+
+        // A payload is read straight into its message, anything else through pchBuf
+        CNetMessage* pmsg = NULL;
+        if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.back().fInData && !pnode->vRecvMsg.back().Complete())
+            pmsg = &pnode->vRecvMsg.back();
+
+        // typical socket buffer is 8K-64K
+        char pchBuf[0x10000];
+        char* pchDest = pchBuf;
+        unsigned int nSpace = sizeof(pchBuf);
+        if (pmsg)
+            pchDest = pmsg->GetDataBuffer(nSpace);
+
+        int nBytes = recv(pnode->hSocket, pchDest, nSpace, MSG_DONTWAIT);
+        if (nBytes > 0)
+        {
+            if (pmsg)
+            {
+                pmsg->nDataPos += nBytes;
+                if (pmsg->Complete())
+                    fMessageRet = true;
+            }
+            else
+            {
+                if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, fMessageRet))
+                {
+                    if (!pnode->fDisconnect)
+                        printf("socket recv bad message header from %s\n", pnode->addr.ToString().c_str());
+                    pnode->CloseSocketDisconnect();
+                    return true;
+                }
+            }
+            pnode->nLastRecv = GetTime();
+        }
+        else if (nBytes == 0)
+        {
+            // socket closed gracefully
+            if (!pnode->fDisconnect)
+                printf("socket closed\n");
+            pnode->CloseSocketDisconnect();
+            return true;
+        }
+        else
+        {
+            // error
+            int nErr = WSAGetLastError();
+            if (nErr == WSAEWOULDBLOCK)
+                return true;
+            if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+            {
+                if (!pnode->fDisconnect)
+                    printf("socket recv error %d\n", nErr);
+                pnode->CloseSocketDisconnect();
+                return true;
+            }
+            return false;
+        }
+    }
+    return false;
+}
+
+// Read from the socket, and queue the node for the message handler once a message is complete.
+// False when the socket may have more to read: vRecvMsg was busy or the reads ran out.
+static bool SocketRecvData(CNode* pnode, int nMaxReads)
+{
+    bool fDone;
+    bool fMessage = false;
+    {
+        TRY_LOCK(pnode->cs_vRecv, lockRecv);
+        if (!lockRecv)
+            return false;
+        fDone = SocketRecv(pnode, nMaxReads, fMessage);
+    }
+    if (fMessage)
+        WakeMessageHandler(pnode);
+    return fDone;
+}
+
+// Write vSendMsg to the socket until it is empty or the socket is full, fWouldBlockRet
+// tells which. False when vSendMsg was busy. Up to MAX_SEND_BUFFERS queued buffers go
+// out in one sendmsg().
+static const int MAX_SEND_BUFFERS = 64;
+
+static bool SocketSendData(CNode* pnode, bool& fWouldBlockRet)
+{
+    fWouldBlockRet = false;
+    TRY_LOCK(pnode->cs_vSend, lockSend);
+    if (!lockSend)
+        return false;
+
+    deque<CSendBufferRef>& vSendMsg = pnode->vSendMsg;
+    while (!vSendMsg.empty() && pnode->hSocket != INVALID_SOCKET)
+    {
+#ifdef WIN32
+        const CSerializeData& data = *vSendMsg.front();
+        unsigned int nSize = data.size() - pnode->nSendOffset;
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nSize, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        struct iovec vIov[MAX_SEND_BUFFERS];
+        int nIov = 0;
+        unsigned int nSize = 0;
+        for (deque<CSendBufferRef>::iterator it = vSendMsg.begin(); it != vSendMsg.end() && nIov < MAX_SEND_BUFFERS; ++it, ++nIov)
+        {
+            const CSerializeData& data = **it;
+            unsigned int nOffset = (nIov == 0 ? pnode->nSendOffset : 0);
+            vIov[nIov].iov_base = (void*)&data[nOffset];
+            vIov[nIov].iov_len = data.size() - nOffset;
+            nSize += data.size() - nOffset;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = vIov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+        if (nBytes > 0)
+        {
+            pnode->nLastSend = GetTime();
+            pnode->nSendSize -= nBytes;
+
+            // drop the buffers that went out whole
+            unsigned int nLeft = nBytes;
+            while (nLeft > 0)
+            {
+                unsigned int nRemaining = vSendMsg.front()->size() - pnode->nSendOffset;
+                if (nLeft < nRemaining)
+                {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nRemaining;
+                pnode->nSendOffset = 0;
+                vSendMsg.pop_front();
+            }
+
+            // a short write means the kernel buffer is full
+            if ((unsigned int)nBytes < nSize)
+            {
+                fWouldBlockRet = true;
+                break;
+            }
+        }
+        else
+        {
+            if (nBytes < 0)
+            {
+                // error
+                int nErr = WSAGetLastError();
+                if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                {
+                    printf("socket send error %d\n", nErr);
+                    pnode->CloseSocketDisconnect();
+                }
+            }
+            fWouldBlockRet = true;
+            break;
+        }
+    }
+    if (pnode->nSendSize > SendBufferSize()) {
+        if (!pnode->fDisconnect)
+            printf("socket send flood control disconnect (%" PRI64u " bytes)\n", pnode->nSendSize);
+        pnode->CloseSocketDisconnect();
+    }
+    return true;
+}
+
+static void InactivityCheck(CNode* pnode)
+{
+    if (pnode->vSendMsg.empty())
+        pnode->nLastSendEmpty = GetTime();
+    if (GetTime() - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
+        {
+            printf("socket not sending\n");
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastRecv > 90*60)
+        {
+            printf("socket inactivity timeout\n");
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+static void MainFrameRepaintOnNodeCount(unsigned int& nPrevNodeCount)
+{
+    if (vNodes.size() != nPrevNodeCount)
+    {
+        nPrevNodeCount = vNodes.size();
+        MainFrameRepaint();
+    }
+}
+
+#ifdef USE_EPOLL
+//
+// epoll socket engine
+//
+// Every socket is registered once, edge triggered, with the node as its data. An edge
+// sets fSocketReadable/fSocketWritable and the socket thread then reads and writes until
+// the kernel says EAGAIN, so an idle connection costs nothing per iteration. Nodes that
+// still have work (a busy lock, a read budget used up) stay in setReady and are retried
+// after a short wait. Other threads wake the loop through an eventfd when they queue
+// data on an empty vSendMsg or add an outbound node, see WakeSocketHandler().
+//
+
+static int hEpoll = -1;
+static int hWakeEvent = -1;
+
+// tags for the epoll data of the listen socket and the eventfd
+static char chListenTag;
+static char chWakeTag;
+
+// reads per node and pass, so one fast peer can't starve the others
+static const int EPOLL_MAX_READS = 16;
+static const int EPOLL_MAX_ACCEPTS = 64;
+
+static bool InitSocketEpoll()
+{
+    hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (hEpoll == -1)
+        return error("InitSocketEpoll() : epoll_create1 failed, error %d", errno);
+
+    int hEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (hEvent == -1)
+    {
+        close(hEpoll);
+        hEpoll = -1;
+        return error("InitSocketEpoll() : eventfd failed, error %d", errno);
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &chWakeTag;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hEvent, &ev) == -1)
+    {
+        close(hEvent);
+        close(hEpoll);
+        hEpoll = -1;
+        return error("InitSocketEpoll() : adding the eventfd failed, error %d", errno);
+    }
+
+    if (hListenSocket != INVALID_SOCKET)
+    {
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = &chListenTag;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &ev) == -1)
+            printf("InitSocketEpoll() : adding the listen socket failed, error %d\n", errno);
+    }
+
+    hWakeEvent = hEvent;
+    printf("ThreadSocketHandler using epoll\n");
+    return true;
+}
+
+static void RegisterSocketEpoll(CNode* pnode)
+{
+    if (pnode->fSocketRegistered || pnode->hSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &ev) == -1)
+    {
+        printf("epoll_ctl add failed for %s, error %d\n", pnode->addr.ToString().c_str(), errno);
+        pnode->CloseSocketDisconnect();
+        return;
+    }
+    pnode->fSocketRegistered = true;
+    // whatever arrived before the registration produced no edge
+    pnode->fSocketReadable = true;
+    pnode->fSocketWritable = true;
+}
+
+static void ThreadSocketHandlerEpoll(list<CNode*>& vNodesDisconnected)
 {
-    printf("ThreadSocketHandler started\n");
-    list<CNode*> vNodesDisconnected;
     unsigned int nPrevNodeCount = 0;
+    set<CNode*> setReady;
+    bool fAcceptPending = false;
+    int64 nLastSweep = 0;
+    struct epoll_event vEvents[256];
 
     while (true)
     {
         //
-        // Disconnect nodes
+        // Disconnect nodes and check for inactivity, a few times a second
         //
+        int64 nNow = GetTimeMillis();
+        if (nNow - nLastSweep >= 250)
         {
+            nLastSweep = nNow;
+            DisconnectNodes(vNodesDisconnected, &setReady);
+            MainFrameRepaintOnNodeCount(nPrevNodeCount);
+
             LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            BOOST_FOREACH(CNode* pnode, vNodes)
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->vSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
-
-                    if (pnode->fHasGrant)
-                        semOutbound->post();
-                    pnode->fHasGrant = false;
+                // outbound nodes are registered through the wake set, this is a backstop
+                RegisterSocketEpoll(pnode);
+                InactivityCheck(pnode);
+            }
+        }
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
-                    pnode->Cleanup();
+        //
+        // Wait for socket edges
+        //
+        int nTimeout = (setReady.empty() && !fAcceptPending) ? 250 : 10;
+        vnThreadsRunning[THREAD_SOCKETHANDLER]--;
+        int nEvents = epoll_wait(hEpoll, vEvents, sizeof(vEvents) / sizeof(vEvents[0]), nTimeout);
+        vnThreadsRunning[THREAD_SOCKETHANDLER]++;
+        if (fShutdown)
+            return;
+        if (nEvents == -1)
+        {
+            if (errno != EINTR)
+            {
+                printf("socket epoll_wait error %d\n", errno);
+                Sleep(nTimeout);
+            }
+            nEvents = 0;
+        }
 
-                    // hold in disconnected pool until all refs are released
-                    pnode->nReleaseTime = max(pnode->nReleaseTime, GetTime() + 15 * 60);
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+        for (int i = 0; i < nEvents; i++)
+        {
+            void* ptr = vEvents[i].data.ptr;
+            if (ptr == &chListenTag)
+                fAcceptPending = true;
+            else if (ptr == &chWakeTag)
+            {
+                uint64_t nCount;
+                while (read(hWakeEvent, &nCount, sizeof(nCount)) == sizeof(nCount))
+                    ;
             }
+            else
+            {
+                CNode* pnode = (CNode*)ptr;
+                if (vEvents[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    pnode->fSocketReadable = true;
+                if (vEvents[i].events & EPOLLOUT)
+                    pnode->fSocketWritable = true;
+                setReady.insert(pnode);
+            }
+        }
+
+        // Nodes other threads queued data for
+        {
+            LOCK(cs_setNodesToWake);
+            BOOST_FOREACH(CNode* pnode, setNodesToWake)
+                setReady.insert(pnode);
+            setNodesToWake.clear();
+        }
 
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+        //
+        // Accept new connections
+        //
+        if (fAcceptPending)
+        {
+            fAcceptPending = false;
+            for (int n = 0; ; n++)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                if (n == EPOLL_MAX_ACCEPTS)
                 {
-                    bool fDelete = false;
-                    {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
-                        {
-                            TRY_LOCK(pnode->cs_vRecv, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_mapRequests, lockReq);
-                                if (lockReq)
-                                {
-                                    TRY_LOCK(pnode->cs_inventory, lockInv);
-                                    if (lockInv)
-                                        fDelete = true;
-                                }
-                            }
-                        }
-                    }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
+                    fAcceptPending = true;
+                    break;
+                }
+                CNode* pnode;
+                if (!AcceptConnection(&pnode))
+                    break;
+                if (pnode)
+                {
+                    RegisterSocketEpoll(pnode);
+                    setReady.insert(pnode);
                 }
             }
         }
-        if (vNodes.size() != nPrevNodeCount)
+
+        if (setReady.empty())
+            continue;
+
+        //
+        // Service the ready sockets
+        //
+        vector<CNode*> vNodesCopy(setReady.begin(), setReady.end());
         {
-            nPrevNodeCount = vNodes.size();
-            MainFrameRepaint();
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
+        }
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        {
+            if (fShutdown)
+                return;
+
+            RegisterSocketEpoll(pnode);
+            if (pnode->hSocket == INVALID_SOCKET)
+            {
+                setReady.erase(pnode);
+                continue;
+            }
+
+            if (pnode->fSocketReadable && SocketRecvData(pnode, EPOLL_MAX_READS))
+                pnode->fSocketReadable = false;
+
+            bool fSendPending = false;
+            if (pnode->fSocketWritable && pnode->hSocket != INVALID_SOCKET)
+            {
+                bool fWouldBlock;
+                if (!SocketSendData(pnode, fWouldBlock))
+                    fSendPending = true;
+                else if (fWouldBlock)
+                    pnode->fSocketWritable = false;
+            }
+
+            if (pnode->hSocket == INVALID_SOCKET || (!pnode->fSocketReadable && !fSendPending))
+                setReady.erase(pnode);
         }
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->Release();
+        }
+    }
+}
+#endif
+
+void WakeSocketHandler(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    if (hWakeEvent == -1)
+        return;
+    {
+        LOCK(cs_setNodesToWake);
+        bool fWasEmpty = setNodesToWake.empty();
+        setNodesToWake.insert(pnode);
+        // the socket thread hasn't picked up the last wake yet
+        if (!fWasEmpty)
+            return;
+    }
+    uint64_t nOne = 1;
+    if (write(hWakeEvent, &nOne, sizeof(nOne)) != sizeof(nOne) && errno != EAGAIN)
+        printf("WakeSocketHandler() : eventfd write failed, error %d\n", errno);
+#endif
+}
+
+void ThreadSocketHandler2(void* parg)
+{
+    printf("ThreadSocketHandler started\n");
+    list<CNode*> vNodesDisconnected;
+    unsigned int nPrevNodeCount = 0;
+
+#ifdef USE_EPOLL
+    if (GetBoolArg("-epoll", true) && InitSocketEpoll())
+    {
+        ThreadSocketHandlerEpoll(vNodesDisconnected);
+        return;
+    }
+#endif
+
+    while (true)
+    {
+        //
+        // Disconnect nodes
+        //
+        DisconnectNodes(vNodesDisconnected, NULL);
+        MainFrameRepaintOnNodeCount(nPrevNodeCount);
 
 
         //
@@ -591,7 +1226,7 @@ void ThreadSocketHandler2(void* parg)
         //
         struct timeval timeout;
         timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+        timeout.tv_usec = 50000; // frequency to poll pnode->vSendMsg
 
         fd_set fdsetRecv;
         fd_set fdsetSend;
@@ -615,7 +1250,7 @@ void ThreadSocketHandler2(void* parg)
                 hSocketMax = max(hSocketMax, pnode->hSocket);
                 {
                     TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSend.empty())
+                    if (lockSend && !pnode->vSendMsg.empty())
                         FD_SET(pnode->hSocket, &fdsetSend);
                 }
             }
@@ -646,50 +1281,8 @@ void ThreadSocketHandler2(void* parg)
         //
         if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
         {
-            struct sockaddr_in sockaddr;
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
-
-            if (hSocket != INVALID_SOCKET)
-                addr = CAddress(sockaddr);
-
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
-
-            if (hSocket == INVALID_SOCKET)
-            {
-                if (WSAGetLastError() != WSAEWOULDBLOCK)
-                    printf("socket error accept failed: %d\n", WSAGetLastError());
-            }
-            else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
-            {
-                {
-                    LOCK(cs_setservAddNodeAddresses);
-                    if (!setservAddNodeAddresses.count(addr))
-                        closesocket(hSocket);
-                }
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
-                closesocket(hSocket);
-            }
-            else
-            {
-                printf("accepted connection %s\n", addr.ToString().c_str());
-                CNode* pnode = new CNode(hSocket, addr, true);
-                pnode->AddRef();
-                {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
-                }
-            }
+            CNode* pnode;
+            AcceptConnection(&pnode);
         }
 
 
@@ -714,49 +1307,7 @@ void ThreadSocketHandler2(void* parg)
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
-            {
-                TRY_LOCK(pnode->cs_vRecv, lockRecv);
-                if (lockRecv)
-                {
-                    CDataStream& vRecv = pnode->vRecv;
-                    unsigned int nPos = vRecv.size();
-
-                    if (nPos > ReceiveBufferSize()) {
-                        if (!pnode->fDisconnect)
-                            printf("socket recv flood control disconnect (%d bytes)\n", vRecv.size());
-                        pnode->CloseSocketDisconnect();
-                    }
-                    else {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            vRecv.resize(nPos + nBytes);
-                            memcpy(&vRecv[nPos], pchBuf, nBytes);
-                            pnode->nLastRecv = GetTime();
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                printf("socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    printf("socket recv error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
-            }
+                SocketRecvData(pnode, 1);
 
             //
             // Send
@@ -765,60 +1316,14 @@ void ThreadSocketHandler2(void* parg)
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetSend))
             {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                {
-                    CDataStream& vSend = pnode->vSend;
-                    if (!vSend.empty())
-                    {
-                        int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
-                            pnode->nLastSend = GetTime();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                printf("socket send error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                        if (vSend.size() > SendBufferSize()) {
-                            if (!pnode->fDisconnect)
-                                printf("socket send flood control disconnect (%d bytes)\n", vSend.size());
-                            pnode->CloseSocketDisconnect();
-                        }
-                    }
-                }
+                bool fWouldBlock;
+                SocketSendData(pnode, fWouldBlock);
             }
 
             //
             // Inactivity checking
             //
-            if (pnode->vSend.empty())
-                pnode->nLastSendEmpty = GetTime();
-            if (GetTime() - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
-                {
-                    printf("socket not sending\n");
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastRecv > 90*60)
-                {
-                    printf("socket inactivity timeout\n");
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1377,27 +1882,58 @@ void ThreadMessageHandler(void* parg)
     printf("ThreadMessageHandler exiting\n");
 }
 
+void WakeMessageHandler(CNode* pnode)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+        if (pnode->fMessageHandlerQueued)
+            return;
+        pnode->fMessageHandlerQueued = true;
+        vNodesToProcess.push_back(pnode);
+    }
+    condMessageHandler.notify_one();
+}
+
 void ThreadMessageHandler2(void* parg)
 {
     printf("ThreadMessageHandler started\n");
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    int64 nLastPass = 0;
     while (!fShutdown)
     {
+        // Every 100 ms all nodes get a pass, for the trickle, pings and anything
+        // that was busy. In between only the nodes in the ready queue do.
+        bool fAllNodes = (GetTimeMillis() - nLastPass >= 100);
+        if (fAllNodes)
+            nLastPass = GetTimeMillis();
+
         vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
+            {
+                boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+                BOOST_FOREACH(CNode* pnode, vNodesToProcess)
+                {
+                    pnode->fMessageHandlerQueued = false;
+                    if (!fAllNodes)
+                        vNodesCopy.push_back(pnode);
+                }
+                vNodesToProcess.clear();
+            }
+            if (fAllNodes)
+                vNodesCopy = vNodes;
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 pnode->AddRef();
         }
 
         // Poll the connected nodes for messages
         CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
+        if (fAllNodes && !vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            // Receive messages
+            // Receive messages, a node that is busy is left to the next pass
+            // over all nodes rather than queued again, which would spin here
             {
                 TRY_LOCK(pnode->cs_vRecv, lockRecv);
                 if (lockRecv)
@@ -1422,11 +1958,16 @@ void ThreadMessageHandler2(void* parg)
                 pnode->Release();
         }
 
-        // Wait and allow messages to bunch up.
+        // Wait for a node to become ready or the next pass over all of them.
         // Reduce vnThreadsRunning so StopNode has permission to exit while
-        // we're sleeping, but we must always check fShutdown after doing this.
+        // we're waiting, but we must always check fShutdown after doing this.
         vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
-        Sleep(100);
+        {
+            int64 nWait = nLastPass + 100 - GetTimeMillis();
+            boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+            if (vNodesToProcess.empty() && nWait > 0)
+                condMessageHandler.timed_wait(lock, boost::posix_time::milliseconds(nWait));
+        }
         if (fRequestShutdown)
             StartShutdown();
         vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
@@ -1704,6 +2245,10 @@ void StartNode(void* parg)
     // slimcoin: hash proof-of-burn in the background
     if (!CreateThread(ThreadAfterBurner, pwalletMain))
         printf("Error: CreateThread(ThreadAfterBurner) failed\n");
+
+    // Delete old blocks from the block files
+    if (nPruneTarget && !CreateThread(ThreadPruneBlockFiles, NULL))
+        printf("Error: CreateThread(ThreadPruneBlockFiles) failed\n");
 }
 
 bool StopNode()
@@ -1730,6 +2275,7 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_OPENCONNECTIONS] > 0) printf("ThreadOpenConnections still running\n");
     if (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0) printf("ThreadMessageHandler still running\n");
     if (vnThreadsRunning[THREAD_MINER] > 0) printf("ThreadSlimcoinMiner still running\n");
+    if (vnThreadsRunning[THREAD_MINER_TEMPLATE] > 0) printf("ThreadSlimcoinMinerTemplate still running\n");
     if (vnThreadsRunning[THREAD_BURNER] > 0) printf("ThreadAfterBurner still running\n");
     if (vnThreadsRunning[THREAD_RPCSERVER] > 0)         printf("ThreadRPCServer still running\n");
     if (fHaveUPnP && vnThreadsRunning[THREAD_UPNP] > 0) printf("ThreadMapPort still running\n");
@@ -1737,6 +2283,7 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_ADDEDCONNECTIONS] > 0) printf("ThreadOpenAddedConnections still running\n");
     if (vnThreadsRunning[THREAD_DUMPADDRESS] > 0) printf("ThreadDumpAddresses still running\n");
     if (vnThreadsRunning[THREAD_MINTER] > 0) printf("ThreadStakeMinter still running\n");
+    if (vnThreadsRunning[THREAD_PRUNE] > 0) printf("ThreadPruneBlockFiles still running\n");
     while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCSERVER] > 0)
         Sleep(20);
     Sleep(50);
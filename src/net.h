@@ -10,6 +10,7 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 #ifndef WIN32
@@ -42,6 +43,10 @@ void MapPort(bool fMapPort);
 bool BindListenPort(std::string& strError=REF(std::string()));
 void StartNode(void* parg);
 bool StopNode();
+// Tell the socket thread that pnode has data to send, or is new and needs its socket watched
+void WakeSocketHandler(CNode* pnode);
+// Queue pnode for the message handler thread: a whole message arrived, or a block is to be announced
+void WakeMessageHandler(CNode* pnode);
 
 enum
 {
@@ -82,6 +87,8 @@ enum threadId
     THREAD_DUMPADDRESS,
     THREAD_MINTER,
     THREAD_BURNER,
+    THREAD_MINER_TEMPLATE,
+    THREAD_PRUNE,
 
     THREAD_MAX
 };
@@ -125,6 +132,72 @@ public:
 
 
 
+/** A whole message, header included, as it goes out on the wire. It is never
+ * changed once queued, so one buffer can be queued on any number of nodes. */
+typedef boost::shared_ptr<const CSerializeData> CSendBufferRef;
+
+// Serialize a message once, for PushSerializedMessage() to any number of nodes
+template<typename T1>
+CSendBufferRef SerializeMessage(const char* pszCommand, const T1& a1, int nVersion)
+{
+    CDataStream ss(SER_NETWORK, nVersion);
+    ss << CMessageHeader(pszCommand, 0);
+    unsigned int nMessageStart = ss.size();
+    ss << a1;
+
+    unsigned int nSize = ss.size() - nMessageStart;
+    memcpy((char*)&ss[0] + offsetof(CMessageHeader, nMessageSize), &nSize, sizeof(nSize));
+    uint256 hash = Hash(ss.begin() + nMessageStart, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    memcpy((char*)&ss[0] + offsetof(CMessageHeader, nChecksum), &nChecksum, sizeof(nChecksum));
+
+    CSerializeData* pdata = new CSerializeData();
+    ss.GetAndClear(*pdata);
+    return CSendBufferRef(pdata);
+}
+
+/** A message as it is read off the socket. The socket thread fills in the header,
+ * then reads the payload straight into vRecv, which is sized as it arrives rather
+ * than to what the header claims. */
+class CNetMessage
+{
+public:
+    bool fInData; // the header is complete, reading the payload
+    CDataStream hdrbuf;
+    CMessageHeader hdr;
+    unsigned int nHdrPos;
+    CDataStream vRecv;
+    unsigned int nDataPos;
+
+    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
+    {
+        hdrbuf.resize(CMessageHeader::HEADER_SIZE);
+        fInData = false;
+        nHdrPos = 0;
+        nDataPos = 0;
+    }
+
+    bool Complete() const
+    {
+        return fInData && nDataPos == hdr.nMessageSize;
+    }
+
+    void SetVersion(int nVersionIn)
+    {
+        hdrbuf.SetVersion(nVersionIn);
+        vRecv.SetVersion(nVersionIn);
+    }
+
+    // Consume up to nBytes of pch, the number of bytes used or -1 for a bad header
+    int ReadHeader(const char* pch, unsigned int nBytes);
+    int ReadData(const char* pch, unsigned int nBytes);
+
+    // Room for the next part of the payload, to recv() into directly
+    char* GetDataBuffer(unsigned int& nSpaceRet);
+};
+
+
 /** Information about a peer */
 class CNode
 {
@@ -132,8 +205,12 @@ public:
     // socket
     uint64 nServices;
     SOCKET hSocket;
-    CDataStream vSend;
-    CDataStream vRecv;
+    CDataStream vSend; // the message being built, EndMessage() moves it to vSendMsg
+    std::deque<CSendBufferRef> vSendMsg; // guarded by cs_vSend like vSend
+    unsigned int nSendOffset; // bytes of vSendMsg.front() already sent
+    uint64 nSendSize; // bytes in vSendMsg not sent yet
+    std::deque<CNetMessage> vRecvMsg; // complete messages, and the one being read at the back
+    int nRecvVersion;
     CCriticalSection cs_vSend;
     CCriticalSection cs_vRecv;
     int64 nLastSend;
@@ -152,6 +229,11 @@ public:
     bool fSuccessfullyConnected;
     bool fDisconnect;
     bool fHasGrant; // whether to call semOutbound.post() at disconnect
+    // socket thread only: registered with epoll, and the edges not yet drained
+    bool fSocketRegistered;
+    bool fSocketReadable;
+    bool fSocketWritable;
+    bool fMessageHandlerQueued; // in the message handler's ready queue
 protected:
     int nRefCount;
 
@@ -183,10 +265,13 @@ public:
     CCriticalSection cs_inventory;
     std::multimap<int64, CInv> mapAskFor;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, bool fInboundIn=false) : vSend(SER_NETWORK, MIN_PROTO_VERSION), vRecv(SER_NETWORK, MIN_PROTO_VERSION)
+    CNode(SOCKET hSocketIn, CAddress addrIn, bool fInboundIn=false) : vSend(SER_NETWORK, MIN_PROTO_VERSION)
     {
         nServices = 0;
         hSocket = hSocketIn;
+        nRecvVersion = MIN_PROTO_VERSION;
+        nSendOffset = 0;
+        nSendSize = 0;
         nLastSend = 0;
         nLastRecv = 0;
         nLastSendEmpty = GetTime();
@@ -203,6 +288,10 @@ public:
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        fSocketRegistered = false;
+        fSocketReadable = false;
+        fSocketWritable = false;
+        fMessageHandlerQueued = false;
         nRefCount = 0;
         nReleaseTime = 0;
         hashContinue = 0;
@@ -233,6 +322,26 @@ private:
     void operator=(const CNode&);
 public:
 
+    // Frame nBytes read off the socket into vRecvMsg, fCompleteRet is set when that
+    // completed a message. False on a malformed header. The caller holds cs_vRecv.
+    bool ReceiveMsgBytes(const char* pch, unsigned int nBytes, bool& fCompleteRet);
+
+    // Bytes held in vRecvMsg, for the receive flood control
+    unsigned int GetRecvSize() const
+    {
+        unsigned int nSize = 0;
+        BOOST_FOREACH(const CNetMessage& msg, vRecvMsg)
+            nSize += msg.vRecv.size() + CMessageHeader::HEADER_SIZE;
+        return nSize;
+    }
+
+    void SetRecvVersion(int nVersionIn)
+    {
+        nRecvVersion = nVersionIn;
+        BOOST_FOREACH(CNetMessage& msg, vRecvMsg)
+            msg.SetVersion(nVersionIn);
+    }
+
 
     int GetRefCount()
     {
@@ -280,11 +389,18 @@ public:
 
     void PushInventory(const CInv& inv)
     {
+        bool fQueued = false;
         {
             LOCK(cs_inventory);
             if (!setInventoryKnown.count(inv))
+            {
                 vInventoryToSend.push_back(inv);
+                fQueued = true;
+            }
         }
+        // announce blocks right away rather than at the next pass over all nodes
+        if (fQueued && inv.type == MSG_BLOCK)
+            WakeMessageHandler(this);
     }
 
     void AskFor(const CInv& inv)
@@ -362,9 +478,38 @@ public:
             printf("(%d bytes)\n", nSize);
         }
 
+        // hand the buffer over to the send queue as it is
+        CSerializeData* pdata = new CSerializeData();
+        vSend.GetAndClear(*pdata);
+        bool fWake = QueueSendBuffer(CSendBufferRef(pdata));
+
         nHeaderStart = -1;
         nMessageStart = -1;
         LEAVE_CRITICAL_SECTION(cs_vSend);
+
+        if (fWake)
+            WakeSocketHandler(this);
+    }
+
+    // Queue a message made by SerializeMessage(), without copying it
+    void PushSerializedMessage(const CSendBufferRef& pdata)
+    {
+        bool fWake;
+        {
+            LOCK(cs_vSend);
+            fWake = QueueSendBuffer(pdata);
+        }
+        if (fWake)
+            WakeSocketHandler(this);
+    }
+
+    // True when the queue was empty: the socket thread needs to be woken. The caller holds cs_vSend.
+    bool QueueSendBuffer(const CSendBufferRef& pdata)
+    {
+        bool fWasEmpty = vSendMsg.empty();
+        nSendSize += pdata->size();
+        vSendMsg.push_back(pdata);
+        return fWasEmpty;
     }
 
     void EndMessageAbortIfEmpty()
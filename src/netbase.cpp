@@ -8,6 +8,7 @@
 
 #ifndef WIN32
 #include <sys/fcntl.h>
+#include <poll.h>
 #endif
 
 #include "strlcpy.h"
@@ -193,6 +194,7 @@ bool ConnectSocket(const CService &addrDest, SOCKET& hSocketRet, int nTimeout)
         // WSAEINVAL is here because some legacy version of winsock uses it
         if(WSAGetLastError() == WSAEINPROGRESS || WSAGetLastError() == WSAEWOULDBLOCK || WSAGetLastError() == WSAEINVAL)
         {
+#ifdef WIN32
             struct timeval timeout;
             timeout.tv_sec  = nTimeout / 1000;
             timeout.tv_usec = (nTimeout % 1000) * 1000;
@@ -201,6 +203,14 @@ bool ConnectSocket(const CService &addrDest, SOCKET& hSocketRet, int nTimeout)
             FD_ZERO(&fdset);
             FD_SET(hSocket, &fdset);
             int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
+#else
+            // poll() has no FD_SETSIZE limit, with many connections open the socket can be past it
+            struct pollfd pollfd;
+            pollfd.fd = hSocket;
+            pollfd.events = POLLOUT;
+            pollfd.revents = 0;
+            int nRet = poll(&pollfd, 1, nTimeout);
+#endif
             if(nRet == 0)
             {
                 printf("connection timeout\n");
@@ -49,7 +49,9 @@ public:
     void getLastInscription()
     {
         std::vector<std::pair<std::string, int> > vTxResults;
-        this->wallet->GetTxMessages(vTxResults);
+        this->wallet->GetTxMessages(vTxResults, 1);
+        if (vTxResults.empty())
+            return;
 
         QDateTime inscription_date = QDateTime::currentDateTime();
 
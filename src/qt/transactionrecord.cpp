@@ -194,7 +194,7 @@ void TransactionRecord::updateStatus(const CWalletTx &wtx)
 
   // Find the block the tx is in
   CBlockIndex* pindex = NULL;
-  std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+  BlockMap::iterator mi = mapBlockIndex.find(wtx.hashBlock);
   if(mi != mapBlockIndex.end())
     pindex = (*mi).second;
 
@@ -72,6 +72,8 @@ Value importpassphrase(const Array& params, bool fHelp)
     throw JSONRPCError(-13, "Error: Please enter the wallet passphrase with walletpassphrase first.");
   if(fWalletUnlockMintOnly) // slimcoin: no importprivkey in mint-only mode
     throw JSONRPCError(-102, "Wallet is unlocked for minting only.");
+  if(nPruneHeight > 0)
+    throw JSONRPCError(-4, "Error: Blocks were pruned, the key's transactions can't be rescanned.");
 
   CKey key;
   CSecret secret = vchSecret.GetSecret(fCompressed);
@@ -122,6 +124,8 @@ Value importprivkey(const Array& params, bool fHelp)
         throw JSONRPCError(-13, "Error: Please enter the wallet passphrase with walletpassphrase first.");
     if (fWalletUnlockMintOnly) // slimcoin: no importprivkey in mint-only mode
         throw JSONRPCError(-102, "Wallet is unlocked for minting only.");
+    if (nPruneHeight > 0)
+        throw JSONRPCError(-4, "Error: Blocks were pruned, the key's transactions can't be rescanned.");
 
     CKey key;
     bool fCompressed;
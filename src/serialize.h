@@ -156,6 +156,22 @@ inline unsigned int GetSerializeSize(bool a, int, int=0)
 template<typename Stream> inline void Serialize(Stream& s, bool a, int, int=0)    { char f=a; WRITEDATA(s, f); }
 template<typename Stream> inline void Unserialize(Stream& s, bool& a, int, int=0) { char f; READDATA(s, f); a=f; }
 
+// Big endian 32-bit integers, for database keys that have to sort by their value
+template<typename Stream>
+inline void WriteBigEndian32(Stream& s, unsigned int n)
+{
+  unsigned char a[4] = { (unsigned char)(n >> 24), (unsigned char)(n >> 16), (unsigned char)(n >> 8), (unsigned char)n };
+  s.write((char*)a, 4);
+}
+
+template<typename Stream>
+inline unsigned int ReadBigEndian32(Stream& s)
+{
+  unsigned char a[4];
+  s.read((char*)a, 4);
+  return ((unsigned int)a[0] << 24) | ((unsigned int)a[1] << 16) | ((unsigned int)a[2] << 8) | a[3];
+}
+
 
 
 #ifndef THROW_WITH_STACKTRACE
@@ -712,6 +728,8 @@ struct ser_streamplaceholder
 
 
 
+typedef std::vector<char, zero_after_free_allocator<char> > CSerializeData;
+
 /** Double ended buffer combining vector and stream-like interfaces.
  *
  * >> and << read and write unformatted data using the above serialization templates.
@@ -893,6 +911,14 @@ CDataStream(const std::vector<unsigned char>& vchIn, int nTypeIn, int nVersionIn
       return vch.erase(first, last);
   }
 
+  // Move the unread bytes into data without copying them, leaving the stream empty
+  void GetAndClear(CSerializeData& data)
+  {
+    Compact();
+    vch.swap(data);
+    CSerializeData().swap(vch);
+  }
+
   inline void Compact()
   {
     vch.erase(vch.begin(), vch.begin() + nReadPos);
@@ -1194,4 +1220,60 @@ public:
   }
 };
 
+/** Unserializing stream over memory owned by someone else, such as a memory
+ * mapped file. Nothing is copied except into the objects being read.
+ */
+class CMemoryReader
+{
+protected:
+  const char* pbegin;
+  const char* pend;
+  const char* pread;
+public:
+  int nType;
+  int nVersion;
+
+  CMemoryReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn)
+  {
+    pbegin = pread = pbeginIn;
+    pend = pendIn;
+    nType = nTypeIn;
+    nVersion = nVersionIn;
+  }
+
+  size_t size() const          { return pend - pread; }
+  bool empty() const           { return pread == pend; }
+  size_t GetPos() const        { return pread - pbegin; }
+
+  void SetType(int n)          { nType = n; }
+  int GetType()                { return nType; }
+  void SetVersion(int n)       { nVersion = n; }
+  int GetVersion()             { return nVersion; }
+
+  CMemoryReader& read(char* pch, size_t nSize)
+  {
+    if (nSize > size())
+      throw std::ios_base::failure("CMemoryReader::read : end of data");
+    memcpy(pch, pread, nSize);
+    pread += nSize;
+    return (*this);
+  }
+
+  CMemoryReader& ignore(size_t nSize)
+  {
+    if (nSize > size())
+      throw std::ios_base::failure("CMemoryReader::ignore : end of data");
+    pread += nSize;
+    return (*this);
+  }
+
+  template<typename T>
+    CMemoryReader& operator>>(T& obj)
+  {
+    // Unserialize from this stream
+    ::Unserialize(*this, obj, nType, nVersion);
+    return (*this);
+  }
+};
+
 #endif
@@ -92,3 +92,346 @@ void sha256_salt_to_str(const u8int *data, size_t data_sz, u8int *salt, size_t s
   //sucess!
   return;
 }
+
+const u32int sha256_init_state[8] =
+{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+static const u32int sha256_k[64] =
+{
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_transform_scalar(u32int state[8][SHA256_MAX_LANES], const u32int words[16][SHA256_MAX_LANES],
+                                    u32int nLanes)
+{
+  for(u32int lane = 0; lane < nLanes; lane++)
+  {
+    u32int w[16], s[8], i;
+
+    for(i = 0; i < 16; i++)
+      w[i] = words[i][lane];
+    for(i = 0; i < 8; i++)
+      s[i] = state[i][lane];
+
+    for(i = 0; i < 64; i++)
+    {
+      if(i >= 16)
+      {
+        u32int w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+        w[i & 15] += (SHA256_ROTR(w2, 17) ^ SHA256_ROTR(w2, 19) ^ (w2 >> 10)) + w[(i - 7) & 15] +
+                     (SHA256_ROTR(w15, 7) ^ SHA256_ROTR(w15, 18) ^ (w15 >> 3));
+      }
+
+      u32int t1 = s[7] + (SHA256_ROTR(s[4], 6) ^ SHA256_ROTR(s[4], 11) ^ SHA256_ROTR(s[4], 25)) +
+                  ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i & 15];
+      u32int t2 = (SHA256_ROTR(s[0], 2) ^ SHA256_ROTR(s[0], 13) ^ SHA256_ROTR(s[0], 22)) +
+                  ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+
+      s[7] = s[6]; s[6] = s[5]; s[5] = s[4]; s[4] = s[3] + t1;
+      s[3] = s[2]; s[2] = s[1]; s[1] = s[0]; s[0] = t1 + t2;
+    }
+
+    for(i = 0; i < 8; i++)
+      state[i][lane] += s[i];
+  }
+
+  return;
+}
+
+//the vector backends are only built where gcc can target them per function,
+// so the rest of the binary does not need -mavx2 and still runs on any cpu
+#if defined(__GNUC__) && (__GNUC__ >= 5) && (defined(__x86_64__) || defined(__i386__))
+#define SHA256_HAVE_X86_LANES
+#include <immintrin.h>
+#include <cpuid.h>
+
+#define V8_ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+__attribute__((target("avx2")))
+static void sha256_transform_avx2(u32int state[8][SHA256_MAX_LANES], const u32int words[16][SHA256_MAX_LANES],
+                                  u32int nLanes)
+{
+  //8 lanes per pass, the lanes past nLanes are neither read nor written
+  for(u32int lane = 0; lane < nLanes; lane += 8)
+  {
+    __m256i w[16], s[8];
+    u32int i;
+
+    __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(nLanes - lane), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    for(i = 0; i < 16; i++)
+      w[i] = _mm256_maskload_epi32((const int*)&words[i][lane], mask);
+    for(i = 0; i < 8; i++)
+      s[i] = _mm256_maskload_epi32((const int*)&state[i][lane], mask);
+
+    __m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+
+#if (__GNUC__ >= 8)
+#pragma GCC unroll 64
+#endif
+    for(i = 0; i < 64; i++)
+    {
+      if(i >= 16)
+      {
+        __m256i w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+        __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(V8_ROTR(w15, 7), V8_ROTR(w15, 18)), _mm256_srli_epi32(w15, 3));
+        __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(V8_ROTR(w2, 17), V8_ROTR(w2, 19)), _mm256_srli_epi32(w2, 10));
+        w[i & 15] = _mm256_add_epi32(_mm256_add_epi32(w[i & 15], s0), _mm256_add_epi32(w[(i - 7) & 15], s1));
+      }
+
+      __m256i S1 = _mm256_xor_si256(_mm256_xor_si256(V8_ROTR(e, 6), V8_ROTR(e, 11)), V8_ROTR(e, 25));
+      __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+      __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, S1), _mm256_add_epi32(ch, w[i & 15]));
+      t1 = _mm256_add_epi32(t1, _mm256_set1_epi32(sha256_k[i]));
+      __m256i S0 = _mm256_xor_si256(_mm256_xor_si256(V8_ROTR(a, 2), V8_ROTR(a, 13)), V8_ROTR(a, 22));
+      __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+      __m256i t2 = _mm256_add_epi32(S0, maj);
+
+      h = g; g = f; f = e; e = _mm256_add_epi32(d, t1);
+      d = c; c = b; b = a; a = _mm256_add_epi32(t1, t2);
+    }
+
+    s[0] = _mm256_add_epi32(s[0], a); s[1] = _mm256_add_epi32(s[1], b);
+    s[2] = _mm256_add_epi32(s[2], c); s[3] = _mm256_add_epi32(s[3], d);
+    s[4] = _mm256_add_epi32(s[4], e); s[5] = _mm256_add_epi32(s[5], f);
+    s[6] = _mm256_add_epi32(s[6], g); s[7] = _mm256_add_epi32(s[7], h);
+
+    for(i = 0; i < 8; i++)
+      _mm256_maskstore_epi32((int*)&state[i][lane], mask, s[i]);
+  }
+
+  return;
+}
+
+__attribute__((target("avx512f")))
+static void sha256_transform_avx512(u32int state[8][SHA256_MAX_LANES], const u32int words[16][SHA256_MAX_LANES],
+                                    u32int nLanes)
+{
+  //all 16 lanes in a single pass, avx512 has a native rotate. The lanes past
+  // nLanes are zeroed on load and not stored, the caller did not fill them in
+  __m512i w[16], s[8];
+  u32int i;
+
+  __mmask16 mask = (__mmask16)((1u << nLanes) - 1);
+  for(i = 0; i < 16; i++)
+    w[i] = _mm512_maskz_loadu_epi32(mask, (const void*)&words[i][0]);
+  for(i = 0; i < 8; i++)
+    s[i] = _mm512_maskz_loadu_epi32(mask, (const void*)&state[i][0]);
+
+  __m512i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+
+#if (__GNUC__ >= 8)
+#pragma GCC unroll 64
+#endif
+  for(i = 0; i < 64; i++)
+  {
+    if(i >= 16)
+    {
+      __m512i w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+      __m512i s0 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(w15, 7), _mm512_ror_epi32(w15, 18),
+                                             _mm512_srli_epi32(w15, 3), 0x96);
+      __m512i s1 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(w2, 17), _mm512_ror_epi32(w2, 19),
+                                             _mm512_srli_epi32(w2, 10), 0x96);
+      w[i & 15] = _mm512_add_epi32(_mm512_add_epi32(w[i & 15], s0), _mm512_add_epi32(w[(i - 7) & 15], s1));
+    }
+
+    //0x96 is a ^ b ^ c, 0xca is (a & b) | (~a & c), 0xe8 is the majority of a, b, c
+    __m512i S1 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(e, 6), _mm512_ror_epi32(e, 11), _mm512_ror_epi32(e, 25), 0x96);
+    __m512i ch = _mm512_ternarylogic_epi32(e, f, g, 0xca);
+    __m512i t1 = _mm512_add_epi32(_mm512_add_epi32(h, S1), _mm512_add_epi32(ch, w[i & 15]));
+    t1 = _mm512_add_epi32(t1, _mm512_set1_epi32(sha256_k[i]));
+    __m512i S0 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(a, 2), _mm512_ror_epi32(a, 13), _mm512_ror_epi32(a, 22), 0x96);
+    __m512i maj = _mm512_ternarylogic_epi32(a, b, c, 0xe8);
+    __m512i t2 = _mm512_add_epi32(S0, maj);
+
+    h = g; g = f; f = e; e = _mm512_add_epi32(d, t1);
+    d = c; c = b; b = a; a = _mm512_add_epi32(t1, t2);
+  }
+
+  s[0] = _mm512_add_epi32(s[0], a); s[1] = _mm512_add_epi32(s[1], b);
+  s[2] = _mm512_add_epi32(s[2], c); s[3] = _mm512_add_epi32(s[3], d);
+  s[4] = _mm512_add_epi32(s[4], e); s[5] = _mm512_add_epi32(s[5], f);
+  s[6] = _mm512_add_epi32(s[6], g); s[7] = _mm512_add_epi32(s[7], h);
+
+  for(i = 0; i < 8; i++)
+    _mm512_mask_storeu_epi32((void*)&state[i][0], mask, s[i]);
+
+  return;
+}
+
+//the sha extensions are not a vector unit, they run one lane after the other,
+// but a block through them is still several times faster than any of the above
+__attribute__((target("sha,sse4.1")))
+static void sha256_transform_shani(u32int state[8][SHA256_MAX_LANES], const u32int words[16][SHA256_MAX_LANES],
+                                   u32int nLanes)
+{
+  for(u32int lane = 0; lane < nLanes; lane++)
+  {
+    u32int w[16], s[8], i;
+
+    for(i = 0; i < 16; i++)
+      w[i] = words[i][lane];
+    for(i = 0; i < 8; i++)
+      s[i] = state[i][lane];
+
+    //the rounds instructions want the state as ABEF and CDGH
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&s[0]), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&s[4]), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    const __m128i abef_save = state0, cdgh_save = state1;
+    __m128i msg[4], m;
+
+    //4 rounds per group, the schedule of the next groups is computed as we go.
+    // Unrolled so msg[] stays in registers
+#if (__GNUC__ >= 8)
+#pragma GCC unroll 16
+#endif
+    for(i = 0; i < 16; i++)
+    {
+      if(i < 4)
+        msg[i] = _mm_loadu_si128((const __m128i*)&w[i * 4]);
+
+      m = _mm_add_epi32(msg[i & 3], _mm_loadu_si128((const __m128i*)&sha256_k[i * 4]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+
+      if(i >= 3 && i < 15)
+      {
+        tmp = _mm_alignr_epi8(msg[i & 3], msg[(i - 1) & 3], 4);
+        msg[(i + 1) & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(msg[(i + 1) & 3], tmp), msg[i & 3]);
+      }
+
+      m = _mm_shuffle_epi32(m, 0x0E);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+
+      if(i >= 1 && i < 13)
+        msg[(i - 1) & 3] = _mm_sha256msg1_epu32(msg[(i - 1) & 3], msg[i & 3]);
+    }
+
+    state0 = _mm_add_epi32(state0, abef_save);
+    state1 = _mm_add_epi32(state1, cdgh_save);
+
+    //back to ABCD and EFGH
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    _mm_storeu_si128((__m128i*)&s[0], _mm_blend_epi16(tmp, state1, 0xF0));
+    _mm_storeu_si128((__m128i*)&s[4], _mm_alignr_epi8(state1, tmp, 8));
+
+    for(i = 0; i < 8; i++)
+      state[i][lane] = s[i];
+  }
+
+  return;
+}
+#endif
+
+typedef void (*sha256_transform_lanes_fn)(u32int state[8][SHA256_MAX_LANES],
+                                          const u32int words[16][SHA256_MAX_LANES], u32int nLanes);
+
+static const struct
+{
+  const char *name;
+  sha256_transform_lanes_fn transform;
+  u32int width;
+} sha256_backends[SHA256_BACKEND_COUNT] =
+{
+  {"scalar", sha256_transform_scalar, 1},
+#ifdef SHA256_HAVE_X86_LANES
+  {"avx2", sha256_transform_avx2, 8},
+  {"avx512", sha256_transform_avx512, 16},
+  {"sha-ni", sha256_transform_shani, 1},
+#else
+  {"avx2", NULL, 8},
+  {"avx512", NULL, 16},
+  {"sha-ni", NULL, 1},
+#endif
+};
+
+bool sha256_lanes_backend_supported(int nBackend)
+{
+  if(nBackend < 0 || nBackend >= SHA256_BACKEND_COUNT || !sha256_backends[nBackend].transform)
+    return false;
+
+#ifdef SHA256_HAVE_X86_LANES
+  //this runs from a static initializer, possibly before the one of libgcc that
+  // fills in the cpu model __builtin_cpu_supports reads
+  __builtin_cpu_init();
+  if(nBackend == SHA256_BACKEND_AVX2)
+    return __builtin_cpu_supports("avx2");
+  if(nBackend == SHA256_BACKEND_AVX512)
+    return __builtin_cpu_supports("avx512f");
+  if(nBackend == SHA256_BACKEND_SHANI)
+  {
+    unsigned int eax, ebx, ecx, edx;
+    if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+      return false;
+
+    //leaf 7 ebx bit 29
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1 << 29));
+  }
+#endif
+
+  return true;
+}
+
+static int sha256_lanes_detect()
+{
+  //16 vector lanes beat the sha extensions, which beat 8 vector lanes
+  static const int nPreferred[] = {SHA256_BACKEND_AVX512, SHA256_BACKEND_SHANI, SHA256_BACKEND_AVX2};
+
+  for(u32int i = 0; i < sizeof(nPreferred) / sizeof(nPreferred[0]); i++)
+    if(sha256_lanes_backend_supported(nPreferred[i]))
+      return nPreferred[i];
+
+  return SHA256_BACKEND_SCALAR;
+}
+
+static int nLanesBackend = sha256_lanes_detect();
+
+bool sha256_lanes_set_backend(int nBackend)
+{
+  if(!sha256_lanes_backend_supported(nBackend))
+    return false;
+
+  nLanesBackend = nBackend;
+  return true;
+}
+
+int sha256_lanes_backend()
+{
+  return nLanesBackend;
+}
+
+u32int sha256_lanes_width()
+{
+  return sha256_backends[nLanesBackend].width;
+}
+
+const char *sha256_lanes_backend_name(int nBackend)
+{
+  if(nBackend < 0 || nBackend >= SHA256_BACKEND_COUNT)
+    return "unknown";
+
+  return sha256_backends[nBackend].name;
+}
+
+void sha256_transform_lanes(u32int state[8][SHA256_MAX_LANES], const u32int words[16][SHA256_MAX_LANES],
+                            u32int nLanes)
+{
+  //a vector pass costs about as much as a few scalar blocks, so a handful of lanes go through scalar code
+  if(sha256_backends[nLanesBackend].width > 1 && nLanes * 4 <= sha256_backends[nLanesBackend].width)
+    sha256_transform_scalar(state, words, nLanes);
+  else
+    sha256_backends[nLanesBackend].transform(state, words, nLanes);
+
+  return;
+}
@@ -17,4 +17,31 @@ uint256 sha256(const u8int *data, size_t data_sz, uint256 *hash_digest = 0);
 void sha256_salt_to_str(const u8int *data, size_t data_sz, u8int *salt, size_t salt_sz, 
                         u8int *outputBuffer, u8int *hash_digest);
 
+//multi-lane sha256, runs the compression function over up to SHA256_MAX_LANES
+// independent message blocks at once using the widest vector unit the cpu has.
+// The arrays are lane-interleaved: state[i][lane] is word i of the lane's state and
+// words[i][lane] is big endian message word i of the lane's block.
+#define SHA256_MAX_LANES     16
+
+enum
+{
+  SHA256_BACKEND_SCALAR = 0,
+  SHA256_BACKEND_AVX2,
+  SHA256_BACKEND_AVX512,
+  SHA256_BACKEND_SHANI,
+  SHA256_BACKEND_COUNT
+};
+
+extern const u32int sha256_init_state[8];
+
+void sha256_transform_lanes(u32int state[8][SHA256_MAX_LANES], const u32int words[16][SHA256_MAX_LANES],
+                            u32int nLanes);
+
+//the backend is chosen by cpuid on startup, these allow checking and overriding the choice
+bool sha256_lanes_backend_supported(int nBackend);
+bool sha256_lanes_set_backend(int nBackend);
+int sha256_lanes_backend();
+u32int sha256_lanes_width();
+const char *sha256_lanes_backend_name(int nBackend);
+
 #endif
@@ -15,6 +15,7 @@ using namespace boost;
 #include "util.h"
 #include "smalldata.h"
 #include "db.h"
+#include "ui_interface.h"
 // #include "txdb.h"
 
 bool fAdEnabled = false;
@@ -72,3 +73,123 @@ bool GetTxMessage(CTransaction &tx, std::string &msg, bool &isBroadcast)
     
     return false;
 }
+
+bool GetTxMessageFace(const std::string &msg, uint256 &hashFace)
+{
+    if (msg.size() != 5 + 64 || msg.compare(0, 5, "face ") != 0)
+        return false;
+
+    // only the exact lowercase hex that uint256::GetHex() writes matches
+    hashFace.SetHex(msg.substr(5));
+    return hashFace.GetHex() == msg.substr(5);
+}
+
+// The transactions of block that carry a message, with their entries
+static void GetBlockTxMessages(CBlock& block, const CBlockIndex* pindex, std::vector<std::pair<CTxMessageKey, CTxMessageEntry> >& vMessages)
+{
+    for (unsigned int nTx = 0; nTx < block.vtx.size(); nTx++)
+    {
+        CTransaction& tx = block.vtx[nTx];
+
+        // a message needs an OP_RETURN output, skip the solver for everything else
+        bool fNullData = false;
+        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+            if (!txout.scriptPubKey.empty() && txout.scriptPubKey[0] == OP_RETURN)
+                fNullData = true;
+        if (!fNullData)
+            continue;
+
+        std::string txmsg;
+        bool isBroadcast;
+        if (!GetTxMessage(tx, txmsg, isBroadcast))
+            continue;
+
+        CTxMessageEntry entry;
+        entry.nSmallDataType = isBroadcast ? SMALLDATA_TYPE_BROADCAST : SMALLDATA_TYPE_PLAINTEXT;
+        entry.nTime = tx.nTime;
+        entry.hashPayload = Hash(txmsg.begin(), txmsg.end());
+        entry.strMessage = txmsg;
+        vMessages.push_back(make_pair(CTxMessageKey(pindex->nHeight, nTx, tx.GetHash()), entry));
+    }
+}
+
+bool TxMessageIndexConnectBlock(CTxDB& txdb, CBlock& block, const CBlockIndex* pindex)
+{
+    std::vector<std::pair<CTxMessageKey, CTxMessageEntry> > vMessages;
+    GetBlockTxMessages(block, pindex, vMessages);
+
+    BOOST_FOREACH(const PAIRTYPE(CTxMessageKey, CTxMessageEntry)& item, vMessages)
+    {
+        if (!txdb.WriteTxMessage(item.first, item.second))
+            return false;
+        uint256 hashFace;
+        if (GetTxMessageFace(item.second.strMessage, hashFace) && !txdb.WriteTxMessageFace(hashFace, item.first))
+            return false;
+    }
+    return true;
+}
+
+bool TxMessageIndexDisconnectBlock(CTxDB& txdb, CBlock& block, const CBlockIndex* pindex)
+{
+    std::vector<std::pair<CTxMessageKey, CTxMessageEntry> > vMessages;
+    GetBlockTxMessages(block, pindex, vMessages);
+
+    BOOST_FOREACH(const PAIRTYPE(CTxMessageKey, CTxMessageEntry)& item, vMessages)
+    {
+        if (!txdb.EraseTxMessage(item.first))
+            return false;
+        uint256 hashFace;
+        if (GetTxMessageFace(item.second.strMessage, hashFace) && !txdb.EraseTxMessageFace(hashFace, item.first))
+            return false;
+    }
+    return true;
+}
+
+bool InitTxMessageIndex()
+{
+    CTxDB txdb("r+");
+    bool fComplete = false;
+    int nBuildHeight = 0;
+    if (txdb.ReadTxMessageIndexState(fComplete, nBuildHeight) && fComplete)
+        return true;
+
+    // blocks connected from here on are indexed by ConnectBlock()
+    CBlockIndex* pindex = pindexByHeight(nBuildHeight + 1);
+    if (pindex)
+        printf("InitTxMessageIndex() : indexing heights %d to %d\n", pindex->nHeight, nBestHeight);
+    int64 nStart = GetTimeMillis();
+    do
+    {
+        if (!txdb.TxnBegin())
+            return error("InitTxMessageIndex() : TxnBegin failed");
+
+        for (int n = 0; pindex && n < 1000; n++, pindex = pindex->pnext)
+        {
+            CBlock block;
+            if (!block.ReadFromDisk(pindex))
+            {
+                txdb.TxnAbort();
+                return error("InitTxMessageIndex() : ReadFromDisk at height %d failed", pindex->nHeight);
+            }
+            if (!TxMessageIndexConnectBlock(txdb, block, pindex))
+            {
+                txdb.TxnAbort();
+                return false;
+            }
+            nBuildHeight = pindex->nHeight;
+        }
+
+        txdb.WriteTxMessageIndexState(pindex == NULL, nBuildHeight);
+        if (!txdb.TxnCommit())
+            return error("InitTxMessageIndex() : TxnCommit failed");
+
+        if (pindex)
+            InitMessage(strprintf(_("Indexing messages... %d/%d"), nBuildHeight, nBestHeight));
+        if (fRequestShutdown)
+            return true;
+    }
+    while (pindex);
+
+    printf("InitTxMessageIndex() : done in %" PRI64d " ms\n", GetTimeMillis() - nStart);
+    return true;
+}
@@ -12,8 +12,13 @@
 
 #include "keystore.h"
 #include "bignum.h"
+#include "serialize.h"
+#include "uint256.h"
 
+class CBlock;
+class CBlockIndex;
 class CTransaction;
+class CTxDB;
 
 enum{
     SMALLDATA_TYPE_NULL,
@@ -25,4 +30,87 @@ const unsigned char *GetSmallDataHeader(int type);
 
 bool GetTxMessage(CTransaction &tx, std::string &msg, bool &isBroadcast);
 
+/** Index of the small data messages in the best chain, kept in the txdb:
+ *   ("msg", key)              the message of a transaction, newest block first
+ *   ("msgface", hash, key)    the transactions whose message is "face <hash>"
+ * ConnectBlock() and DisconnectBlock() update it, so the message lists and the
+ * "face" lookups read the index instead of every block of the chain.
+ */
+class CTxMessageKey
+{
+public:
+    int nHeight;
+    unsigned int nTx;
+    uint256 hashTx;
+
+    CTxMessageKey()
+    {
+        nHeight = 0;
+        nTx = 0;
+        hashTx = 0;
+    }
+
+    CTxMessageKey(int nHeightIn, unsigned int nTxIn, const uint256& hashTxIn)
+    {
+        nHeight = nHeightIn;
+        nTx = nTxIn;
+        hashTx = hashTxIn;
+    }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 4 + 4 + 32;
+    }
+
+    // the height is inverted so a forward walk of the store starts at the newest block
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        WriteBigEndian32(s, ~(unsigned int)nHeight);
+        WriteBigEndian32(s, nTx);
+        hashTx.Serialize(s, nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        nHeight = ~ReadBigEndian32(s);
+        nTx = ReadBigEndian32(s);
+        hashTx.Unserialize(s, nType, nVersion);
+    }
+};
+
+class CTxMessageEntry
+{
+public:
+    unsigned char nSmallDataType;
+    unsigned int nTime;
+    uint256 hashPayload;
+    std::string strMessage;
+
+    CTxMessageEntry()
+    {
+        nSmallDataType = SMALLDATA_TYPE_NULL;
+        nTime = 0;
+        hashPayload = 0;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nSmallDataType);
+        READWRITE(nTime);
+        READWRITE(hashPayload);
+        READWRITE(strMessage);
+    )
+};
+
+// The hash of a "face <hash>" message
+bool GetTxMessageFace(const std::string &msg, uint256 &hashFace);
+
+bool TxMessageIndexConnectBlock(CTxDB& txdb, CBlock& block, const CBlockIndex* pindex);
+bool TxMessageIndexDisconnectBlock(CTxDB& txdb, CBlock& block, const CBlockIndex* pindex);
+
+// Index the blocks of the best chain that are not indexed yet, once after an upgrade
+bool InitTxMessageIndex();
+
 #endif // H_SMALL_DATA_FUSIONCOIN
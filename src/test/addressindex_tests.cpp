@@ -0,0 +1,79 @@
+#include <boost/test/unit_test.hpp>
+
+#include "addressindex.h"
+#include "key.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(addressindex_tests)
+
+static string SerializeKey(const CAddressHistoryKey& key)
+{
+  CDataStream ss(SER_DISK, CLIENT_VERSION);
+  ss << make_pair(string("addrtx"), key);
+  return string(ss.begin(), ss.end());
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_key_order)
+{
+  uint160 hashA = 1, hashB = 2;
+  uint256 hashTx = 7;
+
+  //the entries of an address sort by height, then by position in the block
+  vector<string> vKeys;
+  vKeys.push_back(SerializeKey(CAddressHistoryKey(ADDRESS_TYPE_PUBKEYHASH, hashA, 0, 0, 0, 0, false)));
+  vKeys.push_back(SerializeKey(CAddressHistoryKey(ADDRESS_TYPE_PUBKEYHASH, hashA, 255, 3, hashTx, 0, false)));
+  vKeys.push_back(SerializeKey(CAddressHistoryKey(ADDRESS_TYPE_PUBKEYHASH, hashA, 256, 0, hashTx, 1, true)));
+  vKeys.push_back(SerializeKey(CAddressHistoryKey(ADDRESS_TYPE_PUBKEYHASH, hashA, 256, 1, 0, 0, false)));
+  vKeys.push_back(SerializeKey(CAddressHistoryKey(ADDRESS_TYPE_PUBKEYHASH, hashA, 70000, 0, 0, 0, false)));
+  vKeys.push_back(SerializeKey(CAddressHistoryKey(ADDRESS_TYPE_PUBKEYHASH, hashB, 0, 0, 0, 0, false)));
+  vKeys.push_back(SerializeKey(CAddressHistoryKey(ADDRESS_TYPE_SCRIPTHASH, hashA, 0, 0, 0, 0, false)));
+  for(unsigned int i = 1; i < vKeys.size(); i++)
+    BOOST_CHECK(vKeys[i - 1] < vKeys[i]);
+
+  CAddressHistoryKey key(ADDRESS_TYPE_SCRIPTHASH, hashB, 123456, 17, hashTx, 5, true), keyRead;
+  CDataStream ss(SER_DISK, CLIENT_VERSION);
+  ss << key;
+  BOOST_CHECK_EQUAL(ss.size(), key.GetSerializeSize(SER_DISK, CLIENT_VERSION));
+  ss >> keyRead;
+  BOOST_CHECK(keyRead.nAddressType == ADDRESS_TYPE_SCRIPTHASH);
+  BOOST_CHECK(keyRead.hashAddress == hashB);
+  BOOST_CHECK_EQUAL(keyRead.nHeight, 123456);
+  BOOST_CHECK_EQUAL(keyRead.nTx, 17U);
+  BOOST_CHECK(keyRead.hashTx == hashTx);
+  BOOST_CHECK_EQUAL(keyRead.nIndex, 5U);
+  BOOST_CHECK(keyRead.fSpending);
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_script_key)
+{
+  CKey key;
+  key.MakeNewKey(true);
+  CKeyID keyID = key.GetPubKey().GetID();
+
+  unsigned char nAddressType;
+  uint160 hashAddress;
+
+  //pay-to-pubkey and pay-to-pubkey-hash outputs index under the same address
+  CScript scriptPubKeyHash;
+  scriptPubKeyHash.SetDestination(keyID);
+  BOOST_CHECK(GetAddressIndexKey(scriptPubKeyHash, nAddressType, hashAddress));
+  BOOST_CHECK(nAddressType == ADDRESS_TYPE_PUBKEYHASH && hashAddress == keyID);
+
+  CScript scriptPubKey;
+  scriptPubKey << key.GetPubKey() << OP_CHECKSIG;
+  BOOST_CHECK(GetAddressIndexKey(scriptPubKey, nAddressType, hashAddress));
+  BOOST_CHECK(nAddressType == ADDRESS_TYPE_PUBKEYHASH && hashAddress == keyID);
+
+  CScriptID scriptID = scriptPubKey.GetID();
+  CScript scriptHash;
+  scriptHash.SetDestination(scriptID);
+  BOOST_CHECK(GetAddressIndexKey(scriptHash, nAddressType, hashAddress));
+  BOOST_CHECK(nAddressType == ADDRESS_TYPE_SCRIPTHASH && hashAddress == scriptID);
+
+  CScript scriptData;
+  scriptData << OP_RETURN;
+  BOOST_CHECK(!GetAddressIndexKey(scriptData, nAddressType, hashAddress));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
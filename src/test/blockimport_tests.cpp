@@ -0,0 +1,90 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+
+#include "blockimport.h"
+#include "main.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockimport_tests)
+
+static const unsigned char pchStart[4] = { 0xfa, 0xbf, 0xb5, 0xda };
+
+static void WriteBlock(FILE* file, unsigned int nSize, char c)
+{
+  unsigned char pchSize[4] = { (unsigned char)nSize, (unsigned char)(nSize >> 8), (unsigned char)(nSize >> 16), (unsigned char)(nSize >> 24) };
+  fwrite(pchStart, 1, 4, file);
+  fwrite(pchSize, 1, 4, file);
+  vector<char> vData(nSize, c);
+  fwrite(&vData[0], 1, nSize, file);
+}
+
+BOOST_AUTO_TEST_CASE(blockimport_framing)
+{
+  FILE* file = tmpfile();
+  BOOST_REQUIRE(file);
+  fwrite("garbage", 1, 7, file);
+  WriteBlock(file, 100, 'a');
+  //a message start with a size no block has is skipped
+  fwrite(pchStart, 1, 4, file);
+  fwrite("\x0a\x00\x00\x00", 1, 4, file);
+  WriteBlock(file, 80, 'b');
+  //a block cut off at the end of the file
+  fwrite(pchStart, 1, 4, file);
+  fwrite("\x00\x01\x00\x00", 1, 4, file);
+  fwrite("cc", 1, 2, file);
+  rewind(file);
+
+  vector<char> vData;
+  BOOST_CHECK(ReadNextBlock(file, pchStart, vData));
+  BOOST_CHECK(vData == vector<char>(100, 'a'));
+  BOOST_CHECK(ReadNextBlock(file, pchStart, vData));
+  BOOST_CHECK(vData == vector<char>(80, 'b'));
+  BOOST_CHECK(!ReadNextBlock(file, pchStart, vData));
+  fclose(file);
+}
+
+static void WriteFile(const boost::filesystem::path& path, const string& str)
+{
+  boost::filesystem::ofstream stream(path);
+  stream << str;
+}
+
+static string ReadFile(const boost::filesystem::path& path)
+{
+  boost::filesystem::ifstream stream(path);
+  string str;
+  stream >> str;
+  return str;
+}
+
+BOOST_AUTO_TEST_CASE(blockimport_resume_order)
+{
+  boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("blockimport_tests_%%%%%%%%");
+  boost::filesystem::create_directories(path);
+
+  //an interrupted reindex imported and deleted its first file
+  WriteFile(path / "blk0002.dat.reindex", "left2");
+  WriteFile(path / "blk0003.dat.reindex", "left3");
+  WriteFile(path / "blk0001.dat", "new1");
+  WriteFile(path / "blk0002.dat", "new2");
+
+  unsigned int nMoved = 0;
+  BOOST_CHECK(MoveBlockFilesAside(path, nMoved));
+  BOOST_CHECK_EQUAL(nMoved, 2U);
+  BOOST_CHECK(!boost::filesystem::exists(path / "blk0001.dat"));
+  BOOST_CHECK(!boost::filesystem::exists(path / "blk0002.dat"));
+
+  //the leftovers come first and none of them was replaced
+  vector<boost::filesystem::path> vFiles = GetReindexFiles(path);
+  BOOST_REQUIRE_EQUAL(vFiles.size(), 4U);
+  BOOST_CHECK_EQUAL(ReadFile(vFiles[0]), "left2");
+  BOOST_CHECK_EQUAL(ReadFile(vFiles[1]), "left3");
+  BOOST_CHECK_EQUAL(ReadFile(vFiles[2]), "new1");
+  BOOST_CHECK_EQUAL(ReadFile(vFiles[3]), "new2");
+
+  boost::filesystem::remove_all(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
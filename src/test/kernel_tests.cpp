@@ -0,0 +1,69 @@
+#include <boost/test/unit_test.hpp>
+
+#include "uint256.h"
+#include "util.h"
+#include "bignum.h"
+#include "sha256.h"
+#include "kernel.h"
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+BOOST_AUTO_TEST_CASE(stakeKernelHashes)
+{
+  //more kernels than lanes, so the last batch is partial
+  const unsigned int nCount = 2 * SHA256_MAX_LANES + 5;
+  CStakeKernel kernels[nCount];
+  uint256 reference[nCount], hashes[nCount];
+
+  for(unsigned int n = 0; n < nCount; n++)
+  {
+    kernels[n].nStakeModifier = GetRand(std::numeric_limits<uint64>::max());
+    kernels[n].nTimeBlockFrom = GetRand(0xffffffff);
+    kernels[n].nTxPrevOffset = GetRand(0xffffffff);
+    kernels[n].nTimeTxPrev = GetRand(0xffffffff);
+    kernels[n].nPrevout = GetRand(10);
+    kernels[n].nTimeTx = GetRand(0xffffffff);
+
+    //the layout CheckStakeKernelHash() hashes
+    CDataStream ss(SER_GETHASH, 0);
+    ss << kernels[n].nStakeModifier << kernels[n].nTimeBlockFrom << kernels[n].nTxPrevOffset
+       << kernels[n].nTimeTxPrev << kernels[n].nPrevout << kernels[n].nTimeTx;
+    reference[n] = Hash(ss.begin(), ss.end());
+  }
+
+  int nOrigBackend = sha256_lanes_backend();
+  for(int nBackend = 0; nBackend < SHA256_BACKEND_COUNT; nBackend++)
+  {
+    if(!sha256_lanes_set_backend(nBackend))
+      continue;
+
+    HashStakeKernels(kernels, hashes, nCount);
+    for(unsigned int n = 0; n < nCount; n++)
+      BOOST_CHECK(hashes[n] == reference[n]);
+  }
+
+  sha256_lanes_set_backend(nOrigBackend);
+}
+
+BOOST_AUTO_TEST_CASE(stakeKernelTarget)
+{
+  for(int i = 0; i < 5000; i++)
+  {
+    //hashes and targets of every magnitude, so the product both fits and overflows 256 bits
+    uint256 hash = GetRandHash() >> GetRand(257);
+    uint256 target = GetRandHash() >> GetRand(257);
+    int64 nValueIn = GetRand(MAX_MONEY);
+    int64 nTimeWeight = GetRand(STAKE_MAX_AGE) - (i % 4 ? 0 : nStakeMinAge);
+
+    CBigNum bnCoinDayWeight = CBigNum(nValueIn) * nTimeWeight / COIN / (24 * 60 * 60);
+    bool fReference = !(CBigNum(hash) > CBigNum(target) * bnCoinDayWeight);
+
+    BOOST_CHECK_EQUAL(CheckStakeKernelTarget(hash, target, nValueIn, nTimeWeight), fReference);
+  }
+
+  //zero weight only passes the zero hash
+  BOOST_CHECK(!CheckStakeKernelTarget(1, ~uint256(0), COIN, 0));
+  BOOST_CHECK(CheckStakeKernelTarget(0, ~uint256(0), COIN, 0));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
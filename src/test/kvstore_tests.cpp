@@ -0,0 +1,175 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+
+#include "kvstore.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(kvstore_tests)
+
+static void CheckContents(CKeyValueStore& store, const map<string, string>& mapExpected, const CKeyValueSnapshot* psnapshot=NULL)
+{
+  CKeyValueIterator* pcursor = store.NewIterator(psnapshot);
+  map<string, string>::const_iterator mi = mapExpected.begin();
+  for(pcursor->Seek(string()); pcursor->Valid(); pcursor->Next(), ++mi)
+  {
+    BOOST_REQUIRE(mi != mapExpected.end());
+    BOOST_CHECK_EQUAL(pcursor->GetKey(), mi->first);
+    string strValue;
+    BOOST_CHECK(pcursor->GetValue(strValue));
+    BOOST_CHECK_EQUAL(strValue, mi->second);
+  }
+  BOOST_CHECK(mi == mapExpected.end());
+  delete pcursor;
+
+  for(mi = mapExpected.begin(); mi != mapExpected.end(); ++mi)
+  {
+    string strValue;
+    BOOST_CHECK(store.Read(mi->first, strValue, psnapshot));
+    BOOST_CHECK_EQUAL(strValue, mi->second);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(kvstore_batch)
+{
+  CKeyValueBatch batch;
+  batch.Write("b", "1234");
+  batch.Write("a", "12");
+  batch.Write("b", "1");
+  BOOST_CHECK_EQUAL(batch.GetCount(), 2U);
+  BOOST_CHECK_EQUAL(batch.nDataSize, 5U);
+
+  //a nested batch goes on top of the outer one
+  CKeyValueBatch batchInner;
+  batchInner.Erase("a");
+  string strValue = "xyz";
+  batchInner.WriteSwap("c", strValue);
+  batch.Append(batchInner);
+  BOOST_CHECK(batchInner.IsEmpty());
+  BOOST_CHECK_EQUAL(batch.nDataSize, 7U);
+
+  BOOST_CHECK_EQUAL(batch.Read("a", strValue), 0);
+  BOOST_CHECK_EQUAL(batch.Read("b", strValue), 1);
+  BOOST_CHECK_EQUAL(strValue, "1");
+  BOOST_CHECK_EQUAL(batch.Read("c", strValue), 1);
+  BOOST_CHECK_EQUAL(strValue, "xyz");
+  BOOST_CHECK_EQUAL(batch.Read("d", strValue), -1);
+}
+
+BOOST_AUTO_TEST_CASE(kvstore_log)
+{
+  boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("kvstore_tests_%%%%%%%%");
+  map<string, string> mapExpected;
+  {
+    CLogKeyValueStore store;
+    BOOST_REQUIRE(store.Open(path));
+
+    for(int i = 0; i < 200; i++)
+    {
+      CKeyValueBatch batch;
+      for(int j = 0; j < 10; j++)
+      {
+        string strKey = strprintf("key%d", (int)GetRand(100));
+        if(GetRand(3) == 0)
+        {
+          batch.Erase(strKey);
+          mapExpected.erase(strKey);
+        }
+        else
+        {
+          string strValue(GetRand(300), 'a' + GetRand(26));
+          batch.Write(strKey, strValue);
+          mapExpected[strKey] = strValue;
+        }
+      }
+      BOOST_CHECK(store.WriteBatch(batch));
+    }
+    CheckContents(store, mapExpected);
+    BOOST_CHECK(!store.Exists("nokey"));
+
+    //a snapshot does not see later writes
+    const CKeyValueSnapshot* psnapshot = store.GetSnapshot();
+    map<string, string> mapSnapshot = mapExpected;
+    CKeyValueBatch batch;
+    batch.Write("key0", "changed");
+    batch.Erase("key1");
+    batch.Write("zzz", "new");
+    BOOST_CHECK(store.WriteBatch(batch, true));
+    mapExpected["key0"] = "changed";
+    mapExpected.erase("key1");
+    mapExpected["zzz"] = "new";
+
+    CheckContents(store, mapSnapshot, psnapshot);
+    CheckContents(store, mapExpected);
+    store.ReleaseSnapshot(psnapshot);
+  }
+
+  //the log replays to the same contents
+  {
+    CLogKeyValueStore store;
+    BOOST_REQUIRE(store.Open(path));
+    CheckContents(store, mapExpected);
+  }
+
+  //a torn record at the end is dropped
+  {
+    FILE* file = fopen((path / "txdb.log").string().c_str(), "ab");
+    BOOST_REQUIRE(file);
+    fwrite("LSVK\x10\0\0\0torn", 1, 12, file);
+    fclose(file);
+
+    CLogKeyValueStore store;
+    BOOST_REQUIRE(store.Open(path));
+    CheckContents(store, mapExpected);
+  }
+
+  boost::filesystem::remove_all(path);
+}
+
+BOOST_AUTO_TEST_CASE(kvstore_log_compact)
+{
+  boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("kvstore_tests_%%%%%%%%");
+  map<string, string> mapExpected;
+  {
+    CLogKeyValueStore store(16 * 1024);
+    BOOST_REQUIRE(store.Open(path));
+
+    //rewriting the same keys keeps the log in proportion to the live data
+    for(int i = 0; i < 500; i++)
+    {
+      CKeyValueBatch batch;
+      string strKey = strprintf("key%d", i % 20);
+      string strValue(200, 'a' + i % 26);
+      batch.Write(strKey, strValue);
+      mapExpected[strKey] = strValue;
+      BOOST_CHECK(store.WriteBatch(batch));
+    }
+    CheckContents(store, mapExpected);
+    BOOST_CHECK(boost::filesystem::file_size(path / "txdb.log") < 20 * 1024);
+
+    //not while a snapshot sees older versions
+    const CKeyValueSnapshot* psnapshot = store.GetSnapshot();
+    map<string, string> mapSnapshot = mapExpected;
+    for(int i = 0; i < 200; i++)
+    {
+      CKeyValueBatch batch;
+      batch.Write("key0", strprintf("%d", i));
+      BOOST_CHECK(store.WriteBatch(batch));
+    }
+    mapExpected["key0"] = "199";
+    CheckContents(store, mapSnapshot, psnapshot);
+    CheckContents(store, mapExpected);
+    store.ReleaseSnapshot(psnapshot);
+  }
+
+  {
+    CLogKeyValueStore store(16 * 1024);
+    BOOST_REQUIRE(store.Open(path));
+    CheckContents(store, mapExpected);
+  }
+
+  boost::filesystem::remove_all(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,7 @@
 #include "uint256.h"
 #include "util.h"
 #include "dcrypt.h"
+#include "main.h"
 
 extern void SHA256Transform(void* pstate, void* pinput, const void* pinit);
 
@@ -43,4 +44,232 @@ BOOST_AUTO_TEST_CASE(dcryptHash)
   
 }
 
+BOOST_AUTO_TEST_CASE(dcryptContextReuse)
+{
+  unsigned char header[80];
+  for(int i = 0; i < 80; i++)
+    header[i] = i;
+
+  const uint256 headerHash("732fa78676a6505ce350e1beeef91d19c3f3b5a36e786db394b5b061e8696022");
+  const uint256 emptyHash("6d5eea5394d05535374392486168c29e5edad18a0d231bde3335e044cd6af29f");
+
+  //the same context must give the same results no matter what it hashed before
+  Dcrypt_Context ctx;
+  BOOST_CHECK(dcrypt(header, sizeof(header), &ctx) == headerHash);
+  BOOST_CHECK(ctx.nMixRounds > 0);
+  BOOST_CHECK(dcrypt(header, 0, &ctx) == emptyHash);
+  BOOST_CHECK(dcrypt(header, sizeof(header), &ctx) == headerHash);
+  BOOST_CHECK(dcrypt(header, sizeof(header)) == headerHash);
+}
+
+BOOST_AUTO_TEST_CASE(sha256LanesBackends)
+{
+  u32int state[8][SHA256_MAX_LANES], words[16][SHA256_MAX_LANES];
+  u32int reference[8][SHA256_MAX_LANES], lanes[8][SHA256_MAX_LANES];
+
+  for(int i = 0; i < 16; i++)
+    for(int lane = 0; lane < SHA256_MAX_LANES; lane++)
+    {
+      words[i][lane] = GetRand(0xffffffff);
+      if(i < 8)
+        state[i][lane] = GetRand(0xffffffff);
+    }
+
+  int nOrigBackend = sha256_lanes_backend();
+  BOOST_CHECK(sha256_lanes_set_backend(SHA256_BACKEND_SCALAR));
+
+  memcpy(reference, state, sizeof(state));
+  sha256_transform_lanes(reference, words, SHA256_MAX_LANES);
+
+  for(int nBackend = 0; nBackend < SHA256_BACKEND_COUNT; nBackend++)
+  {
+    if(!sha256_lanes_set_backend(nBackend))
+      continue;
+
+    BOOST_TEST_MESSAGE(sha256_lanes_backend_name(nBackend));
+
+    memcpy(lanes, state, sizeof(state));
+    sha256_transform_lanes(lanes, words, SHA256_MAX_LANES);
+    BOOST_CHECK(memcmp(lanes, reference, sizeof(lanes)) == 0);
+
+    //a partial pass leaves the lanes past nLanes alone
+    for(u32int nLanes = 1; nLanes < SHA256_MAX_LANES; nLanes++)
+    {
+      memcpy(lanes, state, sizeof(state));
+      sha256_transform_lanes(lanes, words, nLanes);
+      for(int i = 0; i < 8; i++)
+        for(int lane = 0; lane < SHA256_MAX_LANES; lane++)
+          BOOST_CHECK_EQUAL(lanes[i][lane], (u32int)lane < nLanes ? reference[i][lane] : state[i][lane]);
+    }
+  }
+
+  sha256_lanes_set_backend(nOrigBackend);
+}
+
+BOOST_AUTO_TEST_CASE(dcryptMultiEquality)
+{
+  //more inputs than lanes, so finished lanes get refilled, of mixed sizes
+  const unsigned int nCount = 40;
+  std::vector<unsigned char> vData(nCount * 200);
+  const uint8_t *pData[nCount];
+  size_t nSizes[nCount];
+  uint256 reference[nCount], hashes[nCount];
+
+  for(unsigned int i = 0; i < vData.size(); i++)
+    vData[i] = GetRand(256);
+
+  for(unsigned int n = 0; n < nCount; n++)
+  {
+    pData[n] = &vData[n * 200];
+    nSizes[n] = n % 2 ? 80 : GetRand(200);
+    reference[n] = dcrypt(pData[n], nSizes[n]);
+  }
+
+  int nOrigBackend = sha256_lanes_backend();
+  for(int nBackend = 0; nBackend < SHA256_BACKEND_COUNT; nBackend++)
+  {
+    if(!sha256_lanes_set_backend(nBackend))
+      continue;
+
+    dcrypt_multi(pData, nSizes, hashes, nCount);
+    for(unsigned int n = 0; n < nCount; n++)
+      BOOST_CHECK(hashes[n] == reference[n]);
+
+    //fewer inputs than lanes
+    dcrypt_multi(pData, nSizes, hashes, 3);
+    for(unsigned int n = 0; n < 3; n++)
+      BOOST_CHECK(hashes[n] == reference[n]);
+  }
+
+  sha256_lanes_set_backend(nOrigBackend);
+}
+
+BOOST_AUTO_TEST_CASE(blockHashCache)
+{
+  CBlock block;
+  block.nVersion = 1;
+  block.nTime = 1234;
+  block.nBits = 0x1e0fffff;
+
+  uint256 hash = block.GetHash();
+  uint64 nComputed = nBlockHashesComputed;
+
+  //unchanged header is served from the cache
+  BOOST_CHECK(block.GetHash() == hash);
+  BOOST_CHECK(nBlockHashesComputed == nComputed);
+
+  //any change to the header recomputes it
+  block.nNonce++;
+  uint256 hashNonce = block.GetHash();
+  BOOST_CHECK(hashNonce != hash);
+  BOOST_CHECK(hashNonce == DcryptHash(BEGIN(block.nVersion), END(block.nNonce)));
+  BOOST_CHECK(nBlockHashesComputed == nComputed + 1);
+
+  block.hashMerkleRoot = 1;
+  BOOST_CHECK(block.GetHash() == DcryptHash(BEGIN(block.nVersion), END(block.nNonce)));
+
+  //and copies keep a valid cache
+  CBlock copy = block;
+  BOOST_CHECK(copy.GetHash() == block.GetHash());
+}
+
+//nPoWBlocksBetween() as it was before the height index, walking back from pindexBest
+static s32int PoWBlocksBetweenWalk(s32int startHeight, s32int endHeight)
+{
+  if(startHeight >= endHeight || startHeight < 0 || endHeight < 0)
+    return 0;
+
+  CBlockIndex *pindex = pindexBest;
+  while(pindex && pindex->pprev && pindex->nHeight != endHeight)
+    pindex = pindex->pprev;
+
+  if(!pindex || !pindex->pprev || pindex->nHeight != endHeight)
+    return 0;
+
+  s32int between = 0;
+  for(; pindex->pprev && pindex->pprev->nHeight > startHeight; pindex = pindex->pprev)
+    if(pindex->IsProofOfWork())
+      between++;
+
+  return pindex->pprev ? between : 0;
+}
+
+BOOST_AUTO_TEST_CASE(bestChainHeightIndex)
+{
+  CBlockIndex *pindexOrigBest = pindexBest;
+
+  //a main chain of 40 blocks and a fork off height 25 that is 20 blocks long
+  std::vector<CBlockIndex*> vMain, vFork;
+  for(int i = 0; i < 40; i++)
+  {
+    CBlockIndex *pindex = new CBlockIndex();
+    pindex->pprev = i ? vMain.back() : NULL;
+    pindex->nHeight = i;
+    if(i % 3 == 1)
+    {
+      pindex->fProofOfBurn = true;
+      pindex->burnBlkHeight = pindex->burnCTx = pindex->burnCTxOut = 0;
+    }
+    vMain.push_back(pindex);
+  }
+
+  for(int i = 26; i < 46; i++)
+  {
+    CBlockIndex *pindex = new CBlockIndex();
+    pindex->pprev = i == 26 ? vMain[25] : vFork.back();
+    pindex->nHeight = i;
+    if(i % 4 == 0)
+      pindex->SetProofOfStake();
+    vFork.push_back(pindex);
+  }
+
+  for(int nChain = 0; nChain < 2; nChain++)
+  {
+    pindexBest = nChain ? vFork.back() : vMain.back();
+    SetBestChainIndex(pindexBest);
+
+    BOOST_CHECK(pindexByHeight(0) == NULL);
+    BOOST_CHECK(pindexByHeight(pindexBest->nHeight) == pindexBest);
+    BOOST_CHECK(pindexByHeight(pindexBest->nHeight + 1) == NULL);
+    BOOST_CHECK(pindexByHeight(30) == (nChain ? vFork[4] : vMain[30]));
+
+    for(int start = -1; start <= pindexBest->nHeight + 1; start++)
+      for(int end = -1; end <= pindexBest->nHeight + 1; end++)
+        BOOST_CHECK_EQUAL(nPoWBlocksBetween(start, end), PoWBlocksBetweenWalk(start, end));
+  }
+
+  pindexBest = pindexOrigBest;
+  SetBestChainIndex(pindexBest);
+
+  BOOST_FOREACH(CBlockIndex *pindex, vMain)
+    delete pindex;
+  BOOST_FOREACH(CBlockIndex *pindex, vFork)
+    delete pindex;
+}
+
+BOOST_AUTO_TEST_CASE(minerWorkCounter)
+{
+  CMinerWorkCounter counter;
+  counter.Reset(7);
+
+  //every range of the template once, then it is used up
+  std::set<unsigned int> setNonces;
+  unsigned int nNonce = 0;
+  for(uint64 i = 0; i < CMinerWorkCounter::RANGES_PER_TEMPLATE; i++)
+  {
+    BOOST_REQUIRE_EQUAL(counter.Take(7, nNonce), (int)CMinerWorkCounter::WORK_RANGE);
+    BOOST_CHECK_EQUAL(nNonce & ((1 << CMinerWorkCounter::RANGE_BITS) - 1), 0U);
+    setNonces.insert(nNonce);
+  }
+  BOOST_CHECK_EQUAL(setNonces.size(), (size_t)CMinerWorkCounter::RANGES_PER_TEMPLATE);
+  BOOST_CHECK_EQUAL(*setNonces.rbegin(), 0xffffffffU - 0xffffU);
+  BOOST_CHECK_EQUAL(counter.Take(7, nNonce), (int)CMinerWorkCounter::WORK_EXHAUSTED);
+
+  //a thread still on the old template is told to move on
+  counter.Reset(8);
+  BOOST_CHECK_EQUAL(counter.Take(7, nNonce), (int)CMinerWorkCounter::WORK_STALE);
+  BOOST_CHECK_EQUAL(counter.Take(8, nNonce), (int)CMinerWorkCounter::WORK_RANGE);
+  BOOST_CHECK_EQUAL(nNonce, 1U << CMinerWorkCounter::RANGE_BITS);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,93 @@
+#include <boost/test/unit_test.hpp>
+
+#include "net.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(netmessage_tests)
+
+static vector<char> MakeMessage(const char* pszCommand, const vector<char>& vPayload)
+{
+  CMessageHeader hdr(pszCommand, vPayload.size());
+  uint256 hash = Hash(vPayload.begin(), vPayload.end());
+  memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+  CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+  ss << hdr;
+  ss.write(vPayload.empty() ? NULL : &vPayload[0], vPayload.size());
+  return vector<char>(ss.begin(), ss.end());
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_framing)
+{
+  vector<char> vPayload(1000);
+  for(unsigned int i = 0; i < vPayload.size(); i++)
+    vPayload[i] = (char)i;
+  vector<char> vBytes = MakeMessage("block", vPayload);
+  vector<char> vPing = MakeMessage("verack", vector<char>());
+  vBytes.insert(vBytes.end(), vPing.begin(), vPing.end());
+
+  //the same messages come out however the bytes are split up
+  for(unsigned int nChunk = 1; nChunk <= vBytes.size(); nChunk *= 7)
+  {
+    CNode node(INVALID_SOCKET, CAddress(), true);
+    bool fComplete = false;
+    for(unsigned int nPos = 0; nPos < vBytes.size(); nPos += nChunk)
+      BOOST_CHECK(node.ReceiveMsgBytes(&vBytes[nPos], min(nChunk, (unsigned int)vBytes.size() - nPos), fComplete));
+    BOOST_CHECK(fComplete);
+
+    BOOST_CHECK_EQUAL(node.vRecvMsg.size(), 2U);
+    CNetMessage& msg = node.vRecvMsg.front();
+    BOOST_CHECK(msg.Complete());
+    BOOST_CHECK_EQUAL(msg.hdr.GetCommand(), "block");
+    BOOST_CHECK(vector<char>(msg.vRecv.begin(), msg.vRecv.end()) == vPayload);
+    BOOST_CHECK(node.vRecvMsg.back().Complete());
+    BOOST_CHECK_EQUAL(node.vRecvMsg.back().hdr.GetCommand(), "verack");
+  }
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_partial)
+{
+  //the payload buffer grows with the data, not with the size the header claims
+  vector<char> vBytes = MakeMessage("block", vector<char>(1000000));
+  CNode node(INVALID_SOCKET, CAddress(), true);
+  bool fComplete = false;
+  BOOST_CHECK(node.ReceiveMsgBytes(&vBytes[0], CMessageHeader::HEADER_SIZE + 10, fComplete));
+  BOOST_CHECK(!fComplete);
+  BOOST_CHECK_EQUAL(node.vRecvMsg.size(), 1U);
+  BOOST_CHECK(node.vRecvMsg.back().fInData);
+  BOOST_CHECK(node.vRecvMsg.back().vRecv.size() < 1000000U);
+
+  //a header with the wrong message start is refused
+  CNode nodeBad(INVALID_SOCKET, CAddress(), true);
+  vector<char> vBad = MakeMessage("verack", vector<char>());
+  vBad[0] ^= 0xff;
+  BOOST_CHECK(!nodeBad.ReceiveMsgBytes(&vBad[0], vBad.size(), fComplete));
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_shared_send)
+{
+  //a message serialized once is the same bytes PushMessage() queues
+  vector<int> vData;
+  for(int i = 0; i < 100; i++)
+    vData.push_back(i * i);
+  CSendBufferRef pdata = SerializeMessage("test", vData, PROTOCOL_VERSION);
+
+  CNode node(INVALID_SOCKET, CAddress(), true);
+  node.PushMessage("test", vData);
+  node.PushSerializedMessage(pdata);
+  BOOST_CHECK_EQUAL(node.vSendMsg.size(), 2U);
+  BOOST_CHECK(*node.vSendMsg.front() == *pdata);
+  BOOST_CHECK(node.vSendMsg.back() == pdata);
+  BOOST_CHECK_EQUAL(node.nSendSize, 2 * pdata->size());
+
+  //and frames back into the message
+  CNode nodeRecv(INVALID_SOCKET, CAddress(), true);
+  bool fComplete = false;
+  BOOST_CHECK(nodeRecv.ReceiveMsgBytes(&(*pdata)[0], pdata->size(), fComplete));
+  BOOST_CHECK(fComplete);
+  vector<int> vRead;
+  nodeRecv.vRecvMsg.front().vRecv >> vRead;
+  BOOST_CHECK(vRead == vData);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
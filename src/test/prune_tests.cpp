@@ -0,0 +1,69 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(prune_tests)
+
+BOOST_AUTO_TEST_CASE(prune_range_coalescing)
+{
+  map<unsigned int, PruneRanges> mapRanges;
+
+  //adjacent ranges of a file merge
+  AddPruneRange(mapRanges, 1, 100, 200);
+  AddPruneRange(mapRanges, 1, 200, 250);
+  BOOST_REQUIRE_EQUAL(mapRanges[1].size(), 1U);
+  BOOST_CHECK_EQUAL(mapRanges[1][0].first, 100U);
+  BOOST_CHECK_EQUAL(mapRanges[1][0].second, 250U);
+
+  //a gap starts a new one
+  AddPruneRange(mapRanges, 1, 300, 400);
+  BOOST_REQUIRE_EQUAL(mapRanges[1].size(), 2U);
+  BOOST_CHECK_EQUAL(mapRanges[1][1].first, 300U);
+  BOOST_CHECK_EQUAL(mapRanges[1][1].second, 400U);
+
+  //other files are kept apart, even at the same offsets
+  AddPruneRange(mapRanges, 2, 400, 500);
+  BOOST_CHECK_EQUAL(mapRanges[1].size(), 2U);
+  BOOST_REQUIRE_EQUAL(mapRanges[2].size(), 1U);
+  BOOST_CHECK_EQUAL(mapRanges[2][0].first, 400U);
+
+  //only the last range of a file grows, an earlier gap stays
+  AddPruneRange(mapRanges, 1, 250, 300);
+  BOOST_REQUIRE_EQUAL(mapRanges[1].size(), 3U);
+  BOOST_CHECK_EQUAL(mapRanges[1][0].second, 250U);
+  BOOST_CHECK_EQUAL(mapRanges[1][2].first, 250U);
+}
+
+BOOST_AUTO_TEST_CASE(prune_keep_tx)
+{
+  CTransaction tx;
+  tx.vout.resize(3);
+  tx.vout[0].scriptPubKey << OP_TRUE;
+  tx.vout[1].scriptPubKey << OP_RETURN;
+  //vout[2] is an empty coinstake marker
+
+  CDiskTxPos posTx(1, 1000, 1100);
+  set<pair<unsigned int, unsigned int> > setRecentBlocks;
+  setRecentBlocks.insert(make_pair(2u, 5000u));
+
+  //without an index entry, or one for another copy of it, it stays
+  BOOST_CHECK(KeepPrunedTx(tx, NULL, posTx, setRecentBlocks));
+  CTxIndex txindex(CDiskTxPos(1, 2000, 2100), tx.vout.size());
+  BOOST_CHECK(KeepPrunedTx(tx, &txindex, posTx, setRecentBlocks));
+
+  //an unspent output keeps it, data outputs and markers don't
+  txindex = CTxIndex(posTx, tx.vout.size());
+  BOOST_CHECK(KeepPrunedTx(tx, &txindex, posTx, setRecentBlocks));
+
+  //spent in an old block it can go
+  txindex.vSpent[0] = CDiskTxPos(1, 3000, 3100);
+  BOOST_CHECK(!KeepPrunedTx(tx, &txindex, posTx, setRecentBlocks));
+
+  //spent in a recent block a reorganization may still want it back
+  txindex.vSpent[0] = CDiskTxPos(2, 5000, 5100);
+  BOOST_CHECK(KeepPrunedTx(tx, &txindex, posTx, setRecentBlocks));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -907,59 +907,28 @@ void CWallet::ResendWalletTransactions()
     }
 }
 
-/* This is how CLAMs does it ... */
+// Both read the message index (smalldata.h) instead of the blocks
 
 void CWallet::SearchOPRETURNTransactions(uint256 hash, std::vector<std::pair<std::string, int> >& vTxResults)
 {
-    int blockstogoback = pindexBest->nHeight - 362500;
-    std::string matchingHash = "face " + hash.GetHex();
-
-    const CBlockIndex* pindexFirst = pindexBest;
-    for (int i = 0; pindexFirst && i < blockstogoback; i++) {
-
-        CBlock block;
-        block.ReadFromDisk(pindexFirst, true);
-
-        BOOST_FOREACH (const CTransaction& tx, block.vtx)
-        {
-            std::string txmsg;
-            bool isBroadcast;
-            CTransaction ctx = tx;
-            if ( GetTxMessage(ctx, txmsg, isBroadcast) ) {
-                if (txmsg == matchingHash) {
-                    vTxResults.push_back( std::make_pair(tx.GetHash().GetHex(), pindexFirst->nHeight) );
-                }
-            }
-        }
+    std::vector<CTxMessageKey> vKeys;
+    CTxDB txdb("r");
+    if (!txdb.ListTxMessagesByFace(hash, 362500, vKeys))
+        return;
 
-        pindexFirst = pindexFirst->pprev;
-    }
-    return;
+    BOOST_FOREACH(const CTxMessageKey& key, vKeys)
+        vTxResults.push_back( std::make_pair(key.hashTx.GetHex(), key.nHeight) );
 }
 
-void CWallet::GetTxMessages(std::vector<std::pair<std::string, int> >& vTxResults)
+void CWallet::GetTxMessages(std::vector<std::pair<std::string, int> >& vTxResults, unsigned int nMax)
 {
-    int blockstogoback = pindexBest->nHeight - 2500;
-
-    const CBlockIndex* pindexFirst = pindexBest;
-    for (int i = 0; pindexFirst && i < blockstogoback; i++) {
-
-        CBlock block;
-        block.ReadFromDisk(pindexFirst, true, false);
-
-        BOOST_FOREACH (const CTransaction& tx, block.vtx)
-        {
-            std::string txmsg;
-            bool isBroadcast;
-            CTransaction ctx = tx;
-            if ( GetTxMessage(ctx, txmsg, isBroadcast) ) {
-                vTxResults.push_back( std::make_pair(txmsg, tx.nTime) );
-            }
-        }
+    std::vector<std::pair<CTxMessageKey, CTxMessageEntry> > vEntries;
+    CTxDB txdb("r");
+    if (!txdb.ListTxMessages(2500, nMax, vEntries))
+        return;
 
-        pindexFirst = pindexFirst->pprev;
-    }
-    return;
+    for (unsigned int i = 0; i < vEntries.size(); i++)
+        vTxResults.push_back( std::make_pair(vEntries[i].second.strMessage, (int)vEntries[i].second.nTime) );
 }
 
 
@@ -1367,6 +1336,9 @@ bool CWallet::CreateTransaction(CScript scriptPubKey, int64 nValue, CWalletTx& w
     return CreateTransaction(vecSend, wtxNew, reservekey, nFeeRet);
 }
 
+// Kernel inputs of the staked coins, kept between CreateCoinStake() rounds
+static CStakeKernelSearch stakeKernelSearch;
+
 // ppcoin: create coin stake transaction
 bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64 nSearchInterval, CTransaction& txNew)
 {
@@ -1403,85 +1375,63 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
         return false;
     int64 nCredit = 0;
     CScript scriptPubKeyKernel;
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+    static unsigned int nMaxStakeSearchInterval = 60;
+    unsigned int nSearchSteps = max((int64)0, min(nSearchInterval, (int64)nMaxStakeSearchInterval));
+    vector<pair<const CWalletTx*, unsigned int> > vCoins(setCoins.begin(), setCoins.end());
+    unsigned int nCoin = 0, n = 0, nTimeBlockFrom = 0;
+    while (!fShutdown && stakeKernelSearch.Search(nBits, txNew.nTime, nSearchSteps, nMaxStakeSearchInterval, vCoins, nCoin, nCoin, n, nTimeBlockFrom))
     {
-        CTxDB txdb("r");
-        CTxIndex txindex;
-        if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
-            continue;
-
-        // Read block header
-        CBlock block;
-        if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+        // Search backward in time from the given txNew timestamp
+        // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
+        const PAIRTYPE(const CWalletTx*, unsigned int)& pcoin = vCoins[nCoin++];
+
+        bool fPrintCoinStake = (fDebug && GetBoolArg("-printcoinstake"));
+        // Found a kernel
+        if (fPrintCoinStake)
+            printf("CreateCoinStake : kernel found\n");
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        CScript scriptPubKeyOut;
+        scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+        if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
+        {
+            if (fPrintCoinStake)
+                printf("CreateCoinStake : failed to parse kernel\n", whichType);
             continue;
-        /* FIXME: reported as unused
-        CBlockIndex *pindex = mapBlockIndex[pcoin.first->hashBlock];
-        */
-        static int nMaxStakeSearchInterval = 60;
-        if (block.GetBlockTime() + nStakeMinAge > txNew.nTime - nMaxStakeSearchInterval)
-            continue; // only count coins meeting min age requirement
-
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64)nMaxStakeSearchInterval) && !fKernelFound && !fShutdown; n++)
+        }
+        if (fPrintCoinStake)
+            printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
+        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+        {
+            if (fPrintCoinStake)
+                printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
+            continue;  // only support pay to public key and pay to address
+        }
+        if (whichType == TX_PUBKEYHASH) // pay to address type
         {
-            // Search backward in time from the given txNew timestamp 
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            uint256 hashProofOfStake = 0;
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            if (CheckStakeKernelHash(nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, *pcoin.first, prevoutStake, txNew.nTime - n, hashProofOfStake))
+            // convert to pay to public key type
+            CKey key;
+            if (!keystore.GetKey(uint160(vSolutions[0]), key))
             {
-                bool fPrintCoinStake = (fDebug && GetBoolArg("-printcoinstake"));
-                // Found a kernel
                 if (fPrintCoinStake)
-                    printf("CreateCoinStake : kernel found\n");
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    if (fPrintCoinStake)
-                        printf("CreateCoinStake : failed to parse kernel\n", whichType);
-                    break;
-                }
-                if (fPrintCoinStake)
-                    printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    if (fPrintCoinStake)
-                        printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    CKey key;
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        if (fPrintCoinStake)
-                            printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-                }
-                else
-                    scriptPubKeyOut = scriptPubKeyKernel;
-
-                txNew.nTime -= n; 
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
-                if (block.GetBlockTime() + nStakeSplitAge > txNew.nTime)
-                    txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
-                if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
+                    printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                continue;  // unable to find corresponding public key
             }
+            scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
         }
-        if (fKernelFound || fShutdown)
-            break; // if kernel is found stop searching
+        else
+            scriptPubKeyOut = scriptPubKeyKernel;
+
+        txNew.nTime -= n;
+        txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+        nCredit += pcoin.first->vout[pcoin.second].nValue;
+        vwtxPrev.push_back(pcoin.first);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+        if (nTimeBlockFrom + nStakeSplitAge > txNew.nTime)
+            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+        if (fDebug && GetBoolArg("-printcoinstake"))
+            printf("CreateCoinStake : added kernel type=%d\n", whichType);
+        break; // if kernel is found stop searching
     }
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
         return false;
@@ -146,7 +146,7 @@ public:
     bool LoadCScript(const CScript& redeemScript) { return CCryptoKeyStore::AddCScript(redeemScript); }
 
     void SearchOPRETURNTransactions(uint256 hash, std::vector<std::pair<std::string, int> >& vTxResults);
-    void GetTxMessages(std::vector<std::pair<std::string, int> >& vTxResults);
+    void GetTxMessages(std::vector<std::pair<std::string, int> >& vTxResults, unsigned int nMax = (unsigned int)-1);
     void GetMyTxMessages(std::vector<std::pair<std::string, int> >& vTxResults);
 
     bool Lock();
@@ -635,7 +635,7 @@ CWalletTx(const CWallet* pwalletIn, const CTransaction& txIn) : CMerkleTx(txIn)
 
     void SetBurnTxCoords(s32int &blkHeightRet, s32int &txIndexRet, s32int &outTxIndexRet) const
     {
-        std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator it = mapBlockIndex.find(hashBlock);
         if (it == mapBlockIndex.end())
             blkHeightRet = -1;
         else